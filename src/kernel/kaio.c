@@ -0,0 +1,218 @@
+#include "./kaio.h"
+#include <pthread.h>
+#include <signal.h>
+#include "./kernel.h"
+#include "./kwait.h"
+#include "./pennfat/pennfat_help.h"
+#include "./util/p_errno.h"
+
+// Queue of requests for the worker, and every request not yet waited for
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_cond = PTHREAD_COND_INITIALIZER;
+static aio_req_t* queue_head;
+static aio_req_t* queue_tail;
+static Vec live;  // aio_req_t*, under aio_lock
+static bool worker_started;
+static int held;  // pid of a parked waiter whose request is done, or 0
+
+// Processes in k_aio_wait, and the completions the tick has seen
+static wait_queue_t aio_wait;
+static atomic_uint completed;
+static unsigned int polled;
+
+// Run one request; the file is still held open for it. P_ERRNO here is the
+// worker's own, so the error only reaches the process through req->err.
+static void aio_run(aio_req_t* req) {
+  P_ERRNO = 0;
+  req->result = req->op == AIO_READ
+                    ? k_pread(req->fd, req->offset, req->n, req->data)
+                    : k_pwrite(req->fd, req->offset, req->data, req->n);
+  if (req->result < 0) {
+    req->err = req->result == -1 ? P_ERRNO : req->result;
+    req->result = -1;
+  }
+  k_close(req->fd);
+}
+
+static void* aio_worker(void* arg) {
+  while (true) {
+    fs_lock(&aio_lock);
+    while (!queue_head) {
+      pthread_cond_wait(&aio_cond, &aio_lock);
+    }
+    aio_req_t* req = queue_head;
+    queue_head = req->next;
+    if (!queue_head) {
+      queue_tail = NULL;
+    }
+    fs_unlock(&aio_lock);
+
+    aio_run(req);
+
+    fs_lock(&aio_lock);
+    atomic_store(&req->done, true);
+    if (atomic_load(&req->waited)) {
+      held = req->pid;
+    }
+    if (req->orphaned) {
+      free(req->data);
+      free(req);
+    }
+    // Finish what is queued before waking a parked waiter, so one wakeup
+    // covers the requests it still has in flight
+    int waiter = queue_head ? 0 : held;
+    if (waiter) {
+      held = 0;
+    }
+    fs_unlock(&aio_lock);
+    atomic_fetch_add(&completed, 1);
+    if (waiter) {
+      scheduler_kick(waiter);  // let the waiter run now rather than next tick
+    }
+  }
+  return NULL;
+}
+
+// Start the worker with every signal blocked, so ticks and job control go
+// to PennOS threads only; aio_lock is held
+static int start_worker() {
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &saved);
+  pthread_t thread;
+  int ret = pthread_create(&thread, NULL, aio_worker, NULL);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (ret != 0) {
+    return P_ENOMEM;
+  }
+  pthread_detach(thread);
+  live = vec_new(8, NULL);
+  wait_queue_init(&aio_wait);
+  worker_started = true;
+  return 0;
+}
+
+aio_req_t* k_aio_submit(int op, int fd, uint32_t offset, const char* buf,
+                        int n, int pid) {
+  file_descriptor_t* file = fd_get(fd);
+  if (!file) {
+    P_ERRNO = FD_INVALID;
+    return NULL;
+  }
+  int perm = op == AIO_READ ? PERM_READ : PERM_WRITE;
+  if ((op != AIO_READ && op != AIO_WRITE) || n < 0 || !file->node) {
+    P_ERRNO = P_EINVAL;  // pipes and stdio have no offset to work at
+    return NULL;
+  }
+  if (!(file->entry->perm & perm)) {
+    P_ERRNO = PERMISSION_DENIED;
+    return NULL;
+  }
+  aio_req_t* req = calloc(1, sizeof(aio_req_t));
+  char* data = malloc(MAX(n, 1));
+  if (!req || !data) {
+    free(req);
+    free(data);
+    P_ERRNO = P_ENOMEM;
+    return NULL;
+  }
+  *req = (aio_req_t){
+      .op = op, .fd = fd, .offset = offset, .n = n, .data = data, .pid = pid};
+  if (op == AIO_WRITE) {
+    memcpy(data, buf, n);
+  }
+
+  // The request holds the file open until the worker is done with it
+  fs_lock(&state.files_lock);
+  file->ref_count++;
+  fs_unlock(&state.files_lock);
+
+  fs_lock(&aio_lock);
+  int ret = worker_started ? 0 : start_worker();
+  if (ret == 0) {
+    vec_push_back(&live, req);
+    if (queue_tail) {
+      queue_tail->next = req;
+    } else {
+      queue_head = req;
+    }
+    queue_tail = req;
+    pthread_cond_signal(&aio_cond);
+  }
+  fs_unlock(&aio_lock);
+  if (ret) {
+    k_close(fd);
+    free(data);
+    free(req);
+    P_ERRNO = ret;
+    return NULL;
+  }
+  return req;
+}
+
+bool k_aio_done(aio_req_t* req) {
+  return atomic_load(&req->done);
+}
+
+// Take a request out of the live list; aio_lock is held
+static void forget(aio_req_t* req) {
+  for (size_t i = 0; i < vec_len(&live); i++) {
+    if (vec_get(&live, i) == req) {
+      vec_shallow_erase(&live, i);
+      return;
+    }
+  }
+}
+
+int k_aio_wait(aio_req_t* req, char* buf) {
+  // Seen by the worker either before it finishes the request, and then it
+  // kicks, or after, and then done is already set below
+  atomic_store(&req->waited, true);
+  while (true) {
+    unsigned int seen = aio_wait.wakeups;
+    if (k_aio_done(req)) {
+      break;
+    }
+    k_wait_on(&aio_wait, seen);
+  }
+  fs_lock(&aio_lock);
+  forget(req);
+  fs_unlock(&aio_lock);
+
+  int result = req->result;
+  if (result > 0 && req->op == AIO_READ) {
+    memcpy(buf, req->data, result);
+  }
+  if (result < 0) {
+    P_ERRNO = req->err;
+  }
+  free(req->data);
+  free(req);
+  return result;
+}
+
+void k_aio_poll(void) {
+  unsigned int now = atomic_load(&completed);
+  if (now != polled) {
+    polled = now;
+    k_wake_up_locked(&aio_wait);
+  }
+}
+
+void k_aio_release(int pid) {
+  fs_lock(&aio_lock);
+  for (size_t i = 0; worker_started && i < vec_len(&live); i++) {
+    aio_req_t* req = vec_get(&live, i);
+    if (req->pid != pid) {
+      continue;
+    }
+    vec_shallow_erase(&live, i--);
+    if (k_aio_done(req)) {
+      free(req->data);
+      free(req);
+    } else {
+      req->orphaned = true;
+    }
+  }
+  fs_unlock(&aio_lock);
+}
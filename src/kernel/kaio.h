@@ -0,0 +1,82 @@
+#ifndef _KERNEL_AIO_H_
+#define _KERNEL_AIO_H_
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define AIO_READ 0
+#define AIO_WRITE 1
+
+/**
+ * @brief A read or write handed to the I/O worker.
+ *
+ * The worker is a host thread that does the disk work (including the fsync
+ * a write ends with) while the process that asked for it is free to run or
+ * parked P_BLOCKED in k_aio_wait, so the scheduler can run other processes
+ * in the meantime. The worker never touches the process's memory: a write's
+ * bytes are copied in when it is submitted and a read's are copied out in
+ * k_aio_wait, so a process that is killed with requests in flight leaves
+ * nothing dangling.
+ */
+typedef struct aio_req_st {
+  int op;               // AIO_READ or AIO_WRITE
+  int fd;               // global fd, held open until the request is done
+  uint32_t offset;      // where in the file
+  int n;                // bytes asked for
+  char* data;           // the worker's copy of the bytes
+  int pid;              // process that submitted it
+  int result;           // bytes moved, or -1
+  int err;              // P_ERRNO when result is -1
+  atomic_bool done;     // the worker has finished it
+  atomic_bool waited;   // its process is parked, or about to be, on it
+  bool orphaned;        // its process is gone; the worker frees it
+  struct aio_req_st* next;  // in the worker's queue
+} aio_req_t;
+
+/**
+ * @brief Queues a positioned read or write of a regular file for the I/O
+ * worker, starting the worker the first time.
+ *
+ * @param op AIO_READ or AIO_WRITE.
+ * @param fd Global fd of a regular file.
+ * @param offset Where to start; the descriptor's own offset is not used or
+ * moved.
+ * @param buf Bytes to write (copied before returning); unused for a read.
+ * @param n Number of bytes.
+ * @param pid Process the request belongs to.
+ * @return The request, or NULL with P_ERRNO set.
+ */
+aio_req_t* k_aio_submit(int op, int fd, uint32_t offset, const char* buf,
+                        int n, int pid);
+
+/**
+ * @brief Parks the calling process until a request is done, then frees it.
+ *
+ * @param req Request from k_aio_submit.
+ * @param buf Receives a read's bytes.
+ * @return Bytes read or written, or -1 with P_ERRNO set.
+ */
+int k_aio_wait(aio_req_t* req, char* buf);
+
+/**
+ * @brief Whether a request is done, so k_aio_wait will not block.
+ */
+bool k_aio_done(aio_req_t* req);
+
+/**
+ * @brief Wakes processes waiting in k_aio_wait if a request was completed
+ * since the last call.
+ *
+ * Called from the clock tick, inside the scheduler's critical section.
+ */
+void k_aio_poll(void);
+
+/**
+ * @brief Gives every request of a process still in flight to the worker
+ * to free, when the process exits or is killed.
+ *
+ * @param pid The process.
+ */
+void k_aio_release(int pid);
+
+#endif
@@ -1,5 +1,11 @@
 #include "./kernel.h"
 #include "./kernel_helper.h"
+#include "./kaio.h"
+#include "./kmmap.h"
+#include "./kpipe.h"
+#include "./kstdin.h"
+#include "./kstdout.h"
+#include "./scheduler/sched_policy.h"
 #include "./scheduler/scheduler_helper.h"
 #include "./util/p_errno.h"
 
@@ -12,6 +18,20 @@ int job_counter = 2;     // Job ID starts from 2 (init and shell)
 
 int current_tick = 0;  // Track tick count here
 
+// Create a process thread with SIGALRM and SIGKICK blocked so ticks are always
+// handled by the main thread, never inside a process that is mid-switch
+static void create_process_thread(spthread_t* thread,
+                                  void* (*func)(void*),
+                                  void* arg) {
+  sigset_t alarm_set, old_set;
+  sigemptyset(&alarm_set);
+  sigaddset(&alarm_set, SIGALRM);
+  sigaddset(&alarm_set, SIGKICK);
+  pthread_sigmask(SIG_BLOCK, &alarm_set, &old_set);
+  spthread_create(thread, NULL, func, arg);
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+}
+
 // Initialize all the lists as empty
 void init_pcb_list() {
   pcb_list = vec_new(INITIAL_NUM_PCB, free);
@@ -24,6 +44,8 @@ void init_pcb_list() {
 // Initialize the kernel
 void init_kernel() {
   init_pcb_list();
+  k_stdin_init();
+  k_stdout_init();
   pcb_t* init_pcb = malloc(sizeof(pcb_t));
   char* init_args[] = {"init", NULL};
   init_pcb->pid = 1;
@@ -37,11 +59,22 @@ void init_kernel() {
   init_pcb->remaining_sleep_ticks = 0;
   init_pcb->is_background = false;
   init_pcb->argv = init_args;
+  init_pcb->owns_argv = false;
+  init_pcb->sched_slot = -1;
+  init_pcb->pass = 0;
+  init_pcb->sched_level = 0;
+  init_pcb->sched_ticks = 0;
+  init_pcb->child_events = vec_new(INITIAL_VEC_CAPACITY, free);
+  wait_queue_init(&init_pcb->child_wait);
+  init_pcb->waiting_on = NULL;
+  init_pcb->out_buf = NULL;
+  init_pcb->out_len = 0;
   init_fd_table(init_pcb);
   vec_push_back(&pcb_list, init_pcb);
   // create init thraed and pass the fucntion as k_reap_zombies_init which means
   // the init process will reap all the zombies
-  spthread_create(&init_pcb->thread, NULL, (void*)k_reap_zombies_init, NULL);
+  create_process_thread(&init_pcb->thread, (void* (*)(void*))k_reap_zombies_init,
+                        NULL);
   add_to_queue(init_pcb);
 }
 
@@ -78,8 +111,17 @@ void k_proc_cleanup(pcb_t* proc) {
     remove_process_pcb_from_job(proc);  // remove from job list
     remove_process_pcb_from_background_job(proc);
     free(proc->file_descriptors);
+    if (proc->owns_argv) {
+      for (int i = 0; proc->argv[i]; i++) {
+        free(proc->argv[i]);
+      }
+      free(proc->argv);
+    }
     remove_process_from_pcb(proc);  // remove from PCB list
     vec_destroy(&proc->children);
+    vec_destroy(&proc->child_events);
+    wait_queue_destroy(&proc->child_wait);
+    k_stdout_release(proc);
   } else {
     panic("k_proc_cleanup: proc is NULL\n");
   }
@@ -117,10 +159,11 @@ int k_fork(void* (*func)(void*),
     parent = k_get_pcb_with_given_pid(parent_id);  // get the parent process
   } else {
     parent = find_parent_with_current_thread();
+    k_flush();  // the parent's pending output must precede the child's
   }
   pcb_t* child =
       k_proc_create(parent, argv, priority, status, is_init, is_background);
-  spthread_create(&child->thread, NULL, func, argv);
+  create_process_thread(&child->thread, func, argv);
   add_to_queue(child);
   add_child_to_parent_pcb(parent, child);  // add child to parent
   if (is_background) {
@@ -136,6 +179,8 @@ int k_fork(void* (*func)(void*),
 
 // The core of parent process - wait for the child process to finish
 // This function is called by the kernel to wait for a child process to finish
+// Children report exits and stops through notify_parent, so each call only
+// looks at pending events instead of rescanning every child
 int k_waitpid(int pid, int* wstatus, int nohang, bool is_init, int ppid) {
   pcb_t* parent;
   if (ppid > 0)
@@ -147,56 +192,52 @@ int k_waitpid(int pid, int* wstatus, int nohang, bool is_init, int ppid) {
     return -1;
   }
   while (1) {
-    Vec* children = &parent->children;
-    if (vec_len(children) == 0) {
-      P_ERRNO = P_EWAITPID_II;
-      return -1;
-    }
-
-    for (size_t i = 0; i < vec_len(children); i++) {
-      pcb_t* child = vec_get(children, i);
-      if (!child)
-        continue;
-      if (pid != -1 && child->pid != pid)
+    unsigned int seen = parent->child_wait.wakeups;
+    Vec* events = &parent->child_events;
+    for (size_t i = 0; i < vec_len(events); i++) {
+      child_event_t* event = vec_get(events, i);
+      if (pid != -1 && event->pid != pid)
         continue;
-      if (child->status == P_ZOMBIED) {
-        int reaped_pid = child->pid;  // reaped child
-        if (wstatus)
-          *wstatus = P_SIGEXIT;  // normal exit
-        reparent_children(child);
-        const char* event = is_init ? "WAITED (init)" : "WAITED";
-        log_event(event, "\t%d\t%d\t%s", child->pid, child->priority,
-                  child->cmd);                        // log the event
-        remove_child_from_parent_pcb(parent, child);  // remove from parent
-        k_proc_cleanup(child);  // free child and remove from PCB list
-        return reaped_pid;
-      }
+      int child_pid = event->pid;
+      int status = event->status;
+      vec_erase(events, i);  // frees the event
+      if (wstatus)
+        *wstatus = status;
 
-      if (child->status == P_STOPPED) {
-        if (wstatus)
-          *wstatus = P_SIGSTOP;
+      pcb_t* child = k_get_pcb_with_given_pid(child_pid);
+      if (!child)
+        return child_pid;
+      if (status == P_SIGSTOP) {
         log_event("STOPPED", "\t%d\t%d\t%s", child->pid, child->priority,
                   child->cmd);  // log the event
-        return child->pid;
+        return child_pid;
       }
+      reparent_children(child);
+      const char* event_name = is_init ? "WAITED (init)" : "WAITED";
+      log_event(event_name, "\t%d\t%d\t%s", child->pid, child->priority,
+                child->cmd);                        // log the event
+      remove_child_from_parent_pcb(parent, child);  // remove from parent
+      k_proc_cleanup(child);  // free child and remove from PCB list
+      return child_pid;
     }
-    // deal with no hang
-    if (nohang) {
-      return 0;  // no child has exited so return
+
+    if (vec_len(&parent->children) == 0) {
+      P_ERRNO = P_EWAITPID_II;
+      return -1;
     }
-    for (size_t i = 0; i < vec_len(children); i++) {
-      pcb_t* child = vec_get(children, i);
-      if (child) {
-        child->waited_by =
-            parent->pid;  // set the child's waited_by to the parent
+    if (pid != -1) {
+      pcb_t* child = k_get_pcb_with_given_pid(pid);
+      if (!child || child->ppid != parent->pid) {
+        P_ERRNO = P_EWAITPID_II;  // not our child, nothing will ever arrive
+        return -1;
       }
     }
-
-    parent->status = P_BLOCKED;  // block the parent
-    k_proc_suspend();            // suspend the parent
+    // deal with no hang
+    if (nohang) {
+      return 0;  // no child has changed state so return
+    }
+    k_wait_on(&parent->child_wait, seen);  // sleep until a child reports
   }
-  P_ERRNO = P_EWAITPID_III;
-  return -1;
 }
 
 // Siganls for PennOS
@@ -236,22 +277,24 @@ void k_exit() {
   current_pcb->status = P_ZOMBIED;
   log_event("ZOMBIE", "\t%d\t%d\t%s", current_pcb->pid, current_pcb->priority,
             current_pcb->cmd);  // log the event
-  remove_pcb_from_queue(current_pcb,
-                        current_pcb->priority);  // remove from queue
+  k_pipe_release_fds(current_pcb->file_descriptors);  // readers see EOF
+  k_munmap_all(current_pcb->pid);
+  k_aio_release(current_pcb->pid);
+  k_flush();  // output must not appear after the parent's next prompt
+  remove_pcb_from_queue(current_pcb);  // remove from queue
   if (parent_pcb == NULL) {
     panic("k_exit: parent processee PCB is NULL");
     return;
   }
+  notify_parent(current_pcb, P_SIGEXIT);  // wake the parent if it waits
 
-  int parent_who_waited_on_this =
-      current_pcb->waited_by;  // get the parent waiting on this
-  pcb_t* waiting_parent =
-      k_get_pcb_with_given_pid(parent_who_waited_on_this);  // get the parent
-
-  if (waiting_parent && waiting_parent->status == P_BLOCKED) {
-    add_to_queue(waiting_parent);
+  // Hand the CPU on now (often to the waiting parent) instead of leaving it
+  // idle until the next tick
+  scheduler_lock();
+  if (!are_all_queues_empty()) {
+    run_scheduler();
   }
-  return;
+  scheduler_unlock();
 }
 
 // Change the priority of a process
@@ -262,11 +305,12 @@ int k_nice(int pid, int priority) {
     return -1;
   }
   // Remove the PCB from its current priority queue
-  int old_priority = pcb_with_given_pid->priority;
-  remove_pcb_from_queue(pcb_with_given_pid, old_priority);
+  bool was_queued = remove_pcb_from_queue(pcb_with_given_pid);
   pcb_with_given_pid->priority = priority;
-  // Add the PCB to the new priority queue
-  add_to_queue(pcb_with_given_pid);
+  // Requeue under the new priority only if it was runnable before
+  if (was_queued) {
+    add_to_queue(pcb_with_given_pid);
+  }
 
   return 0;  // Success
 }
@@ -279,23 +323,48 @@ void k_sleep(unsigned int ticks) {
   if (!self)
     panic("k_sleep: no current PCB");
   // log_event("BLOCKED", "\t%d\t%d\t%s", self->pid, self->priority, self->cmd);
-  remove_pcb_from_queue(self, self->priority);
+  scheduler_lock();  // the tick walks sleeping_processes
+  remove_pcb_from_queue(self);
+  sched_note_blocked(self);
   self->status = P_BLOCKED;                // set the status to blocked
   self->wake_tick = current_tick + ticks;  // set the wake tick
   self->remaining_sleep_ticks = ticks;
   vec_push_back(&sleeping_processes, self);
-  k_proc_suspend();  // suspend the process
+  scheduler_yield(self);  // suspend the process
+}
+
+// Zombie a process on SIGTERM/SIGQUIT and have its parent clean it up
+static void k_proc_terminate(pcb_t* proc, const char* event) {
+  scheduler_lock();
+  proc->status = P_ZOMBIED;
+  remove_pcb_from_queue(proc);
+  // A killed sleeper must not stay behind in the list once it is reaped
+  for (int i = 0; i < vec_len(&sleeping_processes); i++) {
+    if (vec_get(&sleeping_processes, i) == proc) {
+      vec_shallow_erase(&sleeping_processes, i);
+      break;
+    }
+  }
+  scheduler_unlock();
+  log_event(event, "\t%d\t%d\t%s", proc->pid, proc->priority, proc->cmd);
+  k_pipe_release_fds(proc->file_descriptors);
+  k_munmap_all(proc->pid);
+  k_aio_release(proc->pid);
+  k_flush_process(proc);
+  notify_parent(proc, P_SIGTERM);  // wake the parent if it waits
+  if (proc == find_parent_with_current_thread()) {
+    k_proc_suspend();  // a process that killed itself never runs again
+  }
 }
 
 // Send the signal to the process
 int k_proc_kill(pcb_t* proc, int signal) {
-  pcb_t* parent_pcb = k_get_pcb_with_given_pid(proc->ppid);
   switch (signal) {
     case P_SIGSTOP:  // Stop the process
       proc->status = P_STOPPED;
       log_event("STOPPED", "\t%d\t%d\t%s", proc->pid, proc->priority,
                 proc->cmd);
-      remove_from_queue(proc->priority);  // remove from queue
+      remove_pcb_from_queue(proc);  // remove from queue
 
       // Check if it's sleeping and pause its timer
       for (int i = 0; i < vec_len(&sleeping_processes); i++) {
@@ -308,14 +377,16 @@ int k_proc_kill(pcb_t* proc, int signal) {
       }
 
       vec_push_back(&stopped_jobs, proc);
+      notify_parent(proc, P_SIGSTOP);
       break;
     case P_SIGCONT:
+      forget_child_stops(proc);  // a stop that was never collected is stale
       if (proc->remaining_sleep_ticks > 0) {
         proc->status = P_BLOCKED;
         proc->wake_tick = current_tick + proc->remaining_sleep_ticks;
         vec_push_back(&sleeping_processes, proc);
         proc->remaining_sleep_ticks = 0;
-        remove_pcb_from_queue(proc, proc->priority);
+        remove_pcb_from_queue(proc);
       } else {
         proc->status = P_RUNNING;
         add_to_queue(proc);  // add to the queue
@@ -324,43 +395,16 @@ int k_proc_kill(pcb_t* proc, int signal) {
       }
       break;
     case P_SIGTERM:
-      // zombie it and have parent clean it up !!
-      proc->status = P_ZOMBIED;
-      log_event("ZOMBIE", "\t%d\t%d\t%s", proc->pid, proc->priority, proc->cmd);
-      remove_pcb_from_queue(proc, proc->priority);
-      int parent_who_waited_on_this = proc->waited_by;
-      pcb_t* waiting_parent =
-          k_get_pcb_with_given_pid(parent_who_waited_on_this);
-      if (parent_who_waited_on_this != 0) {
-        // If the parent is waiting on this child, wake it up
-        waiting_parent->status = P_RUNNING;
-        add_to_queue(waiting_parent);
-      }
-      k_proc_suspend();
+      k_proc_terminate(proc, "ZOMBIE");
       break;
     case P_SIGQUIT:
-      proc->status = P_ZOMBIED;
-      log_event("QUIT (core dumped)", "\t%d\t%d\t%s", proc->pid, proc->priority,
-                proc->cmd);
-      remove_pcb_from_queue(proc, proc->priority);
-      int parent_waited_on_this = proc->waited_by;
-      pcb_t* waiting_par = k_get_pcb_with_given_pid(parent_waited_on_this);
-      if (parent_waited_on_this != 0) {
-        // If the parent is waiting on this child, wake it up
-        waiting_par->status = P_RUNNING;
-        add_to_queue(waiting_par);
-      }
-      k_proc_suspend();
+      k_proc_terminate(proc, "QUIT (core dumped)");
       break;
     default:
       P_ERRNO = P_EINVAL;
       return -1;
   }
 
-  if (parent_pcb->status == P_BLOCKED) {
-    parent_pcb->status = P_RUNNING;  // unblock the parent
-    add_to_queue(parent_pcb);
-  }
   return 0;
 }
 
@@ -535,14 +579,10 @@ void k_reap_zombies() {
   if (shell == NULL) {
     return;
   }
-  Vec* children = &shell->children;
   int status;
 
-  for (int i = 0; i < vec_len(children); i++) {
-    pcb_t* child = vec_get(children, i);
-    if (child && child->status == P_ZOMBIED) {
-      k_waitpid(child->pid, &status, true, false, -1);  // wait for the child
-    }
+  // Collect every pending child event without blocking
+  while (k_waitpid(-1, &status, true, false, shell->pid) > 0) {
   }
 }
 
@@ -555,13 +595,13 @@ void k_reap_zombies_init() {
 
   while (1) {
     int status;
-    init->status = P_BLOCKED;
+    unsigned int seen = init->child_wait.wakeups;
     int cpid =
         k_waitpid(-1, &status, true, true, -1);  // noblocking, kernel mode
     if (cpid <= 0) {
-      remove_pcb_from_queue(init,
-                            init->priority);  // remove from queue if no child
-      k_proc_suspend();
+      // Nothing to reap: sleep until an orphan exits (init may have no
+      // children at all, so this waits on the queue directly)
+      k_wait_on(&init->child_wait, seen);
     }
   }
 }
@@ -590,6 +630,12 @@ int k_wc(const char* filename,
     return fd;  // Could be FILE_NOT_FOUND or PERMISSION_DENIED
   }
 
+  int result = k_wc_fd(fd, line_count, word_count, char_count);
+  k_close(fd);
+  return result;
+}
+
+int k_wc_fd(int fd, int* line_count, int* word_count, int* char_count) {
   char buf[BUF_SIZE];
   int total_lines = 0, total_words = 0, total_chars = 0;
   int in_word = 0;
@@ -597,7 +643,6 @@ int k_wc(const char* filename,
   while (1) {
     int bytes_read = k_read(fd, BUF_SIZE, buf);
     if (bytes_read < 0) {
-      k_close(fd);
       return -1;
     }
     if (bytes_read == 0)
@@ -630,8 +675,5 @@ int k_wc(const char* filename,
   *line_count = total_lines;
   *word_count = total_words;
   *char_count = total_chars;
-
-  // Close the file descriptor
-  k_close(fd);
   return 0;
 }
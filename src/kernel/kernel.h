@@ -203,44 +203,48 @@ void k_reap_zombies_init();
 void k_clear();
 
 /**
- * @brief Finds an already open file descriptor for the given file and mode.
+ * @brief Finds the open file for the given name, if any, and checks that it
+ * may be opened in the given mode.
  *
- * Increments the reference count if the file is already open.
- * Validates permissions before returning the open file descriptor index.
+ * Called with files_lock held.
  *
- * @param fname Name of the file to find.
+ * @param dir Block of the directory holding the file.
+ * @param fname Name of the file within dir.
  * @param mode Access mode (F_READ, F_WRITE, or F_APPEND).
- * @return File descriptor index if found and permitted, PERMISSION_DENIED on
- * access error, or -1 if not open.
+ * @param out Receives the open file, or NULL if the file is not open.
+ * @return 0, or PERMISSION_DENIED on access error.
  */
-int find_open_fd(const char* fname, int mode);
+int find_open_node(uint32_t dir, const char* fname, int mode,
+                   file_node_t** out);
 
 /**
  * @brief Finds an existing directory entry or creates a new one if allowed.
  *
  * If the file does not exist and mode is F_WRITE, this function creates a new
- * directory entry and allocates its first block. It expands the root directory
- * if necessary to accommodate new entries.
+ * directory entry and allocates its first block.
  *
- * @param fname Name of the file.
+ * @param dir Block of the directory holding the file.
+ * @param fname Name of the file within dir.
  * @param mode File open mode (only F_WRITE supports creation).
- * @return Pointer to the directory entry, or NULL on failure or permission
- * denial.
+ * @param out Receives a copy of the directory entry.
+ * @return 0 on success, or FILE_NOT_FOUND, IS_A_DIRECTORY or DISK_FULL.
  */
-dir_entry_t* find_or_create_entry(const char* fname, int mode);
+int find_or_create_entry(uint32_t dir, const char* fname, int mode,
+                         dir_entry_t* out);
 
 /**
- * @brief Allocates a new file descriptor slot in the open file table.
+ * @brief Allocates a new open-file description on an open file.
  *
- * Sets the file descriptor fields based on the provided directory entry and
- * mode. If the mode is F_WRITE, clears existing FAT chain and resets the file
- * size.
+ * Each call gets its own description, so each open has its own offset; an
+ * F_APPEND description starts at the end of the file. Called with
+ * files_lock held.
  *
- * @param entry Pointer to the directory entry.
+ * @param node The open file, see find_open_node.
  * @param mode Access mode to open the file with.
- * @return File descriptor index on success, -1 if no free slot is available.
+ * @return File descriptor index on success, -1 with P_ERRNO set if the table
+ * cannot grow.
  */
-int allocate_fd(dir_entry_t* entry, int mode);
+int allocate_fd(file_node_t* node, int mode);
 
 /**
  * @brief Calculate the number of lines, words, and characters in a file.
@@ -256,4 +260,16 @@ int k_wc(const char* filename,
          int* word_count,
          int* char_count);
 
+/**
+ * @brief Count lines, words and characters read from an open global fd
+ * until end of file.
+ *
+ * @param fd Global file descriptor to read from (a file or a pipe end).
+ * @param line_count Pointer to store the number of lines.
+ * @param word_count Pointer to store the number of words.
+ * @param char_count Pointer to store the number of characters.
+ * @return 0 on success, -1 on failure.
+ */
+int k_wc_fd(int fd, int* line_count, int* word_count, int* char_count);
+
 #endif  // KERNEL_H_
\ No newline at end of file
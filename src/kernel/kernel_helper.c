@@ -1,4 +1,5 @@
 #include "./kernel_helper.h"
+#include "./kpipe.h"
 #include "./scheduler/scheduler_helper.h"
 #include "./util/spthread.h"
 
@@ -26,6 +27,16 @@ int initialize_new_process(pcb_t* new_pcb,
   new_pcb->remaining_sleep_ticks = 0;
   new_pcb->is_background = is_background;  // is the pcb for a background job
   new_pcb->argv = argv;
+  new_pcb->owns_argv = false;  // s_spawn says otherwise for a copy
+  new_pcb->sched_slot = -1;  // not on any run queue yet
+  new_pcb->pass = 0;
+  new_pcb->sched_level = priority;
+  new_pcb->sched_ticks = 0;
+  new_pcb->child_events = vec_new(INITIAL_VEC_CAPACITY, free);
+  wait_queue_init(&new_pcb->child_wait);
+  new_pcb->waiting_on = NULL;
+  new_pcb->out_buf = NULL;
+  new_pcb->out_len = 0;
 
   new_pcb->children =
       vec_new(INITIAL_VEC_CAPACITY, NULL);  // initialize children as empty
@@ -35,6 +46,7 @@ int initialize_new_process(pcb_t* new_pcb,
         (proc_fd_ent*)malloc(MAX_OPEN_FILES * sizeof(proc_fd_ent));
     memcpy(child_file_descriptor, parent->file_descriptors,
            MAX_OPEN_FILES * sizeof(proc_fd_ent));
+    k_pipe_inherit_fds(child_file_descriptor);
     new_pcb->file_descriptors = child_file_descriptor;
   } else {
     new_pcb->file_descriptors = NULL;
@@ -80,12 +92,13 @@ void reparent_children(pcb_t* parent) {
     if (child == NULL) {
       continue;
     }
-    child->ppid = 1;       // reparent to init
-    child->waited_by = 1;  // set the parent to init
+    child->ppid = 1;  // reparent to init
     log_event("ORPHAN", "\t%d\t%d\t%s", child->pid, child->priority,
               child->cmd);  // log the event
     add_child_to_init_pcb(child);
-    add_to_queue(init);
+    if (child->status == P_ZOMBIED) {
+      notify_parent(child, P_SIGEXIT);  // its exit went to the old parent
+    }
   }
   vec_clear(&parent->children);  // clear the children of the parent
 }
@@ -154,12 +167,9 @@ void init_fd_table(pcb_t* init_pcb) {
   proc_fd_ent stdin;
   proc_fd_ent stdout;
   proc_fd_ent stderr;
-  stdin =
-      (proc_fd_ent){.proc_fd = 0, .mode = F_READ, .offset = 0, .global_fd = 0};
-  stdout =
-      (proc_fd_ent){.proc_fd = 1, .mode = F_WRITE, .offset = 0, .global_fd = 1};
-  stderr =
-      (proc_fd_ent){.proc_fd = 2, .mode = F_WRITE, .offset = 0, .global_fd = 2};
+  stdin = (proc_fd_ent){.proc_fd = 0, .mode = F_READ, .global_fd = 0};
+  stdout = (proc_fd_ent){.proc_fd = 1, .mode = F_WRITE, .global_fd = 1};
+  stderr = (proc_fd_ent){.proc_fd = 2, .mode = F_WRITE, .global_fd = 2};
   init_fd[0] = stdin;
   init_fd[1] = stdout;
   init_fd[2] = stderr;
@@ -167,4 +177,35 @@ void init_fd_table(pcb_t* init_pcb) {
     init_fd[i].proc_fd = -1;
   }
   init_pcb->file_descriptors = init_fd;
-}
\ No newline at end of file
+}
+
+// Record a child's state change for its parent and wake the parent if it is
+// sleeping in waitpid
+void notify_parent(pcb_t* child, int status) {
+  pcb_t* parent = k_get_pcb_with_given_pid(child->ppid);
+  if (!parent) {
+    return;
+  }
+  child_event_t* event = malloc(sizeof(child_event_t));
+  if (!event) {
+    panic("notify_parent: out of memory");
+  }
+  event->pid = child->pid;
+  event->status = status;
+  vec_push_back(&parent->child_events, event);
+  k_wake_up(&parent->child_wait);
+}
+
+// Drop a child's unreported stops, e.g. once it has been continued
+void forget_child_stops(pcb_t* child) {
+  pcb_t* parent = k_get_pcb_with_given_pid(child->ppid);
+  if (!parent) {
+    return;
+  }
+  for (size_t i = 0; i < vec_len(&parent->child_events); i++) {
+    child_event_t* event = vec_get(&parent->child_events, i);
+    if (event->pid == child->pid && event->status == P_SIGSTOP) {
+      vec_erase(&parent->child_events, i--);
+    }
+  }
+}
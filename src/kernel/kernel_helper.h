@@ -85,4 +85,21 @@ void init_fd_table(pcb_t* init_pcb);
  */
 void remove_process_pcb_from_background_job(pcb_t* child);
 
+/**
+ * @brief Report a child's state change to its parent.
+ * Queues the event for the parent's next waitpid and wakes the parent if it
+ * is blocked waiting for one.
+ *
+ * @param child Child whose state changed.
+ * @param status P_SIGEXIT, P_SIGTERM or P_SIGSTOP.
+ */
+void notify_parent(pcb_t* child, int status);
+
+/**
+ * @brief Drop a child's stop events that the parent has not collected.
+ *
+ * @param child Child that has been continued.
+ */
+void forget_child_stops(pcb_t* child);
+
 #endif  // _KERNEL_HELPER_H_
\ No newline at end of file
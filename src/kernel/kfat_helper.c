@@ -1,140 +1,418 @@
 #include "./kfat_helper.h"
+#include "./kpipe.h"
+#include "./kstdin.h"
+#include "./kstdout.h"
+#include "./pennfat/fat_compress.h"
+#include "./pennfat/fat_csum.h"
+#include "./pennfat/fat_dedup.h"
+#include "./pennfat/fat_dir.h"
 #include "./syscall/sys_call.h"
 #include "./util/p_errno.h"
 
+#include <limits.h>
+#include <sys/sendfile.h>
+
 
 // K_OPEN WITH HELPERS:
-int find_open_fd(const char* fname, int mode) {
-  for (int i = 0; i < MAX_OPEN_FILES; i++) {
-    dir_entry_t* entry = state.open_files[i].entry;
-    if (entry && strcmp(entry->name, fname) == 0) {
-      uint8_t perm = entry->perm;
-      if ((mode == F_WRITE || mode == F_APPEND) &&
-          (perm != PERM_READ_WRITE && perm != PERM_WRITE && perm != PERM_ALL)) {
-        return PERMISSION_DENIED;
-      }
-      if (perm == PERM_NONE) return PERMISSION_DENIED;
-      state.open_files[i].ref_count++;
-      return i;
+// Free a file's chain, and with a deduplicated file its references to the
+// blocks its map points at
+static void free_file_blocks(const dir_entry_t* entry) {
+  if ((entry->perm & PERM_DEDUP) && !entry_is_inline(entry)) {
+    dedup_release(entry);
+  }
+  fat_free_chain_deferred(entry_first_block(entry));
+}
+
+// Open file on the entry `name` of directory `dir`, or NULL. The caller
+// holds files_lock.
+static file_node_t* find_node(uint32_t dir, const char* name) {
+  for (size_t i = 0; i < vec_len(&state.nodes); i++) {
+    file_node_t* node = vec_get(&state.nodes, i);
+    if (node->dir == dir && !node->unlinked &&
+        strcmp(node->entry->name, name) == 0) {
+      return node;
     }
   }
-  return -1;  // Not found
+  return NULL;
+}
+
+int find_open_node(uint32_t dir, const char* fname, int mode,
+                   file_node_t** out) {
+  *out = find_node(dir, fname);
+  if (!*out) {
+    return 0;  // Not open
+  }
+  uint8_t perm = (*out)->entry->perm & PERM_ALL;
+  if ((mode == F_WRITE || mode == F_APPEND) &&
+      (perm != PERM_READ_WRITE && perm != PERM_WRITE && perm != PERM_ALL)) {
+    return PERMISSION_DENIED;
+  }
+  if (perm == PERM_NONE) return PERMISSION_DENIED;
+  return 0;
+}
+
+int find_or_create_entry(uint32_t dir, const char* fname, int mode,
+                         dir_entry_t* out) {
+  int ret = dir_lookup(dir, fname, out);
+  if (ret == 0) {
+    return out->type == FT_DIRECTORY ? IS_A_DIRECTORY : 0;
+  }
+  if (ret != FILE_NOT_FOUND || mode != F_WRITE) return ret;  // Only create on WRITE
+
+  // New files take no block until they outgrow their inline data
+  memset(out, 0, sizeof(dir_entry_t));
+  strcpy(out->name, fname);
+  out->size = 0;
+  set_entry_first_block(out, FAT_ENTRY_LAST);
+  out->type = FT_REGULAR;
+  out->perm = PERM_READ_WRITE;
+  out->mtime = time(NULL);
+
+  return dir_insert(dir, out);
 }
 
-dir_entry_t* find_or_create_entry(const char* fname, int mode) {
-  dir_entry_t* entry = find_dir_entry(fname);
-  if (entry) return entry;
+// Write an open file's entry back to its directory, unless it was removed
+static void sync_file_entry(file_node_t* file) {
+  if (!file->unlinked) {
+    dir_update(file->dir, file->entry);
+  }
+}
 
-  if (mode != F_WRITE) return NULL;  // Only create on WRITE
+// Start keeping track of an open file; NULL if out of memory
+static file_node_t* open_node(uint32_t dir, const dir_entry_t* entry,
+                              int mode) {
+  // The node owns its copy of the entry until the last close
+  file_node_t* node = calloc(1, sizeof(file_node_t));
+  dir_entry_t* copy = malloc(sizeof(dir_entry_t));
+  if (!node || !copy) {
+    free(node);
+    free(copy);
+    return NULL;
+  }
+  *copy = *entry;
+  *node = (file_node_t){.entry = copy,
+                        .dir = dir,
+                        .current_block = entry_first_block(entry),
+                        .current_index = 0};
+  pthread_mutex_init(&node->lock, NULL);
+
+  // Truncating makes the file empty and inline again
+  if (mode == F_WRITE) {
+    free_file_blocks(copy);
+    copy->size = 0;
+    set_entry_first_block(copy, FAT_ENTRY_LAST);
+    memset(copy->inline_data, 0, INLINE_DATA_MAX);
+    node->current_block = FAT_ENTRY_LAST;
+    sync_file_entry(node);
+  }
+  vec_push_back(&state.nodes, node);
+  return node;
+}
 
-  // Find free directory slot
-  entry = state.root_dir;
-  while (entry->name[0] != DIR_ENTRY_END) {
-    if (entry->name[0] == DIR_ENTRY_DELETED || entry->name[0] < DIR_ENTRY_IN_USE)
+// Stop keeping track of a file nothing has open; files_lock is held
+static void close_node(file_node_t* node) {
+  for (size_t i = 0; i < vec_len(&state.nodes); i++) {
+    if (vec_get(&state.nodes, i) == node) {
+      vec_shallow_erase(&state.nodes, i);
       break;
-    entry++;
-  }
-
-  int dir_entries_per_block = state.block_size / sizeof(dir_entry_t);
-  int total_entries = state.root_dir_blocks * dir_entries_per_block;
-  int valid_entries = 0;
-  for (int i = 0; i < total_entries; i++) {
-    if (state.root_dir[i].name[0] > DIR_ENTRY_DELETED) valid_entries++;
-  }
-
-  if (valid_entries >= total_entries - 1) {  // Need expansion
-    uint16_t new_block = find_free_fat_entry();
-    if (!new_block) return NULL;
-    uint16_t last = 1;
-    while (state.fat[last] != FAT_ENTRY_LAST) last = state.fat[last];
-    state.fat[last] = new_block;
-    state.fat[new_block] = FAT_ENTRY_LAST;
-
-    void* new_root = realloc(state.root_dir, (state.root_dir_blocks + 1) * state.block_size);
-    if (!new_root) return NULL;
-    state.root_dir = new_root;
-    memset((uint8_t*)state.root_dir + state.root_dir_blocks * state.block_size, 0, state.block_size);
-    state.root_dir_blocks++;
-    ((dir_entry_t*)((uint8_t*)state.root_dir + (state.root_dir_blocks - 1) * state.block_size))->name[0] = DIR_ENTRY_END;
-
-    // Re-scan for new free entry
-    entry = state.root_dir;
-    while (entry->name[0] != DIR_ENTRY_END) {
-      if (entry->name[0] == DIR_ENTRY_DELETED || entry->name[0] < DIR_ENTRY_IN_USE)
-        break;
-      entry++;
-    }
-  }
-
-  memset(entry, 0, sizeof(dir_entry_t));
-  strncpy(entry->name, fname, MAX_FILENAME_LEN - 1);
-  entry->name[MAX_FILENAME_LEN - 1] = '\0';
-  entry->size = 0;
-  entry->first_block = find_free_fat_entry();
-  if (!entry->first_block) return NULL;
-  state.fat[entry->first_block] = FAT_ENTRY_LAST;
-  entry->type = FT_REGULAR;
-  entry->perm = PERM_READ_WRITE;
-  entry->mtime = time(NULL);
-
-  return entry;
-}
-
-int allocate_fd(dir_entry_t* entry, int mode) {
-  for (int i = 0; i < MAX_OPEN_FILES; i++) {
-    if (!state.open_files[i].entry) {
-      state.open_files[i] = (file_descriptor_t){
-          .fd = i,
-          .entry = entry,
-          .current_block = entry->first_block,
-          .offset = (mode == F_APPEND) ? entry->size : 0,
-          .mode = mode,
-          .ref_count = 1};
-
-      if (mode == F_WRITE) {
-        entry->size = 0;
-        uint16_t curr = state.fat[entry->first_block];
-        state.fat[entry->first_block] = FAT_ENTRY_LAST;
-        while (curr != FAT_ENTRY_LAST) {
-          uint16_t next = state.fat[curr];
-          state.fat[curr] = FAT_ENTRY_FREE;
-          curr = next;
-        }
-      }
-      return i;
     }
   }
-  P_ERRNO = FD_INVALID;
-  return -1;
+  if (node->unlinked) {
+    free_file_blocks(node->entry);
+  }
+  pthread_mutex_destroy(&node->lock);
+  free(node->entry);
+  free(node->frames);
+  free(node->map);
+  free(node);
+}
+
+int allocate_fd(file_node_t* node, int mode) {
+  int fd = fd_claim();
+  if (fd < 0) {
+    P_ERRNO = TOO_MANY_OPEN_FILES;
+    return -1;
+  }
+  fs_lock(&node->lock);
+  *fd_slot(fd) = (file_descriptor_t){
+      .fd = fd,
+      .entry = node->entry,
+      .node = node,
+      .offset = (mode == F_APPEND) ? node->entry->size : 0,
+      .mode = mode,
+      .ref_count = 1};
+  node->opens++;
+  fs_unlock(&node->lock);
+  return fd;
+}
+
+// Bytes in the run of consecutive blocks starting at block, at most max
+static uint32_t chain_run(uint32_t block, uint32_t max) {
+  uint32_t len = state.block_size;
+  while (len < max && fat_get(block) == block + 1) {
+    block++;
+    len += state.block_size;
+  }
+  return MIN(len, max);
+}
+
+// Block of a chain that holds byte len - 1 of a run starting at block
+static uint32_t run_end(uint32_t block, uint32_t len) {
+  return block + (len - 1) / state.block_size;
+}
+
+// Copy len bytes between two regular files (or within one), inside the host
+// kernel when it supports copy_file_range
+static int copy_extent(int in_fd, off_t from, int out_fd, off_t to,
+                       size_t len) {
+  while (len > 0) {
+    ssize_t n = copy_file_range(in_fd, &from, out_fd, &to, len, 0);
+    if (n <= 0) {
+      break;
+    }
+    len -= n;
+  }
+
+  char buf[FAT_MAX_BLOCK_SIZE];
+  while (len > 0) {
+    size_t chunk = MIN(len, sizeof(buf));
+    if (pread(in_fd, buf, chunk, from) != (ssize_t)chunk ||
+        pwrite(out_fd, buf, chunk, to) != (ssize_t)chunk) {
+      return FS_IO_ERROR;
+    }
+    from += chunk;
+    to += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
+
+// Copy whole blocks within the image, carrying their checksums along
+static int copy_blocks(uint32_t from, uint32_t to, uint32_t count) {
+  int ret = copy_extent(state.fs_fd, block_offset(from), state.fs_fd,
+                        block_offset(to), (size_t)count * state.block_size);
+  if (ret == 0) {
+    block_copied(from, to, count);
+  }
+  return ret;
+}
+
+// Block number `index` of an open file's chain, or FAT_ENTRY_LAST past its
+// end. Walks on from the cached position, so sequential access costs one FAT
+// lookup per block instead of a walk from the start of the chain; past the
+// end the cache is left on the last block.
+static uint32_t file_block_at(file_node_t* file, uint32_t index) {
+  if (file->current_block == FAT_ENTRY_LAST || index < file->current_index) {
+    file->current_block = entry_first_block(file->entry);
+    file->current_index = 0;
+  }
+  while (file->current_block != FAT_ENTRY_LAST &&
+         file->current_index < index) {
+    uint32_t next = fat_get(file->current_block);
+    if (next == FAT_ENTRY_LAST) {
+      return FAT_ENTRY_LAST;
+    }
+    file->prev_block = file->current_block;
+    file->current_block = next;
+    file->current_index++;
+  }
+  return file->current_block;
 }
 
+// Like file_block_at, but grows the chain up to `index` first
+static uint32_t file_block_for_write(file_node_t* file, uint32_t index) {
+  uint32_t block = file_block_at(file, index);
+  while (block == FAT_ENTRY_LAST) {
+    uint32_t new_block = fat_alloc_block();
+    if (!new_block) {
+      return FAT_ENTRY_LAST;
+    }
+    if (file->current_block == FAT_ENTRY_LAST) {
+      set_entry_first_block(file->entry, new_block);
+      file->current_index = 0;
+    } else {
+      fat_set(file->current_block, new_block);
+      file->prev_block = file->current_block;
+      file->current_index++;
+    }
+    file->current_block = new_block;
+    if (file->current_index == index) {
+      block = new_block;
+    } else {
+      block_restamp(new_block, 1);  // skipped over, so never written
+    }
+  }
+  return block;
+}
+
+// Before a write changes a block that a snapshot holds, move the file onto
+// a copy of it; block is the cached one. Returns the block to write to, or
+// FAT_ENTRY_LAST if no block is free.
+static uint32_t file_unshare(file_node_t* file, uint32_t block,
+                             bool whole) {
+  if (!fat_is_shared(block)) {
+    return block;
+  }
+  uint32_t copy = fat_alloc_block();
+  if (!copy) {
+    return FAT_ENTRY_LAST;
+  }
+  // A write over the whole block needs none of its old bytes
+  if (!whole && copy_blocks(block, copy, 1)) {
+    fat_set(copy, FAT_ENTRY_FREE);
+    return FAT_ENTRY_LAST;
+  }
+  fat_set(copy, fat_get(block));
+  if (file->current_index == 0) {
+    set_entry_first_block(file->entry, copy);
+  } else {
+    fat_set(file->prev_block, copy);
+  }
+  fat_set(block, FAT_ENTRY_FREE);  // stays allocated to the snapshot
+  file->current_block = copy;
+  return copy;
+}
+
+// Move an inline file's bytes to a first block of its own
+static int file_uninline(file_node_t* file) {
+  dir_entry_t* entry = file->entry;
+  uint32_t block = fat_alloc_block();
+  if (!block) {
+    return DISK_FULL;
+  }
+  int size = MIN(entry->size, INLINE_DATA_MAX);
+  int ret = block_write(block, entry->inline_data, size, 0);
+  if (ret) {
+    fat_set(block, FAT_ENTRY_FREE);
+    return ret;
+  }
+  memset(entry->inline_data, 0, INLINE_DATA_MAX);
+  set_entry_first_block(entry, block);
+  file->current_block = block;
+  file->current_index = 0;
+  return 0;
+}
+
+// Frame cache of a compressed file, allocated on first use
+static frame_cache_t* file_frames(file_node_t* file) {
+  if (!file->frames) {
+    file->frames = frame_cache_new();
+  }
+  return file->frames;
+}
+
+// Map cache of a deduplicated file, allocated on first use
+static map_cache_t* file_map(file_node_t* file) {
+  if (!file->map) {
+    file->map = map_cache_new();
+  }
+  return file->map;
+}
 
 int k_open(const char* fname, int mode) {
   // Validate mounted FS and mode
-  if (!state.is_mounted || !state.fat || !state.root_dir) { P_ERRNO = FS_NOT_MOUNTED; return -1; }
+  if (!state.is_mounted || !state.fat) { P_ERRNO = FS_NOT_MOUNTED; return -1; }
   if (mode != F_READ && mode != F_WRITE && mode != F_APPEND) { P_ERRNO = INVALID_MODE; return -1; }
+  if (mode != F_READ && state.read_only) { P_ERRNO = READ_ONLY_FS; return -1; }
+
+  // Resolve the directory that holds the file
+  uint32_t dir;
+  char name[MAX_FILENAME_LEN];
+  int ret = path_resolve(fname, &dir, name);
+  if (ret == 0 && !name[0]) ret = IS_A_DIRECTORY;  // the root itself
+  if (ret) { P_ERRNO = ret; return -1; }
+
+  // The table stays locked so two opens never both create the same file
+  fs_lock(&state.files_lock);
+  file_node_t* node;
+  ret = find_open_node(dir, name, mode, &node);
+  if (ret == 0 && !node) {
+    dir_entry_t entry;
+    ret = find_or_create_entry(dir, name, mode, &entry);
+    if (ret == 0 && !(node = open_node(dir, &entry, mode))) {
+      ret = P_ENOMEM;
+    }
+  }
+  int fd = -1;
+  if (ret) {
+    P_ERRNO = ret;
+  } else if ((fd = allocate_fd(node, mode)) < 0 && node->opens == 0) {
+    close_node(node);
+  }
+  fs_unlock(&state.files_lock);
+  return fd;
+}
 
-  // Check if already open
-  int fd = find_open_fd(fname, mode);
-  if (fd >= 0) return fd;  // Already open
 
-  // Find or create file entry
-  dir_entry_t* entry = find_or_create_entry(fname, mode);
-  if (!entry) { P_ERRNO = FILE_NOT_FOUND; return -1; }
+// Read from a regular file; the caller holds its lock
+static int file_read(file_descriptor_t* file, int n, char* buf) {
+  dir_entry_t* entry = file->entry;
 
-  // Allocate FD
-  return allocate_fd(entry, mode);
-}
+  // Small files are read straight from their entry
+  if (entry_is_inline(entry)) {
+    int end = MIN(entry->size, INLINE_DATA_MAX);
+    int bytes_read = MAX(0, MIN(n, end - (int)file->offset));
+    memcpy(buf, entry->inline_data + file->offset, bytes_read);
+    file->offset += bytes_read;
+    return bytes_read;
+  }
 
+  if (entry->perm & PERM_COMPRESSED) {
+    frame_cache_t* frames = file_frames(file->node);
+    int ret = frames ? compressed_read(entry, frames, file->offset, buf, n)
+                     : FS_MEMORY_ERROR;
+    if (ret < 0) {
+      P_ERRNO = ret;
+      return -1;
+    }
+    file->offset += ret;
+    return ret;
+  }
+
+  if (entry->perm & PERM_DEDUP) {
+    map_cache_t* map = file_map(file->node);
+    int ret = map ? dedup_read(entry, map, file->offset, buf, n)
+                  : FS_MEMORY_ERROR;
+    if (ret < 0) {
+      P_ERRNO = ret;
+      return -1;
+    }
+    file->offset += ret;
+    return ret;
+  }
+
+  // Regular file read
+  int bytes_read = 0;
+  while (bytes_read < n && file->offset < entry->size) {
+    uint32_t block = file_block_at(file->node, file->offset / state.block_size);
+    if (block == FAT_ENTRY_LAST)
+      break;
+
+    uint32_t offset_in_block = file->offset % state.block_size;
+    int bytes_to_read =
+        MIN(MIN(state.block_size - offset_in_block, n - bytes_read),
+            entry->size - file->offset);
+    int ret =
+        block_read(block, buf + bytes_read, bytes_to_read, offset_in_block);
+    if (ret) {
+      P_ERRNO = ret;
+      return -1;
+    }
+
+    bytes_read += bytes_to_read;
+    file->offset += bytes_to_read;
+  }
+
+  return bytes_read;
+}
 
 int k_read(int fd, int n, char* buf) {
   // Validate FD
-  if (fd < 0 || fd >= MAX_OPEN_FILES || !state.open_files[fd].entry) {
+  file_descriptor_t* file = fd_get(fd);
+  if (!file) {
     P_ERRNO = FD_INVALID;
     return -1;
   }
-
-  file_descriptor_t* file = &state.open_files[fd];
   dir_entry_t* entry = file->entry;
 
   // Check permissions
@@ -143,71 +421,48 @@ int k_read(int fd, int n, char* buf) {
     return -1;
   }
 
-  // Read from stdin (special handling)
-  if (fd == 0 && strcmp(entry->name, "stdin") == 0) {
-    size_t input_len = 0;
-    char* local_buf = (char*)malloc(4096 * sizeof(char));
-    ssize_t bytes_read = getline(&local_buf, &input_len, stdin);
-
-    if (bytes_read == -1) {
-      if (feof(stdin)) {
-        clearerr(stdin);  // Reset EOF so future reads work
-        return 0;         // Treat as EOF
-      }
-      P_ERRNO = FD_INVALID;
-      return -1;  // Error
-    }
-    local_buf[strcspn(local_buf, "\n")] = '\0';  // Remove newline
-    strncpy(buf, local_buf, bytes_read + 1);
-    free(local_buf);
-    return (int)bytes_read;
+  if (file->pipe) {
+    return k_pipe_read(file, n, buf);
   }
 
-  // Regular file read
-  if (entry->size == 0 || file->current_block == FAT_ENTRY_LAST) {
-    return 0;
+  // Read from stdin (special handling): blocks the process, not the host
+  if (fd == 0 && strcmp(entry->name, "stdin") == 0) {
+    return k_stdin_read(buf, n);
   }
 
-  int bytes_read = 0;
-  uint16_t current_block = file->current_block;
-  uint32_t offset_in_block = file->offset % state.block_size;
-
-  while (bytes_read < n && current_block != FAT_ENTRY_LAST) {
-    int bytes_remaining_in_block = state.block_size - offset_in_block;
-    int bytes_to_read = MIN(MIN(bytes_remaining_in_block, n - bytes_read),
-                            entry->size - file->offset);
-
-    if (bytes_to_read <= 0)
-      break;
+  fs_lock(&file->node->lock);
+  int ret = file_read(file, n, buf);
+  fs_unlock(&file->node->lock);
+  return ret;
+}
 
-    lseek(state.fs_fd,
-          state.data_start + (current_block - 1) * state.block_size +
-              offset_in_block,
-          SEEK_SET);
-    int chunk = read(state.fs_fd, buf + bytes_read, bytes_to_read);
-    if (chunk < 0) {
-      P_ERRNO = FD_INVALID;
-      return -1;
+// Copy in_fd to out_fd until end of file, filling CAT_SEGMENTS buffers per
+// s_readv and writing them with one s_writev; -1 if a write fell short
+static int cat_copy(int in_fd, int out_fd) {
+  char buf[CAT_SEGMENTS][1024];
+  struct iovec in[CAT_SEGMENTS];
+  for (int i = 0; i < CAT_SEGMENTS; i++) {
+    in[i] = (struct iovec){buf[i], sizeof(buf[i])};
+  }
+  int n;
+  while ((n = s_readv(in_fd, in, CAT_SEGMENTS)) > 0) {
+    // Only the buffers the read reached go out, the last one in part
+    struct iovec out[CAT_SEGMENTS];
+    int count = 0;
+    for (int left = n; left > 0; left -= sizeof(buf[0]), count++) {
+      out[count] = (struct iovec){buf[count], MIN(left, sizeof(buf[0]))};
     }
-
-    bytes_read += chunk;
-    file->offset += chunk;
-    offset_in_block = 0;
-
-    if (file->offset % state.block_size == 0) {
-      current_block = state.fat[current_block];
-      file->current_block = current_block;
+    if (s_writev(out_fd, out, count) != n) {
+      return -1;
     }
   }
-
-  return bytes_read;
+  return 0;
 }
 
 int k_cat(int argc, char* argv[]) {
   if (!state.is_mounted)
     return FS_NOT_MOUNTED;
 
-  char buf[1024];
   int write_mode = 0;
   int append_mode = 0;
   const char* output_filename = NULL;
@@ -265,16 +520,12 @@ int k_cat(int argc, char* argv[]) {
     }
 
     input_found = 1;
-    int n;
-    while ((n = s_read(in_fd, sizeof(buf), buf)) > 0) {
-      if (out_fd >= 0) {
-        if (s_write(out_fd, n, buf) != n) {
-          retval = -1;
-          break;
-        }
-      } else {
-        s_write(STDOUT_FILENO, n, buf);
+    if (out_fd >= 0) {
+      if (cat_copy(in_fd, out_fd) == -1) {
+        retval = -1;
       }
+    } else {
+      cat_copy(in_fd, STDOUT_FILENO);
     }
 
     s_close(in_fd);
@@ -282,208 +533,359 @@ int k_cat(int argc, char* argv[]) {
 
   // If no input file: read from stdin and write to output or stdout
   if (!input_found && argc == 1) {
-    int n;
     proc_fd_ent* file_table = get_file_descriptors();
-    if (file_table[STDIN_FILENO].global_fd ==
-            file_table[STDOUT_FILENO].global_fd &&
+    file_descriptor_t* in = fd_get(file_table[STDIN_FILENO].global_fd);
+    file_descriptor_t* out = fd_get(file_table[STDOUT_FILENO].global_fd);
+    if (in && out && in->node && in->node == out->node &&
         file_table[STDOUT_FILENO].mode == F_APPEND) {
       printf("Cat may not read and append to the same file");
       return INVALID_MODE;
     }
-    while ((n = s_read(STDIN_FILENO, sizeof(buf), buf)) > 0) {
-      if (out_fd >= 0) {
-        if (s_write(out_fd, n, buf) != n) {
-          retval = -1;
-          break;
-        }
-      } else {
-        if(s_write(STDOUT_FILENO, n, buf) == -1) {
-          u_perror("s_write: Failed");
-        }
+    if (out_fd >= 0) {
+      if (cat_copy(STDIN_FILENO, out_fd) == -1) {
+        retval = -1;
       }
+    } else if (cat_copy(STDIN_FILENO, STDOUT_FILENO) == -1) {
+      u_perror("s_write: Failed");
     }
     if (file_table[STDIN_FILENO].global_fd != 0) {
       s_close(STDIN_FILENO);
       file_table[STDIN_FILENO] = (proc_fd_ent){
-          .proc_fd = 0, .mode = F_READ, .offset = 0, .global_fd = 0};
+          .proc_fd = 0, .mode = F_READ, .global_fd = 0};
     }
     if (file_table[STDOUT_FILENO].global_fd != 1) {
       s_close(STDOUT_FILENO);
       file_table[STDOUT_FILENO] = (proc_fd_ent){
-          .proc_fd = 1, .mode = F_WRITE, .offset = 0, .global_fd = 1};
+          .proc_fd = 1, .mode = F_WRITE, .global_fd = 1};
     }
   }
 
   if (out_fd >= 0)
     s_close(out_fd);
-  sync_directory_entry(NULL);
   return retval;
 }
 
-int k_write(int fd, const char* buf, int n) {
-  // Validate FD and permissions
-  if (fd < 0 || fd >= MAX_OPEN_FILES || !state.open_files[fd].entry) {
-    P_ERRNO = FD_INVALID;
-    return -1;
+static __thread int batch_depth;     // k_batch_begin calls not yet ended
+static __thread bool batch_pending;  // a flush was put off until the end
+
+// Flush the FAT and the image, or leave it to the end of the batch
+static void sync_image() {
+  if (batch_depth > 0) {
+    batch_pending = true;
+    return;
   }
+  msync(state.fat, state.fat_size, MS_SYNC);
+  fsync(state.fs_fd);  // Ensure data hits disk
+}
 
-  file_descriptor_t* file = &state.open_files[fd];
-  dir_entry_t* entry = file->entry;
+void k_batch_begin() {
+  batch_depth++;
+}
 
-  if (!(entry->perm & PERM_WRITE)) {
-    P_ERRNO = PERMISSION_DENIED;
-    return -1;
-  }
-  if (fd == STDOUT_FILENO || fd == STDERR_FILENO) {
-    int bytes_written = write(fd, buf, n);
-    return bytes_written;
+void k_batch_end() {
+  if (batch_depth > 0 && --batch_depth == 0 && batch_pending) {
+    batch_pending = false;
+    sync_image();
   }
+}
+
+// Sync metadata once for the whole write
+static void file_write_done(file_node_t* file) {
+  file->entry->mtime = time(NULL);
+  sync_file_entry(file);
+  sync_image();
+}
+
+// Write to a regular file; the caller holds its lock
+static int file_write(file_descriptor_t* file, const char* buf, int n) {
+  dir_entry_t* entry = file->entry;
+
   // Handle append mode
   if (file->mode == F_APPEND) {
     file->offset = entry->size;
-    if (entry->first_block != FAT_ENTRY_LAST) {
-      uint16_t block = entry->first_block;
-      while (state.fat[block] != FAT_ENTRY_LAST) {
-        block = state.fat[block];
-      }
-      file->current_block = block;
+  }
+
+  // Small files stay in their entry until a write goes past its end
+  if (entry_is_inline(entry) && file->offset + n <= INLINE_DATA_MAX) {
+    memcpy(entry->inline_data + file->offset, buf, n);
+    file->offset += n;
+    entry->size = file->offset;
+    entry->mtime = time(NULL);
+    sync_file_entry(file->node);
+    return n;
+  }
+
+  // Compressed files are rewritten a frame at a time, see fat_compress.h
+  if (entry->perm & PERM_COMPRESSED) {
+    frame_cache_t* frames = file_frames(file->node);
+    int ret = frames ? compressed_write(entry, frames, &file->offset, buf, n)
+                     : FS_MEMORY_ERROR;
+    file_write_done(file->node);
+    return ret;
+  }
+
+  // Deduplicated files write through their map, see fat_dedup.h
+  if (entry->perm & PERM_DEDUP) {
+    map_cache_t* map = file_map(file->node);
+    int ret = map ? dedup_write(entry, map, &file->offset, buf, n)
+                  : FS_MEMORY_ERROR;
+    file_write_done(file->node);
+    return ret;
+  }
+
+  if (entry_is_inline(entry)) {
+    int ret = file_uninline(file->node);
+    if (ret) {
+      return ret;
     }
   }
 
   int bytes_written = 0;
-  uint16_t current_block = file->current_block;
-  uint32_t offset_in_block = file->offset % state.block_size;
+  int ret = 0;
 
   // Write loop
   while (bytes_written < n) {
-    // Allocate new block if needed
-    if (current_block == FAT_ENTRY_LAST ||
-        (offset_in_block == state.block_size && bytes_written < n)) {
-      uint16_t new_block = find_free_fat_entry();
-      if (new_block == 0) {
-        return DISK_FULL;
-      }
-
-      if (current_block == FAT_ENTRY_LAST) {
-        entry->first_block = new_block;
-      } else {
-        state.fat[current_block] = new_block;
-      }
-
-      state.fat[new_block] = FAT_ENTRY_LAST;
-      current_block = new_block;
-      offset_in_block = 0;
-      file->current_block = current_block;
+    // Allocate new blocks if needed
+    uint32_t block = file_block_for_write(file->node, file->offset / state.block_size);
+    if (block == FAT_ENTRY_LAST) {
+      ret = DISK_FULL;
+      break;
     }
 
     // Calculate write size
+    uint32_t offset_in_block = file->offset % state.block_size;
     int remaining_in_block = state.block_size - offset_in_block;
     int bytes_to_write = MIN(remaining_in_block, n - bytes_written);
 
-    // Seek and write
-    off_t seek_pos = state.data_start + (current_block - 1) * state.block_size +
-                     offset_in_block;
-    lseek(state.fs_fd, seek_pos, SEEK_SET);
+    // Blocks shared with a snapshot are copied before they change
+    block = file_unshare(file->node, block, bytes_to_write == state.block_size);
+    if (block == FAT_ENTRY_LAST) {
+      ret = DISK_FULL;
+      break;
+    }
 
-    int chunk = write(state.fs_fd, buf + bytes_written, bytes_to_write);
-    if (chunk < 0) {
-      P_ERRNO = FD_INVALID;
+    ret = block_write(block, buf + bytes_written, bytes_to_write,
+                      offset_in_block);
+    if (ret) {
+      P_ERRNO = ret;
       return -1;
     }
 
     // Update state
-    bytes_written += chunk;
-    offset_in_block += chunk;
-    file->offset += chunk;
+    bytes_written += bytes_to_write;
+    file->offset += bytes_to_write;
 
     // Always update size to current write head position
     entry->size = file->offset;
-    sync_directory_entry(entry);
   }
 
-  // Sync metadata
+  file_write_done(file->node);
+  return ret ? ret : bytes_written;
+}
 
-  entry->mtime = time(NULL);
-  msync(state.fat, state.fat_size, MS_SYNC);
-  fsync(state.fs_fd);  // Ensure data hits disk
+int k_write(int fd, const char* buf, int n) {
+  // Validate FD and permissions
+  file_descriptor_t* file = fd_get(fd);
+  if (!file) {
+    P_ERRNO = FD_INVALID;
+    return -1;
+  }
+  dir_entry_t* entry = file->entry;
 
-  return bytes_written;
+  if (!(entry->perm & PERM_WRITE)) {
+    P_ERRNO = PERMISSION_DENIED;
+    return -1;
+  }
+  if (file->pipe) {
+    return k_pipe_write(file, buf, n);
+  }
+  if (fd == STDOUT_FILENO) {
+    return k_stdout_write(buf, n);
+  }
+  if (fd == STDERR_FILENO) {
+    k_flush();  // keep stdout and stderr in order
+    int bytes_written = write(fd, buf, n);
+    return bytes_written;
+  }
+
+  fs_lock(&file->node->lock);
+  int ret = file_write(file, buf, n);
+  fs_unlock(&file->node->lock);
+  return ret;
 }
 
-int k_unlink(const char* fname) {
-  if (!state.is_mounted)
-    return FS_NOT_MOUNTED;
+// Regular file open on fd that a positioned read or write can use, or NULL
+// with P_ERRNO set
+static file_descriptor_t* positioned_file(int fd, int perm) {
+  file_descriptor_t* file = fd_get(fd);
+  if (!file) {
+    P_ERRNO = FD_INVALID;
+    return NULL;
+  }
+  if (!file->node) {
+    P_ERRNO = ILLEGAL_SEEK;  // pipes and stdio have no position
+    return NULL;
+  }
+  if (!(file->entry->perm & perm)) {
+    P_ERRNO = PERMISSION_DENIED;
+    return NULL;
+  }
+  return file;
+}
 
-  // Find the file
-  dir_entry_t* entry = find_dir_entry(fname);
-  if (!entry) {
-    return FILE_NOT_FOUND;
-  }
-
-  // Check if file is open
-  // for (int i = 0; i < MAX_OPEN_FILES; i++) {
-  //   if (state.open_files[i].entry == entry) {
-  //     return FILE_IN_USE;
-  //   }
-  // }
-  bool is_open = false;
-  for (int i = 0; i < MAX_OPEN_FILES; i++) {
-    if (state.open_files[i].entry == entry) {
-      is_open = true;
-      break;
+int k_pread(int fd, uint32_t offset, int n, char* buf) {
+  file_descriptor_t* file = positioned_file(fd, PERM_READ);
+  if (!file) {
+    return -1;
+  }
+  // A description of its own, so the real one's offset stays put
+  file_descriptor_t at = *file;
+  at.offset = offset;
+  fs_lock(&file->node->lock);
+  int ret = file_read(&at, n, buf);
+  fs_unlock(&file->node->lock);
+  return ret;
+}
+
+int k_pwrite(int fd, uint32_t offset, const char* buf, int n) {
+  file_descriptor_t* file = positioned_file(fd, PERM_WRITE);
+  if (!file) {
+    return -1;
+  }
+  file_descriptor_t at = *file;
+  at.offset = offset;
+  at.mode = F_WRITE;  // an append descriptor would write at the end
+  fs_lock(&file->node->lock);
+  int ret = file_write(&at, buf, n);
+  fs_unlock(&file->node->lock);
+  return ret;
+}
+
+// Total length of an iovec array, or -1 if it is not a valid one
+static int iov_total(const struct iovec* iov, int iovcnt) {
+  if (!iov || iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return -1;
+  }
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len && !iov[i].iov_base) {
+      return -1;
+    }
+    total += iov[i].iov_len;
+    if (total > INT32_MAX) {
+      return -1;
     }
   }
+  return total;
+}
 
-  if (is_open) {
-    // Mark as deleted but in-use
-    entry->name[0] = 2;  // Special "deleted but in-use" marker
-    return 0;
+int k_writev(int fd, const struct iovec* iov, int iovcnt) {
+  int total = iov_total(iov, iovcnt);
+  if (total < 0) {
+    P_ERRNO = P_EINVAL;
+    return -1;
+  }
+  if (iovcnt == 1) {
+    return k_write(fd, iov[0].iov_base, total);
   }
 
-  // Regular deletion
-  entry->name[0] = DIR_ENTRY_DELETED;  // 1
-  memset(entry->name + 1, 0, MAX_FILENAME_LEN - 1);
+  // Gather the pieces so the file is written and synced once
+  char small[IOV_SMALL];
+  char* buf = total <= IOV_SMALL ? small : malloc(total);
+  if (!buf) {
+    P_ERRNO = P_ENOMEM;
+    return -1;
+  }
+  for (int i = 0, off = 0; i < iovcnt; off += iov[i++].iov_len) {
+    memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+  }
+  int ret = k_write(fd, buf, total);
+  if (buf != small) {
+    free(buf);
+  }
+  return ret;
+}
+
+int k_readv(int fd, const struct iovec* iov, int iovcnt) {
+  int total = iov_total(iov, iovcnt);
+  if (total < 0) {
+    P_ERRNO = P_EINVAL;
+    return -1;
+  }
+  if (iovcnt == 1) {
+    return k_read(fd, total, iov[0].iov_base);
+  }
+
+  char small[IOV_SMALL];
+  char* buf = total <= IOV_SMALL ? small : malloc(total);
+  if (!buf) {
+    P_ERRNO = P_ENOMEM;
+    return -1;
+  }
+  int ret = k_read(fd, total, buf);
+  for (int i = 0, off = 0; i < iovcnt && off < ret; off += iov[i++].iov_len) {
+    memcpy(iov[i].iov_base, buf + off, MIN(iov[i].iov_len, ret - off));
+  }
+  if (buf != small) {
+    free(buf);
+  }
+  return ret;
+}
 
-  // Free FAT blocks with safety check
-  uint16_t block = entry->first_block;
-  int max_blocks = (state.fat_size / 2);
-  int blocks_freed = 0;
+int k_unlink(const char* fname) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
 
-  while (block != FAT_ENTRY_LAST && block != FAT_ENTRY_FREE &&
-         blocks_freed < max_blocks) {
-    uint16_t next = state.fat[block];
-    state.fat[block] = FAT_ENTRY_FREE;
-    block = next;
-    blocks_freed++;
+  // Find the file
+  uint32_t dir;
+  dir_entry_t entry;
+  int ret = path_lookup(fname, &dir, &entry);
+  if (ret) {
+    return ret;
+  }
+  if (entry.type == FT_DIRECTORY) {
+    return IS_A_DIRECTORY;
   }
 
-  // Mark as deleted and clear name
-  memset(entry->name, 0, MAX_FILENAME_LEN);
-  entry->name[0] = DIR_ENTRY_DELETED;
+  // An open file keeps its blocks until its last close
+  fs_lock(&state.files_lock);
+  file_node_t* node = find_node(dir, entry.name);
+  if (node) {
+    fs_lock(&node->lock);
+  }
+  ret = dir_remove(dir, entry.name);
+  if (node) {
+    node->unlinked = ret == 0;
+    fs_unlock(&node->lock);
+  }
+  fs_unlock(&state.files_lock);
+  if (ret || node) {
+    return ret;
+  }
 
-  // Write updated directory block to disk (block 1)
-  off_t dir_pos = state.block_size;  // Block 0 is FAT, Block 1 is root dir
-  lseek(state.fs_fd, dir_pos, SEEK_SET);
-  write(state.fs_fd, state.root_dir, state.block_size);
+  // Regular deletion
+  free_file_blocks(&entry);
 
   // Force sync all changes
   msync(state.fat, state.fat_size, MS_SYNC);
   fsync(state.fs_fd);
-  sync_directory_entry(NULL);
 
   return 0;
 }
 
 int k_lseek(int fd, int offset, int whence) {
-  file_descriptor_t* file;
-  dir_entry_t* entry;
-  if (fd < 0 || fd >= MAX_OPEN_FILES || !state.open_files[fd].entry) {
+  file_descriptor_t* file = fd_get(fd);
+  if (!file) {
     return FD_INVALID;
   }
+  if (!file->node) {
+    return ILLEGAL_SEEK;  // pipes and stdio have no position
+  }
+  dir_entry_t* entry = file->entry;
 
-  file = &state.open_files[fd];
-  entry = file->entry;
-
+  fs_lock(&file->node->lock);
   uint32_t new_offset;
   switch (whence) {
     case F_SEEK_SET:
@@ -496,6 +898,7 @@ int k_lseek(int fd, int offset, int whence) {
       new_offset = entry->size + offset;
       break;
     default:
+      fs_unlock(&file->node->lock);
       return INVALID_WHENCE;  // Define this error
   }
 
@@ -508,96 +911,751 @@ int k_lseek(int fd, int offset, int whence) {
     }
   }
 
-  // Update block pointer if crossing block boundaries
-  if (new_offset / state.block_size != file->offset / state.block_size) {
-    uint16_t block = entry->first_block;
-    uint32_t target_block = new_offset / state.block_size;
-
-    for (uint32_t i = 0; i < target_block && block != FAT_ENTRY_LAST; i++) {
-      block = state.fat[block];
-    }
-    file->current_block = block;
-  }
-
+  // The block pointer catches up lazily on the next read or write
   file->offset = new_offset;
+  fs_unlock(&file->node->lock);
   return new_offset;
 }
 
 int k_perm(const char* fname) {
-  dir_entry_t* entry = find_dir_entry(fname);
-  if (entry == NULL) {
-    return FILE_NOT_FOUND;
+  uint32_t dir;
+  dir_entry_t entry;
+  int ret = path_lookup(fname, &dir, &entry);
+  if (ret) {
+    return ret;
   } else {
-    return entry->perm;
+    return entry.perm & PERM_ALL;
   }
 }
 
 int k_close(int fd) {
   // Validate FD
-  if (fd < 0 || fd >= MAX_OPEN_FILES || !state.open_files[fd].entry) {
+  file_descriptor_t* file = fd_get(fd);
+  if (!file) {
     P_ERRNO = FD_INVALID;
     return -1;
   }
 
-  // Clear the FD entry if ref_count is 0
-  state.open_files[fd].ref_count--;
-  if (state.open_files[fd].ref_count <= 0) {
-    memset(&state.open_files[fd], 0, sizeof(file_descriptor_t));
-    state.open_files[fd].fd = -1;
+  // Pipes belong to PennOS processes, which never run at the same time
+  bool locked = !file->pipe;
+  if (locked) {
+    fs_lock(&state.files_lock);
   }
 
+  // Clear the FD entry if ref_count is 0; the file goes with its last one
+  file->ref_count--;
+  if (file->ref_count <= 0) {
+    file_node_t* node = file->node;
+    if (file->pipe) {
+      k_pipe_close(file);
+    } else if (node && --node->opens == 0) {
+      close_node(node);
+    }
+    fd_release(fd);
+  }
+
+  if (locked) {
+    fs_unlock(&state.files_lock);
+  }
   return 0;  // Success
 }
 
+// ls column for how a file is stored
+static char storage_flag(uint8_t perm) {
+  if (perm & PERM_COMPRESSED) {
+    return 'c';
+  }
+  return (perm & PERM_DEDUP) ? 'd' : '-';
+}
+
+// dir_iterate callback for k_ls
+static int ls_print_entry(const dir_entry_t* entry, void* arg) {
+  k_print("%6u %c%c%c%c %8u %.24s %s%s\n",
+         entry_is_inline(entry) ? 0 : entry_first_block(entry),
+         (entry->perm & PERM_READ) ? 'r' : '-',
+         (entry->perm & PERM_WRITE) ? 'w' : '-',
+         (entry->perm & PERM_EXEC) == PERM_EXEC ? 'x' : '-',
+         storage_flag(entry->perm), entry->size,
+         ctime(&entry->mtime), entry->name,
+         entry->type == FT_DIRECTORY ? "/" : "");
+  return 0;
+}
+
 int k_ls(const char* filename) {
   if (!state.is_mounted)
     return FS_NOT_MOUNTED;
 
-  if (filename) {
-    // Single file listing
-    dir_entry_t* entry = find_dir_entry(filename);
-    if (!entry)
-      return FILE_NOT_FOUND;
+  uint32_t dir;
+  dir_entry_t entry;
+  int ret = path_lookup(filename ? filename : "/", &dir, &entry);
+  if (ret)
+    return ret;
 
-    k_print("%6u %c%c%c %8u %s\n", entry->first_block,
-           (entry->perm & PERM_READ) ? 'r' : '-',
-           (entry->perm & PERM_WRITE) ? 'w' : '-',
-           (entry->perm & PERM_EXEC) == PERM_EXEC ? 'x' : '-', entry->size,
-           entry->name);
+  if (entry.type == FT_DIRECTORY) {
+    // Streams the tree in name order, one node in memory per level
+    return dir_iterate(entry_first_block(&entry), ls_print_entry, NULL);
+  }
 
-  } else {
-    dir_entry_t* entry = state.root_dir;
-    int entries_per_block = state.block_size / sizeof(dir_entry_t);
-    int total_entries = state.root_dir_blocks * entries_per_block;
+  // Single file listing
+  k_print("%6u %c%c%c %8u %s\n",
+         entry_is_inline(&entry) ? 0 : entry_first_block(&entry),
+         (entry.perm & PERM_READ) ? 'r' : '-',
+         (entry.perm & PERM_WRITE) ? 'w' : '-',
+         (entry.perm & PERM_EXEC) == PERM_EXEC ? 'x' : '-', entry.size,
+         entry.name);
+  return 0;
+}
 
-    for (int i = 0; i < total_entries; i++, entry++) {
-      if (entry->name[0] == DIR_ENTRY_END)
-        break;
-      if (entry->name[0] > DIR_ENTRY_DELETED) {
+// Refresh an entry read from directory dir with the copy held by an open
+// descriptor, which is newer
+static void current_entry(uint32_t dir, dir_entry_t* entry) {
+  fs_lock(&state.files_lock);
+  file_node_t* node = find_node(dir, entry->name);
+  if (node) {
+    fs_lock(&node->lock);
+    *entry = *node->entry;
+    fs_unlock(&node->lock);
+  }
+  fs_unlock(&state.files_lock);
+}
 
+int k_file_size(const char* filename) {
+  uint32_t dir;
+  dir_entry_t entry;
+  int ret = path_lookup(filename, &dir, &entry);
+  if (ret) {
+    return ret;
+  }
+  current_entry(dir, &entry);
+  return entry.size;
+}
 
-        printf("%6u %c%c%c %8u %.24s %s\n", entry->first_block,
-               (entry->perm & PERM_READ) ? 'r' : '-',
-               (entry->perm & PERM_WRITE) ? 'w' : '-',
-               (entry->perm & PERM_EXEC) == PERM_EXEC ? 'x' : '-', entry->size,
-               ctime(&entry->mtime), entry->name);
-      }
-      
+int k_mkdir(const char* path) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
+
+  uint32_t dir;
+  dir_entry_t entry = {0};
+  int ret = path_resolve(path, &dir, entry.name);
+  if (ret)
+    return ret;
+  if (!entry.name[0] || dir_lookup(dir, entry.name, NULL) == 0)
+    return FILE_EXISTS;
+
+  uint32_t block;
+  ret = dir_create(&block);
+  if (ret)
+    return ret;
+  set_entry_first_block(&entry, block);
+  entry.type = FT_DIRECTORY;
+  entry.perm = PERM_ALL;
+  entry.mtime = time(NULL);
+  ret = dir_insert(dir, &entry);
+  if (ret) {
+    dir_destroy(block);
+    return ret;
+  }
+  msync(state.fat, state.fat_size, MS_SYNC);
+  return 0;
+}
+
+int k_rmdir(const char* path) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
+
+  uint32_t dir;
+  dir_entry_t entry;
+  int ret = path_lookup(path, &dir, &entry);
+  if (ret)
+    return ret;
+  if (entry.type != FT_DIRECTORY)
+    return NOT_A_DIRECTORY;
+  if (entry_first_block(&entry) == state.root)
+    return PERMISSION_DENIED;
+
+  ret = dir_destroy(entry_first_block(&entry));
+  if (ret)
+    return ret;
+  ret = dir_remove(dir, entry.name);
+  msync(state.fat, state.fat_size, MS_SYNC);
+  return ret;
+}
+
+// dir_iterate callback: stops once it sees the directory in arg
+static int subtree_contains(const dir_entry_t* entry, void* arg) {
+  if (entry->type != FT_DIRECTORY) {
+    return 0;
+  }
+  uint32_t block = entry_first_block(entry);
+  return block == *(uint32_t*)arg ||
+         dir_iterate(block, subtree_contains, arg) != 0;
+}
+
+int k_rename(const char* source, const char* dest) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
+
+  uint32_t src_dir, dst_dir;
+  dir_entry_t entry;
+  char name[MAX_FILENAME_LEN];
+  int ret = path_lookup(source, &src_dir, &entry);
+  if (ret == 0 && entry_first_block(&entry) == state.root)
+    ret = PERMISSION_DENIED;
+  if (ret == 0)
+    ret = path_resolve(dest, &dst_dir, name);
+  if (ret)
+    return ret;
+  if (!name[0] || dir_lookup(dst_dir, name, NULL) == 0)
+    return FILE_EXISTS;
+
+  // A directory may not end up inside itself
+  if (entry.type == FT_DIRECTORY) {
+    uint32_t block = entry_first_block(&entry);
+    if (dst_dir == block || dir_iterate(block, subtree_contains, &dst_dir))
+      return INVALID_MODE;
+  }
+
+  char old_name[MAX_FILENAME_LEN];
+  strcpy(old_name, entry.name);
+  strcpy(entry.name, name);
+  entry.mtime = time(NULL);
+
+  // Open descriptors follow the file to its new place
+  fs_lock(&state.files_lock);
+  file_node_t* file = find_node(src_dir, old_name);
+  if (file) {
+    fs_lock(&file->lock);
+  }
+  ret = dir_insert(dst_dir, &entry);
+  if (ret == 0) {
+    dir_remove(src_dir, old_name);
+    if (file) {
+      file->dir = dst_dir;
+      strcpy(file->entry->name, name);
+      file->entry->mtime = entry.mtime;
     }
   }
+  if (file) {
+    fs_unlock(&file->lock);
+  }
+  fs_unlock(&state.files_lock);
+  if (ret)
+    return ret;
+  msync(state.fat, state.fat_size, MS_SYNC);
   return 0;
 }
 
-int k_file_size(const char* filename) {
-  for (int i = 0; i < MAX_OPEN_FILES; i++) {
-    dir_entry_t* entry = state.open_files[i].entry;
-    if (entry != NULL && strcmp(entry->name, filename) == 0) {
-      return entry->size;
+int k_update_entry(uint32_t dir, const dir_entry_t* entry) {
+  if (state.read_only)
+    return READ_ONLY_FS;
+  fs_lock(&state.files_lock);
+  file_node_t* file = find_node(dir, entry->name);
+  if (!file) {
+    int ret = dir_update(dir, entry);
+    fs_unlock(&state.files_lock);
+    return ret;
+  }
+
+  // Keep the open copy current so its next write does not undo this one
+  fs_lock(&file->lock);
+  dir_entry_t updated = *entry;
+  updated.size = file->entry->size;
+  memcpy(updated.inline_data, file->entry->inline_data, INLINE_DATA_MAX);
+  set_entry_first_block(&updated, entry_first_block(file->entry));
+  int ret = dir_update(dir, &updated);
+  if (ret == 0) {
+    *file->entry = updated;
+  }
+  fs_unlock(&file->lock);
+  fs_unlock(&state.files_lock);
+  return ret;
+}
+
+// Replace dst's contents with a copy of src's on a chain of its own
+static int copy_data(const dir_entry_t* src, dir_entry_t* dst) {
+  free_file_blocks(dst);
+  set_entry_first_block(dst, FAT_ENTRY_LAST);
+  memset(dst->inline_data, 0, INLINE_DATA_MAX);
+  dst->size = 0;
+  dst->perm =
+      (dst->perm & PERM_ALL) | (src->perm & (PERM_COMPRESSED | PERM_DEDUP));
+  if (entry_is_inline(src)) {
+    memcpy(dst->inline_data, src->inline_data, INLINE_DATA_MAX);
+    dst->size = src->size;
+    return 0;
+  }
+
+  // Compressed frames and maps are copied as they are, so the whole chain
+  // goes
+  bool whole = src->perm & (PERM_COMPRESSED | PERM_DEDUP);
+  uint32_t count = (src->size + state.block_size - 1) / state.block_size;
+  if (whole) {
+    count = 0;
+    for (uint32_t b = entry_first_block(src); b != FAT_ENTRY_LAST;
+         b = fat_get(b)) {
+      count++;
+    }
+  }
+  if (count == 0) {
+    return 0;
+  }
+  uint32_t first = fat_alloc_chain(count);
+  if (!first) {
+    return DISK_FULL;
+  }
+
+  // One copy per run of blocks that are consecutive in both chains
+  uint32_t from = entry_first_block(src);
+  uint32_t to = first;
+  uint32_t remaining = whole ? count * state.block_size : src->size;
+  while (remaining > 0 && from != FAT_ENTRY_LAST) {
+    uint32_t len = chain_run(to, chain_run(from, remaining));
+    int ret = copy_blocks(from, to, (len + state.block_size - 1) /
+                                        state.block_size);
+    if (ret) {
+      fat_free_chain_deferred(first);
+      return ret;
+    }
+    remaining -= len;
+    from = fat_get(run_end(from, len));
+    to = fat_get(run_end(to, len));
+  }
+  set_entry_first_block(dst, first);
+  dst->size = src->size - remaining;
+  if (dst->perm & PERM_COMPRESSED) {
+    // and the count of leading frames stored as is, see fat_compress.c
+    memcpy(dst->inline_data, src->inline_data, INLINE_DATA_MAX);
+  }
+
+  // The copy's map points at the same blocks, which it now shares
+  int ret = (dst->perm & PERM_DEDUP) ? dedup_share(dst) : 0;
+  if (ret) {
+    fat_free_chain_deferred(first);
+    set_entry_first_block(dst, FAT_ENTRY_LAST);
+    dst->size = 0;
+  }
+  return ret;
+}
+
+// Store a file compressed or deduplicated (flag), or plainly again
+static int convert_storage(dir_entry_t* entry, uint8_t flag, bool on) {
+  return flag == PERM_DEDUP ? dedup_convert(entry, on)
+                            : compress_convert(entry, on);
+}
+
+// Open dest for writing and let fill replace its contents with the
+// file's lock held; metadata is synced once for the whole file
+static int fill_file(const char* dest,
+                     int (*fill)(dir_entry_t* dst, void* arg),
+                     void* arg) {
+  int fd = k_open(dest, F_WRITE);
+  if (fd < 0)
+    return P_ERRNO;
+  file_node_t* file = fd_get(fd)->node;
+  fs_lock(&file->lock);
+  int ret = file->mapped ? FILE_IN_USE : PERMISSION_DENIED;
+  uint8_t kept = file->entry->perm & (PERM_COMPRESSED | PERM_DEDUP);
+  if (!file->mapped && (file->entry->perm & PERM_WRITE)) {
+    ret = fill(file->entry, arg);
+  }
+  // A compressed or deduplicated file stays so whatever it was filled from
+  uint8_t filled = file->entry->perm & (PERM_COMPRESSED | PERM_DEDUP);
+  if (ret == 0 && kept && filled != kept) {
+    if (filled) {
+      ret = convert_storage(file->entry, filled, false);
+    }
+    if (ret == 0) {
+      ret = convert_storage(file->entry, kept, true);
     }
   }
-  dir_entry_t* entry = find_dir_entry(filename);
-  if (entry != NULL && strcmp(entry->name, filename) == 0) {
-    return entry->size;
+  if (file->frames) {
+    file->frames->index = FRAME_NONE;
+    frame_cache_moved(file->frames);
   }
-  return FILE_NOT_FOUND;
-}
\ No newline at end of file
+  if (file->map) {
+    map_cache_moved(file->map);
+  }
+  file->current_block = entry_first_block(file->entry);
+  file->current_index = 0;
+  file->entry->mtime = time(NULL);
+  sync_file_entry(file);
+  fs_unlock(&file->lock);
+
+  msync(state.fat, state.fat_size, MS_SYNC);
+  fsync(state.fs_fd);
+  k_close(fd);
+  return ret;
+}
+
+// fill_file callback for k_copy
+static int fill_from_entry(dir_entry_t* dst, void* arg) {
+  return copy_data(arg, dst);
+}
+
+int k_copy(const char* source, const char* dest) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+
+  uint32_t src_dir, dst_dir;
+  dir_entry_t entry;
+  char name[MAX_FILENAME_LEN];
+  int ret = path_lookup(source, &src_dir, &entry);
+  if (ret == 0 && entry.type == FT_DIRECTORY)
+    ret = IS_A_DIRECTORY;
+  if (ret == 0 && !(entry.perm & PERM_READ))
+    ret = PERMISSION_DENIED;
+  if (ret == 0)
+    ret = path_resolve(dest, &dst_dir, name);
+  if (ret)
+    return ret;
+  if (src_dir == dst_dir && strcmp(entry.name, name) == 0)
+    return INVALID_MODE;
+  current_entry(src_dir, &entry);
+  return fill_file(dest, fill_from_entry, &entry);
+}
+
+// Replace dst's contents with the first `size` bytes of a host file
+static int import_data(int host_fd, uint32_t size, dir_entry_t* dst) {
+  free_file_blocks(dst);
+  set_entry_first_block(dst, FAT_ENTRY_LAST);
+  memset(dst->inline_data, 0, INLINE_DATA_MAX);
+  dst->size = 0;
+  dst->perm &= ~(PERM_COMPRESSED | PERM_DEDUP);
+  if (size <= INLINE_DATA_MAX) {
+    if (pread(host_fd, dst->inline_data, size, 0) != size) {
+      return FS_IO_ERROR;
+    }
+    dst->size = size;
+    return 0;
+  }
+
+  uint32_t first =
+      fat_alloc_chain((size + state.block_size - 1) / state.block_size);
+  if (!first) {
+    return DISK_FULL;
+  }
+  uint32_t to = first;
+  for (uint32_t done = 0; done < size;) {
+    uint32_t len = chain_run(to, size - done);
+    int ret = copy_extent(host_fd, done, state.fs_fd, block_offset(to), len);
+    if (ret) {
+      fat_free_chain_deferred(first);
+      return ret;
+    }
+    block_restamp(to, (len + state.block_size - 1) / state.block_size);
+    done += len;
+    to = fat_get(run_end(to, len));
+  }
+  set_entry_first_block(dst, first);
+  dst->size = size;
+  return 0;
+}
+
+// A host file and its size, for fill_from_host
+typedef struct {
+  int fd;
+  uint32_t size;
+} host_file_t;
+
+// fill_file callback for k_import
+static int fill_from_host(dir_entry_t* dst, void* arg) {
+  host_file_t* host = arg;
+  return import_data(host->fd, host->size, dst);
+}
+
+int k_import(int host_fd, const char* dest) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+
+  // Pipes cannot seek, and their size is not known up front
+  off_t size = lseek(host_fd, 0, SEEK_END);
+  if (size < 0)
+    return INVALID_MODE;
+  if (size > UINT32_MAX)
+    return DISK_FULL;
+  host_file_t host = {.fd = host_fd, .size = size};
+  return fill_file(dest, fill_from_host, &host);
+}
+
+// Send len bytes of the image to the host fd at its current position
+static int send_extent(int host_fd, off_t from, size_t len) {
+  while (len > 0) {
+    ssize_t n = sendfile(host_fd, state.fs_fd, &from, len);
+    if (n <= 0) {
+      break;
+    }
+    len -= n;
+  }
+
+  char buf[FAT_MAX_BLOCK_SIZE];
+  while (len > 0) {
+    size_t chunk = MIN(len, sizeof(buf));
+    if (pread(state.fs_fd, buf, chunk, from) != (ssize_t)chunk ||
+        write(host_fd, buf, chunk) != (ssize_t)chunk) {
+      return FS_IO_ERROR;
+    }
+    from += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
+
+// Decompress a compressed file to the host fd a frame at a time
+static int export_frames(const dir_entry_t* entry, int host_fd) {
+  frame_cache_t* frames = frame_cache_new();
+  char* buf = malloc(COMPRESS_FRAME);
+  int ret = frames && buf ? 0 : FS_MEMORY_ERROR;
+  for (uint32_t done = 0; ret == 0 && done < entry->size;) {
+    int n = compressed_read(entry, frames, done, buf, COMPRESS_FRAME);
+    if (n <= 0) {
+      ret = n ? n : FS_IO_ERROR;
+    } else if (write(host_fd, buf, n) != n) {
+      ret = FS_IO_ERROR;
+    }
+    done += n;
+  }
+  free(buf);
+  free(frames);
+  return ret;
+}
+
+// Copy a deduplicated file to the host fd through its map, a map block's
+// worth of file at a time
+static int export_mapped(const dir_entry_t* entry, int host_fd) {
+  map_cache_t* map = map_cache_new();
+  uint32_t chunk = state.block_size / sizeof(uint32_t) * state.block_size;
+  char* buf = malloc(chunk);
+  int ret = map && buf ? 0 : FS_MEMORY_ERROR;
+  for (uint32_t done = 0; ret == 0 && done < entry->size;) {
+    int n = dedup_read(entry, map, done, buf, chunk);
+    if (n <= 0) {
+      ret = n ? n : FS_IO_ERROR;
+    } else if (write(host_fd, buf, n) != n) {
+      ret = FS_IO_ERROR;
+    }
+    done += n;
+  }
+  free(buf);
+  free(map);
+  return ret;
+}
+
+int k_export(const char* source, int host_fd) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+
+  uint32_t dir;
+  dir_entry_t entry;
+  int ret = path_lookup(source, &dir, &entry);
+  if (ret == 0 && entry.type == FT_DIRECTORY)
+    ret = IS_A_DIRECTORY;
+  if (ret == 0 && !(entry.perm & PERM_READ))
+    ret = PERMISSION_DENIED;
+  if (ret)
+    return ret;
+  current_entry(dir, &entry);
+
+  if (entry_is_inline(&entry)) {
+    int size = MIN(entry.size, INLINE_DATA_MAX);
+    return write(host_fd, entry.inline_data, size) == size ? 0 : FS_IO_ERROR;
+  }
+  if (entry.perm & PERM_COMPRESSED) {
+    return export_frames(&entry, host_fd);
+  }
+  if (entry.perm & PERM_DEDUP) {
+    return export_mapped(&entry, host_fd);
+  }
+  uint32_t block = entry_first_block(&entry);
+  for (uint32_t done = 0; done < entry.size && block != FAT_ENTRY_LAST;) {
+    uint32_t len = chain_run(block, entry.size - done);
+    // sendfile hands the blocks over unread, so they are checked first
+    ret = block_check(block, (len + state.block_size - 1) / state.block_size);
+    if (ret || (ret = send_extent(host_fd, block_offset(block), len))) {
+      return ret;
+    }
+    done += len;
+    block = fat_get(run_end(block, len));
+  }
+  return 0;
+}
+
+// Move up to `step` more blocks of a file into its run; *moved counts those
+// already there. Returns 1 once the file is done or changed under it.
+static int relocate_step(uint32_t dir, const char* name, uint32_t run,
+                         uint32_t count, uint32_t step, uint32_t* moved) {
+  fs_lock(&state.files_lock);
+  file_node_t* file = find_node(dir, name);
+  dir_entry_t entry;
+  int ret = 0;
+  if (file) {
+    fs_lock(&file->lock);
+    entry = *file->entry;
+  } else {
+    ret = dir_lookup(dir, name, &entry);
+  }
+
+  // After the first step the file must still start with the run; blocks
+  // mapped into memory stay where they are
+  uint32_t first = entry_first_block(&entry);
+  if (ret == 0 && (entry_is_inline(&entry) || (*moved && first != run) ||
+                   *moved == count || (file && file->mapped))) {
+    ret = 1;
+  }
+  uint32_t start = *moved ? fat_get(run + *moved - 1) : first;
+  uint32_t from = start;
+  uint32_t end = MIN(count, *moved + step);
+  uint32_t to = *moved;
+  while (ret == 0 && to < end && from != FAT_ENTRY_LAST) {
+    uint32_t len = chain_run(from, (end - to) * state.block_size);
+    ret = copy_blocks(from, run + to, len / state.block_size);
+    to += len / state.block_size;
+    from = fat_get(run_end(from, len));
+  }
+
+  if (ret == 0 && to > *moved) {
+    // Link the copies in before the old blocks go
+    fat_set(run + to - 1, from);
+    if (*moved) {
+      fat_set(run + *moved - 1, run + *moved);
+    } else if (file) {
+      set_entry_first_block(file->entry, run);
+      sync_file_entry(file);
+    } else {
+      set_entry_first_block(&entry, run);
+      ret = dir_update(dir, &entry);
+    }
+    for (uint32_t b = start, i = *moved; ret == 0 && i < to; i++) {
+      uint32_t next = fat_get(b);
+      fat_set(b, FAT_ENTRY_FREE);
+      b = next;
+    }
+    *moved = to;
+  }
+  if (ret == 0 && from == FAT_ENTRY_LAST) {
+    ret = 1;
+  }
+  if (file) {
+    file->current_block = entry_first_block(file->entry);
+    file->current_index = 0;
+    if (file->frames) {
+      frame_cache_moved(file->frames);
+    }
+    if (file->map) {
+      map_cache_moved(file->map);
+    }
+    fs_unlock(&file->lock);
+  }
+  fs_unlock(&state.files_lock);
+  return ret;
+}
+
+int k_relocate(uint32_t dir, const char* name, uint32_t step,
+               unsigned pause_us) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
+
+  dir_entry_t entry;
+  int ret = dir_lookup(dir, name, &entry);
+  if (ret)
+    return ret;
+  current_entry(dir, &entry);
+  if (entry.type == FT_DIRECTORY || entry_is_inline(&entry))
+    return 0;
+
+  // Nothing to gain unless the chain is in more than one run
+  uint32_t first = entry_first_block(&entry);
+  uint32_t count = 0;
+  bool contiguous = true;
+  for (uint32_t b = first; b != FAT_ENTRY_LAST; b = fat_get(b), count++) {
+    contiguous &= b == first + count;
+  }
+  if (contiguous || step == 0)
+    return 0;
+  uint32_t run = fat_alloc_run(count);
+  if (!run)
+    return DISK_FULL;
+
+  uint32_t moved = 0;
+  while ((ret = relocate_step(dir, name, run, count, step, &moved)) == 0) {
+    usleep(pause_us);
+  }
+  // Blocks of the run the file never reached
+  if (moved < count) {
+    fat_free_chain_deferred(run + moved);
+  }
+  return ret == 1 && moved > 0 ? 1 : MIN(ret, 0);
+}
+
+int k_compress(const char* path, bool on) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
+
+  uint32_t dir;
+  dir_entry_t entry;
+  int ret = path_lookup(path, &dir, &entry);
+  if (ret == 0 && entry.type == FT_DIRECTORY)
+    ret = IS_A_DIRECTORY;
+  if (ret)
+    return ret;
+  if (!(entry.perm & PERM_COMPRESSED) == !on)
+    return 0;
+  if (entry.perm & PERM_DEDUP)
+    return INVALID_MODE;  // one or the other
+
+  // Open descriptors read the chain as they find it, so wait for them
+  fs_lock(&state.files_lock);
+  if (find_node(dir, entry.name)) {
+    ret = FILE_IN_USE;
+  } else if ((ret = dir_lookup(dir, entry.name, &entry)) == 0 &&
+             (ret = compress_convert(&entry, on)) == 0) {
+    ret = dir_update(dir, &entry);
+  }
+  fs_unlock(&state.files_lock);
+
+  msync(state.fat, state.fat_size, MS_SYNC);
+  fsync(state.fs_fd);
+  return ret;
+}
+
+int k_dedup(const char* path, bool on) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
+
+  uint32_t dir;
+  dir_entry_t entry;
+  int ret = path_lookup(path, &dir, &entry);
+  if (ret == 0 && entry.type == FT_DIRECTORY)
+    ret = IS_A_DIRECTORY;
+  if (ret)
+    return ret;
+  if (!(entry.perm & PERM_DEDUP) == !on)
+    return 0;
+  if (entry.perm & PERM_COMPRESSED)
+    return INVALID_MODE;
+
+  // Open descriptors read the chain as they find it, so wait for them
+  fs_lock(&state.files_lock);
+  if (find_node(dir, entry.name)) {
+    ret = FILE_IN_USE;
+  } else if ((ret = dir_lookup(dir, entry.name, &entry)) == 0 &&
+             (ret = dedup_convert(&entry, on)) == 0) {
+    ret = dir_update(dir, &entry);
+  }
+  fs_unlock(&state.files_lock);
+
+  msync(state.fat, state.fat_size, MS_SYNC);
+  fsync(state.fs_fd);
+  return ret;
+}
@@ -1,5 +1,6 @@
 #ifndef _KERNEL_FAT_H_
 #define _KERNEL_FAT_H_
+#include <sys/uio.h>
 #include "./kernel.h"
 
 // File modes
@@ -12,6 +13,12 @@
 #define F_SEEK_CUR 1
 #define F_SEEK_END 2
 
+// Gathered iovec bytes up to this size stay on the stack
+#define IOV_SMALL 4096
+
+// Buffers k_cat fills per read
+#define CAT_SEGMENTS 4
+
 // Error codes
 #define FD_INVALID -1
 #define FD_PERM_DENIED -2
@@ -20,10 +27,13 @@
 /**
  * @brief Opens a file with the specified mode (read, write, or append).
  * 
- * If the file is already open and permissions allow, returns the existing FD.
- * Creates the file if it does not exist and mode is F_WRITE.
+ * Every open gets a description of its own, with its own offset, in a table
+ * that grows as needed; descriptions of the same file share its entry copy
+ * and caches, see file_node_t. Creates the file if it does not exist and mode
+ * is F_WRITE, and truncates it if it is not already open. Directories cannot
+ * be opened.
  * 
- * @param fname Name of the file to open.
+ * @param fname Path of the file to open, resolved from the root directory.
  * @param mode Access mode: F_READ, F_WRITE, or F_APPEND.
  * @return File descriptor on success, or error code on failure.
  */
@@ -64,12 +74,81 @@ int k_write(int fd, const char* str, int n);
  */
 int k_read(int fd, int n, char* buf);
 
+/**
+ * @brief Reads from a regular file at a given offset, leaving the
+ * descriptor's offset where it was.
+ *
+ * @param fd File descriptor.
+ * @param offset Where to start.
+ * @param n Number of bytes to read.
+ * @param buf Buffer to read into.
+ * @return Number of bytes read, or -1 with P_ERRNO set (ILLEGAL_SEEK for a
+ * pipe or stdio).
+ */
+int k_pread(int fd, uint32_t offset, int n, char* buf);
+
+/**
+ * @brief Writes to a regular file at a given offset, leaving the
+ * descriptor's offset where it was, even on an append descriptor.
+ *
+ * As with k_write, the file ends after the last byte written.
+ *
+ * @param fd File descriptor.
+ * @param offset Where to start.
+ * @param buf Bytes to write.
+ * @param n Number of bytes to write.
+ * @return Number of bytes written, or error code.
+ */
+int k_pwrite(int fd, uint32_t offset, const char* buf, int n);
+
+/**
+ * @brief Writes the pieces of an iovec array as one k_write.
+ *
+ * The pieces are gathered into one buffer first, so a regular file takes
+ * its lock and syncs its entry, the FAT and the image once for the lot, and
+ * a pipe or stdout sees a single write.
+ *
+ * @param fd File descriptor.
+ * @param iov Pieces to write, in order.
+ * @param iovcnt Number of pieces, 1 to IOV_MAX.
+ * @return Number of bytes written, or -1 with P_ERRNO set (P_EINVAL for a
+ * bad array).
+ */
+int k_writev(int fd, const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief Reads into the pieces of an iovec array as one k_read, filling
+ * them in order.
+ *
+ * @param fd File descriptor.
+ * @param iov Buffers to fill.
+ * @param iovcnt Number of buffers, 1 to IOV_MAX.
+ * @return Number of bytes read (0 at end of file), or -1 with P_ERRNO set.
+ */
+int k_readv(int fd, const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief Starts a batch: until the matching k_batch_end, writes made by the
+ * calling thread still update their directory entries but leave flushing
+ * the FAT and the image (msync and fsync) to the end of the batch.
+ *
+ * Batches nest; only the outermost k_batch_end flushes.
+ */
+void k_batch_begin();
+
+/**
+ * @brief Ends a batch, flushing the FAT and the image once if any write in
+ * it was not flushed.
+ */
+void k_batch_end();
+
 /**
  * @brief Deletes a file from the file system.
  * 
- * If the file is currently open, marks it as deleted but retains FAT chain until close.
+ * The entry leaves its directory right away; if the file is currently open,
+ * its FAT chain is kept until the last close. Directories are refused.
  * 
- * @param fname Name of the file to delete.
+ * @param fname Path of the file to delete.
  * @return 0 on success, or error code.
  */
 int k_unlink(const char* fname);
@@ -98,10 +177,11 @@ int k_perm(const char* fname);
 /**
  * @brief Lists information about a file or the entire directory.
  * 
- * If filename is provided, displays info for that file.
- * Otherwise, lists all non-deleted files in the root directory.
+ * If filename names a file, displays info for that file. If it names a
+ * directory (or is NULL, meaning the root), lists the directory's entries in
+ * name order; subdirectories are shown with a trailing '/'.
  * 
- * @param filename Optional name of the file to list.
+ * @param filename Optional path of the file or directory to list.
  * @return 0 on success, or error code.
  */
 int k_ls(const char* filename);
@@ -128,12 +208,139 @@ int k_cat(int argc, char* argv[]);
 /**
  * @brief Returns the size of a file in bytes.
  * 
- * Checks both open files and root directory entries.
+ * Checks both open files and directory entries.
  * 
- * @param filename Name of the file.
+ * @param filename Path of the file.
  * @return Size in bytes, or FILE_NOT_FOUND.
  */
 int k_file_size(const char* filename);
 
+/**
+ * @brief Creates an empty directory.
+ *
+ * @param path Path of the new directory; its parent must exist.
+ * @return 0 on success, or FILE_EXISTS, DISK_FULL or a path error.
+ */
+int k_mkdir(const char* path);
+
+/**
+ * @brief Removes an empty directory.
+ *
+ * @param path Path of the directory.
+ * @return 0 on success, or NOT_A_DIRECTORY, DIR_NOT_EMPTY or a path error.
+ */
+int k_rmdir(const char* path);
+
+/**
+ * @brief Moves a file or directory to a new path that does not exist yet.
+ *
+ * Open descriptors of a moved file follow it. A directory cannot be moved
+ * into its own subtree.
+ *
+ * @param source Current path.
+ * @param dest New path.
+ * @return 0 on success, or FILE_EXISTS, INVALID_MODE or a path error.
+ */
+int k_rename(const char* source, const char* dest);
+
+/**
+ * @brief Replaces a directory entry and the copies held by open descriptors.
+ *
+ * @param dir Block of the directory holding the entry.
+ * @param entry New contents of the entry (matched by name).
+ * @return 0 on success, or FILE_NOT_FOUND.
+ */
+int k_update_entry(uint32_t dir, const dir_entry_t* entry);
+
+/**
+ * @brief Copies a file to another path inside the filesystem.
+ *
+ * The destination is created or truncated, its whole chain is allocated in
+ * one step and the data moves between the two chains with copy_file_range
+ * in runs of consecutive blocks, without passing through a user buffer.
+ * Metadata is synced once at the end.
+ *
+ * @param source Path of the file to copy.
+ * @param dest Path of the copy.
+ * @return 0 on success, or IS_A_DIRECTORY, INVALID_MODE (same file),
+ * DISK_FULL, FS_IO_ERROR or an error from k_open.
+ */
+int k_copy(const char* source, const char* dest);
+
+/**
+ * @brief Copies a host file into the filesystem.
+ *
+ * The destination's chain is allocated up front from the host file's size
+ * and each run of consecutive blocks is filled with one copy_file_range.
+ *
+ * @param host_fd Open host file; must be seekable.
+ * @param dest Path of the copy.
+ * @return 0 on success, or INVALID_MODE (not seekable), DISK_FULL,
+ * FS_IO_ERROR or an error from k_open.
+ */
+int k_import(int host_fd, const char* dest);
+
+/**
+ * @brief Copies a file out of the filesystem to a host file.
+ *
+ * Each run of consecutive blocks is sent with one sendfile and written at
+ * the host fd's current position, so any writable fd works. A compressed
+ * file is decompressed and written a frame at a time instead.
+ *
+ * @param source Path of the file.
+ * @param host_fd Open host fd.
+ * @return 0 on success, or IS_A_DIRECTORY, PERMISSION_DENIED, FS_IO_ERROR
+ * or a path error.
+ */
+int k_export(const char* source, int host_fd);
+
+/**
+ * @brief Moves a fragmented file onto one run of consecutive blocks.
+ *
+ * The run is allocated up front and the file is moved into it `step` blocks
+ * at a time. Each step takes the open file table's lock (and the file's own,
+ * if it is open) only while it copies its blocks and links them into the
+ * chain, and the function sleeps `pause_us` between steps, so the file stays
+ * usable throughout and other I/O gets its turn. A file truncated while it
+ * is being moved is left where it is.
+ *
+ * @param dir Directory holding the file.
+ * @param name Name of the file.
+ * @param step Blocks moved per step.
+ * @param pause_us Microseconds to sleep between steps.
+ * @return 1 if the file was moved, 0 if it did not need to be, or
+ * DISK_FULL (no run large enough), FS_IO_ERROR or a lookup error.
+ */
+int k_relocate(uint32_t dir, const char* name, uint32_t step,
+               unsigned pause_us);
+
+/**
+ * @brief Compresses a file in place, or stores it plainly again.
+ *
+ * Sets or clears PERM_COMPRESSED and rewrites the file's blocks to match
+ * (see fat_compress.h). Reads, writes and seeks on the file behave the same
+ * either way.
+ *
+ * @param path Path of the file.
+ * @param on Compress (true) or decompress.
+ * @return 0 on success, or IS_A_DIRECTORY, FILE_IN_USE, READ_ONLY_FS,
+ * DISK_FULL, FS_IO_ERROR or a path error.
+ */
+int k_compress(const char* path, bool on);
+
+/**
+ * @brief Deduplicates a file in place, or stores it plainly again.
+ *
+ * Sets or clears PERM_DEDUP and moves the file's contents onto a map of
+ * blocks shared with every other deduplicated file holding the same bytes
+ * (see fat_dedup.h). A compressed file is left alone.
+ *
+ * @param path Path of the file.
+ * @param on Deduplicate (true) or store plainly.
+ * @return 0 on success, or IS_A_DIRECTORY, FILE_IN_USE, INVALID_MODE,
+ * READ_ONLY_FS, DISK_FULL, FS_IO_ERROR or a path error.
+ */
+int k_dedup(const char* path, bool on);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,329 @@
+#include "./kmmap.h"
+#include "./kfat_helper.h"
+#include "./pennfat/fat_csum.h"
+#include "./util/p_errno.h"
+
+#define MMAP_CHUNK (1 << 20)  // bytes per k_pread or k_pwrite of a copy
+
+static Vec mappings;  // mapping_t*, under mappings_lock
+static bool mappings_ready;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Error of a k_pread or k_pwrite that moved no bytes
+static int io_error(int n) {
+  return n == -1 ? P_ERRNO : n < 0 ? n : FS_IO_ERROR;
+}
+
+static size_t page_size() {
+  return sysconf(_SC_PAGESIZE);
+}
+
+// Block `index` of a file's chain, FAT_ENTRY_LAST past its end
+static uint32_t chain_block(const dir_entry_t* entry, uint32_t index) {
+  uint32_t b = entry_first_block(entry);
+  for (uint32_t i = 0; i < index && b != FAT_ENTRY_LAST; i++) {
+    b = fat_get(b);
+  }
+  return b;
+}
+
+// Map the range straight from the image; returns 1 if its blocks cannot
+// sit one after another in memory. The file's lock is held.
+static int map_direct(mapping_t* map, const dir_entry_t* entry) {
+  if (entry_is_inline(entry) ||
+      (entry->perm & (PERM_COMPRESSED | PERM_DEDUP))) {
+    return 1;
+  }
+  uint32_t bs = state.block_size;
+  uint32_t first = map->offset / bs;
+  uint32_t count = (map->offset + map->length - 1) / bs - first + 1;
+  uint32_t start = chain_block(entry, first);
+  bool one_run = true;
+  for (uint32_t i = 0, b = start; i < count; i++, b = fat_get(b)) {
+    if (b == FAT_ENTRY_LAST || b == FAT_ENTRY_FREE) {
+      return FS_IO_ERROR;
+    }
+    // Writing a block a snapshot holds would change the snapshot
+    if ((map->prot & PROT_WRITE) && fat_is_shared(b)) {
+      return 1;
+    }
+    int ret = block_check(b, 1);
+    if (ret) {
+      return ret;
+    }
+    one_run &= b == start + i;
+  }
+  if (!one_run && bs % page_size() != 0) {
+    return 1;
+  }
+
+  if (one_run) {
+    off_t host = block_offset(start) + map->offset % bs;
+    off_t aligned = host & ~(off_t)(page_size() - 1);
+    map->host_len = host - aligned + map->length;
+    map->base = mmap(NULL, map->host_len, map->prot, MAP_SHARED, state.fs_fd,
+                     aligned);
+    if (map->base == MAP_FAILED) {
+      return P_ENOMEM;
+    }
+    map->addr = map->base + (host - aligned);
+  } else {
+    // Blocks are whole pages: reserve the range, then lay each run over it
+    map->host_len = (size_t)count * bs;
+    map->base = mmap(NULL, map->host_len, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map->base == MAP_FAILED) {
+      return P_ENOMEM;
+    }
+    for (uint32_t i = 0, b = start; i < count;) {
+      uint32_t run = 1;
+      while (i + run < count && fat_get(b + run - 1) == b + run) {
+        run++;
+      }
+      if (mmap(map->base + (size_t)i * bs, (size_t)run * bs, map->prot,
+               MAP_SHARED | MAP_FIXED, state.fs_fd,
+               block_offset(b)) == MAP_FAILED) {
+        munmap(map->base, map->host_len);
+        return P_ENOMEM;
+      }
+      i += run;
+      b = fat_get(b + run - 1);
+    }
+    map->addr = map->base + map->offset % bs;
+  }
+  map->direct = true;
+  return 0;
+}
+
+// Read the range into a private copy
+static int map_copy(mapping_t* map) {
+  map->host_len = map->length;
+  map->base = mmap(NULL, map->host_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map->base == MAP_FAILED) {
+    return P_ENOMEM;
+  }
+  map->addr = map->base;
+  for (uint32_t done = 0; done < map->length;) {
+    int n = k_pread(map->fd, map->offset + done,
+                    MIN(MMAP_CHUNK, map->length - done), map->addr + done);
+    if (n <= 0) {
+      return io_error(n);
+    }
+    done += n;
+  }
+  if (map->prot & PROT_WRITE) {
+    map->shadow = malloc(map->length);
+    if (!map->shadow) {
+      return P_ENOMEM;
+    }
+    memcpy(map->shadow, map->addr, map->length);
+  } else {
+    mprotect(map->base, map->host_len, PROT_READ);
+  }
+  return 0;
+}
+
+void* k_mmap(int fd, uint32_t offset, uint32_t length, int prot, int pid) {
+  file_descriptor_t* file = fd_get(fd);
+  if (!file) {
+    P_ERRNO = FD_INVALID;
+    return NULL;
+  }
+  if (!file->node || !prot || (prot & ~(PROT_READ | PROT_WRITE)) ||
+      length == 0 || length > INT32_MAX) {
+    P_ERRNO = P_EINVAL;  // pipes and stdio cannot be mapped
+    return NULL;
+  }
+  if (((prot & PROT_READ) && !(file->entry->perm & PERM_READ)) ||
+      ((prot & PROT_WRITE) && !(file->entry->perm & PERM_WRITE))) {
+    P_ERRNO = PERMISSION_DENIED;
+    return NULL;
+  }
+  if ((prot & PROT_WRITE) && file->mode == F_READ) {
+    P_ERRNO = INVALID_MODE;
+    return NULL;
+  }
+  mapping_t* map = calloc(1, sizeof(mapping_t));
+  if (!map) {
+    P_ERRNO = P_ENOMEM;
+    return NULL;
+  }
+  *map = (mapping_t){
+      .fd = fd, .pid = pid, .offset = offset, .length = length, .prot = prot};
+
+  // The mapping holds the file open; a direct one also pins its blocks
+  fs_lock(&state.files_lock);
+  fs_lock(&file->node->lock);
+  int ret = (uint64_t)offset + length > file->entry->size
+                ? P_EINVAL
+                : map_direct(map, file->entry);
+  if (ret == 0 || ret == 1) {
+    file->ref_count++;
+  }
+  if (ret == 0) {
+    file->node->mapped++;
+  }
+  fs_unlock(&file->node->lock);
+  fs_unlock(&state.files_lock);
+  if (ret == 1 && (ret = map_copy(map)) != 0) {
+    if (map->base && map->base != MAP_FAILED) {
+      munmap(map->base, map->host_len);
+    }
+    free(map->shadow);
+    k_close(fd);
+  }
+  if (ret) {
+    free(map);
+    P_ERRNO = ret;
+    return NULL;
+  }
+
+  fs_lock(&mappings_lock);
+  if (!mappings_ready) {
+    mappings = vec_new(8, NULL);
+    mappings_ready = true;
+  }
+  vec_push_back(&mappings, map);
+  fs_unlock(&mappings_lock);
+  return map->addr;
+}
+
+// Bring a direct mapping's blocks and their checksums up to date
+static int sync_direct(mapping_t* map) {
+  if (msync(map->base, map->host_len, MS_SYNC) < 0) {
+    return FS_IO_ERROR;
+  }
+  file_node_t* file = fd_get(map->fd)->node;
+  uint32_t bs = state.block_size;
+  uint32_t first = map->offset / bs;
+  uint32_t count = (map->offset + map->length - 1) / bs - first + 1;
+  fs_lock(&file->lock);
+  uint32_t b = chain_block(file->entry, first);
+  for (uint32_t i = 0; i < count && b != FAT_ENTRY_LAST; i++, b = fat_get(b)) {
+    block_restamp(b, 1);
+  }
+  fs_unlock(&file->lock);
+  return 0;
+}
+
+// Write a private copy back from its first changed byte to the end of the
+// file, since a write ends the file where it stops
+static int sync_copy(mapping_t* map) {
+  uint32_t lo = 0;
+  while (lo < map->length && map->addr[lo] == map->shadow[lo]) {
+    lo++;
+  }
+  if (lo == map->length) {
+    return 0;
+  }
+  uint32_t end = map->offset + map->length;
+  file_node_t* file = fd_get(map->fd)->node;
+  fs_lock(&file->lock);
+  uint32_t size = file->entry->size;
+  fs_unlock(&file->lock);
+  uint32_t len = map->length - lo + (size > end ? size - end : 0);
+  char* buf = malloc(len);
+  if (!buf) {
+    return P_ENOMEM;
+  }
+  memcpy(buf, map->addr + lo, map->length - lo);
+  int ret = 0;
+  for (uint32_t done = map->length - lo; ret == 0 && done < len;) {
+    int n = k_pread(map->fd, map->offset + lo + done,
+                    MIN(MMAP_CHUNK, len - done), buf + done);
+    ret = n > 0 ? 0 : io_error(n);
+    done += MAX(n, 0);
+  }
+  for (uint32_t done = 0; ret == 0 && done < len;) {
+    int n = k_pwrite(map->fd, map->offset + lo + done, buf + done,
+                     MIN(MMAP_CHUNK, len - done));
+    ret = n > 0 ? 0 : io_error(n);
+    done += MAX(n, 0);
+  }
+  free(buf);
+  if (ret == 0) {
+    memcpy(map->shadow + lo, map->addr + lo, map->length - lo);
+  }
+  return ret;
+}
+
+static int sync_mapping(mapping_t* map) {
+  if (!(map->prot & PROT_WRITE)) {
+    return 0;
+  }
+  return map->direct ? sync_direct(map) : sync_copy(map);
+}
+
+// Take the caller's mapping at addr out of the table; NULL if none
+static mapping_t* find_mapping(void* addr, int pid, bool remove) {
+  mapping_t* found = NULL;
+  fs_lock(&mappings_lock);
+  for (size_t i = 0; mappings_ready && i < vec_len(&mappings); i++) {
+    mapping_t* map = vec_get(&mappings, i);
+    if (map->addr == addr && map->pid == pid) {
+      found = map;
+      if (remove) {
+        vec_shallow_erase(&mappings, i);
+      }
+      break;
+    }
+  }
+  fs_unlock(&mappings_lock);
+  return found;
+}
+
+int k_msync(void* addr, int pid) {
+  mapping_t* map = find_mapping(addr, pid, false);
+  int ret = map ? sync_mapping(map) : P_EINVAL;
+  if (ret) {
+    P_ERRNO = ret;
+    return -1;
+  }
+  return 0;
+}
+
+// Write back, unmap and let go of the file
+static int unmap(mapping_t* map) {
+  int ret = sync_mapping(map);
+  munmap(map->base, map->host_len);
+  if (map->direct) {
+    file_node_t* file = fd_get(map->fd)->node;
+    fs_lock(&file->lock);
+    file->mapped--;
+    fs_unlock(&file->lock);
+  }
+  k_close(map->fd);
+  free(map->shadow);
+  free(map);
+  return ret;
+}
+
+int k_munmap(void* addr, int pid) {
+  mapping_t* map = find_mapping(addr, pid, true);
+  int ret = map ? unmap(map) : P_EINVAL;
+  if (ret) {
+    P_ERRNO = ret;
+    return -1;
+  }
+  return 0;
+}
+
+void k_munmap_all(int pid) {
+  while (true) {
+    mapping_t* map = NULL;
+    fs_lock(&mappings_lock);
+    for (size_t i = 0; mappings_ready && i < vec_len(&mappings); i++) {
+      if (((mapping_t*)vec_get(&mappings, i))->pid == pid) {
+        map = vec_get(&mappings, i);
+        vec_shallow_erase(&mappings, i);
+        break;
+      }
+    }
+    fs_unlock(&mappings_lock);
+    if (!map) {
+      return;
+    }
+    unmap(map);
+  }
+}
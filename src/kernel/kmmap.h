@@ -0,0 +1,84 @@
+#ifndef _KERNEL_MMAP_H_
+#define _KERNEL_MMAP_H_
+#include "./kernel.h"
+
+/**
+ * @brief A range of a PennFAT file mapped into memory with k_mmap.
+ *
+ * A plain file's blocks are mapped straight from the image when they can
+ * sit one after another in memory: when the range lies in one run of
+ * consecutive blocks, or when blocks are whole pages, in which case each run
+ * is laid over a reserved range in turn. Reads and writes through such a
+ * mapping touch the image's pages themselves, with no copy. Anything else
+ * (a compressed or deduplicated file, one kept in its entry, a writable
+ * range a snapshot still holds, or scattered blocks smaller than a page) is
+ * given a private copy read through the file, which is written back if it
+ * was changed.
+ *
+ * Every mapping keeps its file open until it is unmapped. While a file has a
+ * direct mapping its blocks must stay where they are, so defrag skips it, cp
+ * and import into it fail with FILE_IN_USE, and so does taking a snapshot.
+ */
+typedef struct mapping_st {
+  char* addr;         // what the process was given
+  char* base;         // start of the host mapping, page aligned
+  size_t host_len;    // its length
+  char* shadow;       // private copy, writable: contents as last written back
+  int fd;             // global fd, held open while mapped
+  int pid;            // process that made the mapping
+  uint32_t offset;    // where the range starts in the file
+  uint32_t length;    // bytes mapped
+  int prot;           // PROT_READ and/or PROT_WRITE
+  bool direct;        // the image's own pages
+} mapping_t;
+
+/**
+ * @brief Maps part of an open regular file into memory.
+ *
+ * The range must lie within the file. PROT_WRITE needs a descriptor opened
+ * for writing; changes reach the file at k_msync or k_munmap, or as they are
+ * made for a direct mapping (whose checksums are brought up to date at
+ * k_msync or k_munmap). A direct mapping's blocks are checked against their
+ * checksums first.
+ *
+ * @param fd Global file descriptor.
+ * @param offset Where the range starts.
+ * @param length Bytes to map.
+ * @param prot PROT_READ, PROT_WRITE or both.
+ * @param pid Process the mapping belongs to.
+ * @return Address of the range, or NULL with P_ERRNO set.
+ */
+void* k_mmap(int fd, uint32_t offset, uint32_t length, int prot, int pid);
+
+/**
+ * @brief Writes a mapping's changes back to its file.
+ *
+ * A private copy is compared with what was last written back and written
+ * from the first changed byte on (with the rest of the file after it, as a
+ * write ends the file); a direct mapping is flushed to the image.
+ *
+ * @param addr Address k_mmap returned.
+ * @param pid Process the mapping belongs to.
+ * @return 0 on success, -1 with P_ERRNO set.
+ */
+int k_msync(void* addr, int pid);
+
+/**
+ * @brief Writes a mapping back like k_msync, removes it and closes its
+ * file's hold.
+ *
+ * @param addr Address k_mmap returned.
+ * @param pid Process the mapping belongs to.
+ * @return 0 on success, -1 with P_ERRNO set; the mapping is removed even if
+ * it could not be written back.
+ */
+int k_munmap(void* addr, int pid);
+
+/**
+ * @brief Unmaps every mapping of a process, when it exits or is killed.
+ *
+ * @param pid The process.
+ */
+void k_munmap_all(int pid);
+
+#endif
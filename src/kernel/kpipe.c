@@ -0,0 +1,155 @@
+#include "./kpipe.h"
+#include "./util/p_errno.h"
+
+// Claim a free slot in the global fd table for one end of a pipe
+static int pipe_allocate_fd(pipe_t* pipe, dir_entry_t* entry, int mode) {
+  int fd = fd_claim();
+  if (fd >= 0) {
+    *fd_slot(fd) = (file_descriptor_t){.fd = fd,
+                                       .offset = 0,
+                                       .mode = mode,
+                                       .ref_count = 1,
+                                       .entry = entry,
+                                       .pipe = pipe};
+  }
+  return fd;
+}
+
+int k_pipe(int fds[2]) {
+  pipe_t* pipe = calloc(1, sizeof(pipe_t));
+  if (!pipe) {
+    P_ERRNO = P_ENOMEM;
+    return -1;
+  }
+  pipe->read_open = true;
+  pipe->write_open = true;
+  wait_queue_init(&pipe->readable);
+  wait_queue_init(&pipe->writable);
+  // "|" can never appear in a file name, so s_open will not match these
+  strcpy(pipe->read_entry.name, "|pipe");
+  pipe->read_entry.perm = PERM_READ;
+  strcpy(pipe->write_entry.name, "|pipe");
+  pipe->write_entry.perm = PERM_WRITE;
+
+  fs_lock(&state.files_lock);
+  fds[0] = pipe_allocate_fd(pipe, &pipe->read_entry, F_READ);
+  fds[1] = fds[0] < 0 ? -1 : pipe_allocate_fd(pipe, &pipe->write_entry, F_WRITE);
+  if (fds[1] < 0 && fds[0] >= 0) {
+    fd_release(fds[0]);
+  }
+  fs_unlock(&state.files_lock);
+  if (fds[1] < 0) {
+    wait_queue_destroy(&pipe->readable);
+    wait_queue_destroy(&pipe->writable);
+    free(pipe);
+    P_ERRNO = TOO_MANY_OPEN_FILES;
+    return -1;
+  }
+  return 0;
+}
+
+int k_pipe_read(file_descriptor_t* file, int n, char* buf) {
+  pipe_t* pipe = file->pipe;
+  while (true) {
+    unsigned int seen = pipe->readable.wakeups;
+    if (pipe->count > 0 || !pipe->write_open) {
+      break;
+    }
+    k_wait_on(&pipe->readable, seen);
+  }
+
+  int bytes_read = MIN(n, pipe->count);
+  for (int i = 0; i < bytes_read; i++) {
+    buf[i] = pipe->buf[(pipe->head + i) % PIPE_BUF_SIZE];
+  }
+  pipe->head = (pipe->head + bytes_read) % PIPE_BUF_SIZE;
+  pipe->count -= bytes_read;
+
+  if (bytes_read > 0) {
+    k_wake_up(&pipe->writable);
+  }
+  return bytes_read;
+}
+
+int k_pipe_write(file_descriptor_t* file, const char* buf, int n) {
+  pipe_t* pipe = file->pipe;
+  int bytes_written = 0;
+  while (bytes_written < n) {
+    while (true) {
+      unsigned int seen = pipe->writable.wakeups;
+      if (pipe->count < PIPE_BUF_SIZE || !pipe->read_open) {
+        break;
+      }
+      k_wait_on(&pipe->writable, seen);
+    }
+    if (!pipe->read_open) {
+      break;
+    }
+
+    int tail = (pipe->head + pipe->count) % PIPE_BUF_SIZE;
+    int chunk = MIN(n - bytes_written, PIPE_BUF_SIZE - pipe->count);
+    for (int i = 0; i < chunk; i++) {
+      pipe->buf[(tail + i) % PIPE_BUF_SIZE] = buf[bytes_written + i];
+    }
+    pipe->count += chunk;
+    bytes_written += chunk;
+    k_wake_up(&pipe->readable);
+  }
+
+  if (bytes_written == 0 && n > 0) {
+    P_ERRNO = BROKEN_PIPE;
+    return -1;
+  }
+  return bytes_written;
+}
+
+void k_pipe_close(file_descriptor_t* file) {
+  pipe_t* pipe = file->pipe;
+  if (file->entry == &pipe->read_entry) {
+    pipe->read_open = false;
+    k_wake_up(&pipe->writable);  // writers now fail with BROKEN_PIPE
+  } else {
+    pipe->write_open = false;
+    k_wake_up(&pipe->readable);  // readers drain the buffer, then see EOF
+  }
+
+  if (!pipe->read_open && !pipe->write_open) {
+    wait_queue_destroy(&pipe->readable);
+    wait_queue_destroy(&pipe->writable);
+    free(pipe);
+  }
+}
+
+void k_pipe_inherit_fds(proc_fd_ent* fds) {
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    file_descriptor_t* file =
+        fds[i].proc_fd < 0 ? NULL : fd_get(fds[i].global_fd);
+    if (!file || !(file->pipe || (file->node && i <= STDERR_FILENO))) {
+      continue;
+    }
+    if (i > STDERR_FILENO) {
+      fds[i].proc_fd = -1;
+    } else if (file->pipe) {
+      file->ref_count++;
+    } else {
+      // A redirected file, which the shell closes once the child has it
+      fs_lock(&state.files_lock);
+      file->ref_count++;
+      fs_unlock(&state.files_lock);
+    }
+  }
+}
+
+void k_pipe_release_fds(proc_fd_ent* fds) {
+  if (!fds) {
+    return;
+  }
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    file_descriptor_t* file =
+        fds[i].proc_fd < 0 ? NULL : fd_get(fds[i].global_fd);
+    if (file && (file->pipe || (file->node && i <= STDERR_FILENO))) {
+      k_close(fds[i].global_fd);
+      fds[i].proc_fd = -1;
+    }
+  }
+}
@@ -0,0 +1,93 @@
+#ifndef _KERNEL_PIPE_H_
+#define _KERNEL_PIPE_H_
+#include "./kernel.h"
+#include "./kwait.h"
+
+#define PIPE_BUF_SIZE 4096
+
+/**
+ * @brief An in-kernel pipe: a bounded ring buffer shared by two global file
+ * descriptors, one for each end.
+ *
+ * Readers block while the buffer is empty and a write end is still open;
+ * writers block while it is full and a read end is still open. Each side
+ * sleeps on its own wait queue and is woken by the other side.
+ */
+typedef struct pipe_st {
+  char buf[PIPE_BUF_SIZE];
+  int head;                 // index of the next byte to read
+  int count;                // bytes currently buffered
+  bool read_open;           // read end still referenced
+  bool write_open;          // write end still referenced
+  wait_queue_t readable;    // readers waiting for data
+  wait_queue_t writable;    // writers waiting for space
+  dir_entry_t read_entry;   // stands in for a directory entry in the fd table
+  dir_entry_t write_entry;
+} pipe_t;
+
+/**
+ * @brief Creates a pipe and opens both of its ends.
+ *
+ * @param fds On success fds[0] is the global fd of the read end and fds[1]
+ * the global fd of the write end.
+ * @return 0 on success, -1 on failure with P_ERRNO set.
+ */
+int k_pipe(int fds[2]);
+
+/**
+ * @brief Reads up to n bytes from the read end of a pipe.
+ *
+ * Blocks until at least one byte is available or every write end is closed.
+ *
+ * @param file Global file descriptor of the read end.
+ * @param n Maximum number of bytes to read.
+ * @param buf Buffer to read into.
+ * @return Number of bytes read, 0 at end of file, or -1 on error.
+ */
+int k_pipe_read(file_descriptor_t* file, int n, char* buf);
+
+/**
+ * @brief Writes n bytes to the write end of a pipe.
+ *
+ * Blocks while the buffer is full. Fails with BROKEN_PIPE once the read end
+ * is closed.
+ *
+ * @param file Global file descriptor of the write end.
+ * @param buf Bytes to write.
+ * @param n Number of bytes to write.
+ * @return Number of bytes written, or -1 on error.
+ */
+int k_pipe_write(file_descriptor_t* file, const char* buf, int n);
+
+/**
+ * @brief Closes one end of a pipe once its global fd is no longer referenced.
+ *
+ * Wakes the processes blocked on the other end and frees the pipe when both
+ * ends are closed.
+ *
+ * @param file Global file descriptor whose ref_count dropped to zero.
+ */
+void k_pipe_close(file_descriptor_t* file);
+
+/**
+ * @brief Fixes up a freshly copied child fd table.
+ *
+ * Pipe ends are only inherited through the standard descriptors 0-2 (which
+ * gain a reference); any other pipe fd is dropped from the child so that a
+ * pipeline stage never holds a stray end that would keep a reader from
+ * seeing end of file. Files redirected onto 0-2 gain a reference too, so
+ * the shell can close its own as soon as the child is spawned.
+ *
+ * @param fds The child's file descriptor table.
+ */
+void k_pipe_inherit_fds(proc_fd_ent* fds);
+
+/**
+ * @brief Closes every pipe end, and every file on descriptors 0-2,
+ * referenced by a terminating process.
+ *
+ * @param fds The process's file descriptor table.
+ */
+void k_pipe_release_fds(proc_fd_ent* fds);
+
+#endif
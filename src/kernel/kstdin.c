@@ -0,0 +1,45 @@
+#include "./kstdin.h"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include "./kstdout.h"
+#include "./kwait.h"
+#include "./util/p_errno.h"
+
+// Processes waiting for the terminal
+static wait_queue_t stdin_wait;
+
+// True once a read on the host stdin will not block (data, EOF or error)
+static bool stdin_ready(void) {
+  struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+void k_stdin_init(void) {
+  wait_queue_init(&stdin_wait);
+}
+
+int k_stdin_read(char* buf, int n) {
+  k_flush();  // show any pending prompt before waiting for input
+  while (true) {
+    unsigned int seen = stdin_wait.wakeups;
+    if (stdin_ready()) {
+      ssize_t bytes_read = read(STDIN_FILENO, buf, n);
+      if (bytes_read >= 0) {
+        return (int)bytes_read;
+      }
+      if (errno != EAGAIN && errno != EINTR) {
+        P_ERRNO = FD_INVALID;
+        return -1;
+      }
+      continue;  // another reader took the input first
+    }
+    k_wait_on(&stdin_wait, seen);
+  }
+}
+
+void k_stdin_poll(void) {
+  if (vec_len(&stdin_wait.waiters) > 0 && stdin_ready()) {
+    k_wake_up_locked(&stdin_wait);
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef _KERNEL_STDIN_H_
+#define _KERNEL_STDIN_H_
+
+/**
+ * @brief Sets up the queue of processes waiting for terminal input.
+ */
+void k_stdin_init(void);
+
+/**
+ * @brief Reads up to n bytes of terminal input.
+ *
+ * If no input is ready the calling process is parked as P_BLOCKED so other
+ * processes keep running; the clock tick polls the host stdin and wakes it
+ * once input arrives. Never blocks the host thread, with or without --aio.
+ *
+ * @param buf Buffer to read into.
+ * @param n Maximum number of bytes to read.
+ * @return Number of bytes read, 0 at end of input, or -1 on error.
+ */
+int k_stdin_read(char* buf, int n);
+
+/**
+ * @brief Wakes processes waiting for terminal input if some is ready.
+ *
+ * Called from the clock tick, inside the scheduler's critical section.
+ */
+void k_stdin_poll(void);
+
+#endif
@@ -0,0 +1,82 @@
+#include "./kstdout.h"
+#include <string.h>
+#include <unistd.h>
+#include "./kernel.h"
+
+static bool stdout_is_tty = false;
+
+// Looking the process up scans pcb_list, so each thread remembers its own
+static _Thread_local pcb_t* self_cache = NULL;
+
+void k_stdout_init(void) {
+  stdout_is_tty = isatty(STDOUT_FILENO);
+}
+
+// The calling process, or NULL outside of one (main thread, clock tick)
+static pcb_t* caller(void) {
+  spthread_t self;
+  if (!self_cache && spthread_self(&self)) {
+    self_cache = find_parent_with_current_thread();
+  }
+  return self_cache;
+}
+
+// Write the whole buffer to the host stdout, retrying short writes
+static int drain(const char* buf, int* len) {
+  int done = 0;
+  while (done < *len) {
+    ssize_t n = write(STDOUT_FILENO, buf + done, *len - done);
+    if (n <= 0) {
+      *len = 0;
+      return -1;
+    }
+    done += n;
+  }
+  *len = 0;
+  return 0;
+}
+
+int k_stdout_write(const char* data, int n) {
+  pcb_t* self = caller();
+  if (!self) {
+    return write(STDOUT_FILENO, data, n);  // kernel output is not buffered
+  }
+  if (!self->out_buf) {
+    self->out_buf = malloc(STDOUT_BUF_SIZE);
+    if (!self->out_buf) {
+      return write(STDOUT_FILENO, data, n);
+    }
+    self->out_len = 0;
+  }
+  if (self->out_len + n > STDOUT_BUF_SIZE &&
+      drain(self->out_buf, &self->out_len) == -1) {
+    return -1;
+  }
+  if (n >= STDOUT_BUF_SIZE) {
+    int len = n;  // too big to be worth copying
+    return drain(data, &len) == -1 ? -1 : n;
+  }
+  memcpy(self->out_buf + self->out_len, data, n);
+  self->out_len += n;
+  if (stdout_is_tty && memchr(data, '\n', n) &&
+      drain(self->out_buf, &self->out_len) == -1) {
+    return -1;
+  }
+  return n;
+}
+
+void k_flush(void) {
+  k_flush_process(caller());
+}
+
+void k_flush_process(pcb_t* pcb) {
+  if (pcb && pcb->out_buf) {
+    drain(pcb->out_buf, &pcb->out_len);
+  }
+}
+
+void k_stdout_release(pcb_t* pcb) {
+  k_flush_process(pcb);
+  free(pcb->out_buf);
+  pcb->out_buf = NULL;
+}
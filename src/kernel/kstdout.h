@@ -0,0 +1,45 @@
+#ifndef _KERNEL_STDOUT_H_
+#define _KERNEL_STDOUT_H_
+#include "./pcb.h"
+
+#define STDOUT_BUF_SIZE 4096
+
+/**
+ * @brief Checks whether the host stdout is a terminal. Call once at boot.
+ */
+void k_stdout_init(void);
+
+/**
+ * @brief Writes n bytes to the terminal through the caller's output buffer.
+ *
+ * Each process has its own buffer. It is flushed when it fills up, at every
+ * newline when stdout is a terminal, before the process reads stdin, when it
+ * exits, and on k_flush. Output from outside any process (e.g. the clock
+ * tick) is written straight through.
+ *
+ * @param buf Bytes to write.
+ * @param n Number of bytes.
+ * @return n on success, or -1 if the host write failed.
+ */
+int k_stdout_write(const char* buf, int n);
+
+/**
+ * @brief Writes out everything buffered by the calling process.
+ */
+void k_flush(void);
+
+/**
+ * @brief Writes out everything buffered by another process.
+ *
+ * @param pcb The process, which must not be running.
+ */
+void k_flush_process(pcb_t* pcb);
+
+/**
+ * @brief Flushes a terminating process's buffer and frees it.
+ *
+ * @param pcb The process being cleaned up.
+ */
+void k_stdout_release(pcb_t* pcb);
+
+#endif
@@ -0,0 +1,54 @@
+#include "./kwait.h"
+#include <stdint.h>
+#include "./kernel.h"
+#include "./kernel_helper.h"
+#include "./scheduler/sched_policy.h"
+#include "./scheduler/scheduler_helper.h"
+
+void wait_queue_init(wait_queue_t* wq) {
+  wq->waiters = vec_new(INITIAL_VEC_CAPACITY, NULL);
+  wq->wakeups = 0;
+}
+
+void wait_queue_destroy(wait_queue_t* wq) {
+  vec_destroy(&wq->waiters);
+}
+
+void k_wait_on(wait_queue_t* wq, unsigned int seen) {
+  pcb_t* self = find_parent_with_current_thread();
+  if (!self) {
+    panic("k_wait_on: no current PCB");
+  }
+  scheduler_lock();
+  if (wq->wakeups != seen) {
+    scheduler_unlock();
+    return;  // the event already happened
+  }
+  vec_push_back(&wq->waiters, (void*)(intptr_t)self->pid);
+  self->waiting_on = wq;
+  remove_pcb_from_queue(self);
+  sched_note_blocked(self);
+  self->status = P_BLOCKED;
+  scheduler_yield(self);  // hand the CPU over now rather than next tick
+}
+
+void k_wake_up_locked(wait_queue_t* wq) {
+  wq->wakeups++;
+  for (size_t i = 0; i < vec_len(&wq->waiters); i++) {
+    pcb_t* pcb =
+        k_get_pcb_with_given_pid((int)(intptr_t)vec_get(&wq->waiters, i));
+    // Skip processes that died or have since blocked on something else
+    if (pcb && pcb->status == P_BLOCKED && pcb->waiting_on == wq) {
+      pcb->waiting_on = NULL;
+      pcb->status = P_RUNNING;
+      add_to_queue(pcb);
+    }
+  }
+  vec_clear(&wq->waiters);
+}
+
+void k_wake_up(wait_queue_t* wq) {
+  scheduler_lock();
+  k_wake_up_locked(wq);
+  scheduler_unlock();
+}
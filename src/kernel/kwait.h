@@ -0,0 +1,52 @@
+#ifndef _KERNEL_WAIT_H_
+#define _KERNEL_WAIT_H_
+#include "./vec/Vec.h"
+
+/**
+ * @brief A list of processes sleeping until some event happens.
+ *
+ * Waiters are stored by PID so a process that is killed while waiting
+ * leaves no dangling pointer behind. `wakeups` counts calls to k_wake_up;
+ * a waiter samples it before checking its condition so that a wake-up that
+ * lands in between is never lost.
+ */
+typedef struct wait_queue_st {
+  Vec waiters;            // PIDs of the blocked processes
+  unsigned int wakeups;   // number of k_wake_up calls so far
+} wait_queue_t;
+
+/**
+ * @brief Initializes an empty wait queue.
+ */
+void wait_queue_init(wait_queue_t* wq);
+
+/**
+ * @brief Frees a wait queue's storage. Any waiters are forgotten.
+ */
+void wait_queue_destroy(wait_queue_t* wq);
+
+/**
+ * @brief Blocks the calling process on a wait queue.
+ *
+ * Usage: `seen = wq->wakeups`, check the condition, and only if it does not
+ * hold call k_wait_on(wq, seen). Returns immediately if a wake-up happened
+ * since `seen` was sampled; otherwise returns once the process has been
+ * woken. Callers re-check their condition in a loop.
+ *
+ * @param wq The queue to sleep on.
+ * @param seen Value of wq->wakeups sampled before the condition check.
+ */
+void k_wait_on(wait_queue_t* wq, unsigned int seen);
+
+/**
+ * @brief Makes every process blocked on a wait queue runnable again.
+ */
+void k_wake_up(wait_queue_t* wq);
+
+/**
+ * @brief Same as k_wake_up, for callers already inside the scheduler's
+ * critical section (the clock tick, or code holding scheduler_lock).
+ */
+void k_wake_up_locked(wait_queue_t* wq);
+
+#endif
@@ -1,5 +1,6 @@
 #include "./pennfat/pennfat.h"
 #include "./util/spthread.h"
+#include "./kernel/kwait.h"
 #include "./vec/Vec.h"
 
 #ifndef PCB_H_
@@ -21,6 +22,12 @@ enum { P_RUNNING, P_STOPPED, P_BLOCKED, P_ZOMBIED };
 #define P_WIFSTOPPED(status) ((status) == P_SIGSTOP)
 #define P_WIFSIGNALED(status) ((status) == P_SIGTERM)
 
+// A child state change that has not been collected by waitpid yet
+typedef struct child_event_st {
+  int pid;     // child that changed state
+  int status;  // P_SIGEXIT, P_SIGTERM or P_SIGSTOP
+} child_event_t;
+
 typedef struct pcb_st {
   int pid;                        // process id
   int job_id;                     // job id
@@ -33,9 +40,18 @@ typedef struct pcb_st {
   Vec children;                   // list of child processes
   int wake_tick;                  // tick to wake up
   int remaining_sleep_ticks;      // remaining sleep ticks
-  int waited_by;                  // pid that is waiting for this process
+  Vec child_events;               // unreported child state changes
+  wait_queue_t child_wait;        // where waitpid sleeps for child_events
+  wait_queue_t* waiting_on;       // queue this process is blocked on, if any
+  char* out_buf;                  // buffered terminal output (NULL until used)
+  int out_len;                    // bytes waiting in out_buf
   bool is_background;             // is this a background job?
   char** argv;                    // arguments to the command
+  bool owns_argv;                 // argv is its own copy, freed with it
+  int sched_slot;                 // run queue position (-1 if not queued)
+  uint64_t pass;                  // stride scheduling virtual time
+  int sched_level;                // mlfq queue level
+  int sched_ticks;                // mlfq ticks used at the current level
 
 } pcb_t;
 
@@ -0,0 +1,671 @@
+#include "./fat_compress.h"
+#include "./fat_csum.h"
+#include "./util/p_errno.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Start of every compressed frame's first block; a frame stored as is has
+// none and takes just the blocks its bytes need
+typedef struct {
+  uint16_t length;     // bytes of the file in the frame
+  uint16_t stored;     // bytes after the header
+  uint32_t raw_after;  // frames stored as is right after this one
+} frame_header_t;
+
+frame_cache_t* frame_cache_new() {
+  frame_cache_t* cache = malloc(sizeof(frame_cache_t));
+  if (cache) {
+    cache->index = FRAME_NONE;
+    cache->length = 0;
+    frame_cache_moved(cache);
+  }
+  return cache;
+}
+
+void frame_cache_moved(frame_cache_t* cache) {
+  cache->walk.index = FRAME_NONE;
+}
+
+// LZ77 CODER
+
+static uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Length bytes past a 15 in a token: 255 while more follow, then the rest
+static uint8_t* put_length(uint8_t* op, uint32_t len) {
+  for (; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+// One sequence: a run of literals, then a match unless mlen is 0
+static uint8_t* put_sequence(uint8_t* op, uint8_t* oend, const uint8_t* lit,
+                             uint32_t nlit, uint32_t offset, uint32_t mlen) {
+  if (oend - op < 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1) {
+    return NULL;
+  }
+  uint32_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+  *op++ = (MIN(nlit, 15) << 4) | MIN(mcode, 15);
+  if (nlit >= 15) {
+    op = put_length(op, nlit - 15);
+  }
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen) {
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    if (mcode >= 15) {
+      op = put_length(op, mcode - 15);
+    }
+  }
+  return op;
+}
+
+int lz_compress(const uint8_t* src, int n, uint8_t* dst, int cap) {
+  int32_t table[1 << LZ_HASH_BITS];
+  memset(table, -1, sizeof(table));
+  uint8_t* op = dst;
+  uint8_t* oend = dst + cap;
+  int anchor = 0;
+  int ip = 0;
+
+  while (ip + LZ_MIN_MATCH <= n) {
+    uint32_t seq = read32(src + ip);
+    uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+    int ref = table[h];
+    table[h] = ip;
+    if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(src + ref) != seq) {
+      ip++;
+      continue;
+    }
+    int len = LZ_MIN_MATCH;
+    while (ip + len < n && src[ref + len] == src[ip + len]) {
+      len++;
+    }
+    op = put_sequence(op, oend, src + anchor, ip - anchor, ip - ref, len);
+    if (!op) {
+      return 0;
+    }
+    ip += len;
+    anchor = ip;
+  }
+  op = put_sequence(op, oend, src + anchor, n - anchor, 0, 0);
+  return op ? op - dst : 0;
+}
+
+// Read the length bytes after a 15 in a token
+static const uint8_t* get_length(const uint8_t* ip, const uint8_t* iend,
+                                 uint32_t* len) {
+  uint8_t b;
+  do {
+    if (ip >= iend) {
+      return NULL;
+    }
+    b = *ip++;
+    *len += b;
+  } while (b == 255);
+  return ip;
+}
+
+int lz_decompress(const uint8_t* src, int n, uint8_t* dst, int cap) {
+  const uint8_t* ip = src;
+  const uint8_t* iend = src + n;
+  uint8_t* op = dst;
+  uint8_t* oend = dst + cap;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    uint32_t nlit = token >> 4;
+    if (nlit == 15 && !(ip = get_length(ip, iend, &nlit))) {
+      return -1;
+    }
+    if (nlit > (uint32_t)(iend - ip) || nlit > (uint32_t)(oend - op)) {
+      return -1;
+    }
+    memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == iend) {
+      break;  // the last sequence has no match
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    uint32_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    uint32_t mlen = token & 15;
+    if (mlen == 15 && !(ip = get_length(ip, iend, &mlen))) {
+      return -1;
+    }
+    mlen += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (uint32_t)(op - dst) ||
+        mlen > (uint32_t)(oend - op)) {
+      return -1;
+    }
+    if (offset >= mlen) {
+      memcpy(op, op - offset, mlen);
+      op += mlen;
+      continue;
+    }
+    // Byte by byte: the match overlaps the bytes it produces
+    for (uint32_t i = 0; i < mlen; i++, op++) {
+      *op = *(op - offset);
+    }
+  }
+  return op - dst;
+}
+
+// FRAMES
+
+// Read or write len bytes along a chain, from the start of block
+static int chain_io(uint32_t block, uint8_t* buf, uint32_t len, bool write) {
+  for (uint32_t done = 0; done < len; block = fat_get(block)) {
+    if (block == FAT_ENTRY_LAST || block == FAT_ENTRY_FREE) {
+      return FS_IO_ERROR;
+    }
+    uint32_t n = MIN(state.block_size, len - done);
+    int ret = write ? block_write(block, buf + done, n, 0)
+                    : block_read(block, buf + done, n, 0);
+    if (ret) {
+      return ret;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// Blocks that len bytes take
+static uint32_t blocks_for(uint32_t len) {
+  return (len + state.block_size - 1) / state.block_size;
+}
+
+static int read_header(uint32_t block, frame_header_t* header) {
+  int ret = block_read(block, header, sizeof(*header), 0);
+  if (ret == 0 &&
+      (header->length > COMPRESS_FRAME || header->stored > COMPRESS_FRAME)) {
+    ret = FS_IO_ERROR;
+  }
+  return ret;
+}
+
+// Frames stored as is before the first compressed one. A file with blocks
+// has no use for its inline bytes, so they hold the count.
+static uint32_t lead_raw(const dir_entry_t* entry) {
+  uint32_t count;
+  memcpy(&count, entry->inline_data, sizeof(count));
+  return count;
+}
+
+static void set_lead_raw(dir_entry_t* entry, uint32_t count) {
+  memcpy(entry->inline_data, &count, sizeof(count));
+}
+
+// Frames of the file; an inline file's bytes count as one
+static uint32_t frame_count(const dir_entry_t* entry) {
+  return (entry->size + COMPRESS_FRAME - 1) / COMPRESS_FRAME;
+}
+
+// Bytes of the file in frame i, which is one of its frames
+static uint32_t frame_length(const dir_entry_t* entry, uint32_t i) {
+  return MIN(COMPRESS_FRAME, entry->size - i * COMPRESS_FRAME);
+}
+
+static void walk_start(const dir_entry_t* entry, frame_walk_t* walk) {
+  walk->index = 0;
+  walk->block = entry_first_block(entry);
+  walk->prev = 0;
+  walk->owner = FRAME_NONE;
+  walk->owner_block = 0;
+  walk->owner_prev = 0;
+  walk->run = entry_is_inline(entry) ? 0 : lead_raw(entry);
+}
+
+// Whether the frame the walk is at is stored as is
+static bool walk_raw(const frame_walk_t* walk) {
+  uint32_t start = walk->owner == FRAME_NONE ? 0 : walk->owner + 1;
+  return walk->index - start < walk->run;
+}
+
+// Blocks and last block of the frame the walk is at, and its header if it
+// is compressed
+static int walk_frame(const dir_entry_t* entry, const frame_walk_t* walk,
+                      frame_header_t* header, uint32_t* count,
+                      uint32_t* last) {
+  int ret = 0;
+  if (walk_raw(walk)) {
+    *count = blocks_for(frame_length(entry, walk->index));
+  } else {
+    ret = read_header(walk->block, header);
+    *count = blocks_for(sizeof(*header) + header->stored);
+  }
+  uint32_t block = walk->block;
+  for (uint32_t i = 1; ret == 0 && i < *count; i++) {
+    block = fat_get(block);
+    if (block == FAT_ENTRY_LAST || block == FAT_ENTRY_FREE) {
+      ret = FS_IO_ERROR;
+    }
+  }
+  *last = block;
+  return ret;
+}
+
+// Move the walk past the frame it is at, which ends at last
+static void walk_past(frame_walk_t* walk, bool raw,
+                      const frame_header_t* header, uint32_t last) {
+  if (!raw) {
+    walk->owner = walk->index;
+    walk->owner_block = walk->block;
+    walk->owner_prev = walk->prev;
+    walk->run = header->raw_after;
+  }
+  walk->prev = last;
+  walk->block = fat_get(last);
+  walk->index++;
+}
+
+uint32_t compressed_span(const dir_entry_t* entry, uint32_t blocks) {
+  frame_walk_t walk;
+  walk_start(entry, &walk);
+  uint32_t bytes = 0;
+  for (uint32_t used = 0;
+       walk.block != FAT_ENTRY_LAST && walk.index < frame_count(entry);) {
+    bool raw = walk_raw(&walk);
+    frame_header_t header;
+    uint32_t count, last;
+    if (walk_frame(entry, &walk, &header, &count, &last) ||
+        used + count > blocks) {
+      break;
+    }
+    bytes += raw ? frame_length(entry, walk.index) : header.length;
+    used += count;
+    walk_past(&walk, raw, &header, last);
+  }
+  return bytes;
+}
+
+// Walk to frame i; its first block is FAT_ENTRY_LAST past the end of the
+// chain
+static int frame_locate(const dir_entry_t* entry, frame_cache_t* cache,
+                        uint32_t i) {
+  frame_walk_t* walk = &cache->walk;
+  if (walk->index == FRAME_NONE || walk->index > i) {
+    walk_start(entry, walk);
+  }
+  while (walk->index < i && walk->block != FAT_ENTRY_LAST) {
+    bool raw = walk_raw(walk);
+    frame_header_t header;
+    uint32_t count, last;
+    int ret = walk_frame(entry, walk, &header, &count, &last);
+    if (ret) {
+      frame_cache_moved(cache);
+      return ret;
+    }
+    walk_past(walk, raw, &header, last);
+  }
+  if (walk->index < i) {
+    frame_cache_moved(cache);
+    return FS_IO_ERROR;  // the chain ends before the frames do
+  }
+  return 0;
+}
+
+// Make frame i the cached one; past the end of the file it is all zeros
+static int frame_load(const dir_entry_t* entry, frame_cache_t* cache,
+                      uint32_t i) {
+  // Inline bytes are written without the cache, so are always read again
+  if (cache->index == i && !entry_is_inline(entry)) {
+    // A write to an earlier frame may have ended the file before this one
+    uint64_t start = (uint64_t)i * COMPRESS_FRAME;
+    uint32_t valid = entry->size > start ? MIN(cache->length,
+                                               entry->size - start) : 0;
+    memset(cache->data + valid, 0, cache->length - valid);
+    cache->length = valid;
+    return 0;
+  }
+  cache->index = FRAME_NONE;
+  cache->length = 0;
+  memset(cache->data, 0, COMPRESS_FRAME);
+  if (entry_is_inline(entry)) {
+    if (i == 0) {
+      cache->length = MIN(entry->size, INLINE_DATA_MAX);
+      memcpy(cache->data, entry->inline_data, cache->length);
+    }
+    cache->index = i;
+    return 0;
+  }
+  if (i >= frame_count(entry)) {
+    cache->index = i;
+    return 0;
+  }
+
+  int ret = frame_locate(entry, cache, i);
+  uint32_t block = cache->walk.block;
+  if (ret == 0 && block == FAT_ENTRY_LAST) {
+    ret = FS_IO_ERROR;
+  }
+  if (ret == 0 && walk_raw(&cache->walk)) {
+    uint32_t length = frame_length(entry, i);
+    ret = chain_io(block, cache->data, length, false);
+    if (ret == 0) {
+      cache->index = i;
+      cache->length = length;
+    }
+    return ret;
+  }
+  frame_header_t header;
+  if (ret == 0) {
+    ret = read_header(block, &header);
+  }
+  uint8_t* raw = ret ? NULL : malloc(sizeof(header) + header.stored);
+  if (ret == 0 && !raw) {
+    ret = FS_MEMORY_ERROR;
+  }
+  if (ret == 0) {
+    ret = chain_io(block, raw, sizeof(header) + header.stored, false);
+  }
+  if (ret == 0 &&
+      lz_decompress(raw + sizeof(header), header.stored, cache->data,
+                    COMPRESS_FRAME) != header.length) {
+    ret = FS_IO_ERROR;
+  }
+  free(raw);
+  if (ret == 0) {
+    cache->index = i;
+    cache->length = header.length;
+  }
+  return ret;
+}
+
+// Copy the first block of a compressed frame, its header now counting run
+// frames stored as is after it. The frame moves to the copy rather than
+// change a block a snapshot may hold.
+static int header_copy(uint32_t block, uint32_t run, uint32_t* copy) {
+  uint8_t* buf = malloc(state.block_size);
+  *copy = buf ? fat_alloc_block() : 0;
+  int ret = !buf     ? FS_MEMORY_ERROR
+            : !*copy ? DISK_FULL
+                     : block_read(block, buf, state.block_size, 0);
+  if (ret == 0) {
+    ((frame_header_t*)buf)->raw_after = run;
+    ret = block_write(*copy, buf, state.block_size, 0);
+  }
+  if (ret && *copy) {
+    fat_free_chain_deferred(*copy);
+    *copy = 0;
+  }
+  free(buf);
+  return ret;
+}
+
+// Store the cached frame in new blocks, compressed if that saves a block,
+// and link them in place of the old ones; the file then has size bytes. The
+// frame holding the file's last byte drops any after it.
+static int frame_store(dir_entry_t* entry, frame_cache_t* cache,
+                       uint32_t size) {
+  uint32_t i = cache->index;
+  uint8_t out[sizeof(frame_header_t) + COMPRESS_FRAME];
+  frame_header_t* header = (frame_header_t*)out;
+  uint32_t plain = blocks_for(cache->length);
+  int cap = (int)((plain - 1) * state.block_size) - (int)sizeof(*header);
+  int stored = cap > 0 ? lz_compress(cache->data, cache->length,
+                                     out + sizeof(*header), cap)
+                       : 0;
+  bool raw = stored == 0;
+
+  // Find the old frame and the frames stored as is on either side of it
+  bool was_inline = entry_is_inline(entry);
+  int ret = frame_locate(entry, cache, i);
+  if (ret) {
+    return ret;
+  }
+  frame_walk_t* walk = &cache->walk;
+  uint32_t old = walk->block, prev = walk->prev, old_last = 0;
+  uint32_t next = old;  // anything left past the end goes too
+  uint32_t start = walk->owner == FRAME_NONE ? 0 : walk->owner + 1;
+  uint32_t before = i - start, after = 0;
+  if (old != FAT_ENTRY_LAST && i < frame_count(entry)) {
+    bool old_raw = walk_raw(walk);
+    frame_header_t old_header;
+    uint32_t count;
+    ret = walk_frame(entry, walk, &old_header, &count, &old_last);
+    if (ret) {
+      return ret;
+    }
+    next = fat_get(old_last);
+    after = old_raw ? walk->run - before - 1 : old_header.raw_after;
+    after = MIN(after, frame_count(entry) - i - 1);
+  } else {
+    old = FAT_ENTRY_LAST;
+  }
+  uint32_t dropped = FAT_ENTRY_LAST;
+  if ((i + 1) * (uint64_t)COMPRESS_FRAME >= size) {
+    dropped = next;
+    next = FAT_ENTRY_LAST;
+    after = 0;
+  }
+  uint32_t run = raw ? before + 1 + after : before;
+
+  uint32_t count = raw ? plain : blocks_for(sizeof(*header) + stored);
+  uint32_t first = fat_alloc_chain(count);
+  if (!first) {
+    return DISK_FULL;
+  }
+  if (raw) {
+    ret = chain_io(first, cache->data, cache->length, true);
+  } else {
+    header->length = cache->length;
+    header->stored = stored;
+    header->raw_after = after;
+    ret = chain_io(first, out, sizeof(*header) + stored, true);
+  }
+  uint32_t owner_copy = 0;
+  if (ret == 0 && walk->owner != FRAME_NONE && run != walk->run) {
+    ret = header_copy(walk->owner_block, run, &owner_copy);
+  }
+  if (ret) {
+    fat_free_chain_deferred(first);
+    return ret;
+  }
+
+  // Link the new frame in before the old one and any dropped ones go
+  uint32_t last = first;
+  for (uint32_t k = 1; k < count; k++) {
+    last = fat_get(last);
+  }
+  fat_set(last, next);
+  if (owner_copy) {
+    fat_set(owner_copy, fat_get(walk->owner_block));
+    if (walk->owner_prev) {
+      fat_set(walk->owner_prev, owner_copy);
+    } else {
+      set_entry_first_block(entry, owner_copy);
+    }
+    if (prev == walk->owner_block) {
+      prev = owner_copy;
+    }
+    fat_set(walk->owner_block, FAT_ENTRY_LAST);
+    fat_free_chain_deferred(walk->owner_block);
+    walk->owner_block = owner_copy;
+  }
+  if (prev) {
+    fat_set(prev, first);
+  } else {
+    if (was_inline) {
+      memset(entry->inline_data, 0, INLINE_DATA_MAX);
+    }
+    set_entry_first_block(entry, first);
+  }
+  if (walk->owner == FRAME_NONE) {
+    set_lead_raw(entry, run);
+  }
+  walk->run = run;
+  if (old != FAT_ENTRY_LAST) {
+    fat_set(old_last, FAT_ENTRY_LAST);
+    fat_free_chain_deferred(old);
+  }
+  fat_free_chain_deferred(dropped);
+
+  walk->index = i;
+  walk->block = first;
+  walk->prev = prev;
+  entry->size = size;
+  return 0;
+}
+
+int compressed_read(const dir_entry_t* entry, frame_cache_t* cache,
+                    uint32_t offset, char* buf, int n) {
+  int bytes_read = 0;
+  while (bytes_read < n && offset < entry->size) {
+    uint32_t i = offset / COMPRESS_FRAME;
+    int ret = frame_load(entry, cache, i);
+    if (ret) {
+      return ret;
+    }
+    uint32_t in_frame = offset % COMPRESS_FRAME;
+    uint32_t end = MIN(cache->length, entry->size - i * COMPRESS_FRAME);
+    if (end <= in_frame) {
+      break;
+    }
+    int chunk = MIN(end - in_frame, (uint32_t)(n - bytes_read));
+    memcpy(buf + bytes_read, cache->data + in_frame, chunk);
+    bytes_read += chunk;
+    offset += chunk;
+  }
+  return bytes_read;
+}
+
+// Before a write that starts in frame target, fill out the last frame and
+// add zero frames up to it
+static int fill_gap(dir_entry_t* entry, frame_cache_t* cache,
+                    uint32_t target) {
+  uint32_t frames = frame_count(entry);
+  for (uint32_t i = frames ? frames - 1 : 0; i < target; i++) {
+    int ret = frame_load(entry, cache, i);
+    if (ret) {
+      return ret;
+    }
+    cache->length = COMPRESS_FRAME;
+    if ((ret = frame_store(entry, cache, (i + 1) * COMPRESS_FRAME))) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+int compressed_write(dir_entry_t* entry, frame_cache_t* cache,
+                     uint32_t* offset, const char* buf, int n) {
+  int ret = 0;
+  if (*offset > entry->size) {
+    ret = fill_gap(entry, cache, *offset / COMPRESS_FRAME);
+  }
+
+  int bytes_written = 0;
+  while (ret == 0 && bytes_written < n) {
+    uint32_t i = *offset / COMPRESS_FRAME;
+    uint32_t in_frame = *offset % COMPRESS_FRAME;
+    if ((ret = frame_load(entry, cache, i))) {
+      break;
+    }
+    int chunk = MIN(COMPRESS_FRAME - in_frame, (uint32_t)(n - bytes_written));
+    memcpy(cache->data + in_frame, buf + bytes_written, chunk);
+    // As with any file, the write head becomes the end
+    uint32_t end = in_frame + chunk;
+    if (cache->length > end) {
+      memset(cache->data + end, 0, cache->length - end);
+    }
+    cache->length = end;
+    if ((ret = frame_store(entry, cache, *offset + chunk))) {
+      cache->index = FRAME_NONE;
+      break;
+    }
+    bytes_written += chunk;
+    *offset += chunk;
+  }
+  return ret ? ret : bytes_written;
+}
+
+// Plain chain -> frames, reading the old chain block by block
+static int compress_chain(dir_entry_t* entry, frame_cache_t* cache) {
+  dir_entry_t packed = *entry;
+  packed.size = 0;
+  set_entry_first_block(&packed, FAT_ENTRY_LAST);
+  memset(packed.inline_data, 0, INLINE_DATA_MAX);
+
+  uint32_t block = entry_first_block(entry);
+  int ret = 0;
+  for (uint32_t i = 0; ret == 0 && i < frame_count(entry); i++) {
+    uint32_t len = MIN(COMPRESS_FRAME, entry->size - i * COMPRESS_FRAME);
+    for (uint32_t done = 0; ret == 0 && done < len; block = fat_get(block)) {
+      uint32_t chunk = MIN(state.block_size, len - done);
+      ret = block == FAT_ENTRY_LAST
+                ? FS_IO_ERROR
+                : block_read(block, cache->data + done, chunk, 0);
+      done += chunk;
+    }
+    cache->index = i;
+    cache->length = len;
+    if (ret == 0) {
+      ret = frame_store(&packed, cache, i * COMPRESS_FRAME + len);
+    }
+  }
+  if (ret) {
+    fat_free_chain_deferred(entry_first_block(&packed));
+    return ret;
+  }
+  fat_free_chain_deferred(entry_first_block(entry));
+  *entry = packed;
+  entry->perm |= PERM_COMPRESSED;
+  return 0;
+}
+
+// Frames -> plain chain, allocated in one go
+static int decompress_chain(dir_entry_t* entry, frame_cache_t* cache) {
+  uint32_t first =
+      fat_alloc_chain((entry->size + state.block_size - 1) / state.block_size);
+  if (!first) {
+    return DISK_FULL;
+  }
+  uint32_t block = first;
+  int ret = 0;
+  for (uint32_t i = 0; ret == 0 && i < frame_count(entry); i++) {
+    ret = frame_load(entry, cache, i);
+    for (uint32_t done = 0; ret == 0 && done < cache->length;
+         block = fat_get(block)) {
+      uint32_t chunk = MIN(state.block_size, cache->length - done);
+      ret = block_write(block, cache->data + done, chunk, 0);
+      done += chunk;
+    }
+  }
+  if (ret) {
+    fat_free_chain_deferred(first);
+    return ret;
+  }
+  fat_free_chain_deferred(entry_first_block(entry));
+  set_entry_first_block(entry, first);
+  memset(entry->inline_data, 0, INLINE_DATA_MAX);  // no frames to count
+  entry->perm &= ~PERM_COMPRESSED;
+  return 0;
+}
+
+int compress_convert(dir_entry_t* entry, bool on) {
+  if (entry_is_inline(entry) || entry->size == 0) {
+    entry->perm = on ? entry->perm | PERM_COMPRESSED
+                     : entry->perm & ~PERM_COMPRESSED;
+    return 0;
+  }
+  frame_cache_t* cache = frame_cache_new();
+  if (!cache) {
+    return FS_MEMORY_ERROR;
+  }
+  int ret = on ? compress_chain(entry, cache) : decompress_chain(entry, cache);
+  free(cache);
+  return ret;
+}
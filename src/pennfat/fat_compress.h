@@ -0,0 +1,140 @@
+#ifndef FAT_COMPRESS_H
+#define FAT_COMPRESS_H
+
+#include "./pennfat_help.h"
+
+#define COMPRESS_FRAME 16384  // bytes of a file compressed together
+#define FRAME_NONE UINT32_MAX
+
+/**
+ * @brief Where a walk along the frames of a compressed file got to.
+ *
+ * Frames stored as is have no header, so the walk also keeps the last
+ * compressed frame it passed, whose header counts the frames stored as is
+ * right after it (before the first one, the entry counts them).
+ */
+typedef struct frame_walk_st {
+  uint32_t index;        // frame starting at block, FRAME_NONE to restart
+  uint32_t block;
+  uint32_t prev;         // last block of the frame before, 0 for the first
+  uint32_t owner;        // last compressed frame before index, or FRAME_NONE
+  uint32_t owner_block;  // its first block
+  uint32_t owner_prev;   // last block before it, 0 if it is the first frame
+  uint32_t run;          // frames stored as is after owner, as it counts them
+} frame_walk_t;
+
+/**
+ * @brief The frame of a compressed file that was last read or written,
+ * decompressed, and where the walk along its frames got to.
+ *
+ * A file with PERM_COMPRESSED set stores its contents in frames of
+ * COMPRESS_FRAME bytes (the last may be shorter), each compressed on its own
+ * and written to whole blocks of the chain behind a small header. A frame
+ * that would not save a block that way is stored as is, without a header,
+ * so the file never takes more blocks than it would plainly. Reaching byte n
+ * means walking the frames before it rather than the blocks, and a change
+ * rewrites only its frame, to new blocks. Every open descriptor of such a
+ * file has one of these.
+ */
+typedef struct frame_cache_st {
+  uint32_t index;   // frame held in data, FRAME_NONE if none
+  uint32_t length;  // bytes of the file in that frame
+  frame_walk_t walk;
+  uint8_t data[COMPRESS_FRAME];
+} frame_cache_t;
+
+/**
+ * @brief Allocate an empty frame cache.
+ *
+ * @return The cache, or NULL if out of memory.
+ */
+frame_cache_t* frame_cache_new();
+
+/**
+ * @brief Forget where the frames are, after the chain was moved.
+ *
+ * @param cache The file's cache.
+ */
+void frame_cache_moved(frame_cache_t* cache);
+
+/**
+ * @brief Compress with the built-in LZ77 coder (LZ4's sequence format:
+ * literal runs and back references of 4 bytes or more within 64 KB).
+ *
+ * @param src Bytes to compress.
+ * @param n Number of bytes.
+ * @param dst Receives the compressed bytes.
+ * @param cap Size of dst.
+ * @return Compressed length, or 0 if it does not fit in cap.
+ */
+int lz_compress(const uint8_t* src, int n, uint8_t* dst, int cap);
+
+/**
+ * @brief Undo lz_compress, checking every length against both buffers.
+ *
+ * @param src Compressed bytes.
+ * @param n Number of compressed bytes.
+ * @param dst Receives the original bytes.
+ * @param cap Size of dst.
+ * @return Length of the original, or -1 if src is damaged.
+ */
+int lz_decompress(const uint8_t* src, int n, uint8_t* dst, int cap);
+
+/**
+ * @brief Read from a compressed file through its frame cache.
+ *
+ * @param entry The file's entry.
+ * @param cache The file's cache.
+ * @param offset Where to start.
+ * @param buf Receives the bytes.
+ * @param n Bytes wanted.
+ * @return Bytes read (0 at the end), or FS_MEMORY_ERROR, FS_IO_ERROR or
+ * BAD_CHECKSUM.
+ */
+int compressed_read(const dir_entry_t* entry, frame_cache_t* cache,
+                    uint32_t offset, char* buf, int n);
+
+/**
+ * @brief Write to a compressed file; every frame touched is compressed and
+ * stored again before this returns.
+ *
+ * Like a write to any other file, the file ends after the last byte
+ * written. Frames skipped over by a write past the end are stored as zeros.
+ *
+ * @param entry The file's entry; its size and first block are updated.
+ * @param cache The file's cache.
+ * @param offset Where to start; moved past every frame's worth written, even
+ * if a later one fails.
+ * @param buf Bytes to write.
+ * @param n Number of bytes.
+ * @return Bytes written, or DISK_FULL, FS_MEMORY_ERROR, FS_IO_ERROR or
+ * BAD_CHECKSUM.
+ */
+int compressed_write(dir_entry_t* entry, frame_cache_t* cache,
+                     uint32_t* offset, const char* buf, int n);
+
+/**
+ * @brief Rewrite a file that has blocks as compressed frames, or back as
+ * plain blocks, and set or clear PERM_COMPRESSED.
+ *
+ * The new chain is written before the old one is freed. The caller makes
+ * sure the file is not open and writes the entry back.
+ *
+ * @param entry The file's entry, updated.
+ * @param on Compress (true) or decompress.
+ * @return 0 on success, DISK_FULL, FS_MEMORY_ERROR, FS_IO_ERROR or
+ * BAD_CHECKSUM.
+ */
+int compress_convert(dir_entry_t* entry, bool on);
+
+/**
+ * @brief Bytes of a compressed file held by the whole frames in the first
+ * blocks of its chain, for cutting a damaged chain short.
+ *
+ * @param entry The file's entry.
+ * @param blocks Blocks of the chain that are good.
+ * @return Bytes up to the end of the last frame that fits.
+ */
+uint32_t compressed_span(const dir_entry_t* entry, uint32_t blocks);
+
+#endif  // FAT_COMPRESS_H
@@ -0,0 +1,315 @@
+#include "./fat_csum.h"
+#include "./fat_dir.h"
+#include "./util/p_errno.h"
+
+#define CRC32C_POLY 0x82F63B78  // reversed Castagnoli polynomial
+#define SCRUB_BATCH 64          // blocks read between rate checks
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_update)(uint32_t crc, const uint8_t* p, size_t len);
+
+// The checksum region as mapped, from the page it starts in
+static uint8_t* csum_map;
+static size_t csum_map_size;
+
+// CRC32C
+
+static uint32_t crc_update_table(uint32_t crc, const uint8_t* p, size_t len) {
+  for (; len >= 8; len -= 8, p += 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+          crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+          crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+          crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+  }
+  for (; len > 0; len--) {
+    crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc_update_hw(
+    uint32_t crc, const uint8_t* p, size_t len) {
+  uint64_t crc64 = crc;
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, v);
+  }
+  crc = crc64;
+  for (; len > 0; len--) {
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+static void crc_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int t = 1; t < 8; t++) {
+      uint32_t prev = crc_table[t - 1][i];
+      crc_table[t][i] = crc_table[0][prev & 0xFF] ^ (prev >> 8);
+    }
+  }
+  crc_update = crc_update_table;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc_update = crc_update_hw;
+  }
+#endif
+}
+
+uint32_t crc32c(const void* buf, size_t len) {
+  pthread_once(&crc_once, crc_init);
+  return ~crc_update(~0u, buf, len);
+}
+
+// REGION
+
+size_t csum_region_size(off_t image_size, int block_size) {
+  return image_size / block_size * sizeof(uint32_t);
+}
+
+// Slot of data block b; the FAT blocks take the slots before block 1's
+static uint32_t* data_slot(uint32_t block) {
+  return &state.csums[state.fat_blocks + block - 1];
+}
+
+static bool data_block_valid(uint32_t block) {
+  return block >= 1 && block < state.fat_entries;
+}
+
+bool csum_fat_ok(uint32_t index) {
+  return !state.csums ||
+         crc32c((uint8_t*)state.fat + (size_t)index * state.block_size,
+                state.block_size) == state.csums[index];
+}
+
+int csum_init() {
+  uint32_t fat_entry_zero = state.fat32 ? ((uint32_t*)state.fat)[0]
+                                        : ((uint16_t*)state.fat)[0];
+  state.csums = NULL;
+  if (!(fat_entry_zero & FAT_HEADER_CSUM)) {
+    return 0;
+  }
+
+  // The region follows the last data block, which need not be page aligned
+  off_t image_size =
+      state.fat_size + (off_t)(state.fat_entries - 1) * state.block_size;
+  off_t page = sysconf(_SC_PAGESIZE);
+  off_t start = image_size / page * page;
+  csum_map_size =
+      image_size - start + csum_region_size(image_size, state.block_size);
+  csum_map = mmap(NULL, csum_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  state.fs_fd, start);
+  if (csum_map == MAP_FAILED) {
+    csum_map = NULL;
+    return -1;
+  }
+  state.csums = (uint32_t*)(csum_map + (image_size - start));
+
+  int bad = 0;
+  for (uint32_t i = 0; i < state.fat_blocks; i++) {
+    if (!csum_fat_ok(i)) {
+      k_print("mount: FAT block %u fails its checksum\n", i);
+      bad++;
+    }
+  }
+  return bad;
+}
+
+void csum_destroy() {
+  if (csum_map) {
+    msync(csum_map, csum_map_size, MS_SYNC);
+    munmap(csum_map, csum_map_size);
+  }
+  csum_map = NULL;
+  state.csums = NULL;
+}
+
+void csum_fat_stamp(uint32_t index) {
+  if (state.csums && !state.read_only) {
+    state.csums[index] =
+        crc32c((uint8_t*)state.fat + (size_t)index * state.block_size,
+               state.block_size);
+  }
+}
+
+void csum_fat_changed(uint32_t entry) {
+  uint32_t entry_size = state.fat32 ? sizeof(uint32_t) : sizeof(uint16_t);
+  csum_fat_stamp(entry * entry_size / state.block_size);
+}
+
+// BLOCKS
+
+int block_read(uint32_t block, void* buf, uint32_t len, uint32_t offset) {
+  if (!state.csums) {
+    return pread(state.fs_fd, buf, len, block_offset(block) + offset) == len
+               ? 0
+               : FS_IO_ERROR;
+  }
+  // Only a whole block can be checked
+  uint8_t whole[FAT_MAX_BLOCK_SIZE];
+  uint8_t* data = len == state.block_size ? buf : whole;
+  if (pread(state.fs_fd, data, state.block_size, block_offset(block)) !=
+      state.block_size) {
+    return FS_IO_ERROR;
+  }
+  if (data_block_valid(block) &&
+      crc32c(data, state.block_size) != *data_slot(block)) {
+    return BAD_CHECKSUM;
+  }
+  if (data == whole) {
+    memcpy(buf, whole + offset, len);
+  }
+  return 0;
+}
+
+int block_write(uint32_t block, const void* buf, uint32_t len,
+                uint32_t offset) {
+  if (pwrite(state.fs_fd, buf, len, block_offset(block) + offset) != len) {
+    return FS_IO_ERROR;
+  }
+  if (state.csums && data_block_valid(block)) {
+    if (len == state.block_size) {
+      *data_slot(block) = crc32c(buf, len);
+    } else {
+      block_restamp(block, 1);
+    }
+  }
+  return 0;
+}
+
+int block_check(uint32_t block, uint32_t count) {
+  uint8_t data[FAT_MAX_BLOCK_SIZE];
+  for (uint32_t i = 0; state.csums && i < count; i++) {
+    int ret = block_read(block + i, data, state.block_size, 0);
+    if (ret) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+void block_copied(uint32_t from, uint32_t to, uint32_t count) {
+  for (uint32_t i = 0; state.csums && i < count; i++) {
+    if (data_block_valid(from + i) && data_block_valid(to + i)) {
+      *data_slot(to + i) = *data_slot(from + i);
+    }
+  }
+}
+
+void block_restamp(uint32_t block, uint32_t count) {
+  uint8_t data[FAT_MAX_BLOCK_SIZE];
+  for (uint32_t i = 0; state.csums && i < count; i++) {
+    if (data_block_valid(block + i) &&
+        pread(state.fs_fd, data, state.block_size,
+              block_offset(block + i)) == state.block_size) {
+      *data_slot(block + i) = crc32c(data, state.block_size);
+    }
+  }
+}
+
+bool block_csum(uint32_t block, uint32_t* csum) {
+  if (!state.csums || !data_block_valid(block)) {
+    return false;
+  }
+  *csum = *data_slot(block);
+  return true;
+}
+
+// SCRUB
+
+// Check slot again with nothing writing to the image; data is scratch
+static bool scrub_recheck(uint32_t slot, uint8_t* data) {
+  fs_lock(&state.files_lock);
+  for (size_t i = 0; i < vec_len(&state.nodes); i++) {
+    fs_lock(&((file_node_t*)vec_get(&state.nodes, i))->lock);
+  }
+  dir_read_lock();
+  fs_lock(&state.fat_lock);
+
+  off_t offset = slot < state.fat_blocks
+                     ? (off_t)slot * state.block_size
+                     : block_offset(slot - state.fat_blocks + 1);
+  bool ok = slot < state.fat_blocks
+                ? csum_fat_ok(slot)
+                : pread(state.fs_fd, data, state.block_size, offset) ==
+                          state.block_size &&
+                      crc32c(data, state.block_size) == state.csums[slot];
+
+  fs_unlock(&state.fat_lock);
+  dir_unlock();
+  for (size_t i = vec_len(&state.nodes); i-- > 0;) {
+    fs_unlock(&((file_node_t*)vec_get(&state.nodes, i))->lock);
+  }
+  fs_unlock(&state.files_lock);
+  return ok;
+}
+
+static double scrub_elapsed(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int fat_scrub(unsigned kb_per_sec) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (!state.csums)
+    return INVALID_MODE;
+
+  uint8_t data[FAT_MAX_BLOCK_SIZE];
+  uint32_t slots = state.fat_blocks + state.fat_entries - 1;
+  uint32_t checked = 0, bad = 0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // A mounted snapshot's FAT is a copy that the checksums do not cover
+  for (uint32_t slot = state.read_only ? state.fat_blocks : 0; slot < slots;
+       slot++) {
+    bool fat_block = slot < state.fat_blocks;
+    uint32_t block = slot - state.fat_blocks + 1;
+    if (!fat_block && fat_get(block) == FAT_ENTRY_FREE &&
+        !fat_is_shared(block)) {
+      continue;
+    }
+    bool ok = fat_block ? csum_fat_ok(slot)
+                        : pread(state.fs_fd, data, state.block_size,
+                                block_offset(block)) == state.block_size &&
+                              crc32c(data, state.block_size) ==
+                                  state.csums[slot];
+    if (!ok && !scrub_recheck(slot, data)) {
+      if (bad++ < SCRUB_BAD_SHOWN) {
+        k_print("scrub: %s block %u fails its checksum\n",
+                fat_block ? "FAT" : "data", fat_block ? slot : block);
+      }
+    }
+
+    // Sleep off whatever is ahead of the rate
+    if (++checked % SCRUB_BATCH == 0 && kb_per_sec) {
+      double due = (double)checked * state.block_size / 1024 / kb_per_sec;
+      double ahead = due - scrub_elapsed(&start);
+      if (ahead > 0) {
+        usleep(ahead * 1e6);
+      }
+    }
+  }
+
+  double secs = scrub_elapsed(&start);
+  k_print("scrub: %u blocks (%.1f MB) checked in %.2f s, %u bad\n", checked,
+          (double)checked * state.block_size / 1048576, secs, bad);
+  return bad ? BAD_CHECKSUM : 0;
+}
@@ -0,0 +1,153 @@
+#ifndef FAT_CSUM_H
+#define FAT_CSUM_H
+
+#include "./pennfat_help.h"
+
+#define SCRUB_RATE_KB 16384  // default scrub rate, KB per second
+#define SCRUB_BAD_SHOWN 10   // bad blocks listed before they are counted
+
+/**
+ * @brief CRC32C (Castagnoli) of a buffer.
+ *
+ * Uses the CPU's crc32 instruction where there is one (SSE 4.2) and a
+ * slice-by-8 table otherwise; both give the same result.
+ *
+ * @param buf Bytes to checksum.
+ * @param len Number of bytes.
+ * @return The checksum.
+ */
+uint32_t crc32c(const void* buf, size_t len);
+
+/**
+ * @brief Bytes of the checksum region of an image of the given size.
+ *
+ * The region follows the last data block and holds one CRC32C for every
+ * block of the image in order: the FAT blocks, then data block 1 onwards.
+ * Images made before it existed have no region and no FAT_HEADER_CSUM flag,
+ * and are used without checksums.
+ *
+ * @param image_size Bytes of FAT and data region.
+ * @param block_size Block size.
+ * @return Size of the region.
+ */
+size_t csum_region_size(off_t image_size, int block_size);
+
+/**
+ * @brief Map the checksum region of the mounted image, if it has one, and
+ * check every FAT block against it.
+ *
+ * @return Number of FAT blocks that fail their checksum (reported on
+ * stdout), or -1 if the region could not be mapped.
+ */
+int csum_init();
+
+/**
+ * @brief Write the checksum region back and unmap it.
+ */
+void csum_destroy();
+
+/**
+ * @brief Recompute the checksum of the FAT block holding an entry; called
+ * by fat_set with fat_lock held.
+ *
+ * @param entry Index of the FAT entry that changed.
+ */
+void csum_fat_changed(uint32_t entry);
+
+/**
+ * @brief Set a FAT block's checksum to match what it holds now.
+ *
+ * @param index FAT block, from 0.
+ */
+void csum_fat_stamp(uint32_t index);
+
+/**
+ * @brief Whether a FAT block matches its checksum.
+ *
+ * @param index FAT block, from 0.
+ * @return true if it matches or the image has no checksums.
+ */
+bool csum_fat_ok(uint32_t index);
+
+/**
+ * @brief Read part of a data block and check the whole block against its
+ * checksum.
+ *
+ * @param block Data block.
+ * @param buf Receives the bytes.
+ * @param len Bytes to read.
+ * @param offset Where in the block to start.
+ * @return 0 on success, FS_IO_ERROR or BAD_CHECKSUM.
+ */
+int block_read(uint32_t block, void* buf, uint32_t len, uint32_t offset);
+
+/**
+ * @brief Write part of a data block and update its checksum.
+ *
+ * A write of the whole block checksums buf; anything less reads the block
+ * back to checksum all of it.
+ *
+ * @param block Data block.
+ * @param buf Bytes to write.
+ * @param len Number of bytes.
+ * @param offset Where in the block to start.
+ * @return 0 on success, or FS_IO_ERROR.
+ */
+int block_write(uint32_t block, const void* buf, uint32_t len,
+                uint32_t offset);
+
+/**
+ * @brief Check count consecutive data blocks against their checksums, for
+ * reads that go around block_read (such as sendfile).
+ *
+ * @param block First block.
+ * @param count Number of blocks.
+ * @return 0 if they all match, FS_IO_ERROR or BAD_CHECKSUM.
+ */
+int block_check(uint32_t block, uint32_t count);
+
+/**
+ * @brief Give count consecutive blocks the checksums of the blocks they
+ * were just copied from, so a copy made inside the host kernel needs no
+ * read and a bad source block stays bad.
+ *
+ * @param from First source block.
+ * @param to First copied block.
+ * @param count Number of blocks.
+ */
+void block_copied(uint32_t from, uint32_t to, uint32_t count);
+
+/**
+ * @brief Recompute the checksums of count consecutive blocks from what is
+ * on disk, after they were written without block_write.
+ *
+ * @param block First block.
+ * @param count Number of blocks.
+ */
+void block_restamp(uint32_t block, uint32_t count);
+
+/**
+ * @brief The checksum a data block is stored with, without reading it.
+ *
+ * @param block Data block.
+ * @param csum Receives the checksum.
+ * @return false if the image has no checksums.
+ */
+bool block_csum(uint32_t block, uint32_t* csum);
+
+/**
+ * @brief Check every block in use against its checksum, at most kb_per_sec
+ * kilobytes per second so other I/O keeps its share.
+ *
+ * FAT blocks and every allocated data block (or one a snapshot holds) are
+ * read and checked without holding any lock; a block that fails is checked
+ * again with every open file and the directories locked, so a write caught
+ * halfway is not reported. The first SCRUB_BAD_SHOWN bad blocks are listed.
+ *
+ * @param kb_per_sec Rate limit, 0 for none.
+ * @return 0 if every block matches, BAD_CHECKSUM if some do not, or
+ * INVALID_MODE if the image has no checksums.
+ */
+int fat_scrub(unsigned kb_per_sec);
+
+#endif  // FAT_CSUM_H
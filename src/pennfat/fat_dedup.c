@@ -0,0 +1,614 @@
+#include "./fat_dedup.h"
+#include "./fat_csum.h"
+#include "./util/p_errno.h"
+
+#define DEDUP_INDEX_MIN 1024  // index slots when the first block is stored
+#define DEDUP_RUN 16          // blocks converted per dedup_write
+
+// Slot of the index: a stored block and the CRC32C of its contents
+typedef struct {
+  uint32_t hash;
+  uint32_t block;  // 0 while the slot is empty
+} index_slot_t;
+
+// All under state.dedup_lock; allocated once the image has a deduplicated
+// file
+static uint32_t* refs;    // references from maps to each block
+static uint32_t* hashes;  // CRC32C of each stored block
+static index_slot_t* index_slots;  // open addressing, linear probing
+static uint32_t index_cap;
+static uint32_t index_used;
+
+static const uint8_t zeros[FAT_MAX_BLOCK_SIZE];
+
+static uint32_t slots_per_map() {
+  return state.block_size / sizeof(uint32_t);
+}
+
+// Blocks of a file of the given size, one map slot each
+static uint32_t file_slots(uint32_t size) {
+  return (size + state.block_size - 1) / state.block_size;
+}
+
+static bool stored_valid(uint32_t block) {
+  return block > ROOT_DIR_BLOCK && block < state.fat_entries;
+}
+
+uint32_t dedup_map_blocks(uint32_t size) {
+  return MAX(1, (file_slots(size) + slots_per_map() - 1) / slots_per_map());
+}
+
+map_cache_t* map_cache_new() {
+  map_cache_t* cache = malloc(sizeof(map_cache_t));
+  if (cache) {
+    map_cache_moved(cache);
+  }
+  return cache;
+}
+
+void map_cache_moved(map_cache_t* cache) {
+  cache->index = MAP_NONE;
+  cache->block = FAT_ENTRY_LAST;
+  cache->prev = 0;
+  cache->dirty = false;
+}
+
+// INDEX
+
+static int ensure_refs() {
+  if (!refs) {
+    refs = calloc(state.fat_entries, sizeof(uint32_t));
+    hashes = calloc(state.fat_entries, sizeof(uint32_t));
+    if (!refs || !hashes) {
+      free(refs);
+      free(hashes);
+      refs = hashes = NULL;
+      return FS_MEMORY_ERROR;
+    }
+  }
+  return 0;
+}
+
+static void index_put(index_slot_t* slots, uint32_t cap, uint32_t hash,
+                      uint32_t block) {
+  uint32_t i = hash & (cap - 1);
+  while (slots[i].block) {
+    i = (i + 1) & (cap - 1);
+  }
+  slots[i] = (index_slot_t){.hash = hash, .block = block};
+}
+
+// Doubles the table before it is half full
+static int index_insert(uint32_t hash, uint32_t block) {
+  if (2 * (index_used + 1) > index_cap) {
+    uint32_t cap = index_cap ? 2 * index_cap : DEDUP_INDEX_MIN;
+    index_slot_t* grown = calloc(cap, sizeof(index_slot_t));
+    if (!grown) {
+      return FS_MEMORY_ERROR;
+    }
+    for (uint32_t i = 0; i < index_cap; i++) {
+      if (index_slots[i].block) {
+        index_put(grown, cap, index_slots[i].hash, index_slots[i].block);
+      }
+    }
+    free(index_slots);
+    index_slots = grown;
+    index_cap = cap;
+  }
+  index_put(index_slots, index_cap, hash, block);
+  index_used++;
+  return 0;
+}
+
+// Shifts back whatever follows the hole, so no probe stops short of it
+static void index_remove(uint32_t hash, uint32_t block) {
+  uint32_t mask = index_cap - 1;
+  uint32_t i = hash & mask;
+  while (index_cap && index_slots[i].block && index_slots[i].block != block) {
+    i = (i + 1) & mask;
+  }
+  if (!index_cap || !index_slots[i].block) {
+    return;
+  }
+  index_slots[i].block = 0;
+  index_used--;
+  for (uint32_t j = (i + 1) & mask; index_slots[j].block; j = (j + 1) & mask) {
+    uint32_t home = index_slots[j].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      index_slots[i] = index_slots[j];
+      index_slots[j].block = 0;
+      i = j;
+    }
+  }
+}
+
+// A stored block holding exactly data, or 0; a hash match is only a hint
+static uint32_t index_find(uint32_t hash, const uint8_t* data) {
+  uint8_t stored[FAT_MAX_BLOCK_SIZE];
+  uint32_t mask = index_cap - 1;
+  for (uint32_t i = hash & mask; index_cap && index_slots[i].block;
+       i = (i + 1) & mask) {
+    if (index_slots[i].hash == hash &&
+        block_read(index_slots[i].block, stored, state.block_size, 0) == 0 &&
+        memcmp(stored, data, state.block_size) == 0) {
+      return index_slots[i].block;
+    }
+  }
+  return 0;
+}
+
+// Give *block a reference to a stored copy of data, storing it unless the
+// index has one; blocks of zeros take none and are 0
+static int data_store(const uint8_t* data, uint32_t* block) {
+  *block = 0;
+  if (memcmp(data, zeros, state.block_size) == 0) {
+    return 0;
+  }
+  uint32_t hash = crc32c(data, state.block_size);
+  fs_lock(&state.dedup_lock);
+  int ret = ensure_refs();
+  uint32_t found = ret ? 0 : index_find(hash, data);
+  if (found) {
+    refs[found]++;
+  }
+  fs_unlock(&state.dedup_lock);
+  if (ret || found) {
+    *block = found;
+    return ret;
+  }
+
+  // New contents are written before the index can hand them out
+  uint32_t fresh = fat_alloc_block();
+  if (!fresh) {
+    return DISK_FULL;
+  }
+  if ((ret = block_write(fresh, data, state.block_size, 0))) {
+    fat_set(fresh, FAT_ENTRY_FREE);
+    return ret;
+  }
+  fs_lock(&state.dedup_lock);
+  refs[fresh] = 1;
+  hashes[fresh] = hash;
+  index_insert(hash, fresh);  // left out if it cannot grow, so never shared
+  fs_unlock(&state.dedup_lock);
+  *block = fresh;
+  return 0;
+}
+
+// Drop a reference; the last one frees the block
+static void data_release(uint32_t block) {
+  if (!stored_valid(block)) {
+    return;
+  }
+  fs_lock(&state.dedup_lock);
+  bool last = refs && refs[block] && --refs[block] == 0;
+  if (last) {
+    index_remove(hashes[block], block);
+  }
+  fs_unlock(&state.dedup_lock);
+  if (last) {
+    fat_free_chain_deferred(block);
+  }
+}
+
+// MAPS
+
+int dedup_for_each(const dir_entry_t* entry, uint32_t max_blocks,
+                   int (*fn)(uint32_t* slot, void* arg), void* arg) {
+  if (entry_is_inline(entry)) {
+    return 0;
+  }
+  uint32_t per_map = slots_per_map();
+  uint32_t slots = file_slots(entry->size);
+  uint32_t map[FAT_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+  uint32_t block = entry_first_block(entry);
+  for (uint32_t k = 0; k < max_blocks && k * per_map < slots; k++) {
+    if (block == FAT_ENTRY_LAST || block == FAT_ENTRY_FREE ||
+        block >= state.fat_entries) {
+      return FS_IO_ERROR;
+    }
+    int ret = block_read(block, map, state.block_size, 0);
+    bool changed = false;
+    for (uint32_t s = 0; ret == 0 && s < per_map && k * per_map + s < slots;
+         s++) {
+      ret = fn(&map[s], arg);
+      changed |= ret > 0;
+      ret = MIN(ret, 0);
+    }
+    if (ret == 0 && changed) {
+      ret = block_write(block, map, state.block_size, 0);
+    }
+    if (ret) {
+      return ret;
+    }
+    block = fat_get(block);
+  }
+  return 0;
+}
+
+// dedup_for_each callback for dedup_release
+static int release_slot(uint32_t* slot, void* arg) {
+  data_release(*slot);
+  return 0;
+}
+
+void dedup_release(const dir_entry_t* entry) {
+  dedup_for_each(entry, UINT32_MAX, release_slot, NULL);
+}
+
+// dedup_for_each callback for dedup_share and dedup_load
+static int add_ref(uint32_t* slot, void* arg) {
+  if (!stored_valid(*slot)) {
+    return 0;
+  }
+  fs_lock(&state.dedup_lock);
+  int ret = ensure_refs();
+  if (ret == 0) {
+    refs[*slot]++;
+  }
+  fs_unlock(&state.dedup_lock);
+  return ret;
+}
+
+int dedup_share(const dir_entry_t* entry) {
+  return dedup_for_each(entry, UINT32_MAX, add_ref, NULL);
+}
+
+// dir_iterate callback for dedup_load; a map that cannot be read is left
+// for fsck
+static int load_entry(const dir_entry_t* entry, void* arg) {
+  if (entry->type == FT_DIRECTORY) {
+    return dir_iterate(entry_first_block(entry), load_entry, arg);
+  }
+  if (entry->type == FT_REGULAR && (entry->perm & PERM_DEDUP)) {
+    int ret = dedup_for_each(entry, UINT32_MAX, add_ref, NULL);
+    return ret == FS_MEMORY_ERROR ? ret : 0;
+  }
+  return 0;
+}
+
+int dedup_load() {
+  dedup_destroy();
+  int ret = dir_iterate(state.root, load_entry, NULL);
+  uint8_t data[FAT_MAX_BLOCK_SIZE];
+  fs_lock(&state.dedup_lock);
+  for (uint32_t b = 2; ret == 0 && refs && b < state.fat_entries; b++) {
+    if (!refs[b]) {
+      continue;
+    }
+    // The checksum region already has every block's CRC32C
+    if (!block_csum(b, &hashes[b])) {
+      if (block_read(b, data, state.block_size, 0)) {
+        continue;  // never shared, so never read for a match either
+      }
+      hashes[b] = crc32c(data, state.block_size);
+    }
+    ret = index_insert(hashes[b], b);
+  }
+  fs_unlock(&state.dedup_lock);
+  return ret;
+}
+
+void dedup_destroy() {
+  fs_lock(&state.dedup_lock);
+  free(refs);
+  free(hashes);
+  free(index_slots);
+  refs = hashes = NULL;
+  index_slots = NULL;
+  index_cap = index_used = 0;
+  fs_unlock(&state.dedup_lock);
+}
+
+// Make map block k the cached one; the cache must be clean
+static int map_load(const dir_entry_t* entry, map_cache_t* cache,
+                    uint32_t k) {
+  if (cache->index == k) {
+    return 0;
+  }
+  uint32_t i = 0;
+  uint32_t block = entry_first_block(entry);
+  uint32_t prev = 0;
+  if (cache->index != MAP_NONE && cache->index < k) {
+    i = cache->index;
+    block = cache->block;
+    prev = cache->prev;
+  }
+  cache->index = MAP_NONE;
+  for (; i < k && block != FAT_ENTRY_LAST && block != FAT_ENTRY_FREE; i++) {
+    prev = block;
+    block = fat_get(block);
+  }
+  if (block == FAT_ENTRY_LAST || block == FAT_ENTRY_FREE) {
+    return FS_IO_ERROR;  // the map ends before the file does
+  }
+  int ret = block_read(block, cache->slots, state.block_size, 0);
+  if (ret == 0) {
+    cache->index = k;
+    cache->block = block;
+    cache->prev = prev;
+  }
+  return ret;
+}
+
+// Write the cached map block back, onto a copy if a snapshot holds it
+static int map_flush(dir_entry_t* entry, map_cache_t* cache) {
+  if (!cache->dirty) {
+    return 0;
+  }
+  uint32_t block = cache->block;
+  if (!fat_is_shared(block)) {
+    int ret = block_write(block, cache->slots, state.block_size, 0);
+    cache->dirty = ret != 0;
+    return ret;
+  }
+  uint32_t copy = fat_alloc_block();
+  if (!copy) {
+    return DISK_FULL;
+  }
+  int ret = block_write(copy, cache->slots, state.block_size, 0);
+  if (ret) {
+    fat_set(copy, FAT_ENTRY_FREE);
+    return ret;
+  }
+  fat_set(copy, fat_get(block));
+  if (cache->prev) {
+    fat_set(cache->prev, copy);
+  } else {
+    set_entry_first_block(entry, copy);
+  }
+  fat_set(block, FAT_ENTRY_FREE);  // stays allocated to the snapshot
+  cache->block = copy;
+  cache->dirty = false;
+  return 0;
+}
+
+// map_load for a write: the cached block is written back first
+static int map_reach(dir_entry_t* entry, map_cache_t* cache, uint32_t k) {
+  if (cache->index == k) {
+    return 0;
+  }
+  int ret = map_flush(entry, cache);
+  return ret ? ret : map_load(entry, cache, k);
+}
+
+// Add map blocks of holes until the map has `blocks` of them; the map has
+// as many as its size calls for
+static int map_grow(dir_entry_t* entry, map_cache_t* cache, uint32_t blocks) {
+  uint32_t have = entry_is_inline(entry) ? 0 : dedup_map_blocks(entry->size);
+  uint32_t last = 0;
+  if (have >= blocks) {
+    return 0;
+  }
+  if (have) {
+    int ret = map_reach(entry, cache, have - 1);
+    if (ret) {
+      return ret;
+    }
+    last = cache->block;
+  }
+  for (; have < blocks; have++) {
+    uint32_t block = fat_alloc_block();
+    if (!block) {
+      return DISK_FULL;
+    }
+    int ret = block_write(block, zeros, state.block_size, 0);
+    if (ret) {
+      fat_set(block, FAT_ENTRY_FREE);
+      return ret;
+    }
+    if (last) {
+      fat_set(last, block);
+    } else {
+      set_entry_first_block(entry, block);
+    }
+    last = block;
+  }
+  return 0;
+}
+
+// Drop the blocks of a file that was old_size bytes long past its end now,
+// and the map blocks it no longer needs, then write the map back
+static int map_trim(dir_entry_t* entry, map_cache_t* cache,
+                    uint32_t old_size) {
+  uint32_t per_map = slots_per_map();
+  uint32_t keep = dedup_map_blocks(entry->size);
+  int ret = 0;
+  for (uint32_t i = file_slots(entry->size);
+       ret == 0 && i < file_slots(old_size); i++) {
+    if ((ret = map_reach(entry, cache, i / per_map)) == 0) {
+      data_release(cache->slots[i % per_map]);
+      cache->slots[i % per_map] = 0;
+      // Map blocks about to be cut off need not be written
+      cache->dirty |= i / per_map < keep;
+    }
+  }
+  if (ret == 0 && !entry_is_inline(entry) &&
+      (ret = map_reach(entry, cache, keep - 1)) == 0) {
+    uint32_t rest = fat_get(cache->block);
+    if (rest != FAT_ENTRY_LAST) {
+      fat_set(cache->block, FAT_ENTRY_LAST);
+      fat_free_chain_deferred(rest);
+    }
+  }
+  int flushed = map_flush(entry, cache);
+  return ret ? ret : flushed;
+}
+
+int dedup_read(const dir_entry_t* entry, map_cache_t* cache, uint32_t offset,
+               char* buf, int n) {
+  uint32_t per_map = slots_per_map();
+  int bytes_read = 0;
+  while (bytes_read < n && offset < entry->size) {
+    uint32_t i = offset / state.block_size;
+    uint32_t in_block = offset % state.block_size;
+    uint32_t chunk = MIN(MIN(state.block_size - in_block,
+                             (uint32_t)(n - bytes_read)),
+                         entry->size - offset);
+    int ret = map_load(entry, cache, i / per_map);
+    uint32_t block = ret ? 0 : cache->slots[i % per_map];
+    if (ret == 0 && block && !stored_valid(block)) {
+      ret = FS_IO_ERROR;
+    }
+    if (ret == 0 && block) {
+      ret = block_read(block, buf + bytes_read, chunk, in_block);
+    } else if (ret == 0) {
+      memset(buf + bytes_read, 0, chunk);
+    }
+    if (ret) {
+      return ret;
+    }
+    bytes_read += chunk;
+    offset += chunk;
+  }
+  return bytes_read;
+}
+
+int dedup_write(dir_entry_t* entry, map_cache_t* cache, uint32_t* offset,
+                const char* buf, int n) {
+  uint32_t per_map = slots_per_map();
+  uint32_t old_size = entry->size;
+  uint8_t data[FAT_MAX_BLOCK_SIZE];
+  int ret = 0;
+
+  // An inline file's bytes become its first block
+  if (entry_is_inline(entry)) {
+    uint32_t block;
+    memset(data, 0, state.block_size);
+    memcpy(data, entry->inline_data, MIN(entry->size, INLINE_DATA_MAX));
+    if ((ret = data_store(data, &block)) == 0 &&
+        (ret = map_grow(entry, cache, 1)) == 0 &&
+        (ret = map_reach(entry, cache, 0)) == 0) {
+      cache->slots[0] = block;
+      cache->dirty = true;
+      memset(entry->inline_data, 0, INLINE_DATA_MAX);
+    } else {
+      data_release(block);
+      return ret;
+    }
+  }
+  ret = map_grow(entry, cache, dedup_map_blocks(*offset + n));
+
+  int bytes_written = 0;
+  while (ret == 0 && bytes_written < n) {
+    uint32_t i = *offset / state.block_size;
+    uint32_t in_block = *offset % state.block_size;
+    uint32_t chunk = MIN(state.block_size - in_block,
+                         (uint32_t)(n - bytes_written));
+    if ((ret = map_reach(entry, cache, i / per_map))) {
+      break;
+    }
+    uint32_t* slot = &cache->slots[i % per_map];
+    uint32_t old = *slot;
+
+    // Bytes before the write that are in the file stay; whatever follows it
+    // is past the new end, so zeros
+    uint32_t start = i * state.block_size;
+    uint32_t keep = MIN(in_block, entry->size > start ? entry->size - start
+                                                      : 0);
+    memset(data, 0, state.block_size);
+    if (keep && old && (ret = block_read(old, data, keep, 0))) {
+      break;
+    }
+    memcpy(data + in_block, buf + bytes_written, chunk);
+    uint32_t block;
+    if ((ret = data_store(data, &block))) {
+      break;
+    }
+    *slot = block;
+    cache->dirty = true;
+    data_release(old);
+
+    bytes_written += chunk;
+    *offset += chunk;
+    // As with any file, the write head becomes the end
+    entry->size = *offset;
+  }
+
+  int trimmed = map_trim(entry, cache, MAX(old_size, entry->size));
+  ret = ret ? ret : trimmed;
+  return ret ? ret : bytes_written;
+}
+
+// Plain chain -> map, a run of blocks per dedup_write
+static int dedup_chain(dir_entry_t* entry, map_cache_t* cache) {
+  dir_entry_t mapped = *entry;
+  mapped.size = 0;
+  set_entry_first_block(&mapped, FAT_ENTRY_LAST);
+  memset(mapped.inline_data, 0, INLINE_DATA_MAX);
+
+  uint32_t run = DEDUP_RUN * state.block_size;
+  uint8_t* buf = malloc(run);
+  int ret = buf ? 0 : FS_MEMORY_ERROR;
+  uint32_t block = entry_first_block(entry);
+  for (uint32_t offset = 0; ret == 0 && offset < entry->size;) {
+    uint32_t len = MIN(run, entry->size - offset);
+    for (uint32_t done = 0; ret == 0 && done < len;
+         done += state.block_size, block = fat_get(block)) {
+      ret = block == FAT_ENTRY_LAST
+                ? FS_IO_ERROR
+                : block_read(block, buf + done,
+                             MIN(state.block_size, len - done), 0);
+    }
+    if (ret == 0) {
+      int n = dedup_write(&mapped, cache, &offset, (char*)buf, len);
+      ret = MIN(n, 0);
+    }
+  }
+  free(buf);
+  if (ret) {
+    dedup_release(&mapped);
+    fat_free_chain_deferred(entry_first_block(&mapped));
+    return ret;
+  }
+  fat_free_chain_deferred(entry_first_block(entry));
+  *entry = mapped;
+  entry->perm |= PERM_DEDUP;
+  return 0;
+}
+
+// Map -> plain chain, allocated in one go
+static int undedup_chain(dir_entry_t* entry, map_cache_t* cache) {
+  uint32_t count = file_slots(entry->size);
+  uint32_t first = count ? fat_alloc_chain(count) : FAT_ENTRY_LAST;
+  if (!first) {
+    return DISK_FULL;
+  }
+  uint8_t data[FAT_MAX_BLOCK_SIZE];
+  uint32_t block = first;
+  int ret = 0;
+  for (uint32_t i = 0; ret == 0 && i < count; i++, block = fat_get(block)) {
+    ret = map_load(entry, cache, i / slots_per_map());
+    uint32_t stored = ret ? 0 : cache->slots[i % slots_per_map()];
+    memset(data, 0, state.block_size);
+    if (ret == 0 && stored) {
+      ret = block_read(stored, data, state.block_size, 0);
+    }
+    if (ret == 0) {
+      ret = block_write(block, data, state.block_size, 0);
+    }
+  }
+  if (ret) {
+    fat_free_chain_deferred(first);
+    return ret;
+  }
+  dedup_release(entry);
+  fat_free_chain_deferred(entry_first_block(entry));
+  set_entry_first_block(entry, first);
+  entry->perm &= ~PERM_DEDUP;
+  return 0;
+}
+
+int dedup_convert(dir_entry_t* entry, bool on) {
+  if (entry_is_inline(entry)) {
+    entry->perm = on ? entry->perm | PERM_DEDUP : entry->perm & ~PERM_DEDUP;
+    return 0;
+  }
+  map_cache_t* cache = map_cache_new();
+  if (!cache) {
+    return FS_MEMORY_ERROR;
+  }
+  int ret = on ? dedup_chain(entry, cache) : undedup_chain(entry, cache);
+  free(cache);
+  return ret;
+}
@@ -0,0 +1,147 @@
+#ifndef FAT_DEDUP_H
+#define FAT_DEDUP_H
+
+#include "./fat_dir.h"
+#include "./pennfat_help.h"
+
+#define MAP_NONE UINT32_MAX
+
+/**
+ * @brief The block of a deduplicated file's map that was last used, and
+ * where it sits in the map's chain.
+ *
+ * A file with PERM_DEDUP set does not keep its bytes on its chain. The
+ * chain holds its map instead: one block number per block of the file, 0
+ * for a block of zeros. The blocks the map points at are each allocated on
+ * their own (FAT_ENTRY_LAST), are shared by every deduplicated file with
+ * the same contents in that block, and are never written again once
+ * stored: a write stores the new contents (or finds them already stored)
+ * and moves the map over. Every open descriptor of such a file has one of
+ * these, written back before each write returns.
+ */
+typedef struct map_cache_st {
+  uint32_t index;  // map block held in slots, MAP_NONE if none
+  uint32_t block;  // where it is stored
+  uint32_t prev;   // map block before it, 0 for the first
+  bool dirty;      // slots changed since it was read
+  uint32_t slots[FAT_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+} map_cache_t;
+
+/**
+ * @brief Allocate an empty map cache.
+ *
+ * @return The cache, or NULL if out of memory.
+ */
+map_cache_t* map_cache_new();
+
+/**
+ * @brief Forget the cached map block, after the map's chain was moved or
+ * replaced.
+ *
+ * @param cache The file's cache.
+ */
+void map_cache_moved(map_cache_t* cache);
+
+/**
+ * @brief Blocks of map a deduplicated file of the given size has.
+ *
+ * @param size Size of the file.
+ * @return Length of its chain, at least 1.
+ */
+uint32_t dedup_map_blocks(uint32_t size);
+
+/**
+ * @brief Count the references to every stored block and index them by
+ * contents; called by pmount and again after a rollback or repair.
+ *
+ * Walks every deduplicated file under the root directory. The index is
+ * keyed by each block's CRC32C, taken from the checksum region when the
+ * image has one and read from the block otherwise.
+ *
+ * @return 0 on success, FS_MEMORY_ERROR or a read error.
+ */
+int dedup_load();
+
+/**
+ * @brief Free the reference counts and the index; called by punmount.
+ */
+void dedup_destroy();
+
+/**
+ * @brief Call fn for every slot of a deduplicated file's map that lies
+ * within the file, writing back each map block where fn changed a slot.
+ *
+ * @param entry The file's entry.
+ * @param max_blocks Map blocks to walk at most, for a damaged chain.
+ * @param fn Called with the slot; returns 1 if it changed it, 0 if not, or
+ * a negative error code to stop.
+ * @param arg Passed to fn.
+ * @return 0 on success, or fn's error or a read or write error.
+ */
+int dedup_for_each(const dir_entry_t* entry, uint32_t max_blocks,
+                   int (*fn)(uint32_t* slot, void* arg), void* arg);
+
+/**
+ * @brief Drop the file's references to its stored blocks, freeing those
+ * nobody else uses. The caller frees the map's chain.
+ *
+ * @param entry The file's entry.
+ */
+void dedup_release(const dir_entry_t* entry);
+
+/**
+ * @brief Add a reference to every stored block of a map that was just
+ * copied, so the copy shares them.
+ *
+ * @param entry Entry of the copy.
+ * @return 0 on success, or a read error.
+ */
+int dedup_share(const dir_entry_t* entry);
+
+/**
+ * @brief Read from a deduplicated file through its map cache.
+ *
+ * @param entry The file's entry.
+ * @param cache The file's cache.
+ * @param offset Where to start.
+ * @param buf Receives the bytes.
+ * @param n Bytes wanted.
+ * @return Bytes read (0 at the end), or FS_IO_ERROR or BAD_CHECKSUM.
+ */
+int dedup_read(const dir_entry_t* entry, map_cache_t* cache, uint32_t offset,
+               char* buf, int n);
+
+/**
+ * @brief Write to a deduplicated file.
+ *
+ * Every block written is hashed and looked up in the index; a block with
+ * the same contents is shared instead of storing another. Like a write to
+ * any other file, the file ends after the last byte written, and blocks
+ * skipped over by a write past the end read as zeros.
+ *
+ * @param entry The file's entry; its size and first block are updated.
+ * @param cache The file's cache.
+ * @param offset Where to start; moved past every block written, even if a
+ * later one fails.
+ * @param buf Bytes to write.
+ * @param n Number of bytes.
+ * @return Bytes written, or DISK_FULL, FS_IO_ERROR or BAD_CHECKSUM.
+ */
+int dedup_write(dir_entry_t* entry, map_cache_t* cache, uint32_t* offset,
+                const char* buf, int n);
+
+/**
+ * @brief Rewrite a file as a map of shared blocks, or back onto a plain
+ * chain, and set or clear PERM_DEDUP.
+ *
+ * The new blocks are written before the old ones are freed. The caller
+ * makes sure the file is not open and writes the entry back.
+ *
+ * @param entry The file's entry, updated.
+ * @param on Deduplicate (true) or store plainly.
+ * @return 0 on success, DISK_FULL, FS_MEMORY_ERROR, FS_IO_ERROR or
+ * BAD_CHECKSUM.
+ */
+int dedup_convert(dir_entry_t* entry, bool on);
+
+#endif  // FAT_DEDUP_H
@@ -0,0 +1,229 @@
+#include "./fat_defrag.h"
+#include "./fat_dir.h"
+#include "./kernel/kfat_helper.h"
+#include "./util/p_errno.h"
+
+#define DEFRAG_PATH_MAX 256
+#define DEFRAG_READ_CHUNK 65536
+#define DEFRAG_READ_REPEAT 5  // cold reads per timing; the median counts
+
+// A file found by the walk
+typedef struct {
+  uint32_t dir;
+  char name[MAX_FILENAME_LEN];
+  char path[DEFRAG_PATH_MAX];
+} defrag_file_t;
+
+// Where the walk is, for collect
+typedef struct {
+  Vec* files;
+  Vec* dirs;  // blocks of every directory
+  uint32_t dir;
+  const char* path;
+} defrag_walk_t;
+
+typedef struct {
+  uint32_t files;
+  uint32_t blocks;
+  uint32_t runs;  // runs of consecutive blocks
+} frag_stats_t;
+
+// dir_iterate callback listing files and directories under a directory
+static int collect(const dir_entry_t* entry, void* arg) {
+  defrag_walk_t* walk = arg;
+  char path[DEFRAG_PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", walk->path, entry->name);
+  if (entry->type == FT_DIRECTORY) {
+    defrag_walk_t sub = *walk;
+    sub.dir = entry_first_block(entry);
+    sub.path = path;
+    vec_push_back(walk->dirs, (ptr_t)(uintptr_t)sub.dir);
+    return dir_iterate(sub.dir, collect, &sub);
+  }
+  defrag_file_t* file = malloc(sizeof(defrag_file_t));
+  if (!file) {
+    return FS_MEMORY_ERROR;
+  }
+  file->dir = walk->dir;
+  strcpy(file->name, entry->name);
+  strcpy(file->path, path);
+  vec_push_back(walk->files, file);
+  return 0;
+}
+
+// Runs of consecutive blocks in a chain, and its blocks
+static uint32_t chain_runs(const dir_entry_t* entry, uint32_t* blocks) {
+  uint32_t runs = 0;
+  uint32_t prev = 0;
+  *blocks = 0;
+  for (uint32_t b = entry_first_block(entry); b != FAT_ENTRY_LAST;
+       prev = b, b = fat_get(b)) {
+    (*blocks)++;
+    runs += b != prev + 1;
+  }
+  return runs;
+}
+
+static void measure(Vec* files, frag_stats_t* stats) {
+  *stats = (frag_stats_t){0};
+  for (size_t i = 0; i < vec_len(files); i++) {
+    defrag_file_t* file = vec_get(files, i);
+    dir_entry_t entry;
+    if (dir_lookup(file->dir, file->name, &entry) || entry_is_inline(&entry)) {
+      continue;
+    }
+    uint32_t blocks;
+    stats->files++;
+    stats->runs += chain_runs(&entry, &blocks);
+    stats->blocks += blocks;
+  }
+}
+
+static void print_stats(const char* when, const frag_stats_t* stats) {
+  // Links between blocks that do not go to the next one
+  uint32_t links = stats->blocks - stats->files;
+  k_print("defrag: %s: %u files, %u blocks in %u runs, %.1f%% fragmented\n",
+          when, stats->files, stats->blocks, stats->runs,
+          links ? 100.0 * (stats->runs - stats->files) / links : 0.0);
+}
+
+// Drop the file's blocks, and only those, from the page cache
+static void drop_cached(const dir_entry_t* entry) {
+  uint32_t run = entry_first_block(entry);
+  while (run != FAT_ENTRY_LAST) {
+    uint32_t last = run;
+    uint32_t next;
+    while ((next = fat_get(last)) == last + 1) {
+      last = next;
+    }
+    posix_fadvise(state.fs_fd, block_offset(run),
+                  (off_t)(last - run + 1) * state.block_size,
+                  POSIX_FADV_DONTNEED);
+    run = next;
+  }
+}
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Seconds to read a file from start to end out of the page cache, the
+// median of DEFRAG_READ_REPEAT reads, and its bytes. Reads sleep pause_us
+// between chunks like the moves do; the sleeps are not timed.
+static double read_time(const defrag_file_t* file, char* buf,
+                        unsigned pause_us, uint64_t* bytes) {
+  double times[DEFRAG_READ_REPEAT];
+  dir_entry_t entry;
+  if (dir_lookup(file->dir, file->name, &entry)) {
+    return 0;
+  }
+  fsync(state.fs_fd);  // dirty pages would stay cached
+  for (int r = 0; r < DEFRAG_READ_REPEAT; r++) {
+    drop_cached(&entry);
+    int fd = k_open(file->path, F_READ);
+    if (fd < 0) {
+      return 0;
+    }
+    times[r] = 0;
+    *bytes = 0;
+    while (true) {
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      int n = k_read(fd, DEFRAG_READ_CHUNK, buf);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      times[r] +=
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+      if (n <= 0) {
+        break;
+      }
+      *bytes += n;
+      if (pause_us) {
+        usleep(pause_us);
+      }
+    }
+    k_close(fd);
+  }
+  qsort(times, DEFRAG_READ_REPEAT, sizeof(double), compare_double);
+  return times[DEFRAG_READ_REPEAT / 2];
+}
+
+int fat_defrag(unsigned pause_us) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
+
+  Vec files = vec_new(64, free);
+  Vec dirs = vec_new(16, NULL);
+  vec_push_back(&dirs, (ptr_t)(uintptr_t)state.root);
+  defrag_walk_t walk = {.files = &files, .dirs = &dirs, .dir = state.root,
+                        .path = ""};
+  int ret = dir_iterate(state.root, collect, &walk);
+
+  frag_stats_t before, after;
+  measure(&files, &before);
+  print_stats("before", &before);
+
+  int nodes = 0;
+  for (size_t i = 0; i < vec_len(&dirs) && ret == 0; i++) {
+    int freed;
+    ret = dir_compact((uintptr_t)vec_get(&dirs, i), &freed);
+    nodes += freed;
+  }
+
+  // Fragmented files are timed before and after they move, so the speedup
+  // is over the same files and only those
+  char* buf = malloc(DEFRAG_READ_CHUNK);
+  if (!buf && ret == 0) {
+    ret = FS_MEMORY_ERROR;
+  }
+  int moved = 0;
+  int no_room = 0;
+  uint64_t moved_bytes = 0;
+  double secs_before = 0, secs_after = 0;
+  for (size_t i = 0; i < vec_len(&files) && ret == 0; i++) {
+    defrag_file_t* file = vec_get(&files, i);
+    dir_entry_t entry;
+    uint32_t blocks;
+    uint64_t bytes = 0;
+    double t_before = 0;
+    if (dir_lookup(file->dir, file->name, &entry) == 0 &&
+        !entry_is_inline(&entry) && chain_runs(&entry, &blocks) > 1) {
+      t_before = read_time(file, buf, pause_us, &bytes);
+    }
+    int r = k_relocate(file->dir, file->name, DEFRAG_STEP, pause_us);
+    if (r == DISK_FULL) {
+      no_room++;
+    } else if (r < 0 && r != FILE_NOT_FOUND) {
+      ret = r;  // removed since the walk is fine, anything else is not
+    } else if (r > 0) {
+      moved++;
+      uint64_t bytes_after = 0;
+      double t_after =
+          t_before > 0 ? read_time(file, buf, pause_us, &bytes_after) : 0;
+      if (t_after > 0 && bytes_after == bytes) {
+        moved_bytes += bytes;
+        secs_before += t_before;
+        secs_after += t_after;
+      }
+    }
+  }
+  free(buf);
+  k_print("defrag: moved %d files (%d without a free run), freed %d "
+          "directory nodes\n", moved, no_room, nodes);
+
+  measure(&files, &after);
+  print_stats("after", &after);
+  if (ret == 0 && moved_bytes > 0) {
+    double mb = moved_bytes / 1048576.0;
+    k_print("defrag: moved files read %.1f -> %.1f MB/s (%.2fx)\n",
+            mb / secs_before, mb / secs_after, secs_before / secs_after);
+  }
+
+  msync(state.fat, state.fat_size, MS_SYNC);
+  fsync(state.fs_fd);
+  vec_destroy(&files);
+  vec_destroy(&dirs);
+  return ret;
+}
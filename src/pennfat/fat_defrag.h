@@ -0,0 +1,27 @@
+#ifndef FAT_DEFRAG_H
+#define FAT_DEFRAG_H
+
+#include "./pennfat_help.h"
+
+#define DEFRAG_STEP 64          // blocks moved while the table is locked
+#define DEFRAG_PAUSE_US 500     // default sleep between steps
+
+/**
+ * @brief Defragment the mounted filesystem while it stays in use.
+ *
+ * Every directory whose tree is emptier than it needs to be is repacked,
+ * then every file whose chain is in more than one run is moved onto the
+ * lowest free run that holds it, DEFRAG_STEP blocks at a time (see
+ * k_relocate). Fragmentation, as the share of a chain's links that do not
+ * go to the next block, is printed before and after, and so is the speed
+ * of reading the files that were moved, each timed cold just before and
+ * just after its move.
+ *
+ * @param pause_us Microseconds to sleep between steps; more leaves more room
+ * for other I/O.
+ * @return 0 on success, negative on failure. Files that find no free run
+ * long enough are left as they are.
+ */
+int fat_defrag(unsigned pause_us);
+
+#endif  // FAT_DEFRAG_H
@@ -0,0 +1,787 @@
+#include "./fat_dir.h"
+#include "./fat_csum.h"
+#include "./util/p_errno.h"
+
+// A directory node held in memory while it is worked on
+typedef struct {
+  uint32_t block;
+  uint8_t data[FAT_MAX_BLOCK_SIZE];
+} dir_node_t;
+
+// Set when inserting into a subtree made its top node split in two
+typedef struct {
+  bool split;
+  char key[MAX_FILENAME_LEN];  // smallest name in the new right node
+  uint32_t right;              // block of the new right node
+} dir_split_t;
+
+static dir_node_header_t* node_header(dir_node_t* node) {
+  return (dir_node_header_t*)node->data;
+}
+
+static dir_entry_t* leaf_slots(dir_node_t* node) {
+  return (dir_entry_t*)node->data + 1;
+}
+
+static dir_index_t* index_slots(dir_node_t* node) {
+  return (dir_index_t*)node->data + 1;
+}
+
+// Slots after the header
+static int node_capacity(void) {
+  return state.block_size / DIR_ENTRY_SIZE - 1;
+}
+
+static int node_read(uint32_t block, dir_node_t* node) {
+  node->block = block;
+  int ret = block_read(block, node->data, state.block_size, 0);
+  if (ret) {
+    return ret;
+  }
+  return node_header(node)->magic == DIR_NODE_MAGIC ? 0 : NOT_A_DIRECTORY;
+}
+
+static int node_write(dir_node_t* node) {
+  return block_write(node->block, node->data, state.block_size, 0);
+}
+
+// Level 0 is a leaf; a node's children are one level below it
+static void node_init(dir_node_t* node, uint32_t block, int level) {
+  memset(node->data, 0, state.block_size);
+  node->block = block;
+  node_header(node)->magic = DIR_NODE_MAGIC;
+  node_header(node)->level = level;
+}
+
+static int node_alloc(dir_node_t* node, int level) {
+  uint32_t block = fat_alloc_block();
+  if (!block) {
+    return DISK_FULL;
+  }
+  node_init(node, block, level);
+  return 0;
+}
+
+// First slot of a leaf whose name is not below name
+static int leaf_search(dir_node_t* node, const char* name, bool* found) {
+  dir_entry_t* slots = leaf_slots(node);
+  int lo = 0;
+  int hi = node_header(node)->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (strcmp(slots[mid].name, name) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *found = lo < node_header(node)->count && strcmp(slots[lo].name, name) == 0;
+  return lo;
+}
+
+// Slot of an internal node whose child covers name
+static int index_search(dir_node_t* node, const char* name) {
+  dir_index_t* slots = index_slots(node);
+  int lo = 1;
+  int hi = node_header(node)->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (strcmp(slots[mid].name, name) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo - 1;
+}
+
+// Walk down from the root of dir to the leaf that holds (or would hold) name
+static int find_leaf(uint32_t dir, const char* name, dir_node_t* node) {
+  int ret = node_read(dir, node);
+  while (ret == 0 && node_header(node)->level > 0) {
+    if (node_header(node)->count == 0) {
+      return FS_IO_ERROR;
+    }
+    ret = node_read(index_slots(node)[index_search(node, name)].child, node);
+  }
+  return ret;
+}
+
+static void delete_slot(dir_node_t* node, int pos) {
+  uint8_t* slots = node->data + DIR_ENTRY_SIZE;
+  int count = node_header(node)->count;
+  memmove(slots + pos * DIR_ENTRY_SIZE, slots + (pos + 1) * DIR_ENTRY_SIZE,
+          (count - pos - 1) * DIR_ENTRY_SIZE);
+  memset(slots + (count - 1) * DIR_ENTRY_SIZE, 0, DIR_ENTRY_SIZE);
+  node_header(node)->count--;
+}
+
+// Put a slot (entry or index, both DIR_ENTRY_SIZE bytes and starting with a
+// name) at pos, moving the upper half to a new node if this one is full
+static int insert_slot(dir_node_t* node,
+                       int pos,
+                       const void* slot,
+                       dir_split_t* split) {
+  dir_node_header_t* header = node_header(node);
+  uint8_t* slots = node->data + DIR_ENTRY_SIZE;
+  int capacity = node_capacity();
+  split->split = false;
+
+  if (header->count < capacity) {
+    memmove(slots + (pos + 1) * DIR_ENTRY_SIZE, slots + pos * DIR_ENTRY_SIZE,
+            (header->count - pos) * DIR_ENTRY_SIZE);
+    memcpy(slots + pos * DIR_ENTRY_SIZE, slot, DIR_ENTRY_SIZE);
+    header->count++;
+    return node_write(node);
+  }
+
+  uint8_t all[FAT_MAX_BLOCK_SIZE];  // capacity + 1 slots
+  memcpy(all, slots, pos * DIR_ENTRY_SIZE);
+  memcpy(all + pos * DIR_ENTRY_SIZE, slot, DIR_ENTRY_SIZE);
+  memcpy(all + (pos + 1) * DIR_ENTRY_SIZE, slots + pos * DIR_ENTRY_SIZE,
+         (capacity - pos) * DIR_ENTRY_SIZE);
+  int total = capacity + 1;
+  int left = total / 2;
+
+  dir_node_t right;
+  int ret = node_alloc(&right, header->level);
+  if (ret) {
+    return ret;
+  }
+  memcpy(right.data + DIR_ENTRY_SIZE, all + left * DIR_ENTRY_SIZE,
+         (total - left) * DIR_ENTRY_SIZE);
+  node_header(&right)->count = total - left;
+  memset(slots, 0, capacity * DIR_ENTRY_SIZE);
+  memcpy(slots, all, left * DIR_ENTRY_SIZE);
+  header->count = left;
+  if ((ret = node_write(&right)) || (ret = node_write(node))) {
+    return ret;
+  }
+
+  split->split = true;
+  memcpy(split->key, right.data + DIR_ENTRY_SIZE, MAX_FILENAME_LEN);
+  split->right = right.block;
+  return 0;
+}
+
+static int insert_into(uint32_t block,
+                       const dir_entry_t* entry,
+                       dir_split_t* split) {
+  dir_node_t node;
+  int ret = node_read(block, &node);
+  if (ret) {
+    return ret;
+  }
+  split->split = false;
+
+  if (node_header(&node)->level == 0) {
+    bool found;
+    int pos = leaf_search(&node, entry->name, &found);
+    return found ? FILE_EXISTS : insert_slot(&node, pos, entry, split);
+  }
+
+  int pos = index_search(&node, entry->name);
+  dir_split_t child_split;
+  ret = insert_into(index_slots(&node)[pos].child, entry, &child_split);
+  if (ret || !child_split.split) {
+    return ret;
+  }
+  dir_index_t slot = {0};
+  memcpy(slot.name, child_split.key, MAX_FILENAME_LEN);
+  slot.child = child_split.right;
+  return insert_slot(&node, pos + 1, &slot, split);
+}
+
+// Returns whether the node was left empty, so the parent can drop it
+static int remove_from(uint32_t block, const char* name, bool* emptied) {
+  dir_node_t node;
+  *emptied = false;
+  int ret = node_read(block, &node);
+  if (ret) {
+    return ret;
+  }
+
+  if (node_header(&node)->level == 0) {
+    bool found;
+    int pos = leaf_search(&node, name, &found);
+    if (!found) {
+      return FILE_NOT_FOUND;
+    }
+    delete_slot(&node, pos);
+  } else {
+    int pos = index_search(&node, name);
+    uint32_t child = index_slots(&node)[pos].child;
+    bool child_emptied;
+    ret = remove_from(child, name, &child_emptied);
+    if (ret || !child_emptied) {
+      return ret;
+    }
+    fat_set(child, FAT_ENTRY_FREE);
+    delete_slot(&node, pos);
+  }
+
+  *emptied = node_header(&node)->count == 0;
+  return node_write(&node);
+}
+
+static int iterate_from(uint32_t block,
+                        int (*fn)(const dir_entry_t* entry, void* arg),
+                        void* arg) {
+  // Only the read is locked: fn may block (ls into a pipe) or touch the tree
+  dir_node_t node;
+  dir_read_lock();
+  int ret = node_read(block, &node);
+  dir_unlock();
+  if (ret) {
+    return ret;
+  }
+  for (int i = 0; i < node_header(&node)->count && ret == 0; i++) {
+    if (node_header(&node)->level == 0) {
+      ret = fn(&leaf_slots(&node)[i], arg);
+    } else {
+      ret = iterate_from(index_slots(&node)[i].child, fn, arg);
+    }
+  }
+  return ret;
+}
+
+int dir_init_block(uint32_t block) {
+  dir_node_t node;
+  node_init(&node, block, 0);
+  return node_write(&node);
+}
+
+int dir_create(uint32_t* block) {
+  dir_node_t node;
+  int ret = node_alloc(&node, 0);
+  if (ret) {
+    return ret;
+  }
+  ret = node_write(&node);
+  if (ret) {
+    fat_set(node.block, FAT_ENTRY_FREE);
+    return ret;
+  }
+  *block = node.block;
+  return 0;
+}
+
+// The *_locked functions below expect the caller to hold dir_lock
+
+static int destroy_locked(uint32_t dir) {
+  dir_node_t node;
+  int ret = node_read(dir, &node);
+  if (ret) {
+    return ret;
+  }
+  if (node_header(&node)->level > 0 || node_header(&node)->count > 0) {
+    return DIR_NOT_EMPTY;
+  }
+  fat_set(dir, FAT_ENTRY_FREE);
+  return 0;
+}
+
+static int lookup_locked(uint32_t dir, const char* name, dir_entry_t* out) {
+  dir_node_t node;
+  int ret = find_leaf(dir, name, &node);
+  if (ret) {
+    return ret;
+  }
+  bool found;
+  int pos = leaf_search(&node, name, &found);
+  if (!found) {
+    return FILE_NOT_FOUND;
+  }
+  if (out) {
+    *out = leaf_slots(&node)[pos];
+  }
+  return 0;
+}
+
+static int update_locked(uint32_t dir, const dir_entry_t* entry) {
+  dir_node_t node;
+  int ret = find_leaf(dir, entry->name, &node);
+  if (ret) {
+    return ret;
+  }
+  bool found;
+  int pos = leaf_search(&node, entry->name, &found);
+  if (!found) {
+    return FILE_NOT_FOUND;
+  }
+  leaf_slots(&node)[pos] = *entry;
+  return node_write(&node);
+}
+
+static int insert_locked(uint32_t dir, const dir_entry_t* entry) {
+  dir_node_t root;
+  int ret = node_read(dir, &root);
+  if (ret) {
+    return ret;
+  }
+  // A split may reach the root: one new node per level, plus one for it
+  if (state.free_blocks < node_header(&root)->level + 2u) {
+    fat_reclaim_deferred();
+    if (state.free_blocks < node_header(&root)->level + 2u) {
+      return DISK_FULL;
+    }
+  }
+
+  dir_split_t split;
+  ret = insert_into(dir, entry, &split);
+  if (ret || !split.split) {
+    return ret;
+  }
+
+  // The root keeps its block: move its (left) half out and point to both
+  if ((ret = node_read(dir, &root))) {
+    return ret;
+  }
+  dir_node_t left;
+  if ((ret = node_alloc(&left, node_header(&root)->level))) {
+    return ret;
+  }
+  memcpy(left.data, root.data, state.block_size);
+  node_header(&left)->snapshots = 0;
+  if ((ret = node_write(&left))) {
+    return ret;
+  }
+  uint32_t snapshots = node_header(&root)->snapshots;
+  node_init(&root, dir, node_header(&left)->level + 1);
+  node_header(&root)->snapshots = snapshots;
+  index_slots(&root)[0].child = left.block;
+  memcpy(index_slots(&root)[1].name, split.key, MAX_FILENAME_LEN);
+  index_slots(&root)[1].child = split.right;
+  node_header(&root)->count = 2;
+  return node_write(&root);
+}
+
+static int remove_locked(uint32_t dir, const char* name) {
+  bool emptied;
+  int ret = remove_from(dir, name, &emptied);
+  if (ret) {
+    return ret;
+  }
+
+  // Shorten the tree while its root has a single child
+  dir_node_t root;
+  if ((ret = node_read(dir, &root))) {
+    return ret;
+  }
+  uint32_t snapshots = node_header(&root)->snapshots;
+  while (node_header(&root)->level > 0 && node_header(&root)->count <= 1) {
+    if (node_header(&root)->count == 0) {
+      node_init(&root, dir, 0);
+      node_header(&root)->snapshots = snapshots;
+      return node_write(&root);
+    }
+    uint32_t child = index_slots(&root)[0].child;
+    dir_node_t node;
+    if ((ret = node_read(child, &node))) {
+      return ret;
+    }
+    memcpy(root.data, node.data, state.block_size);
+    node_header(&root)->snapshots = snapshots;
+    if ((ret = node_write(&root))) {
+      return ret;
+    }
+    fat_set(child, FAT_ENTRY_FREE);
+  }
+  return 0;
+}
+
+int dir_destroy(uint32_t dir) {
+  dir_write_lock();
+  int ret = destroy_locked(dir);
+  dir_unlock();
+  return ret;
+}
+
+int dir_lookup(uint32_t dir, const char* name, dir_entry_t* out) {
+  dir_read_lock();
+  int ret = lookup_locked(dir, name, out);
+  dir_unlock();
+  return ret;
+}
+
+int dir_update(uint32_t dir, const dir_entry_t* entry) {
+  dir_write_lock();
+  int ret = update_locked(dir, entry);
+  dir_unlock();
+  return ret;
+}
+
+int dir_insert(uint32_t dir, const dir_entry_t* entry) {
+  dir_write_lock();
+  int ret = insert_locked(dir, entry);
+  dir_unlock();
+  return ret;
+}
+
+int dir_remove(uint32_t dir, const char* name) {
+  dir_write_lock();
+  int ret = remove_locked(dir, name);
+  dir_unlock();
+  return ret;
+}
+
+int dir_iterate(uint32_t dir,
+                int (*fn)(const dir_entry_t* entry, void* arg),
+                void* arg) {
+  return iterate_from(dir, fn, arg);
+}
+
+// Copy the tree at block to *copy (a new block unless set); see dir_clone
+static int clone_from(uint32_t block,
+                      uint32_t* copy,
+                      void (*visit)(uint32_t block, uint32_t copy, void* arg),
+                      void* arg) {
+  dir_node_t node;
+  int ret = node_read(block, &node);
+  if (ret) {
+    return ret;
+  }
+  for (int i = 0; i < node_header(&node)->count; i++) {
+    uint32_t child_copy = 0;
+    if (node_header(&node)->level > 0) {
+      dir_index_t* slot = &index_slots(&node)[i];
+      if ((ret = clone_from(slot->child, &child_copy, visit, arg))) {
+        return ret;
+      }
+      slot->child = child_copy;
+    } else if (leaf_slots(&node)[i].type == FT_DIRECTORY) {
+      dir_entry_t* slot = &leaf_slots(&node)[i];
+      ret = clone_from(entry_first_block(slot), &child_copy, visit, arg);
+      if (ret) {
+        return ret;
+      }
+      set_entry_first_block(slot, child_copy);
+    }
+  }
+
+  uint32_t snapshots = 0;
+  if (*copy) {
+    dir_node_t target;
+    if ((ret = node_read(*copy, &target))) {
+      return ret;
+    }
+    snapshots = node_header(&target)->snapshots;
+  } else if (!(*copy = fat_alloc_block())) {
+    return DISK_FULL;
+  }
+  node_header(&node)->snapshots = snapshots;
+  if (visit) {
+    visit(block, *copy, arg);
+  }
+  node.block = *copy;
+  return node_write(&node);
+}
+
+int dir_clone(uint32_t dir,
+              uint32_t* copy,
+              void (*visit)(uint32_t block, uint32_t copy, void* arg),
+              void* arg) {
+  dir_write_lock();
+  int ret = clone_from(dir, copy, visit, arg);
+  dir_unlock();
+  return ret;
+}
+
+static int walk_from(uint32_t block, void (*fn)(uint32_t block, void* arg),
+                     void* arg) {
+  dir_node_t node;
+  int ret = node_read(block, &node);
+  if (ret) {
+    return ret;
+  }
+  fn(block, arg);
+  for (int i = 0; i < node_header(&node)->count && ret == 0; i++) {
+    if (node_header(&node)->level > 0) {
+      ret = walk_from(index_slots(&node)[i].child, fn, arg);
+    } else if (leaf_slots(&node)[i].type == FT_DIRECTORY) {
+      ret = walk_from(entry_first_block(&leaf_slots(&node)[i]), fn, arg);
+    }
+  }
+  return ret;
+}
+
+int dir_walk_nodes(uint32_t dir, void (*fn)(uint32_t block, void* arg),
+                   void* arg) {
+  dir_read_lock();
+  int ret = walk_from(dir, fn, arg);
+  dir_unlock();
+  return ret;
+}
+
+// Nodes and, in name order, entries of one directory tree
+typedef struct {
+  Vec nodes;
+  uint8_t* entries;  // DIR_ENTRY_SIZE bytes each
+  int count;
+  int capacity;
+} dir_contents_t;
+
+static int gather_from(uint32_t block, dir_contents_t* all) {
+  dir_node_t node;
+  int ret = node_read(block, &node);
+  if (ret) {
+    return ret;
+  }
+  vec_push_back(&all->nodes, (ptr_t)(uintptr_t)block);
+  for (int i = 0; i < node_header(&node)->count && ret == 0; i++) {
+    if (node_header(&node)->level > 0) {
+      ret = gather_from(index_slots(&node)[i].child, all);
+      continue;
+    }
+    if (all->count == all->capacity) {
+      all->capacity = all->capacity ? 2 * all->capacity : 64;
+      uint8_t* grown = realloc(all->entries, all->capacity * DIR_ENTRY_SIZE);
+      if (!grown) {
+        return FS_MEMORY_ERROR;
+      }
+      all->entries = grown;
+    }
+    memcpy(all->entries + all->count++ * DIR_ENTRY_SIZE, &leaf_slots(&node)[i],
+           DIR_ENTRY_SIZE);
+  }
+  return ret;
+}
+
+// Nodes needed to hold count slots at each level of a full tree
+static int packed_nodes(int count) {
+  int nodes = 1;
+  for (int level = (count + node_capacity() - 1) / node_capacity(); level > 1;
+       level = (level + node_capacity() - 1) / node_capacity()) {
+    nodes += level;
+  }
+  return nodes;
+}
+
+// Write slots (entries or index slots) to full nodes, one level of the new
+// tree, the top one into dir; index receives a slot per node written
+static int write_level(uint32_t dir, int level, const uint8_t* slots,
+                       int count, dir_index_t* index, int* written,
+                       Vec* fresh) {
+  int capacity = node_capacity();
+  int nodes = MAX((count + capacity - 1) / capacity, 1);
+  for (int i = 0; i < nodes; i++) {
+    uint32_t block = dir;
+    if (nodes > 1) {
+      if (!(block = fat_alloc_block())) {
+        return DISK_FULL;
+      }
+      vec_push_back(fresh, (ptr_t)(uintptr_t)block);
+    }
+    dir_node_t node;
+    if (nodes == 1) {
+      // The top keeps its block, and the root its snapshot table
+      int ret = node_read(dir, &node);
+      if (ret) {
+        return ret;
+      }
+      uint32_t snapshots = node_header(&node)->snapshots;
+      node_init(&node, dir, level);
+      node_header(&node)->snapshots = snapshots;
+    } else {
+      node_init(&node, block, level);
+    }
+    int n = MIN(capacity, count - i * capacity);
+    memcpy(node.data + DIR_ENTRY_SIZE, slots + i * capacity * DIR_ENTRY_SIZE,
+           n * DIR_ENTRY_SIZE);
+    node_header(&node)->count = n;
+    int ret = node_write(&node);
+    if (ret) {
+      return ret;
+    }
+    memset(&index[i], 0, sizeof(dir_index_t));
+    memcpy(index[i].name, node.data + DIR_ENTRY_SIZE, MAX_FILENAME_LEN);
+    index[i].child = block;
+  }
+  *written = nodes;
+  return 0;
+}
+
+static int compact_locked(uint32_t dir, int* freed) {
+  dir_contents_t all = {.nodes = vec_new(16, NULL)};
+  int ret = gather_from(dir, &all);
+  int old_nodes = vec_len(&all.nodes);
+  if (ret || packed_nodes(all.count) >= old_nodes) {
+    free(all.entries);
+    vec_destroy(&all.nodes);
+    return ret;
+  }
+
+  // Build from the leaves up; each level's index slots are the next one's
+  // contents, until a level fits in the top node
+  Vec fresh = vec_new(16, NULL);
+  uint8_t* slots = all.entries;
+  int count = all.count;
+  for (int level = 0; ret == 0; level++) {
+    int nodes;
+    dir_index_t* index =
+        malloc(MAX((count + node_capacity() - 1) / node_capacity(), 1) *
+               sizeof(dir_index_t));
+    ret = index ? write_level(dir, level, slots, count, index, &nodes, &fresh)
+                : FS_MEMORY_ERROR;
+    free(slots);
+    slots = (uint8_t*)index;
+    count = nodes;
+    if (ret == 0 && count == 1) {
+      break;
+    }
+  }
+  free(slots);
+
+  // The new tree is in place once the top is written; before that, give
+  // back the new nodes instead
+  if (ret == 0) {
+    for (int i = 1; i < old_nodes; i++) {
+      fat_set((uintptr_t)vec_get(&all.nodes, i), FAT_ENTRY_FREE);
+    }
+    *freed = old_nodes - 1 - vec_len(&fresh);
+  } else {
+    for (size_t i = 0; i < vec_len(&fresh); i++) {
+      fat_set((uintptr_t)vec_get(&fresh, i), FAT_ENTRY_FREE);
+    }
+  }
+  vec_destroy(&fresh);
+  vec_destroy(&all.nodes);
+  return ret;
+}
+
+int dir_compact(uint32_t dir, int* freed) {
+  *freed = 0;
+  dir_write_lock();
+  int ret = compact_locked(dir, freed);
+  dir_unlock();
+  return ret;
+}
+
+uint32_t dir_snapshot_table() {
+  dir_node_t root;
+  dir_read_lock();
+  int ret = node_read(ROOT_DIR_BLOCK, &root);
+  dir_unlock();
+  return ret ? 0 : node_header(&root)->snapshots;
+}
+
+int dir_set_snapshot_table(uint32_t table) {
+  dir_node_t root;
+  dir_write_lock();
+  int ret = node_read(ROOT_DIR_BLOCK, &root);
+  if (ret == 0) {
+    node_header(&root)->snapshots = table;
+    ret = node_write(&root);
+  }
+  dir_unlock();
+  return ret;
+}
+
+int path_resolve(const char* path, uint32_t* dir, char name[MAX_FILENAME_LEN]) {
+  uint32_t current = state.root;
+  name[0] = '\0';
+
+  const char* p = path;
+  while (*p) {
+    if (*p == '/') {
+      p++;
+      continue;
+    }
+    const char* end = strchr(p, '/');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    if (len >= MAX_FILENAME_LEN || (p[0] == '.' && len <= 2 &&
+                                    (len == 1 || p[1] == '.'))) {
+      return FILENAME_INVALID;  // no "." or "..": nodes have no parent link
+    }
+
+    // Everything before the last component has to be a directory
+    if (name[0]) {
+      dir_entry_t entry;
+      int ret = dir_lookup(current, name, &entry);
+      if (ret) {
+        return ret;
+      }
+      if (entry.type != FT_DIRECTORY) {
+        return NOT_A_DIRECTORY;
+      }
+      current = entry_first_block(&entry);
+    }
+    memcpy(name, p, len);
+    name[len] = '\0';
+    p += len;
+  }
+
+  *dir = current;
+  return 0;
+}
+
+int path_lookup(const char* path, uint32_t* dir, dir_entry_t* out) {
+  char name[MAX_FILENAME_LEN];
+  int ret = path_resolve(path, dir, name);
+  if (ret) {
+    return ret;
+  }
+  if (name[0]) {
+    return dir_lookup(*dir, name, out);
+  }
+
+  memset(out, 0, sizeof(dir_entry_t));
+  strcpy(out->name, "/");
+  out->type = FT_DIRECTORY;
+  out->perm = PERM_ALL;
+  set_entry_first_block(out, state.root);
+  return 0;
+}
+
+int dir_upgrade_root() {
+  uint8_t magic = 0;
+  if (pread(state.fs_fd, &magic, 1, block_offset(ROOT_DIR_BLOCK)) != 1) {
+    return FS_IO_ERROR;
+  }
+  if (magic == DIR_NODE_MAGIC) {
+    return 0;
+  }
+
+  // Collect the live entries of the flat chain, freeing all but block 1
+  int per_block = state.block_size / sizeof(dir_entry_t);
+  dir_entry_t* entries = NULL;
+  int count = 0;
+  uint8_t buf[FAT_MAX_BLOCK_SIZE];
+  for (uint32_t block = ROOT_DIR_BLOCK; block != FAT_ENTRY_LAST;) {
+    if (pread(state.fs_fd, buf, state.block_size, block_offset(block)) !=
+        state.block_size) {
+      free(entries);
+      return FS_IO_ERROR;
+    }
+    dir_entry_t* grown = realloc(entries, (count + per_block) * sizeof(dir_entry_t));
+    if (!grown) {
+      free(entries);
+      return FS_MEMORY_ERROR;
+    }
+    entries = grown;
+    for (int i = 0; i < per_block; i++) {
+      dir_entry_t* entry = (dir_entry_t*)buf + i;
+      if (entry->name[0] > DIR_ENTRY_IN_USE) {
+        entries[count] = *entry;
+        entries[count].name[MAX_FILENAME_LEN - 1] = '\0';
+        count++;
+      }
+    }
+    uint32_t next = fat_get(block);
+    if (block != ROOT_DIR_BLOCK) {
+      fat_set(block, FAT_ENTRY_FREE);
+    }
+    block = next;
+  }
+
+  fat_set(ROOT_DIR_BLOCK, FAT_ENTRY_LAST);
+  int ret = dir_init_block(ROOT_DIR_BLOCK);
+  for (int i = 0; i < count && ret == 0; i++) {
+    ret = dir_insert(ROOT_DIR_BLOCK, &entries[i]);
+    if (ret == FILE_EXISTS) {
+      ret = 0;  // keep the first of two entries with the same name
+    }
+  }
+  free(entries);
+  return ret;
+}
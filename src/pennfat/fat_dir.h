@@ -0,0 +1,212 @@
+#ifndef FAT_DIR_H
+#define FAT_DIR_H
+
+#include "./pennfat_help.h"
+
+#define ROOT_DIR_BLOCK 1
+#define FAT_MAX_BLOCK_SIZE 4096
+#define DIR_NODE_MAGIC 0xB7  // first byte of every directory node
+
+/**
+ * @brief Header in the first slot of a directory node.
+ *
+ * Every directory is a B+ tree whose nodes are single data blocks, and the
+ * directory entry of a subdirectory points at the tree's root node (the root
+ * directory's is always block 1). The other slots of a leaf hold dir_entry_t
+ * records sorted by name; those of an internal node hold dir_index_t records.
+ * Nodes are never merged when they shrink, only freed once empty, so the
+ * height stays logarithmic in the largest size the directory has reached.
+ */
+typedef struct {
+  uint8_t magic;    // DIR_NODE_MAGIC, never a valid first name character
+  uint8_t level;    // 0 for leaves, one more than its children otherwise
+  uint16_t count;   // slots in use after the header
+  uint32_t snapshots;  // block 1 only: table of snapshots, 0 if none yet
+  char reserved[DIR_ENTRY_SIZE - 8];
+} dir_node_header_t;
+
+/**
+ * @brief Slot of an internal directory node.
+ *
+ * The first slot's name is ignored when searching, so it covers every name
+ * below the second one.
+ */
+typedef struct {
+  char name[MAX_FILENAME_LEN];  // smallest name stored under child
+  uint32_t child;               // block of the child node
+  char reserved[DIR_ENTRY_SIZE - MAX_FILENAME_LEN - sizeof(uint32_t)];
+} dir_index_t;
+
+/**
+ * @brief Write an empty directory node to a newly allocated block.
+ *
+ * @param block Receives the block of the new directory.
+ * @return 0 on success, DISK_FULL if no block is free.
+ */
+int dir_create(uint32_t* block);
+
+/**
+ * @brief Initialize an empty directory in a block that is already allocated.
+ *
+ * @param block Block to turn into an empty directory.
+ * @return 0 on success, FS_IO_ERROR on failure.
+ */
+int dir_init_block(uint32_t block);
+
+/**
+ * @brief Free the single node of an empty directory.
+ *
+ * @param dir Block of the directory.
+ * @return 0 on success, DIR_NOT_EMPTY if it still has entries.
+ */
+int dir_destroy(uint32_t dir);
+
+/**
+ * @brief Look up a name in one directory.
+ *
+ * @param dir Block of the directory.
+ * @param name Name to search for.
+ * @param out Receives a copy of the entry if found (may be NULL).
+ * @return 0 if found, FILE_NOT_FOUND otherwise.
+ */
+int dir_lookup(uint32_t dir, const char* name, dir_entry_t* out);
+
+/**
+ * @brief Insert a new entry into a directory.
+ *
+ * @param dir Block of the directory.
+ * @param entry Entry to insert.
+ * @return 0 on success, FILE_EXISTS or DISK_FULL on failure.
+ */
+int dir_insert(uint32_t dir, const dir_entry_t* entry);
+
+/**
+ * @brief Overwrite the entry with the same name.
+ *
+ * @param dir Block of the directory.
+ * @param entry New contents of the entry.
+ * @return 0 on success, FILE_NOT_FOUND if the name is not in dir.
+ */
+int dir_update(uint32_t dir, const dir_entry_t* entry);
+
+/**
+ * @brief Remove an entry from a directory.
+ *
+ * The file's blocks are left alone; that is up to the caller.
+ *
+ * @param dir Block of the directory.
+ * @param name Name of the entry to remove.
+ * @return 0 on success, FILE_NOT_FOUND if the name is not in dir.
+ */
+int dir_remove(uint32_t dir, const char* name);
+
+/**
+ * @brief Call fn on every entry of a directory in name order.
+ *
+ * @param dir Block of the directory.
+ * @param fn Callback; a non-zero return stops the walk.
+ * @param arg Passed through to fn.
+ * @return 0, or the first non-zero value returned by fn.
+ */
+int dir_iterate(uint32_t dir,
+                int (*fn)(const dir_entry_t* entry, void* arg),
+                void* arg);
+
+/**
+ * @brief Copy a directory tree, and the trees of its subdirectories.
+ *
+ * Files are not copied: the copied entries point at the same chains.
+ *
+ * @param dir Block of the directory to copy.
+ * @param copy Receives the block of the copy. If it is non-zero on entry,
+ * the top node is written over that block instead of a new one, keeping
+ * the block's snapshot table.
+ * @param visit Called with each copied node and its copy (may be NULL).
+ * @param arg Passed through to visit.
+ * @return 0 on success, negative on failure.
+ */
+int dir_clone(uint32_t dir,
+              uint32_t* copy,
+              void (*visit)(uint32_t block, uint32_t copy, void* arg),
+              void* arg);
+
+/**
+ * @brief Call fn on every node of a directory tree and of its
+ * subdirectories.
+ *
+ * @param dir Block of the directory.
+ * @param fn Callback given each node's block.
+ * @param arg Passed through to fn.
+ * @return 0 on success, negative on failure.
+ */
+int dir_walk_nodes(uint32_t dir, void (*fn)(uint32_t block, void* arg),
+                   void* arg);
+
+/**
+ * @brief Repack a directory tree whose nodes were left part empty by
+ * removals.
+ *
+ * The entries are written to new, full nodes and the top node is rewritten
+ * last, so the old tree stays whole until then; the old nodes are freed
+ * after. Subdirectories are not touched.
+ *
+ * @param dir Block of the directory.
+ * @param freed Receives the number of nodes given back.
+ * @return 0 on success (also when nothing could be saved), negative on
+ * failure.
+ */
+int dir_compact(uint32_t dir, int* freed);
+
+/**
+ * @brief Block of the snapshot table kept in the root directory's header.
+ *
+ * @return The table's block, or 0 if no snapshot was ever taken.
+ */
+uint32_t dir_snapshot_table();
+
+/**
+ * @brief Record the block of the snapshot table in the root's header.
+ *
+ * @param table Block of the table.
+ * @return 0 on success, FS_IO_ERROR on failure.
+ */
+int dir_set_snapshot_table(uint32_t table);
+
+/**
+ * @brief Resolve every component of a path but the last.
+ *
+ * Paths are taken from the root directory (state.root) whether or not they
+ * start with a '/'; empty components are skipped.
+ *
+ * @param path Path to resolve.
+ * @param dir Receives the block of the directory holding the last component.
+ * @param name Receives the last component, or "" if the path names the root.
+ * @return 0 on success, or FILE_NOT_FOUND, NOT_A_DIRECTORY or
+ * FILENAME_INVALID.
+ */
+int path_resolve(const char* path, uint32_t* dir, char name[MAX_FILENAME_LEN]);
+
+/**
+ * @brief Resolve a whole path to its directory entry.
+ *
+ * @param path Path to look up.
+ * @param dir Receives the block of the directory holding the entry.
+ * @param out Receives a copy of the entry. For the root directory this is a
+ * synthetic FT_DIRECTORY entry named "/".
+ * @return 0 on success, or an error from path_resolve or dir_lookup.
+ */
+int path_lookup(const char* path, uint32_t* dir, dir_entry_t* out);
+
+/**
+ * @brief Convert a mounted image's flat root directory to a directory tree.
+ *
+ * Images written before directories were trees keep their root as a plain
+ * array of entries in the chain starting at block 1. It is read, block 1 is
+ * rewritten as an empty tree and the live entries are inserted again.
+ *
+ * @return 0 on success (or if the root already is a tree), negative on
+ * failure.
+ */
+int dir_upgrade_root();
+
+#endif  // FAT_DIR_H
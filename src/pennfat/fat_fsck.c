@@ -0,0 +1,542 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#include "./fat_fsck.h"
+#include "./fat_compress.h"
+#include "./fat_csum.h"
+#include "./fat_dedup.h"
+#include "./fat_dir.h"
+#include "./fat_snapshot.h"
+#include "./util/p_errno.h"
+
+#define FSCK_PATH_MAX 256
+#define FSCK_LEAKS_SHOWN 10  // leaked blocks listed before they are counted
+
+// What is wrong with a chain
+enum {
+  CHAIN_OK,
+  CHAIN_BAD_BLOCK,  // points outside the FAT or at a free block
+  CHAIN_LOOP,       // comes back to one of its own blocks
+  CHAIN_CROSSED,    // runs into a block another chain already has
+  CHAIN_SHORT,      // ends before the size says it should
+  CHAIN_LONG,       // goes on after the size says it should end
+};
+
+// A chain to check, found in a directory
+typedef struct {
+  uint32_t dir;        // directory holding the entry
+  size_t path;         // index of the directory's path in fsck_t.paths
+  dir_entry_t entry;
+  uint32_t first;      // first block of the chain
+  uint32_t expect;     // blocks the size calls for
+  int problem;         // CHAIN_*
+  uint32_t length;     // good blocks before the end or the problem
+  uint32_t last;       // last good block, 0 if none
+  uint32_t bad;        // block where the problem is
+} fsck_chain_t;
+
+// A change to a directory entry, made once the walk is over
+typedef struct {
+  uint32_t dir;
+  dir_entry_t entry;
+  bool remove;  // remove the entry instead of updating it
+} fsck_fix_t;
+
+typedef struct {
+  bool repair;
+  bool damaged;               // part of a directory tree could not be read
+  uint32_t table;             // snapshot table being walked, 0 if none
+  _Atomic uint64_t* visited;  // bit per block, set by the first to reach it
+  atomic_size_t next_chain;   // next chain for a thread to claim
+  Vec paths;                  // char* of every directory walked
+  Vec chains;                 // fsck_chain_t*
+  Vec fixes;                  // fsck_fix_t*
+  uint32_t problems;
+  uint32_t fixed;
+} fsck_t;
+
+// What check_map found in one deduplicated file's map
+typedef struct {
+  fsck_t* ck;
+  uint64_t* stored;  // bit per block some map already points at
+  uint32_t bad;      // slots pointing outside the FAT or at a free block
+  uint32_t crossed;  // slots pointing at a block a chain has
+} fsck_map_t;
+
+// A thread's share of the leak scan
+typedef struct {
+  fsck_t* ck;
+  uint32_t lo, hi;  // blocks scanned
+  uint32_t used;    // allocated blocks that were reached
+  uint32_t leaks;   // allocated blocks that were not
+} fsck_range_t;
+
+// Mark a block as reached; false if something already had it
+static bool claim(fsck_t* ck, uint32_t block) {
+  uint64_t bit = 1ULL << (block % 64);
+  return !(atomic_fetch_or(&ck->visited[block / 64], bit) & bit);
+}
+
+static bool reached(fsck_t* ck, uint32_t block) {
+  return atomic_load(&ck->visited[block / 64]) & (1ULL << (block % 64));
+}
+
+static bool block_valid(uint32_t block) {
+  return block >= ROOT_DIR_BLOCK && block < state.fat_entries;
+}
+
+// Print one problem, counting it as fixed if repair will deal with it
+static void problem(fsck_t* ck, bool fixable, const char* fmt, ...) {
+  char buf[FSCK_PATH_MAX + 128];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+
+  ck->problems++;
+  ck->fixed += ck->repair && fixable;
+  k_print("fsck: %s%s\n", buf,
+          !ck->repair ? "" : fixable ? " (fixed)" : " (not fixed)");
+}
+
+static void add_fix(fsck_t* ck, uint32_t dir, const dir_entry_t* entry,
+                    bool remove) {
+  fsck_fix_t* fix = malloc(sizeof(fsck_fix_t));
+  if (fix) {
+    *fix = (fsck_fix_t){.dir = dir, .entry = *entry, .remove = remove};
+    vec_push_back(&ck->fixes, fix);
+  }
+}
+
+static const char* path_of(fsck_t* ck, size_t path) {
+  return vec_get(&ck->paths, path);
+}
+
+static void add_chain(fsck_t* ck, uint32_t dir, size_t path,
+                      const dir_entry_t* entry, uint32_t first,
+                      uint32_t expect) {
+  fsck_chain_t* chain = calloc(1, sizeof(fsck_chain_t));
+  if (chain) {
+    *chain = (fsck_chain_t){.dir = dir, .path = path, .entry = *entry,
+                            .first = first, .expect = expect};
+    vec_push_back(&ck->chains, chain);
+  }
+}
+
+static int check_node(fsck_t* ck, uint32_t block, int level, uint32_t dir,
+                      size_t path);
+
+static void check_entry(fsck_t* ck, uint32_t dir, size_t path,
+                        const dir_entry_t* entry) {
+  const char* where = path_of(ck, path);
+  if (entry->type == FT_DIRECTORY) {
+    char* child = malloc(FSCK_PATH_MAX);
+    if (!child) {
+      return;
+    }
+    snprintf(child, FSCK_PATH_MAX, "%s/%s", where, entry->name);
+    vec_push_back(&ck->paths, child);
+    uint32_t top = entry_first_block(entry);
+    if (check_node(ck, top, -1, top, vec_len(&ck->paths) - 1)) {
+      problem(ck, true, "%s: directory cannot be read", child);
+      add_fix(ck, dir, entry, true);
+    }
+  } else if (entry->type == FT_SNAPSHOT && dir == ck->table) {
+    add_chain(ck, dir, path, entry, snapshot_saved_fat(entry),
+              state.fat_blocks);
+  } else if (entry->type != FT_REGULAR && entry->type != FT_SYMLINK) {
+    problem(ck, true, "%s/%s: unknown type %d", where, entry->name,
+            entry->type);
+    add_fix(ck, dir, entry, true);
+  } else if (entry_is_inline(entry)) {
+    if (entry->size > INLINE_DATA_MAX) {
+      problem(ck, true, "%s/%s: size %u is too large for a file without blocks",
+              where, entry->name, entry->size);
+      dir_entry_t fixed = *entry;
+      fixed.size = INLINE_DATA_MAX;
+      add_fix(ck, dir, &fixed, false);
+    }
+  } else if (entry->perm & PERM_COMPRESSED) {
+    // Frames take however many blocks they compress to
+    add_chain(ck, dir, path, entry, entry_first_block(entry), UINT32_MAX);
+  } else if (entry->perm & PERM_DEDUP) {
+    add_chain(ck, dir, path, entry, entry_first_block(entry),
+              dedup_map_blocks(entry->size));
+  } else {
+    uint32_t blocks = (entry->size + state.block_size - 1) / state.block_size;
+    add_chain(ck, dir, path, entry, entry_first_block(entry), MAX(blocks, 1));
+  }
+}
+
+// Check one node of a directory tree and everything below it; level is the
+// one its parent expects, -1 for the top node
+static int check_node(fsck_t* ck, uint32_t block, int level, uint32_t dir,
+                      size_t path) {
+  uint8_t data[FAT_MAX_BLOCK_SIZE];
+  if (!block_valid(block) || !claim(ck, block)) {
+    return FS_CORRUPTED;
+  }
+  // A node that fails its checksum is still read, to find what is below it
+  int ret = block_read(block, data, state.block_size, 0);
+  if (ret == BAD_CHECKSUM) {
+    problem(ck, false, "%s: directory node %u fails its checksum",
+            path_of(ck, path), block);
+  } else if (ret) {
+    return FS_CORRUPTED;
+  }
+  dir_node_header_t* header = (dir_node_header_t*)data;
+  if (header->magic != DIR_NODE_MAGIC ||
+      header->count > state.block_size / DIR_ENTRY_SIZE - 1 ||
+      (level >= 0 && header->level != level)) {
+    return FS_CORRUPTED;
+  }
+  if (fat_get(block) != FAT_ENTRY_LAST) {
+    problem(ck, true, "%s: directory node %u is not allocated",
+            path_of(ck, path), block);
+    if (ck->repair) {
+      fat_set(block, FAT_ENTRY_LAST);
+    }
+  }
+
+  for (int i = 0; i < header->count; i++) {
+    if (header->level == 0) {
+      check_entry(ck, dir, path, (dir_entry_t*)data + 1 + i);
+    } else if (check_node(ck, ((dir_index_t*)data + 1 + i)->child,
+                          header->level - 1, dir, path)) {
+      problem(ck, false, "%s: part of the directory cannot be read",
+              path_of(ck, path));
+      ck->damaged = true;
+    }
+  }
+  return 0;
+}
+
+// Whether block is one of the blocks of chain already walked
+static bool chain_holds(const fsck_chain_t* chain, uint32_t block) {
+  uint32_t b = chain->first;
+  for (uint32_t i = 0; i < chain->length; i++, b = fat_get(b)) {
+    if (b == block) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void check_chain(fsck_t* ck, fsck_chain_t* chain) {
+  uint32_t block = chain->first;
+  while (chain->length < chain->expect) {
+    if (!block_valid(block) || fat_get(block) == FAT_ENTRY_FREE) {
+      chain->problem = CHAIN_BAD_BLOCK;
+      break;
+    }
+    if (!claim(ck, block)) {
+      chain->problem = chain_holds(chain, block) ? CHAIN_LOOP : CHAIN_CROSSED;
+      break;
+    }
+    chain->last = block;
+    chain->length++;
+    block = fat_get(block);
+    if (block == FAT_ENTRY_LAST) {
+      break;
+    }
+  }
+  chain->bad = block;
+  if (chain->problem == CHAIN_OK && chain->length < chain->expect &&
+      chain->expect != UINT32_MAX) {
+    chain->problem = CHAIN_SHORT;
+  } else if (chain->problem == CHAIN_OK && block != FAT_ENTRY_LAST) {
+    chain->problem = CHAIN_LONG;
+  }
+}
+
+static void* chain_worker(void* arg) {
+  fsck_t* ck = arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&ck->next_chain, 1)) < vec_len(&ck->chains)) {
+    check_chain(ck, vec_get(&ck->chains, i));
+  }
+  return NULL;
+}
+
+static void* leak_worker(void* arg) {
+  fsck_range_t* range = arg;
+  for (uint32_t b = range->lo; b < range->hi; b++) {
+    if (fat_get(b) == FAT_ENTRY_FREE) {
+      continue;
+    }
+    if (reached(range->ck, b)) {
+      range->used++;
+    } else {
+      range->leaks++;
+    }
+  }
+  return NULL;
+}
+
+// Report a damaged chain and queue what repair does about it
+static void report_chain(fsck_t* ck, fsck_chain_t* chain) {
+  char name[FSCK_PATH_MAX + MAX_FILENAME_LEN];
+  snprintf(name, sizeof(name), "%s/%s", path_of(ck, chain->path),
+           chain->entry.name);
+  // A snapshot's saved FAT cannot be cut short; it has to be deleted
+  bool fixable = chain->dir != ck->table;
+  switch (chain->problem) {
+    case CHAIN_BAD_BLOCK:
+      problem(ck, fixable, "%s: bad block %u after %u blocks", name,
+              chain->bad, chain->length);
+      break;
+    case CHAIN_LOOP:
+      problem(ck, fixable, "%s: chain loops back to block %u", name,
+              chain->bad);
+      break;
+    case CHAIN_CROSSED:
+      problem(ck, fixable, "%s: block %u is also used by another file", name,
+              chain->bad);
+      break;
+    case CHAIN_SHORT:
+    case CHAIN_LONG:
+      problem(ck, fixable, "%s: size %u needs %u blocks, the chain %s", name,
+              chain->entry.size, chain->expect,
+              chain->problem == CHAIN_SHORT ? "is shorter" : "is longer");
+      break;
+  }
+  if (!fixable || !ck->repair) {
+    return;
+  }
+
+  // Keep the good blocks; whatever followed is freed as a leak
+  dir_entry_t fixed = chain->entry;
+  uint32_t kept = chain->length * state.block_size;
+  if (fixed.perm & PERM_COMPRESSED) {
+    kept = compressed_span(&fixed, chain->length);
+  } else if (fixed.perm & PERM_DEDUP) {
+    kept = MIN((uint64_t)chain->length * (state.block_size / 4) *
+                   state.block_size,
+               UINT32_MAX);
+  }
+  if (chain->last) {
+    fat_set(chain->last, FAT_ENTRY_LAST);
+  } else {
+    set_entry_first_block(&fixed, FAT_ENTRY_LAST);
+    if (fixed.perm & PERM_COMPRESSED) {
+      memset(fixed.inline_data, 0, INLINE_DATA_MAX);  // held a frame count
+    }
+  }
+  fixed.size = MIN(fixed.size, kept);
+  add_fix(ck, chain->dir, &fixed, false);
+}
+
+// dedup_for_each callback: a slot must point at an allocated block of its
+// own, which any number of maps may share; repair makes a bad one a hole
+static int check_slot(uint32_t* slot, void* arg) {
+  fsck_map_t* map = arg;
+  uint32_t block = *slot;
+  uint64_t bit = 1ULL << (block % 64);
+  if (block == 0) {
+    return 0;
+  }
+  if (block <= ROOT_DIR_BLOCK || block >= state.fat_entries ||
+      fat_get(block) != FAT_ENTRY_LAST) {
+    map->bad++;
+  } else if (map->stored[block / 64] & bit) {
+    return 0;
+  } else if (claim(map->ck, block)) {
+    map->stored[block / 64] |= bit;
+    return 0;
+  } else {
+    map->crossed++;
+  }
+  if (map->ck->repair) {
+    *slot = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// Check the blocks every deduplicated file's map points at, once the chains
+// (and so the maps themselves) have been claimed
+static void check_maps(fsck_t* ck) {
+  uint64_t* stored = calloc((state.fat_entries + 63) / 64, sizeof(uint64_t));
+  if (!stored) {
+    return;
+  }
+  for (size_t i = 0; i < vec_len(&ck->chains); i++) {
+    fsck_chain_t* chain = vec_get(&ck->chains, i);
+    if (!(chain->entry.perm & PERM_DEDUP) || chain->dir == ck->table) {
+      continue;
+    }
+    fsck_map_t map = {.ck = ck, .stored = stored};
+    const char* where = path_of(ck, chain->path);
+    if (dedup_for_each(&chain->entry, chain->length, check_slot, &map)) {
+      problem(ck, false, "%s/%s: map cannot be read", where,
+              chain->entry.name);
+      ck->damaged = true;
+    }
+    if (map.bad) {
+      problem(ck, true, "%s/%s: %u blocks of its map are not allocated",
+              where, chain->entry.name, map.bad);
+    }
+    if (map.crossed) {
+      problem(ck, true, "%s/%s: %u blocks of its map are used by other files",
+              where, chain->entry.name, map.crossed);
+    }
+  }
+  free(stored);
+}
+
+// Find the leaks with every thread, then list and free them
+static void check_leaks(fsck_t* ck, int threads, uint32_t* used) {
+  pthread_t* ids = malloc(threads * sizeof(pthread_t));
+  fsck_range_t* ranges = calloc(threads, sizeof(fsck_range_t));
+  if (!ids || !ranges) {
+    free(ids);
+    free(ranges);
+    return;
+  }
+  uint32_t leaks = 0;
+  uint32_t span = (state.fat_entries - 1 + threads - 1) / threads;
+  for (int i = 0; i < threads; i++) {
+    ranges[i].ck = ck;
+    ranges[i].lo = MIN(1 + i * span, state.fat_entries);
+    ranges[i].hi = MIN(ranges[i].lo + span, state.fat_entries);
+    pthread_create(&ids[i], NULL, leak_worker, &ranges[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+    *used += ranges[i].used;
+    leaks += ranges[i].leaks;
+  }
+  free(ids);
+  free(ranges);
+  if (!leaks) {
+    return;
+  }
+
+  // Blocks under a directory that could not be read look leaked too, so
+  // nothing is freed then
+  problem(ck, !ck->damaged, "%u blocks are allocated but not used", leaks);
+  uint32_t shown = 0;
+  for (uint32_t b = 1; b < state.fat_entries; b++) {
+    if (fat_get(b) == FAT_ENTRY_FREE || reached(ck, b)) {
+      continue;
+    }
+    if (shown++ < FSCK_LEAKS_SHOWN) {
+      k_print("fsck:   block %u -> %u\n", b, fat_get(b));
+    }
+    if (ck->repair && !ck->damaged) {
+      fat_set(b, FAT_ENTRY_FREE);
+    }
+  }
+}
+
+static int apply_fixes(fsck_t* ck) {
+  int ret = 0;
+  for (size_t i = 0; i < vec_len(&ck->fixes) && ret == 0; i++) {
+    fsck_fix_t* fix = vec_get(&ck->fixes, i);
+    ret = fix->remove ? dir_remove(fix->dir, fix->entry.name)
+                      : dir_update(fix->dir, &fix->entry);
+  }
+  msync(state.fat, state.fat_size, MS_SYNC);
+  fsync(state.fs_fd);
+  return ret;
+}
+
+static int fsck_locked(fsck_t* ck, int threads) {
+  if (vec_len(&state.nodes) > 0) {
+    return FILE_IN_USE;
+  }
+  // Queued frees would show up as leaks
+  fat_reclaim_deferred();
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  // A mounted snapshot's FAT is a copy that the checksums do not cover
+  for (uint32_t i = 0; state.csums && !state.read_only && i < state.fat_blocks;
+       i++) {
+    if (!csum_fat_ok(i)) {
+      problem(ck, true, "FAT block %u fails its checksum", i);
+      if (ck->repair) {
+        csum_fat_stamp(i);
+      }
+    }
+  }
+
+  vec_push_back(&ck->paths, strdup(""));
+  if (check_node(ck, state.root, -1, state.root, 0)) {
+    k_print("fsck: the root directory cannot be read\n");
+    return FS_CORRUPTED;
+  }
+  uint32_t dirs = vec_len(&ck->paths);
+  if (state.root == ROOT_DIR_BLOCK && (ck->table = dir_snapshot_table())) {
+    vec_push_back(&ck->paths, strdup("(snapshots)"));
+    if (check_node(ck, ck->table, -1, ck->table, vec_len(&ck->paths) - 1)) {
+      problem(ck, false, "the snapshot table cannot be read");
+      ck->damaged = true;
+    }
+  }
+
+  pthread_t* ids = malloc(threads * sizeof(pthread_t));
+  if (!ids) {
+    return FS_MEMORY_ERROR;
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&ids[i], NULL, chain_worker, ck);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  free(ids);
+  for (size_t i = 0; i < vec_len(&ck->chains); i++) {
+    fsck_chain_t* chain = vec_get(&ck->chains, i);
+    if (chain->problem != CHAIN_OK) {
+      report_chain(ck, chain);
+    }
+  }
+  check_maps(ck);
+
+  uint32_t used = 0;
+  check_leaks(ck, threads, &used);
+  int ret = ck->repair ? apply_fixes(ck) : 0;
+  // Repairs change what the maps point at
+  if (ret == 0 && ck->repair) {
+    ret = dedup_load();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double secs =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  k_print("fsck: %u directories, %zu chains, %u blocks in use; %u problems, "
+          "%u fixed (%.2f s, %d threads)\n",
+          dirs, vec_len(&ck->chains), used, ck->problems, ck->fixed, secs,
+          threads);
+  if (ret == 0 && ck->problems > ck->fixed) {
+    ret = FS_CORRUPTED;
+  }
+  return ret;
+}
+
+int fat_fsck(bool repair, int threads) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (repair && state.read_only)
+    return READ_ONLY_FS;
+  if (threads < 1)
+    return INVALID_MODE;
+
+  fsck_t ck = {.repair = repair,
+               .visited = calloc((state.fat_entries + 63) / 64,
+                                 sizeof(uint64_t)),
+               .paths = vec_new(64, free),
+               .chains = vec_new(1024, free),
+               .fixes = vec_new(16, free)};
+  int ret = FS_MEMORY_ERROR;
+  if (ck.visited) {
+    fs_lock(&state.files_lock);
+    ret = fsck_locked(&ck, threads);
+    fs_unlock(&state.files_lock);
+  }
+  free(ck.visited);
+  vec_destroy(&ck.paths);
+  vec_destroy(&ck.chains);
+  vec_destroy(&ck.fixes);
+  return ret;
+}
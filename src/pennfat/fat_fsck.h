@@ -0,0 +1,31 @@
+#ifndef FAT_FSCK_H
+#define FAT_FSCK_H
+
+#include "./pennfat_help.h"
+
+#define FSCK_THREADS_MAX 64
+
+/**
+ * @brief Check the mounted image for damage, and optionally repair it.
+ *
+ * The directory trees are walked first, checking every node and entry and
+ * collecting the chain of each file. The chains are then walked by a pool of
+ * threads that claim each block in a shared bitmap, which finds chains that
+ * run off the FAT, loop back on themselves or share a block with another
+ * chain, and sizes that disagree with the chain's length. Blocks the FAT
+ * still has allocated but nothing reached are leaks, such as the chain of a
+ * file removed while open when the system went down; the same threads look
+ * for them.
+ *
+ * With repair set, damaged chains are cut before the first bad block and
+ * their size trimmed to match, entries that cannot be read are removed and
+ * leaked blocks are freed. Nothing is changed otherwise.
+ *
+ * @param repair Fix what is found.
+ * @param threads Number of threads walking chains (at least 1).
+ * @return 0 if the image is clean (or every problem was fixed), FS_CORRUPTED
+ * if problems remain, FILE_IN_USE if a file is open, negative on failure.
+ */
+int fat_fsck(bool repair, int threads);
+
+#endif  // FAT_FSCK_H
@@ -0,0 +1,386 @@
+#include "./fat_snapshot.h"
+#include "./fat_csum.h"
+#include "./fat_dedup.h"
+#include "./fat_dir.h"
+#include "./util/p_errno.h"
+
+// What snapshot_create builds before the snapshot is recorded
+typedef struct {
+  void* fat;   // the FAT the snapshot will save
+  Vec copies;  // directory node copies, held by the snapshot alone
+} snapshot_build_t;
+
+// Entry of a FAT held in memory, in either width
+static uint32_t buf_get(const void* fat, uint32_t block) {
+  if (state.fat32) {
+    return ((const uint32_t*)fat)[block];
+  }
+  uint16_t next = ((const uint16_t*)fat)[block];
+  return next == FAT16_ENTRY_LAST ? FAT_ENTRY_LAST : next;
+}
+
+static void buf_set(void* fat, uint32_t block, uint32_t next) {
+  if (state.fat32) {
+    ((uint32_t*)fat)[block] = next;
+  } else {
+    ((uint16_t*)fat)[block] =
+        next == FAT_ENTRY_LAST ? FAT16_ENTRY_LAST : (uint16_t)next;
+  }
+}
+
+uint32_t snapshot_saved_fat(const dir_entry_t* entry) {
+  uint32_t head;
+  memcpy(&head, entry->inline_data, sizeof(head));
+  return head;
+}
+
+static bool snapshot_name_valid(const char* name) {
+  size_t len = strlen(name);
+  return len > 0 && len < MAX_FILENAME_LEN && !strchr(name, '/');
+}
+
+static int find_snapshot(const char* name, dir_entry_t* out) {
+  uint32_t table = dir_snapshot_table();
+  return table ? dir_lookup(table, name, out) : FILE_NOT_FOUND;
+}
+
+// The hold counts are only allocated once an image has a snapshot
+static int ensure_refs() {
+  if (!state.snap_refs) {
+    state.snap_refs = calloc(state.fat_entries, sizeof(uint8_t));
+  }
+  return state.snap_refs ? 0 : FS_MEMORY_ERROR;
+}
+
+// Read a snapshot's saved FAT into a new buffer, NULL on failure
+static void* read_saved_fat(const dir_entry_t* entry) {
+  uint8_t* fat = malloc(state.fat_size);
+  uint32_t block = snapshot_saved_fat(entry);
+  for (uint32_t off = 0; fat && off < state.fat_size;
+       off += state.block_size) {
+    if (block == FAT_ENTRY_LAST ||
+        block_read(block, fat + off, state.block_size, 0)) {
+      free(fat);
+      return NULL;
+    }
+    block = fat_get(block);
+  }
+  return fat;
+}
+
+static int write_saved_fat(uint32_t head, const void* fat) {
+  uint32_t block = head;
+  for (uint32_t off = 0; off < state.fat_size; off += state.block_size) {
+    int ret = block_write(block, (const uint8_t*)fat + off, state.block_size,
+                          0);
+    if (ret) {
+      return ret;
+    }
+    block = fat_get(block);
+  }
+  return 0;
+}
+
+// dir_walk_nodes callback: the snapshot does not hold a node of the table
+static void drop_node(uint32_t block, void* arg) {
+  buf_set(arg, block, FAT_ENTRY_FREE);
+}
+
+// dir_clone callback: the snapshot holds its own copy of each node
+static void swap_node(uint32_t block, uint32_t copy, void* arg) {
+  snapshot_build_t* build = arg;
+  buf_set(build->fat, block, FAT_ENTRY_FREE);
+  buf_set(build->fat, copy, FAT_ENTRY_LAST);
+  vec_push_back(&build->copies, (ptr_t)(uintptr_t)copy);
+}
+
+// dir_iterate callback counting entries
+static int count_entry(const dir_entry_t* entry, void* arg) {
+  (*(int*)arg)++;
+  return 0;
+}
+
+static int create_locked(const char* name) {
+  uint32_t table = dir_snapshot_table();
+  int ret = 0;
+  if (!table &&
+      ((ret = dir_create(&table)) || (ret = dir_set_snapshot_table(table)))) {
+    return ret;
+  }
+  int count = 0;
+  dir_iterate(table, count_entry, &count);
+  if (dir_lookup(table, name, NULL) == 0) {
+    return FILE_EXISTS;
+  }
+  if (count >= SNAPSHOT_MAX) {
+    return TOO_MANY_SNAPSHOTS;
+  }
+  if ((ret = ensure_refs())) {
+    return ret;
+  }
+
+  // Chains waiting to be freed are not worth keeping
+  fat_reclaim_deferred();
+  snapshot_build_t build = {.fat = malloc(state.fat_size),
+                            .copies = vec_new(64, NULL)};
+  if (!build.fat) {
+    vec_destroy(&build.copies);
+    return FS_MEMORY_ERROR;
+  }
+  fs_lock(&state.fat_lock);
+  memcpy(build.fat, state.fat, state.fat_size);
+  fs_unlock(&state.fat_lock);
+
+  // Save the FAT as it is once the directories are swapped for copies
+  dir_entry_t entry = {0};
+  uint32_t root = 0;
+  uint32_t head = 0;
+  ret = dir_walk_nodes(table, drop_node, build.fat);
+  if (ret == 0) {
+    ret = dir_clone(ROOT_DIR_BLOCK, &root, swap_node, &build);
+  }
+  if (ret == 0 && !(head = fat_alloc_chain(state.fat_blocks))) {
+    ret = DISK_FULL;
+  }
+  if (ret == 0) {
+    ret = write_saved_fat(head, build.fat);
+  }
+  if (ret == 0) {
+    strcpy(entry.name, name);
+    entry.type = FT_SNAPSHOT;
+    entry.perm = PERM_READ;
+    entry.mtime = time(NULL);
+    set_entry_first_block(&entry, root);
+    memcpy(entry.inline_data, &head, sizeof(head));
+    for (uint32_t b = 2; b < state.fat_entries; b++) {
+      entry.size += buf_get(build.fat, b) != FAT_ENTRY_FREE;
+    }
+    ret = dir_insert(table, &entry);
+  }
+
+  if (ret == 0) {
+    for (uint32_t b = 2; b < state.fat_entries; b++) {
+      if (buf_get(build.fat, b) != FAT_ENTRY_FREE) {
+        fat_hold(b);
+      }
+    }
+  } else if (head) {
+    fat_free_chain_deferred(head);
+  }
+  // The copies leave the live FAT; held ones stay allocated to the snapshot
+  for (size_t i = 0; i < vec_len(&build.copies); i++) {
+    fat_set((uintptr_t)vec_get(&build.copies, i), FAT_ENTRY_FREE);
+  }
+  vec_destroy(&build.copies);
+  free(build.fat);
+
+  msync(state.fat, state.fat_size, MS_SYNC);
+  fsync(state.fs_fd);
+  return ret;
+}
+
+int snapshot_create(const char* name) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
+  if (!snapshot_name_valid(name))
+    return FILENAME_INVALID;
+
+  // No file is opened or closed while the snapshot is taken, and none may
+  // have blocks mapped into memory, which writes would not copy first
+  fs_lock(&state.files_lock);
+  int ret = 0;
+  for (size_t i = 0; i < vec_len(&state.nodes); i++) {
+    ret = ((file_node_t*)vec_get(&state.nodes, i))->mapped ? FILE_IN_USE : ret;
+  }
+  ret = ret ? ret : create_locked(name);
+  fs_unlock(&state.files_lock);
+  return ret;
+}
+
+int snapshot_delete(const char* name) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
+
+  dir_entry_t entry;
+  int ret = find_snapshot(name, &entry);
+  if (ret) {
+    return ret;
+  }
+  void* fat = read_saved_fat(&entry);
+  if (!fat) {
+    return FS_IO_ERROR;
+  }
+  ret = dir_remove(dir_snapshot_table(), name);
+  if (ret == 0) {
+    for (uint32_t b = 2; b < state.fat_entries; b++) {
+      if (buf_get(fat, b) != FAT_ENTRY_FREE) {
+        fat_release(b);
+      }
+    }
+    fat_free_chain_deferred(snapshot_saved_fat(&entry));
+  }
+  free(fat);
+
+  msync(state.fat, state.fat_size, MS_SYNC);
+  fsync(state.fs_fd);
+  return ret;
+}
+
+// dir_walk_nodes callback: mark a block the rollback keeps
+static void keep_node(uint32_t block, void* arg) {
+  ((uint8_t*)arg)[block] = 1;
+}
+
+// dir_iterate callback: keep the chain of a snapshot's saved FAT
+static int keep_saved_fat(const dir_entry_t* entry, void* arg) {
+  for (uint32_t b = snapshot_saved_fat(entry); b != FAT_ENTRY_LAST;
+       b = fat_get(b)) {
+    keep_node(b, arg);
+  }
+  return 0;
+}
+
+// dedup_for_each callback for restore_entry
+static int restore_stored(uint32_t* slot, void* arg) {
+  if (*slot > ROOT_DIR_BLOCK && *slot < state.fat_entries) {
+    fat_set(*slot, FAT_ENTRY_LAST);
+  }
+  return 0;
+}
+
+// dir_iterate callback: give the live FAT the chains of a snapshot's files
+static int restore_entry(const dir_entry_t* entry, void* arg) {
+  if (entry->type == FT_DIRECTORY) {
+    return dir_iterate(entry_first_block(entry), restore_entry, arg);
+  }
+  for (uint32_t b = entry_first_block(entry); b != FAT_ENTRY_LAST;
+       b = buf_get(arg, b)) {
+    fat_set(b, buf_get(arg, b));
+  }
+  // The blocks a map points at are in no chain of their own
+  if (entry->perm & PERM_DEDUP) {
+    return dedup_for_each(entry, UINT32_MAX, restore_stored, NULL);
+  }
+  return 0;
+}
+
+static int rollback_locked(const char* name) {
+  if (vec_len(&state.nodes) > 0) {
+    return FILE_IN_USE;
+  }
+  dir_entry_t entry;
+  int ret = find_snapshot(name, &entry);
+  if (ret) {
+    return ret;
+  }
+  void* fat = read_saved_fat(&entry);
+  uint8_t* keep = calloc(state.fat_entries, sizeof(uint8_t));
+  if (!fat || !keep) {
+    free(fat);
+    free(keep);
+    return FS_MEMORY_ERROR;
+  }
+
+  // Empty the live FAT but for the root block and the snapshot table
+  fat_reclaim_deferred();
+  uint32_t table = dir_snapshot_table();
+  keep[ROOT_DIR_BLOCK] = 1;
+  ret = dir_walk_nodes(table, keep_node, keep);
+  if (ret == 0) {
+    ret = dir_iterate(table, keep_saved_fat, keep);
+  }
+  for (uint32_t b = 2; ret == 0 && b < state.fat_entries; b++) {
+    if (!keep[b] && fat_get(b) != FAT_ENTRY_FREE) {
+      fat_set(b, FAT_ENTRY_FREE);
+    }
+  }
+
+  // Share the snapshot's files and copy its directories into place
+  uint32_t root = ROOT_DIR_BLOCK;
+  if (ret == 0) {
+    ret = dir_iterate(entry_first_block(&entry), restore_entry, fat);
+  }
+  if (ret == 0) {
+    ret = dir_clone(entry_first_block(&entry), &root, NULL, NULL);
+  }
+  if (ret == 0) {
+    ret = dedup_load();
+  }
+  free(keep);
+  free(fat);
+
+  msync(state.fat, state.fat_size, MS_SYNC);
+  fsync(state.fs_fd);
+  return ret;
+}
+
+int snapshot_rollback(const char* name) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (state.read_only)
+    return READ_ONLY_FS;
+
+  fs_lock(&state.files_lock);
+  int ret = rollback_locked(name);
+  fs_unlock(&state.files_lock);
+  return ret;
+}
+
+// dir_iterate callback for snapshot_list
+static int print_snapshot(const dir_entry_t* entry, void* arg) {
+  k_print("%-31s %8u blocks  %.24s\n", entry->name, entry->size,
+          ctime(&entry->mtime));
+  return 0;
+}
+
+int snapshot_list() {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  uint32_t table = dir_snapshot_table();
+  return table ? dir_iterate(table, print_snapshot, NULL) : 0;
+}
+
+// dir_iterate callback for snapshot_load: count what one snapshot holds
+static int load_snapshot(const dir_entry_t* entry, void* arg) {
+  void* fat = read_saved_fat(entry);
+  if (!fat) {
+    return FS_IO_ERROR;
+  }
+  for (uint32_t b = 2; b < state.fat_entries; b++) {
+    if (buf_get(fat, b) != FAT_ENTRY_FREE) {
+      fat_hold(b);
+    }
+  }
+  free(fat);
+  return 0;
+}
+
+int snapshot_load() {
+  uint32_t table = dir_snapshot_table();
+  if (!table) {
+    return 0;
+  }
+  int ret = ensure_refs();
+  return ret ? ret : dir_iterate(table, load_snapshot, NULL);
+}
+
+int snapshot_mount(const char* name) {
+  dir_entry_t entry;
+  int ret = find_snapshot(name, &entry);
+  if (ret) {
+    return ret;
+  }
+  void* fat = read_saved_fat(&entry);
+  if (!fat) {
+    return FS_IO_ERROR;
+  }
+  munmap(state.fat, state.fat_size);
+  state.fat = fat;
+  state.root = entry_first_block(&entry);
+  state.read_only = true;
+  return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef FAT_SNAPSHOT_H
+#define FAT_SNAPSHOT_H
+
+#include "./pennfat_help.h"
+
+#define SNAPSHOT_MAX 64  // snapshots per image, state.snap_refs is 8 bits
+
+/**
+ * @brief Take a named, read-only snapshot of the whole filesystem.
+ *
+ * A snapshot is a copy of the FAT, stored in a chain of blocks, plus a copy
+ * of every directory tree. Files are not copied: their blocks are shared
+ * between the live filesystem and each snapshot that holds them (counted in
+ * state.snap_refs), and k_write moves a shared block to a new one before it
+ * changes it. Taking a snapshot costs time proportional to the FAT and the
+ * directories, not to the data.
+ *
+ * Snapshots are listed in a directory tree of FT_SNAPSHOT entries whose block
+ * is kept in the root directory's header. Each entry points at the copied
+ * root directory, keeps the head of the saved FAT's chain in its inline data
+ * and counts the blocks the snapshot holds in its size.
+ *
+ * @param name Name of the snapshot.
+ * @return 0 on success, or FILE_EXISTS, FILENAME_INVALID, DISK_FULL,
+ * TOO_MANY_SNAPSHOTS, READ_ONLY_FS, or FILE_IN_USE while a file's blocks are
+ * mapped into memory (see kmmap.h).
+ */
+int snapshot_create(const char* name);
+
+/**
+ * @brief First block of the chain holding a snapshot's saved FAT.
+ *
+ * @param entry The snapshot's entry in the snapshot table.
+ * @return The block.
+ */
+uint32_t snapshot_saved_fat(const dir_entry_t* entry);
+
+/**
+ * @brief Delete a snapshot, giving back the blocks only it held.
+ *
+ * @param name Name of the snapshot.
+ * @return 0 on success, FILE_NOT_FOUND or READ_ONLY_FS.
+ */
+int snapshot_delete(const char* name);
+
+/**
+ * @brief Make the live filesystem what it was when a snapshot was taken.
+ *
+ * Everything written since is dropped; the snapshot itself is kept. No file
+ * may be open.
+ *
+ * @param name Name of the snapshot.
+ * @return 0 on success, or FILE_NOT_FOUND, FILE_IN_USE or READ_ONLY_FS.
+ */
+int snapshot_rollback(const char* name);
+
+/**
+ * @brief Print every snapshot with the blocks it holds and when it was taken.
+ *
+ * @return 0 on success, negative on failure.
+ */
+int snapshot_list();
+
+/**
+ * @brief Count the blocks held by the image's snapshots; called by pmount.
+ *
+ * @return 0 on success, negative on failure.
+ */
+int snapshot_load();
+
+/**
+ * @brief Switch a freshly mounted filesystem to a snapshot, read-only.
+ *
+ * The snapshot's FAT replaces the live one in memory and its root directory
+ * becomes state.root. Every change is refused with READ_ONLY_FS until
+ * unmount.
+ *
+ * @param name Name of the snapshot.
+ * @return 0 on success, FILE_NOT_FOUND or FS_IO_ERROR.
+ */
+int snapshot_mount(const char* name);
+
+#endif  // FAT_SNAPSHOT_H
@@ -1,11 +1,15 @@
 #include "./pennfat.h"
+#include "./fat_csum.h"
+#include "./fat_dedup.h"
+#include "./fat_dir.h"
+#include "./fat_snapshot.h"
 #include "./util/p_errno.h"
 
 
 int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config) {
     if (state.is_mounted)
         return FS_NOT_MOUNTED;
-    if (blocks_in_fat < 1 || blocks_in_fat > 32)
+    if (blocks_in_fat < 1 || blocks_in_fat > FAT32_MAX_BLOCKS)
         return INVALID_FAT_CONFIG;
     if (block_size_config < 0 || block_size_config > 4)
         return INVALID_FAT_CONFIG;
@@ -13,13 +17,15 @@ int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config) {
     const int block_sizes[] = {256, 512, 1024, 2048, 4096};
     int block_size = block_sizes[block_size_config];
 
-    uint32_t fat_entries = (blocks_in_fat * block_size) / 2;
+    // FATs too big for 16-bit entries switch to the 32-bit format
+    bool fat32 = blocks_in_fat > FAT_MAX_BLOCKS;
+    int entry_size = fat32 ? sizeof(uint32_t) : sizeof(uint16_t);
+    uint32_t fat_entries = ((uint32_t)blocks_in_fat * block_size) / entry_size;
     uint32_t data_blocks = fat_entries - 1;
-    uint32_t total_blocks = blocks_in_fat + data_blocks;
-    uint32_t total_size = total_blocks * block_size;
+    off_t total_size = ((off_t)blocks_in_fat + data_blocks) * block_size;
 
-    // Special case for maximum size
-    if (blocks_in_fat == 32 && block_size_config == 4) {
+    // Special case for maximum size: block 0xFFFF would read as end of chain
+    if (!fat32 && blocks_in_fat == FAT_MAX_BLOCKS && block_size_config == 4) {
         total_size -= 4096;
     }
 
@@ -28,75 +34,54 @@ int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config) {
     if (fd < 0)
         return -1;
 
-    // Allocate and initialize FAT
-    uint16_t* fat = malloc(fat_entries * sizeof(uint16_t));
-    if (!fat) {
+    // Only the first FAT block holds anything but zeros (free entries); the
+    // root directory starts out as an empty leaf node
+    uint8_t* first_block = calloc(1, block_size);
+    uint8_t* root = calloc(1, block_size);
+    uint8_t* zeros = calloc(1, block_size);
+    size_t region_size = csum_region_size(total_size, block_size);
+    uint32_t* csums = calloc(1, region_size);
+    if (!first_block || !root || !zeros || !csums) {
+        free(first_block);
+        free(root);
+        free(zeros);
+        free(csums);
         close(fd);
         return -1;
     }
-
-    // Explicit FAT initialization
-    fat[0] = (uint16_t)((blocks_in_fat << 8) | block_size_config); // Header
-    fat[1] = FAT_ENTRY_LAST; // Root directory marker
-    
-    // Explicitly mark all other blocks as free
-    for (uint32_t i = 2; i < fat_entries; i++) {
-        fat[i] = FAT_ENTRY_FREE;
-    }
-
-    // Write FAT to disk
-    ssize_t written = write(fd, fat, fat_entries * sizeof(uint16_t));
-    if (written != fat_entries * sizeof(uint16_t)) {
-        free(fat);
-        close(fd);
-        return -1;
-    }
-
-    // Pad FAT region if needed (using dynamic zero buffer)
-    uint32_t fat_bytes_total = blocks_in_fat * block_size;
-    uint32_t fat_bytes_written = fat_entries * sizeof(uint16_t);
-    
-    if (fat_bytes_written < fat_bytes_total) {
-        uint8_t* zero_block = calloc(1, block_size); // Block-sized zero buffer
-        if (!zero_block) {
-            free(fat);
-            close(fd);
-            return -1;
-        }
-        write(fd, zero_block, fat_bytes_total - fat_bytes_written);
-        free(zero_block);
+    if (fat32) {
+        uint32_t* fat = (uint32_t*)first_block;
+        fat[0] = ((uint32_t)blocks_in_fat << 8) | FAT_HEADER_FAT32 |
+                 FAT_HEADER_CSUM | block_size_config;  // Header
+        fat[1] = FAT_ENTRY_LAST;     // Root directory marker
+    } else {
+        uint16_t* fat = (uint16_t*)first_block;
+        fat[0] = (uint16_t)((blocks_in_fat << 8) | FAT_HEADER_CSUM |
+                            block_size_config);  // Header
+        fat[1] = FAT16_ENTRY_LAST; // Root directory marker
     }
+    *(dir_node_header_t*)root =
+        (dir_node_header_t){.magic = DIR_NODE_MAGIC, .level = 0};
 
-    // Initialize root directory block
-    uint8_t* zero_block = calloc(1, block_size);
-    if (!zero_block) {
-        free(fat);
-        close(fd);
-        return -1;
-    }
-    
-    // Set directory end marker
-    dir_entry_t* dir = (dir_entry_t*)zero_block;
-    dir[0].name[0] = DIR_ENTRY_END;
-    
-    written = write(fd, zero_block, block_size);
-    free(zero_block);
-    if (written != block_size) {
-        free(fat);
-        close(fd);
-        return -1;
-    }
-
-    // Set final size
-    if (ftruncate(fd, total_size) < 0) {
-        free(fat);
-        close(fd);
-        return -1;
+    // Checksums of the FAT and the root; free blocks need none
+    csums[0] = crc32c(first_block, block_size);
+    for (int i = 1; i < blocks_in_fat; i++) {
+        csums[i] = crc32c(zeros, block_size);
     }
-
-    free(fat);
+    csums[blocks_in_fat] = crc32c(root, block_size);
+
+    // Set final size; the rest of the FAT reads back as zeros
+    bool ok = pwrite(fd, first_block, block_size, 0) == block_size &&
+              ftruncate(fd, total_size + region_size) == 0 &&
+              pwrite(fd, root, block_size, (off_t)blocks_in_fat * block_size) ==
+                  block_size &&
+              pwrite(fd, csums, region_size, total_size) == (ssize_t)region_size;
+    free(first_block);
+    free(root);
+    free(zeros);
+    free(csums);
     close(fd);
-    return 0;
+    return ok ? 0 : -1;
 }
 
 // Mount PennFAT
@@ -104,47 +89,58 @@ int pmount(const char* fs_name) {
   if (state.is_mounted)
     return FS_NOT_MOUNTED;
 
+  // "image@name" mounts snapshot `name` of the image, read-only
+  char image[256];
+  const char* snapshot = strrchr(fs_name, '@');
+  if (snapshot && access(fs_name, F_OK) != 0) {
+    snprintf(image, sizeof(image), "%.*s", (int)(snapshot - fs_name),
+             fs_name);
+    fs_name = image;
+    snapshot++;
+  } else {
+    snapshot = NULL;
+  }
+
   state.fs_fd = open(fs_name, O_RDWR);
   if (state.fs_fd < 0)
     return -1;
 
-  // Read FAT[0] to get config
-  uint16_t fat_entry_zero;
-  read(state.fs_fd, &fat_entry_zero, 2);
+  // Read FAT[0] to get config; its flag tells how wide the entries are
+  uint32_t fat_entry_zero = 0;
+  if (pread(state.fs_fd, &fat_entry_zero, sizeof(uint16_t), 0) !=
+      sizeof(uint16_t))
+    return -1;
+  state.fat32 = fat_entry_zero & FAT_HEADER_FAT32;
+  if (state.fat32 && pread(state.fs_fd, &fat_entry_zero, sizeof(uint32_t),
+                           0) != sizeof(uint32_t))
+    return -1;
 
-  state.block_size = 256 << (fat_entry_zero & 0xFF);  // LSB = block size config
-  state.fat_blocks = fat_entry_zero >> 8;             // MSB = blocks in FAT
+  // LSB = block size config, the bits above it = blocks in FAT
+  state.block_size = 256 << (fat_entry_zero & 0x0F);
+  state.fat_blocks = fat_entry_zero >> 8;
   state.fat_size = state.block_size * state.fat_blocks;
+  state.fat_entries = state.fat32 ? state.fat_size / sizeof(uint32_t)
+                                  : MIN(state.fat_size / sizeof(uint16_t),
+                                        FAT16_ENTRY_LAST);
 
   // Memory-map FAT
   state.fat = mmap(NULL, state.fat_size, PROT_READ | PROT_WRITE, MAP_SHARED,
                    state.fs_fd, 0);
   if (state.fat == MAP_FAILED)
     return -1;
+  fs_locks_init();
+  // FAT blocks that fail their checksum are reported, see fsck -r
+  if (csum_init() < 0 || fat_free_map_init() < 0)
+    return -1;
 
-  // Initialize root directory (starts at Block 1)
+  // Root directory starts at Block 1; older images keep it flat
   state.data_start = state.fat_size;
-    uint16_t root_block = 1;
-    uint32_t max_dir_blocks = 64; // Choose based on memory or FAT size
-    state.root_dir = malloc(max_dir_blocks * state.block_size);
-    if (!state.root_dir)
-        return -1;
-
-    uint8_t* dir_ptr = (uint8_t*)state.root_dir;
-    uint32_t blocks_read = 0;
-
-    while (root_block != FAT_ENTRY_LAST && blocks_read < max_dir_blocks) {
-        off_t offset = state.data_start + ((root_block-1) * state.block_size);
-        lseek(state.fs_fd, offset, SEEK_SET);
-        read(state.fs_fd, dir_ptr, state.block_size);
-        dir_ptr += state.block_size;
-        root_block = state.fat[root_block];
-        blocks_read++;
-    }
+  state.root = ROOT_DIR_BLOCK;
+  state.read_only = false;
+  if (dir_upgrade_root() < 0 || snapshot_load() < 0) {
+    return -1;
+  }
 
-    // Store how many blocks we loaded
-    state.root_dir_blocks = blocks_read;
-    
     // Initialize stdin, stdout, stderr
     dir_entry_t *stdin = (dir_entry_t*)malloc(sizeof(dir_entry_t));
     strncpy(stdin->name, "stdin", MAX_FILENAME_LEN - 1);
@@ -152,7 +148,6 @@ int pmount(const char* fs_name) {
     stdin->perm = PERM_READ;
     file_descriptor_t stdin_fd = {0};
     stdin_fd.fd = 0;
-    stdin_fd.current_block = 0;
     stdin_fd.offset = 0;
     stdin_fd.mode = F_READ;
     stdin_fd.ref_count = 1;
@@ -164,7 +159,6 @@ int pmount(const char* fs_name) {
     stdout->perm = PERM_WRITE;
     file_descriptor_t stdout_fd = {0};
     stdout_fd.fd = 1;
-    stdout_fd.current_block = 0;
     stdout_fd.offset = 0;
     stdout_fd.mode = F_WRITE;
     stdout_fd.ref_count = 1;
@@ -176,20 +170,30 @@ int pmount(const char* fs_name) {
     stderr->perm = PERM_WRITE;
     file_descriptor_t stderr_fd = {0};
     stderr_fd.fd = 2;
-    stderr_fd.current_block = 0;
     stderr_fd.offset = 0;
     stderr_fd.mode = F_WRITE;
     stderr_fd.ref_count = 1;
     stderr_fd.entry = stderr;
 
-    state.open_files[0] = stdin_fd;
-    state.open_files[1] = stdout_fd;
-    state.open_files[2] = stderr_fd;
+    // The empty table hands out 0, 1 and 2 first
+    state.nodes = vec_new(8, NULL);
+    *fd_slot(fd_claim()) = stdin_fd;
+    *fd_slot(fd_claim()) = stdout_fd;
+    *fd_slot(fd_claim()) = stderr_fd;
     state.is_mounted = 1;
 
-  for (int i = 3; i < MAX_OPEN_FILES; i++) {
-    state.open_files[i].fd = -1;
-   }
+  if (snapshot) {
+    int ret = snapshot_mount(snapshot);
+    if (ret) {
+      punmount();
+      return ret;
+    }
+  }
+  // Shared blocks are counted and indexed from the maps of the files
+  if (dedup_load() < 0) {
+    punmount();
+    return -1;
+  }
   return 0;
 }
 
@@ -201,40 +205,35 @@ int punmount() {
     }
 
     //Check for open files (critical for tests)
-    for (int i = MAX_OPEN_FILES; i >= 0; i--) {
-        if (i >= 0 && i <= 2) {
-            free(state.open_files[i].entry);
-        } else if (state.open_files[i].entry != NULL) {
+    int capacity = atomic_load(&state.fd_capacity);
+    for (int i = 3; i < capacity; i++) {
+        if (fd_slot(i)->entry != NULL) {
             return FILE_IN_USE;
         }
     }
-
-    //Write root directory to disk (REQUIRED to prevent corruption)
-    if (state.root_dir && state.fs_fd >= 0) {
-        uint8_t* dir_ptr = (uint8_t*)state.root_dir;
-        uint16_t block = 1;
-        int written_blocks = 0;
-
-        while (block != FAT_ENTRY_LAST && written_blocks < state.root_dir_blocks) {
-            off_t offset = state.data_start + ((block-1) * state.block_size);
-            lseek(state.fs_fd, offset, SEEK_SET);
-            write(state.fs_fd, dir_ptr, state.block_size);
-            dir_ptr += state.block_size;
-            block = state.fat[block];
-            written_blocks++;
-        }
-
-        fsync(state.fs_fd);  // Ensure metadata flush
+    for (int i = 0; i <= 2 && i < capacity; i++) {
+        free(fd_slot(i)->entry);
     }
-    //Free root_dir
-    free(state.root_dir);
-    //Sync FAT
-    if (state.fat && msync(state.fat, state.fat_size, MS_SYNC) < 0) {
+    fd_table_free();
+
+    //Sync FAT, after giving back the chains still queued to be freed
+    fat_reclaim_deferred();
+    if (state.fat && !state.read_only &&
+        msync(state.fat, state.fat_size, MS_SYNC) < 0) {
         return FS_IO_ERROR;
     }
 
-    //Unmap FAT
-    if (state.fat != NULL && state.fat != MAP_FAILED) {
+    //Unmap FAT; a mounted snapshot's FAT is a plain copy
+    fat_free_map_destroy();
+    csum_destroy();
+    dedup_destroy();
+    free(state.snap_refs);
+    state.snap_refs = NULL;
+    if (state.read_only) {
+        free(state.fat);
+        state.fat = NULL;
+        state.read_only = false;
+    } else if (state.fat != NULL && state.fat != MAP_FAILED) {
         munmap(state.fat, state.fat_size);
         state.fat = NULL;
     }
@@ -246,10 +245,13 @@ int punmount() {
     }
 
     //Reset state (minimal fields)
+    fs_locks_destroy();
     state.is_mounted = 0;
     state.block_size = 0;
     state.fat_blocks = 0;
     state.fat_size = 0;
+    state.fat_entries = 0;
+    state.fat32 = false;
     state.data_start = 0;
 
     return 0;  // FS_SUCCESS
@@ -324,6 +326,30 @@ int main(int argc, char* argv[]) {
             } else {
                 k_print("Usage: touch <filename>\n");
             }
+        } else if (strcmp(cmd, "mkdir") == 0) {
+            if (arg_count >= 2) {
+                int ret = pmkdir(arg_count, args);
+                if (ret != 0)
+                    k_print("Error %d\n", ret);
+            } else {
+                k_print("Usage: mkdir <dirname>\n");
+            }
+        } else if (strcmp(cmd, "rmdir") == 0) {
+            if (arg_count >= 2) {
+                int ret = prmdir(arg_count, args);
+                if (ret != 0)
+                    k_print("Error %d\n", ret);
+            } else {
+                k_print("Usage: rmdir <dirname>\n");
+            }
+        } else if (strcmp(cmd, "snapshot") == 0) {
+            int ret = psnapshot(arg_count, args);
+            if (ret != 0)
+                k_print("Error %d\n", ret);
+        } else if (strcmp(cmd, "rollback") == 0) {
+            int ret = prollback(arg_count, args);
+            if (ret != 0)
+                k_print("Error %d\n", ret);
         } else if (strcmp(cmd, "mv") == 0) {
             if (arg_count == 3) {
                 int ret = mv(args[1], args[2]);
@@ -355,6 +381,43 @@ int main(int argc, char* argv[]) {
             if (ret != 0)
                 k_print("Error %d\n", ret);
 
+        } else if (strcmp(cmd, "stress") == 0) {
+            int kb = (arg_count >= 2) ? atoi(args[1]) : 1024;
+            int threads = (arg_count >= 3) ? atoi(args[2]) : 8;
+            int ret = pstress(kb, threads);
+            if (ret != 0)
+                k_print("Error %d\n", ret);
+        } else if (strcmp(cmd, "defrag") == 0) {
+            int ret = pdefrag(arg_count, args);
+            if (ret != 0)
+                k_print("Error %d\n", ret);
+        } else if (strcmp(cmd, "scrub") == 0) {
+            int ret = pscrub(arg_count, args);
+            if (ret != 0)
+                k_print("Error %d\n", ret);
+        } else if (strcmp(cmd, "compress") == 0) {
+            int ret = pcompress(arg_count, args);
+            if (ret != 0)
+                k_print("Error %d\n", ret);
+        } else if (strcmp(cmd, "zbench") == 0) {
+            int kb = (arg_count >= 2) ? atoi(args[1]) : 4096;
+            int ret = pzbench(kb);
+            if (ret != 0)
+                k_print("Error %d\n", ret);
+        } else if (strcmp(cmd, "dedup") == 0) {
+            int ret = pdedup(arg_count, args);
+            if (ret != 0)
+                k_print("Error %d\n", ret);
+        } else if (strcmp(cmd, "ddbench") == 0) {
+            int kb = (arg_count >= 2) ? atoi(args[1]) : 1024;
+            int copies = (arg_count >= 3) ? atoi(args[2]) : 8;
+            int ret = pddbench(kb, copies);
+            if (ret != 0)
+                k_print("Error %d\n", ret);
+        } else if (strcmp(cmd, "fsck") == 0) {
+            int ret = pfsck(arg_count, args);
+            if (ret != 0)
+                k_print("Error %d\n", ret);
         } else if (strcmp(cmd, "cp") == 0) {
             int ret = cp(arg_count, args);
             if (ret != 0)
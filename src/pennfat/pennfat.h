@@ -10,7 +10,7 @@
 
 
 int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config);
-// Mount PennFAT
+// Mount PennFAT; "image@name" mounts the image's snapshot `name` read-only
 int pmount(const char* fs_name);
 
 int punmount();
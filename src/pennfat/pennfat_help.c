@@ -1,6 +1,13 @@
 
 #include "./pennfat_help.h"
+#include "./fat_compress.h"
+#include "./fat_csum.h"
+#include "./fat_defrag.h"
+#include "./fat_dir.h"
+#include "./fat_fsck.h"
+#include "./fat_snapshot.h"
 #include "./kernel/kernel.h"
+#include "./kernel/kstdout.h"
 #include "./util/p_errno.h"
 #include "./syscall/sys_call.h"
 
@@ -17,50 +24,393 @@ void k_print(const char* fmt, ...) {
     va_end(args);
 
     if (len > 0) {
-        write(STDOUT_FILENO, buf, len);
+        k_stdout_write(buf, MIN(len, (int)sizeof(buf) - 1));
     }
 }
 
-//Find the first free FAT entry
-uint16_t find_free_fat_entry() {
-  for (uint16_t i = 2; i < (state.fat_size / 2); i++) {
-    if (state.fat[i] == FAT_ENTRY_FREE) {
+void fs_locks_init() {
+  pthread_mutex_init(&state.files_lock, NULL);
+  pthread_rwlock_init(&state.dir_lock, NULL);
+  pthread_mutex_init(&state.dedup_lock, NULL);
+  pthread_mutex_init(&state.fat_lock, NULL);
+}
+
+void fs_locks_destroy() {
+  pthread_mutex_destroy(&state.files_lock);
+  pthread_rwlock_destroy(&state.dir_lock);
+  pthread_mutex_destroy(&state.dedup_lock);
+  pthread_mutex_destroy(&state.fat_lock);
+}
+
+file_descriptor_t* fd_slot(int fd) {
+  if (fd < 0 || fd >= atomic_load(&state.fd_capacity)) {
+    return NULL;
+  }
+  return &state.fd_chunks[fd / FD_CHUNK][fd % FD_CHUNK];
+}
+
+file_descriptor_t* fd_get(int fd) {
+  file_descriptor_t* file = fd_slot(fd);
+  return file && file->entry ? file : NULL;
+}
+
+int fd_claim() {
+  int capacity = atomic_load(&state.fd_capacity);
+  for (int i = state.fd_hint; i < capacity; i++) {
+    if (!fd_slot(i)->entry) {
+      state.fd_hint = i;
       return i;
     }
   }
-  return 0;  // No free blocks
+  if (capacity / FD_CHUNK == MAX_FD_CHUNKS) {
+    return -1;
+  }
+  file_descriptor_t* chunk = malloc(FD_CHUNK * sizeof(file_descriptor_t));
+  if (!chunk) {
+    return -1;
+  }
+  for (int i = 0; i < FD_CHUNK; i++) {
+    chunk[i] = (file_descriptor_t){.fd = -1};
+  }
+  // Readers check the capacity first, so the chunk must be in place by then
+  state.fd_chunks[capacity / FD_CHUNK] = chunk;
+  atomic_store(&state.fd_capacity, capacity + FD_CHUNK);
+  state.fd_hint = capacity;
+  return capacity;
+}
+
+void fd_release(int fd) {
+  *fd_slot(fd) = (file_descriptor_t){.fd = -1};
+  state.fd_hint = MIN(state.fd_hint, fd);
+}
+
+void fd_table_free() {
+  int chunks = atomic_load(&state.fd_capacity) / FD_CHUNK;
+  for (int i = 0; i < chunks; i++) {
+    free(state.fd_chunks[i]);
+    state.fd_chunks[i] = NULL;
+  }
+  atomic_store(&state.fd_capacity, 0);
+  state.fd_hint = 0;
+  vec_destroy(&state.nodes);
+}
+
+// Locks held by this thread, and its signal mask from before the first
+static __thread int fs_lock_depth;
+static __thread sigset_t fs_saved_mask;
+
+static void fs_block_signals() {
+  if (fs_lock_depth++ == 0) {
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &fs_saved_mask);
+  }
+}
+
+static void fs_restore_signals() {
+  if (--fs_lock_depth == 0) {
+    pthread_sigmask(SIG_SETMASK, &fs_saved_mask, NULL);
+  }
+}
+
+void fs_lock(pthread_mutex_t* lock) {
+  fs_block_signals();
+  pthread_mutex_lock(lock);
+}
+
+void fs_unlock(pthread_mutex_t* lock) {
+  pthread_mutex_unlock(lock);
+  fs_restore_signals();
+}
+
+void dir_read_lock() {
+  fs_block_signals();
+  pthread_rwlock_rdlock(&state.dir_lock);
+}
+
+void dir_write_lock() {
+  fs_block_signals();
+  pthread_rwlock_wrlock(&state.dir_lock);
+}
+
+void dir_unlock() {
+  pthread_rwlock_unlock(&state.dir_lock);
+  fs_restore_signals();
 }
 
-// Locate a directory
-dir_entry_t* find_dir_entry(const char* name) {
-  dir_entry_t* entry = state.root_dir;
-  int entries_per_block = state.block_size / sizeof(dir_entry_t);
-  int total_entries = state.root_dir_blocks * entries_per_block;
+uint32_t fat_get(uint32_t block) {
+  if (state.fat32) {
+    return ((uint32_t*)state.fat)[block];
+  }
+  uint16_t next = ((uint16_t*)state.fat)[block];
+  return next == FAT16_ENTRY_LAST ? FAT_ENTRY_LAST : next;
+}
 
-  for (int i = 0; i < total_entries; i++, entry++) {
-    if (entry->name[0] > DIR_ENTRY_DELETED && strcmp(entry->name, name) == 0) {
-      return entry;
+// fat_set with fat_lock already held
+static void fat_set_locked(uint32_t block, uint32_t next) {
+  if (state.fat32) {
+    ((uint32_t*)state.fat)[block] = next;
+  } else {
+    ((uint16_t*)state.fat)[block] =
+        next == FAT_ENTRY_LAST ? FAT16_ENTRY_LAST : (uint16_t)next;
+  }
+  csum_fat_changed(block);
+
+  if (!state.free_map || block < 2 || block >= state.fat_entries) {
+    return;
+  }
+  uint32_t word = block / 64;
+  uint64_t bit = 1ULL << (block % 64);
+  bool was_free = state.free_map[word] & bit;
+  if (next == FAT_ENTRY_FREE && fat_is_shared(block)) {
+    return;  // still in use by a snapshot
+  }
+  if (next == FAT_ENTRY_FREE) {
+    state.free_blocks += !was_free;
+    state.free_map[word] |= bit;
+    state.free_summary[word / 64] |= 1ULL << (word % 64);
+  } else {
+    state.free_blocks -= was_free;
+    state.free_map[word] &= ~bit;
+    if (!state.free_map[word]) {
+      state.free_summary[word / 64] &= ~(1ULL << (word % 64));
     }
   }
-  return NULL;
 }
 
-//Sync directory entries
-void sync_directory_entry(dir_entry_t* entry) {
-  uint8_t* dir_ptr = (uint8_t*)state.root_dir;
-  uint16_t block = 1;
-  int written_blocks = 0;
+void fat_set(uint32_t block, uint32_t next) {
+  fs_lock(&state.fat_lock);
+  fat_set_locked(block, next);
+  fs_unlock(&state.fat_lock);
+}
+
+off_t block_offset(uint32_t block) {
+  return state.data_start + (off_t)(block - 1) * state.block_size;
+}
 
-  while (block != FAT_ENTRY_LAST && written_blocks < state.root_dir_blocks) {
-    off_t offset = state.data_start + ((block - 1) * state.block_size);
-    lseek(state.fs_fd, offset, SEEK_SET);
-    write(state.fs_fd, dir_ptr, state.block_size);
-    dir_ptr += state.block_size;
-    block = state.fat[block];
-    written_blocks++;
+uint32_t entry_first_block(const dir_entry_t* entry) {
+  if (!state.fat32) {
+    return entry->first_block == FAT16_ENTRY_LAST ? FAT_ENTRY_LAST
+                                                   : entry->first_block;
   }
+  return ((uint32_t)entry->first_block_hi << 16) | entry->first_block;
+}
 
-  fsync(state.fs_fd);
+bool entry_is_inline(const dir_entry_t* entry) {
+  return entry->type != FT_DIRECTORY &&
+         entry_first_block(entry) == FAT_ENTRY_LAST;
+}
+
+void set_entry_first_block(dir_entry_t* entry, uint32_t block) {
+  if (!state.fat32) {
+    entry->first_block =
+        block == FAT_ENTRY_LAST ? FAT16_ENTRY_LAST : (uint16_t)block;
+    return;
+  }
+  entry->first_block = block & 0xFFFF;
+  entry->first_block_hi = block >> 16;
+}
+
+int fat_free_map_init() {
+  uint32_t words = (state.fat_entries + 63) / 64;
+  state.free_map = calloc(words, sizeof(uint64_t));
+  state.free_summary = calloc((words + 63) / 64, sizeof(uint64_t));
+  if (!state.free_map || !state.free_summary) {
+    fat_free_map_destroy();
+    return -1;
+  }
+  // Blocks 0 and 1 are never handed out (header and root directory)
+  state.free_blocks = 0;
+  for (uint32_t i = 2; i < state.fat_entries; i++) {
+    if (fat_get(i) == FAT_ENTRY_FREE) {
+      state.free_blocks++;
+      state.free_map[i / 64] |= 1ULL << (i % 64);
+      state.free_summary[i / 64 / 64] |= 1ULL << (i / 64 % 64);
+    }
+  }
+  state.free_hint = 0;
+  state.deferred_free = vec_new(FAT_DEFERRED_MAX, NULL);
+  return 0;
+}
+
+void fat_free_map_destroy() {
+  if (state.deferred_free.data) {
+    vec_destroy(&state.deferred_free);
+    state.deferred_free.data = NULL;
+  }
+  free(state.free_map);
+  free(state.free_summary);
+  state.free_map = NULL;
+  state.free_summary = NULL;
+}
+
+// fat_reclaim_deferred with fat_lock already held
+static void reclaim_locked() {
+  if (!state.deferred_free.data) {
+    return;
+  }
+  for (size_t i = 0; i < vec_len(&state.deferred_free); i++) {
+    uint32_t block = (uintptr_t)vec_get(&state.deferred_free, i);
+    uint32_t blocks_freed = 0;
+    while (block != FAT_ENTRY_LAST && block != FAT_ENTRY_FREE &&
+           blocks_freed < state.fat_entries) {
+      uint32_t next = fat_get(block);
+      fat_set_locked(block, FAT_ENTRY_FREE);
+      block = next;
+      blocks_freed++;
+    }
+  }
+  vec_clear(&state.deferred_free);
+}
+
+void fat_free_chain_deferred(uint32_t block) {
+  if (block == FAT_ENTRY_LAST || block == FAT_ENTRY_FREE) {
+    return;
+  }
+  fs_lock(&state.fat_lock);
+  vec_push_back(&state.deferred_free, (ptr_t)(uintptr_t)block);
+  if (vec_len(&state.deferred_free) >= FAT_DEFERRED_MAX) {
+    reclaim_locked();
+  }
+  fs_unlock(&state.fat_lock);
+}
+
+void fat_reclaim_deferred() {
+  fs_lock(&state.fat_lock);
+  reclaim_locked();
+  fs_unlock(&state.fat_lock);
+}
+
+// Next-fit over the summary level, so each lookup reads a handful of words
+static uint32_t find_free_in_map() {
+  uint32_t summary_words = (state.fat_entries + 64 * 64 - 1) / (64 * 64);
+  uint32_t start = state.free_hint / (64 * 64);
+  for (uint32_t i = 0; i < summary_words; i++) {
+    uint32_t s = (start + i) % summary_words;
+    if (state.free_summary[s]) {
+      uint32_t word = s * 64 + __builtin_ctzll(state.free_summary[s]);
+      uint32_t block = word * 64 + __builtin_ctzll(state.free_map[word]);
+      state.free_hint = block;
+      return block;
+    }
+  }
+  return 0;  // No free blocks
+}
+
+void fat_hold(uint32_t block) {
+  fs_lock(&state.fat_lock);
+  state.snap_refs[block]++;
+  uint32_t word = block / 64;
+  uint64_t bit = 1ULL << (block % 64);
+  if (state.free_map[word] & bit) {
+    state.free_blocks--;
+    state.free_map[word] &= ~bit;
+    if (!state.free_map[word]) {
+      state.free_summary[word / 64] &= ~(1ULL << (word % 64));
+    }
+  }
+  fs_unlock(&state.fat_lock);
+}
+
+void fat_release(uint32_t block) {
+  fs_lock(&state.fat_lock);
+  state.snap_refs[block]--;
+  if (!state.snap_refs[block] && fat_get(block) == FAT_ENTRY_FREE) {
+    fat_set_locked(block, FAT_ENTRY_FREE);
+  }
+  fs_unlock(&state.fat_lock);
+}
+
+bool fat_is_shared(uint32_t block) {
+  return state.snap_refs && state.snap_refs[block];
+}
+
+uint32_t fat_alloc_block() {
+  if (!state.free_map) {
+    return 0;
+  }
+  fs_lock(&state.fat_lock);
+  uint32_t block = find_free_in_map();
+  if (!block && !vec_is_empty(&state.deferred_free)) {
+    reclaim_locked();
+    block = find_free_in_map();
+  }
+  if (block) {
+    fat_set_locked(block, FAT_ENTRY_LAST);
+  }
+  fs_unlock(&state.fat_lock);
+  return block;
+}
+
+uint32_t fat_alloc_chain(uint32_t count) {
+  if (!state.free_map || count == 0) {
+    return 0;
+  }
+  fs_lock(&state.fat_lock);
+  if (state.free_blocks < count && !vec_is_empty(&state.deferred_free)) {
+    reclaim_locked();
+  }
+  uint32_t first = 0;
+  if (state.free_blocks >= count) {
+    // Blocks come out in ascending order, so the chain is contiguous
+    // wherever the free space is
+    uint32_t prev = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t block = find_free_in_map();
+      fat_set_locked(block, FAT_ENTRY_LAST);
+      if (prev) {
+        fat_set_locked(prev, block);
+      } else {
+        first = block;
+      }
+      prev = block;
+    }
+  }
+  fs_unlock(&state.fat_lock);
+  return first;
+}
+
+// First block of the lowest run of count free blocks, or 0
+static uint32_t find_free_run(uint32_t count) {
+  uint32_t first = 0;
+  uint32_t len = 0;
+  for (uint32_t b = 2; b < state.fat_entries && len < count;) {
+    uint64_t word = state.free_map[b / 64];
+    // Whole words are skipped when they are all used or all free
+    if (b % 64 == 0 && word == 0) {
+      len = 0;
+      b += 64;
+    } else if (b % 64 == 0 && word == ~0ULL && b + 64 <= state.fat_entries) {
+      first = len ? first : b;
+      len += 64;
+      b += 64;
+    } else if (word & (1ULL << (b % 64))) {
+      first = len ? first : b;
+      len++;
+      b++;
+    } else {
+      len = 0;
+      b++;
+    }
+  }
+  return len >= count ? first : 0;
+}
+
+uint32_t fat_alloc_run(uint32_t count) {
+  if (!state.free_map || count == 0) {
+    return 0;
+  }
+  fs_lock(&state.fat_lock);
+  uint32_t first = find_free_run(count);
+  if (!first && !vec_is_empty(&state.deferred_free)) {
+    reclaim_locked();
+    first = find_free_run(count);
+  }
+  for (uint32_t i = 0; first && i < count; i++) {
+    fat_set_locked(first + i, i + 1 < count ? first + i + 1 : FAT_ENTRY_LAST);
+  }
+  fs_unlock(&state.fat_lock);
+  return first;
 }
 
 //Touch command - Create new files
@@ -75,6 +425,14 @@ int ptouch(int argc, char* argv[]) {
 
   for (int i = 1; i < argc; i++) {
     const char* filename = argv[i];
+    // An existing file only gets a new mtime, it is not truncated
+    uint32_t dir;
+    dir_entry_t entry;
+    if (path_lookup(filename, &dir, &entry) == 0) {
+      entry.mtime = time(NULL);
+      k_update_entry(dir, &entry);
+      continue;
+    }
     int fd = k_open(filename, F_WRITE);
     if (fd < 0) {
       k_print("Error creating file '%s': %d\n", filename, fd);
@@ -82,42 +440,114 @@ int ptouch(int argc, char* argv[]) {
     }
     k_close(fd);
   }
-  sync_directory_entry(NULL);
 
   return 0;
 }
 
-//Mv command - Rename files
+//Mkdir command - Create directories
+int pmkdir(int argc, char* argv[]) {
+  if (!state.is_mounted) {
+    return FS_NOT_MOUNTED;
+  }
+
+  if (argc < 2) {
+    return INVALID_MODE;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    int ret = k_mkdir(argv[i]);
+    if (ret < 0) {
+      k_print("Error creating directory '%s': %d\n", argv[i], ret);
+    }
+  }
+  return 0;
+}
+
+//Snapshot command - List, take or delete snapshots
+int psnapshot(int argc, char* argv[]) {
+  if (argc == 1) {
+    return snapshot_list();
+  }
+  if (argc == 2 && strcmp(argv[1], "-d") != 0) {
+    return snapshot_create(argv[1]);
+  }
+  if (argc == 3 && strcmp(argv[1], "-d") == 0) {
+    return snapshot_delete(argv[2]);
+  }
+  k_print("Usage: snapshot [[-d] <name>]\n");
+  return INVALID_MODE;
+}
+
+//Rollback command - Go back to a snapshot
+int prollback(int argc, char* argv[]) {
+  if (argc != 2) {
+    k_print("Usage: rollback <name>\n");
+    return INVALID_MODE;
+  }
+  return snapshot_rollback(argv[1]);
+}
+
+//Rmdir command - Remove empty directories
+int prmdir(int argc, char* argv[]) {
+  if (!state.is_mounted) {
+    return FS_NOT_MOUNTED;
+  }
+
+  if (argc < 2) {
+    return INVALID_MODE;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    int ret = k_rmdir(argv[i]);
+    if (ret < 0) {
+      k_print("Error removing directory '%s': %d\n", argv[i], ret);
+    }
+  }
+  return 0;
+}
+
+//Mv command - Rename or move files
 int mv(const char* source, const char* dest) {
   if (!state.is_mounted)
     return FS_NOT_MOUNTED;
 
   // Find source entry
-  dir_entry_t* src = find_dir_entry(source);
-  if (!src)
-    return FILE_NOT_FOUND;
+  uint32_t src_dir;
+  dir_entry_t src;
+  int ret = path_lookup(source, &src_dir, &src);
+  if (ret)
+    return ret;
   // Check source permissions
-  if (src->perm < 4 || src->perm > 7) {
+  if ((src.perm & PERM_ALL) < 4) {
     k_print("Read permission denied at source '%s'\n", source);
     return PERMISSION_DENIED;
   }
+
+  // Moving onto a directory puts the file inside it
+  char target[256];
+  uint32_t dst_dir;
+  dir_entry_t dst;
+  snprintf(target, sizeof(target), "%s", dest);
+  ret = path_lookup(target, &dst_dir, &dst);
+  if (ret == 0 && dst.type == FT_DIRECTORY) {
+    snprintf(target, sizeof(target), "%s/%s", dest, src.name);
+    ret = path_lookup(target, &dst_dir, &dst);
+  }
   // Check if destination exists
-  dir_entry_t* dst = find_dir_entry(dest);
-  if (dst) {
-    int perm = dst->perm;
+  if (ret == 0) {
+    if (dst.type == FT_DIRECTORY)
+      return IS_A_DIRECTORY;
+    int perm = dst.perm & PERM_ALL;
     if (perm != 2 && perm != 6 && perm != 7) {
       k_print("Write permission denied at destination %s\n", dest);
       return PERMISSION_DENIED;
     }
-    rm(dest);
+    if (src_dir == dst_dir && strcmp(src.name, dst.name) == 0)
+      return 0;
+    rm(target);
   }
-  // Update name
-  strncpy(src->name, dest, MAX_FILENAME_LEN - 1);
-  src->name[MAX_FILENAME_LEN - 1] = '\0';
-  src->mtime = time(NULL);
-  sync_directory_entry(NULL);
 
-  return 0;
+  return k_rename(source, target);
 }
 
 //Rm - Remove files
@@ -241,6 +671,14 @@ int cp_host_to_pennfat(const char* host_src, const char* dest) {
         return -1;
     }
 
+    // Files are copied a run of blocks at a time; pipes go through the
+    // buffer below
+    int ret = k_import(host_fd, dest);
+    if (ret != INVALID_MODE) {
+        close(host_fd);
+        return ret;
+    }
+
     int penn_fd = k_open(dest, F_WRITE);
     if (penn_fd < 0) {
         close(host_fd);
@@ -269,56 +707,30 @@ int cp_pennfat_to_host(const char* src, const char* host_dest) {
         return -1;
     }
 
-    int penn_fd = k_open(src, F_READ);
-    if (penn_fd < 0) {
-        close(host_fd);
-        return penn_fd;
-    }
-
-    char buf[1024];
-    ssize_t n;
-    while ((n = k_read(penn_fd, sizeof(buf), buf)) > 0) {
-        if (write(host_fd, buf, n) != n) {
-            close(host_fd);
-            k_close(penn_fd);
-            return -1;
-        }
-    }
-
+    int ret = k_export(src, host_fd);
     close(host_fd);
-    return k_close(penn_fd);
+    return ret;
 }
 
 //Copy files to and from pennFAT
 int cp_pennfat_to_pennfat(const char* src, const char* dest) {
-    dir_entry_t* src_entry = find_dir_entry(src);
-    if (!src_entry || src_entry->name[0] == DIR_ENTRY_DELETED) {
+    uint32_t src_dir;
+    dir_entry_t src_entry;
+    if (path_lookup(src, &src_dir, &src_entry) != 0) {
         k_print("Error: Source file '%s' not found\n", src);
         return FILE_NOT_FOUND;
     }
 
-    int src_fd = k_open(src, F_READ);
-    if (src_fd < 0)
-        return src_fd;
-
-    int dest_fd = k_open(dest, F_WRITE);
-    if (dest_fd < 0) {
-        k_close(src_fd);
-        return dest_fd;
-    }
-
-    char buf[1024];
-    ssize_t n;
-    while ((n = k_read(src_fd, sizeof(buf), buf)) > 0) {
-        if (k_write(dest_fd, buf, n) != n) {
-            k_close(src_fd);
-            k_close(dest_fd);
-            return -1;
-        }
-    }
+    // Copying onto a directory puts the copy inside it
+    char target[256];
+    uint32_t dst_dir;
+    dir_entry_t dst;
+    snprintf(target, sizeof(target), "%s", dest);
+    if (path_lookup(target, &dst_dir, &dst) == 0 && dst.type == FT_DIRECTORY)
+        snprintf(target, sizeof(target), "%s/%s", dest, src_entry.name);
 
-    k_close(src_fd);
-    return k_close(dest_fd);
+    // Whole blocks are copied inside the image, not through a buffer
+    return k_copy(src, target);
 }
 
 //Cp command - To copy files
@@ -363,20 +775,410 @@ int chmod(const char* filename, int perm) {
   if (!state.is_mounted)
     return FS_NOT_MOUNTED;
 
-  dir_entry_t* entry = find_dir_entry(filename);
-  if (!entry)
-    return FILE_NOT_FOUND;
-  int new_perm = entry->perm + perm;
-  if (new_perm < 0 || new_perm > 7)
+  uint32_t dir;
+  dir_entry_t entry;
+  int ret = path_lookup(filename, &dir, &entry);
+  if (ret)
+    return ret;
+  if (entry.type == FT_DIRECTORY)
+    return IS_A_DIRECTORY;
+  int new_perm = (entry.perm & PERM_ALL) + perm;
+  if (new_perm < 0 || new_perm > PERM_ALL)
     return INVALID_MODE;
-  entry->perm = new_perm;
+  entry.perm = new_perm | (entry.perm & (PERM_COMPRESSED | PERM_DEDUP));
 
-  entry->mtime = time(NULL);
-  sync_directory_entry(NULL);
-  return 0;
+  entry.mtime = time(NULL);
+  return k_update_entry(dir, &entry);
 }
 
 //Ls command - List directory entries
 int ls(const char* filename) {
   return k_ls(filename);
-}
\ No newline at end of file
+}
+// One stress thread's file and outcome
+typedef struct {
+  char name[MAX_FILENAME_LEN];
+  int id;   // seeds the byte pattern, so threads write different data
+  int kb;
+  int ret;
+} stress_arg_t;
+
+#define STRESS_CHUNK 4096
+
+// Write, read back and delete one file
+static void* stress_thread(void* arg) {
+  stress_arg_t* job = arg;
+  char buf[STRESS_CHUNK], check[STRESS_CHUNK];
+  int chunks = job->kb * 1024 / STRESS_CHUNK;
+
+  int fd = k_open(job->name, F_WRITE);
+  if (fd < 0) {
+    job->ret = P_ERRNO;
+    return NULL;
+  }
+  for (int i = 0; i < chunks && job->ret == 0; i++) {
+    memset(buf, job->id + i, sizeof(buf));
+    if (k_write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      job->ret = FS_IO_ERROR;
+    }
+  }
+  k_close(fd);
+
+  fd = k_open(job->name, F_READ);
+  if (fd < 0) {
+    job->ret = job->ret ? job->ret : P_ERRNO;
+    return NULL;
+  }
+  for (int i = 0; i < chunks && job->ret == 0; i++) {
+    memset(buf, job->id + i, sizeof(buf));
+    if (k_read(fd, sizeof(check), check) != sizeof(check) ||
+        memcmp(buf, check, sizeof(buf)) != 0) {
+      job->ret = FS_IO_ERROR;
+    }
+  }
+  k_close(fd);
+
+  int ret = k_unlink(job->name);
+  if (job->ret == 0) {
+    job->ret = ret;
+  }
+  return NULL;
+}
+
+//Stress command - Hammer disjoint files from several host threads
+int pstress(int kb, int max_threads) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (kb < STRESS_CHUNK / 1024 || max_threads < 1 ||
+      max_threads > MAX_OPEN_FILES - 3)
+    return INVALID_MODE;
+
+  pthread_t* threads = malloc(max_threads * sizeof(pthread_t));
+  stress_arg_t* jobs = calloc(max_threads, sizeof(stress_arg_t));
+  if (!threads || !jobs) {
+    free(threads);
+    free(jobs);
+    return P_ENOMEM;
+  }
+
+  int ret = 0;
+  for (int n = 1; n <= max_threads && ret == 0; n *= 2) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i++) {
+      jobs[i] = (stress_arg_t){.id = i, .kb = kb};
+      snprintf(jobs[i].name, MAX_FILENAME_LEN, "stress%d", i);
+      pthread_create(&threads[i], NULL, stress_thread, &jobs[i]);
+    }
+    for (int i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+      ret = ret ? ret : jobs[i].ret;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Every byte is written once and read once
+    double secs =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    k_print("%3d threads: %8.2f MB/s\n", n, 2.0 * n * kb / 1024 / secs);
+  }
+
+  free(threads);
+  free(jobs);
+  return ret;
+}
+
+//Fsck command - Check the image, and repair it with -r
+int pfsck(int argc, char* argv[]) {
+  bool repair = argc > 1 && strcmp(argv[1], "-r") == 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc > 1 + repair) {
+    threads = atoi(argv[1 + repair]);
+  }
+  if (argc > 2 + repair || threads < 1 || threads > FSCK_THREADS_MAX) {
+    k_print("Usage: fsck [-r] [threads]\n");
+    return INVALID_MODE;
+  }
+  return fat_fsck(repair, threads);
+}
+
+//Defrag command - Move fragmented files onto runs of consecutive blocks
+int pdefrag(int argc, char* argv[]) {
+  if (argc > 2 || (argc == 2 && atoi(argv[1]) < 0)) {
+    k_print("Usage: defrag [pause_us]\n");
+    return INVALID_MODE;
+  }
+  return fat_defrag(argc == 2 ? atoi(argv[1]) : DEFRAG_PAUSE_US);
+}
+
+//Scrub command - Check every block in use against its checksum
+int pscrub(int argc, char* argv[]) {
+  if (argc > 2 || (argc == 2 && atoi(argv[1]) < 0)) {
+    k_print("Usage: scrub [kb_per_sec]\n");
+    return INVALID_MODE;
+  }
+  int ret = fat_scrub(argc == 2 ? atoi(argv[1]) : SCRUB_RATE_KB);
+  if (ret == INVALID_MODE) {
+    k_print("scrub: this image has no checksums\n");
+  }
+  return ret;
+}
+
+// Blocks in a file's chain, 0 if it is inline or cannot be found
+static uint32_t file_blocks(const char* path) {
+  uint32_t dir;
+  dir_entry_t entry;
+  uint32_t count = 0;
+  if (path_lookup(path, &dir, &entry) == 0 && !entry_is_inline(&entry)) {
+    for (uint32_t b = entry_first_block(&entry); b != FAT_ENTRY_LAST;
+         b = fat_get(b)) {
+      count++;
+    }
+  }
+  return count;
+}
+
+//Compress command - Store files compressed, or plainly again with -d
+int pcompress(int argc, char* argv[]) {
+  bool on = !(argc > 1 && strcmp(argv[1], "-d") == 0);
+  if (argc < 3 - on) {
+    k_print("Usage: compress [-d] <file>...\n");
+    return INVALID_MODE;
+  }
+  uint32_t total_before = 0, total_after = 0;
+  for (int i = 2 - on; i < argc; i++) {
+    uint32_t before = file_blocks(argv[i]);
+    int ret = k_compress(argv[i], on);
+    if (ret)
+      return ret;
+    uint32_t after = file_blocks(argv[i]);
+    k_print("%s: %u -> %u blocks%s\n", argv[i], before, after,
+            on && after >= before ? " (does not compress)" : "");
+    total_before += before;
+    total_after += after;
+  }
+  if (argc > 3 - on && total_before) {
+    k_print("total: %u -> %u blocks (%.1f%%)\n", total_before, total_after,
+            100.0 * total_after / total_before);
+  }
+  return 0;
+}
+
+#define ZBENCH_CHUNK 4096
+#define ZBENCH_READ_CHUNK 65536
+
+// Lines like a busy log's, so the benchmark has something to compress
+static void zbench_text(char* buf, int len) {
+  static const char* levels[] = {"INFO", "DEBUG", "WARN"};
+  static const char* events[] = {"scheduled", "blocked", "unblocked",
+                                 "exited", "stopped"};
+  char line[128];
+  unsigned seed = 42;
+  for (int done = 0, tick = 0; done < len; tick++) {
+    seed = seed * 1103515245 + 12345;
+    int n = snprintf(line, sizeof(line),
+                     "[%8d] %-5s pid %4u prio %u: process %s\n", tick,
+                     levels[(seed >> 16) % 3], (seed >> 8) % 64,
+                     (seed >> 4) % 3, events[(seed >> 12) % 5]);
+    n = MIN(n, len - done);
+    memcpy(buf + done, line, n);
+    done += n;
+  }
+}
+
+static double zbench_secs(const struct timespec* start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Write text to path a chunk at a time, read it back cold and check it
+static int zbench_run(const char* path, bool compress, const char* text,
+                      int len) {
+  int fd = k_open(path, F_WRITE);
+  if (fd < 0)
+    return P_ERRNO;
+  k_close(fd);
+  int ret = compress ? k_compress(path, true) : 0;
+  if (ret)
+    return ret;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  fd = k_open(path, F_APPEND);
+  if (fd < 0)
+    return P_ERRNO;
+  for (int done = 0; done < len && ret == 0; done += ZBENCH_CHUNK) {
+    int n = MIN(ZBENCH_CHUNK, len - done);
+    if (k_write(fd, text + done, n) != n)
+      ret = FS_IO_ERROR;
+  }
+  k_close(fd);
+  double write_secs = zbench_secs(&start);
+
+  char* check = malloc(len + ZBENCH_READ_CHUNK);
+  if (!check)
+    return ret ? ret : P_ENOMEM;
+  fsync(state.fs_fd);
+  posix_fadvise(state.fs_fd, 0, 0, POSIX_FADV_DONTNEED);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  fd = ret ? -1 : k_open(path, F_READ);
+  int got = 0;
+  for (int n; fd >= 0 && (n = k_read(fd, ZBENCH_READ_CHUNK, check + got)) > 0;)
+    got += n;
+  if (fd >= 0)
+    k_close(fd);
+  double read_secs = zbench_secs(&start);
+  if (ret == 0 && (got != len || memcmp(check, text, len) != 0))
+    ret = FS_IO_ERROR;
+  free(check);
+
+  if (ret == 0) {
+    k_print("%-10s %6u blocks  write %8.2f MB/s  read %8.2f MB/s\n",
+            compress ? "compressed" : "plain", file_blocks(path),
+            len / 1048576.0 / write_secs, len / 1048576.0 / read_secs);
+  }
+  k_unlink(path);
+  return ret;
+}
+
+//Zbench command - Compare plain and compressed files of log-like text
+int pzbench(int kb) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (kb < 1)
+    return INVALID_MODE;
+  int len = kb * 1024;
+  char* text = malloc(len);
+  if (!text)
+    return P_ENOMEM;
+  zbench_text(text, len);
+  k_print("%d KB of log text, written %d bytes at a time\n", kb, ZBENCH_CHUNK);
+  int ret = zbench_run("zbench.plain", false, text, len);
+  if (ret == 0)
+    ret = zbench_run("zbench.z", true, text, len);
+  free(text);
+  return ret;
+}
+
+// Free data blocks once the queued frees are given back
+static uint32_t free_blocks_now() {
+  fat_reclaim_deferred();
+  return state.free_blocks;
+}
+
+//Dedup command - Share the blocks of files, or store them plainly with -u
+int pdedup(int argc, char* argv[]) {
+  bool on = !(argc > 1 && strcmp(argv[1], "-u") == 0);
+  if (argc < 3 - on) {
+    k_print("Usage: dedup [-u] <file>...\n");
+    return INVALID_MODE;
+  }
+  for (int i = 2 - on; i < argc; i++) {
+    uint32_t before = free_blocks_now();
+    int ret = k_dedup(argv[i], on);
+    if (ret)
+      return ret;
+    int64_t freed = (int64_t)free_blocks_now() - before;
+    k_print("%s: %lld blocks %s\n", argv[i], (long long)llabs(freed),
+            freed >= 0 ? "freed" : "taken");
+  }
+  return 0;
+}
+
+#define DDBENCH_EDITS 4  // bytes changed in each copy
+
+// Write `copies` versions of text, each with a few bytes changed in place,
+// to plain or deduplicated files; reports the blocks they took
+static int ddbench_run(bool dedup, char* text, int len, int copies) {
+  char path[MAX_FILENAME_LEN];
+  uint32_t before = free_blocks_now();
+  double write_secs = 0;
+  int ret = 0;
+  for (int c = 0; c < copies && ret == 0; c++) {
+    snprintf(path, sizeof(path), "ddbench.%s.%d", dedup ? "d" : "p", c);
+    int fd = k_open(path, F_WRITE);
+    if (fd < 0)
+      return P_ERRNO;
+    k_close(fd);
+    if (dedup && (ret = k_dedup(path, true)))
+      break;
+
+    // Edits in place keep every other block the same as the first copy's
+    char saved[DDBENCH_EDITS];
+    int at[DDBENCH_EDITS];
+    for (int e = 0; e < DDBENCH_EDITS; e++) {
+      at[e] = (int)(((uint64_t)(c + 1) * 104729 * (e + 1)) % len);
+      saved[e] = text[at[e]];
+      text[at[e]] = c ? 'A' + c % 26 : saved[e];
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fd = k_open(path, F_APPEND);
+    if (fd < 0)
+      return P_ERRNO;
+    for (int done = 0; done < len && ret == 0; done += ZBENCH_CHUNK) {
+      int n = MIN(ZBENCH_CHUNK, len - done);
+      if (k_write(fd, text + done, n) != n)
+        ret = FS_IO_ERROR;
+    }
+    k_close(fd);
+    write_secs += zbench_secs(&start);
+
+    // Read back and check it before the edits are undone
+    char* check = malloc(len);
+    fd = ret || !check ? -1 : k_open(path, F_READ);
+    int got = 0;
+    for (int n; fd >= 0 && (n = k_read(fd, len - got, check + got)) > 0;)
+      got += n;
+    if (fd >= 0)
+      k_close(fd);
+    if (ret == 0 && (got != len || memcmp(check, text, len) != 0))
+      ret = check ? FS_IO_ERROR : P_ENOMEM;
+    free(check);
+    for (int e = DDBENCH_EDITS - 1; e >= 0; e--)
+      text[at[e]] = saved[e];
+  }
+
+  uint32_t used = before - free_blocks_now();
+  if (ret == 0) {
+    k_print("%-6s %7u blocks  write %8.2f MB/s\n", dedup ? "dedup" : "plain",
+            used, (double)len * copies / 1048576.0 / write_secs);
+  }
+  for (int c = 0; c < copies; c++) {
+    snprintf(path, sizeof(path), "ddbench.%s.%d", dedup ? "d" : "p", c);
+    k_unlink(path);
+  }
+  return ret ? ret : (int)used;
+}
+
+//Ddbench command - Compare plain and deduplicated copies of the same text
+int pddbench(int kb, int copies) {
+  if (!state.is_mounted)
+    return FS_NOT_MOUNTED;
+  if (kb < 1 || copies < 1)
+    return INVALID_MODE;
+  int len = kb * 1024;
+  char* text = malloc(len);
+  if (!text)
+    return P_ENOMEM;
+  zbench_text(text, len);
+  k_print("%d copies of %d KB of log text, %d bytes changed in each, "
+          "written %d bytes at a time\n",
+          copies, kb, DDBENCH_EDITS, ZBENCH_CHUNK);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int plain = ddbench_run(false, text, len, copies);
+  double plain_secs = zbench_secs(&start);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int dedup = plain < 0 ? plain : ddbench_run(true, text, len, copies);
+  double dedup_secs = zbench_secs(&start);
+  free(text);
+  if (dedup < 0)
+    return dedup;
+  k_print("dedup saved %.1f%% of the blocks; run time %+.1f%% against "
+          "plain\n",
+          plain ? 100.0 * (plain - dedup) / plain : 0.0,
+          100.0 * (dedup_secs - plain_secs) / plain_secs);
+  return 0;
+}
+
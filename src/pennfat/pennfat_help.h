@@ -2,6 +2,10 @@
 #define PENNFAT_H
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,20 +14,28 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "./vec/Vec.h"
+
 // Constants
 #define MAX_FILENAME_LEN 32
-#define MAX_ROOT_DIR_BLOCKS 64
 #define DIR_ENTRY_SIZE 64
+#define INLINE_DATA_MAX 14         // largest file kept inside its entry
 #define FAT_ENTRY_FREE 0
-#define FAT_ENTRY_LAST 0xFFFF
-#define FAT_MAX_BLOCKS 32
+#define FAT_ENTRY_LAST 0xFFFFFFFF  // end of chain, as returned by fat_get
+#define FAT16_ENTRY_LAST 0xFFFF    // end of chain as stored in a 16-bit FAT
+#define FAT_MAX_BLOCKS 32          // largest FAT of the 16-bit format
+#define FAT32_MAX_BLOCKS 65536     // largest FAT of the 32-bit format
+#define FAT_HEADER_FAT32 0x80      // fat[0] flag: FAT entries are 32 bits
+#define FAT_HEADER_CSUM 0x40       // fat[0] flag: block checksums, fat_csum.h
 #define FAT_BLOCK_SIZES {256, 512, 1024, 2048, 4096}
+#define FAT_DEFERRED_MAX 256       // freed chains queued before a reclaim
 
 // File types
 #define FT_UNKNOWN 0
 #define FT_REGULAR 1
 #define FT_DIRECTORY 2
 #define FT_SYMLINK 4
+#define FT_SNAPSHOT 8  // entry of the snapshot table, see fat_snapshot.h
 
 // Permissions
 #define PERM_NONE 0
@@ -33,6 +45,8 @@
 #define PERM_READ_WRITE 6
 #define PERM_EXEC 1
 #define PERM_ALL 7
+#define PERM_COMPRESSED 8  // not a permission: stored compressed, see fat_compress.h
+#define PERM_DEDUP 16      // not a permission: blocks shared by contents, see fat_dedup.h
 
 // File modes for k_open
 #define F_READ 0
@@ -50,8 +64,9 @@
 #define DIR_ENTRY_IN_USE 2
 
 // System limits
-#define MAX_OPEN_FILES 32
-#define MAX_ROOT_ENTRIES 512  // Adjust based on your block size/entry size
+#define MAX_OPEN_FILES 1024  // descriptors per process
+#define FD_CHUNK 64          // slots added to the open-file table at a time
+#define MAX_FD_CHUNKS 1024   // so at most 65536 open-file descriptions
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
@@ -59,43 +74,79 @@
 typedef struct {
   char name[MAX_FILENAME_LEN];
   uint32_t size;
-  uint16_t first_block;
+  uint16_t first_block;     // low 16 bits, see entry_first_block
   uint8_t type;
   uint8_t perm;
   time_t mtime;
-  char reserved[16];
+  uint16_t first_block_hi;  // high 16 bits, only set in the 32-bit format
+  char inline_data[INLINE_DATA_MAX];  // contents while the file has no block
 } dir_entry_t;
 
-// File descriptor entry
+// Open regular file, shared by every description open on it
+typedef struct file_node_st {
+  dir_entry_t* entry;      // the file's own copy until the last close
+  uint32_t dir;            // directory holding the file
+  uint32_t current_block;  // cached block of the chain, see current_index
+  uint32_t current_index;  // position of current_block within the chain
+  uint32_t prev_block;     // block before current_block, if current_index > 0
+  bool unlinked;           // removed while open; blocks freed on last close
+  struct frame_cache_st* frames;  // compressed files, allocated on first use
+  struct map_cache_st* map;       // deduplicated files, allocated on first use
+  int mapped;  // direct mappings of its blocks, see kmmap.h
+  int opens;   // descriptions open on it
+  pthread_mutex_t lock;  // entry copy, cache and its descriptions' offsets
+} file_node_t;
+
+// Open-file description: one per open, with its own offset. Process
+// descriptors inherited by a child or copied by redirection share it.
 typedef struct {
   int fd;
-  uint16_t current_block;
   uint32_t offset;
   int mode;
   int ref_count;
-  dir_entry_t* entry;
+  dir_entry_t* entry;    // the node's entry for regular files
+  file_node_t* node;     // set for regular files, NULL for pipes and stdio
+  struct pipe_st* pipe;  // set when this descriptor is one end of a pipe
 } file_descriptor_t;
 
 // Process-specific file descriptor table entry
 typedef struct proc_fd_ent_st {
   int proc_fd;  // Process specific file descriptor
   int mode;     // file mode of ref'd process: F_WRITE, F_READ, F_APPEND
-  int offset;
-  int global_fd;  // Global file descriptor
+  int global_fd;  // Global file descriptor, which holds the offset
 } proc_fd_ent;
 
 // Filesystem State
 typedef struct {
   int fs_fd;                                     // Disk image file descriptor
-  uint16_t* fat;                                 // Memory-mapped FAT
-  uint16_t fat_blocks;                           // Number of blocks in FAT
+  void* fat;                                     // Memory-mapped FAT
+  bool fat32;                                    // 32-bit FAT entries
+  uint32_t fat_blocks;                           // Number of blocks in FAT
   uint16_t block_size;                           // Block size in bytes
   uint32_t fat_size;                             // FAT size in bytes
+  uint32_t fat_entries;                          // Usable FAT entries
   uint32_t data_start;                           // Offset to data region
-  dir_entry_t* root_dir;                         // Root directory entries
+  uint64_t* free_map;      // bit i set while block i is free
+  uint64_t* free_summary;  // bit w set while free_map[w] has a free block
+  uint32_t free_hint;      // where the next free block search starts
+  uint32_t free_blocks;    // number of free data blocks
+  Vec deferred_free;       // heads of chains still to be freed
+  uint8_t* snap_refs;      // snapshots holding each block, NULL if none
+  uint32_t* csums;         // checksum of every block, NULL if the image has none
+  uint32_t root;           // root directory: block 1, or a snapshot's
+  bool read_only;          // a snapshot is mounted
   int is_mounted;                                // Mount status flag
-  file_descriptor_t open_files[MAX_OPEN_FILES];  // Open files table
-  int root_dir_blocks;
+  // Open-file descriptions, FD_CHUNK slots per chunk; chunks never move, so
+  // a description stays put while the table grows. See fd_get.
+  file_descriptor_t* fd_chunks[MAX_FD_CHUNKS];
+  atomic_int fd_capacity;  // slots in the chunks allocated so far
+  int fd_hint;             // no free slot below this one
+  Vec nodes;               // file_node_t* of every open regular file
+  // Lock order: files_lock, a node's lock, dir_lock, dedup_lock, fat_lock
+  pthread_mutex_t files_lock;  // descriptions, nodes and their ref counts
+  pthread_rwlock_t dir_lock;   // every directory tree
+  pthread_mutex_t dedup_lock;  // reference counts and index, fat_dedup.c
+  pthread_mutex_t fat_lock;    // FAT, free map and deferred frees
 } pennfat_state_t;
 
 extern pennfat_state_t state;
@@ -104,35 +155,239 @@ extern pennfat_state_t state;
 void k_print(const char* fmt, ...);
 
 /**
- * @brief Find the first free FAT entry.
- * 
- * @return Index of the free FAT entry, or 0 if none found.
+ * @brief Create the filesystem locks; called by pmount.
  */
-uint16_t find_free_fat_entry();
+void fs_locks_init();
 
 /**
- * @brief Find a directory entry by its name.
- * 
- * @param name Pointer to name of the file to search for.
- * @return Pointer to the directory entry if found, NULL otherwise.
+ * @brief Destroy the filesystem locks; called by punmount.
  */
-dir_entry_t* find_dir_entry(const char* name);
+void fs_locks_destroy();
 
+/**
+ * @brief Slot fd of the open-file table, in use or not.
+ *
+ * @param fd Global file descriptor.
+ * @return The slot, or NULL if fd lies past the chunks allocated so far.
+ */
+file_descriptor_t* fd_slot(int fd);
 
+/**
+ * @brief The open-file description fd stands for.
+ *
+ * @param fd Global file descriptor.
+ * @return The description, or NULL if fd is not open.
+ */
+file_descriptor_t* fd_get(int fd);
 
 /**
- * @brief Write the root directory blocks to disk.
- * 
- * @param entry Optional pointer for syncing particular blocks.
+ * @brief Finds the lowest free slot of the open-file table, adding a chunk
+ * of FD_CHUNK slots when every one is taken. The caller holds files_lock
+ * and fills the slot in before taking another.
+ *
+ * @return The slot's fd, or -1 if the table cannot grow.
+ */
+int fd_claim();
+
+/**
+ * @brief Gives a slot back to the open-file table; files_lock is held.
+ *
+ * @param fd Global file descriptor.
+ */
+void fd_release(int fd);
+
+/**
+ * @brief Frees the open-file table and the list of open files; called by
+ * punmount once nothing is open.
+ */
+void fd_table_free();
+
+/**
+ * @brief Take one of the filesystem mutexes.
+ *
+ * Like scheduler_lock, every filesystem lock blocks all signals while it is
+ * held, so a PennOS process is never suspended (or killed) halfway through
+ * a filesystem update and never leaves a lock held while asleep. Locks may
+ * nest in the order given in pennfat_state_t.
+ *
+ * @param lock The mutex.
+ */
+void fs_lock(pthread_mutex_t* lock);
+
+/**
+ * @brief Release a mutex taken with fs_lock.
+ *
+ * @param lock The mutex.
+ */
+void fs_unlock(pthread_mutex_t* lock);
+
+/**
+ * @brief Take the directory lock for lookups.
+ */
+void dir_read_lock();
+
+/**
+ * @brief Take the directory lock for changes.
+ */
+void dir_write_lock();
+
+/**
+ * @brief Release the directory lock.
+ */
+void dir_unlock();
+
+/**
+ * @brief Read a FAT entry in either format.
+ *
+ * @param block Index of the FAT entry.
+ * @return The next block of the chain, FAT_ENTRY_FREE or FAT_ENTRY_LAST.
+ */
+uint32_t fat_get(uint32_t block);
+
+/**
+ * @brief Write a FAT entry in either format and keep the free map current.
+ *
+ * @param block Index of the FAT entry.
+ * @param next The next block of the chain, FAT_ENTRY_FREE or FAT_ENTRY_LAST.
+ */
+void fat_set(uint32_t block, uint32_t next);
+
+/**
+ * @brief Byte offset of a data block in the image.
+ *
+ * @param block Data block number (block 1 is the root directory).
+ * @return Offset of the start of the block.
+ */
+off_t block_offset(uint32_t block);
+
+/**
+ * @brief Get the first block of a file in either format.
+ *
+ * @param entry Directory entry of the file.
+ * @return First block, or FAT_ENTRY_LAST if the file has none.
+ */
+uint32_t entry_first_block(const dir_entry_t* entry);
+
+/**
+ * @brief Check whether a file keeps its contents in its directory entry.
+ *
+ * New files start out with no blocks and store up to INLINE_DATA_MAX bytes
+ * in inline_data; the first write that goes past that moves them to a block.
+ *
+ * @param entry Directory entry of the file.
+ * @return true if the file has no blocks.
+ */
+bool entry_is_inline(const dir_entry_t* entry);
+
+/**
+ * @brief Set the first block of a file in either format.
+ *
+ * @param entry Directory entry of the file.
+ * @param block First block, or FAT_ENTRY_LAST.
+ */
+void set_entry_first_block(dir_entry_t* entry, uint32_t block);
+
+/**
+ * @brief Build the free block bitmap from the FAT of the mounted image.
+ *
+ * The bitmap has a second, 64x smaller level marking which words still
+ * hold a free block, so a search skips full regions without touching them.
+ *
+ * @return 0 on success, -1 if it could not be allocated.
+ */
+int fat_free_map_init();
+
+/**
+ * @brief Release the free block bitmap.
  */
-void sync_directory_entry(dir_entry_t* entry);
+void fat_free_map_destroy();
+
+/**
+ * @brief Queue a chain that is no longer referenced to be freed later.
+ *
+ * Truncated and deleted files give their blocks back this way, so neither
+ * has to walk the chain. Queued chains are walked and freed together once
+ * FAT_DEFERRED_MAX of them are waiting, when the allocator runs dry, and at
+ * unmount.
+ *
+ * @param block First block of the chain (FAT_ENTRY_LAST for none).
+ */
+void fat_free_chain_deferred(uint32_t block);
+
+/**
+ * @brief Free every queued chain now.
+ */
+void fat_reclaim_deferred();
+
+/**
+ * @brief Count one more snapshot holding a block.
+ *
+ * A held block is never handed out, even once the live FAT frees it.
+ *
+ * @param block The block.
+ */
+void fat_hold(uint32_t block);
+
+/**
+ * @brief Count one snapshot less holding a block.
+ *
+ * The block becomes free again once no snapshot holds it and the live FAT
+ * does not use it.
+ *
+ * @param block The block.
+ */
+void fat_release(uint32_t block);
+
+/**
+ * @brief Whether a snapshot holds a block, so it must not be written in
+ * place.
+ *
+ * @param block The block.
+ * @return true if at least one snapshot holds it.
+ */
+bool fat_is_shared(uint32_t block);
+
+/**
+ * @brief Allocate a free block as a chain of its own (marked end of chain).
+ *
+ * Searches the free block bitmap starting where the last search ended,
+ * reclaiming the queued chains first if nothing is free. Finding and
+ * claiming the block happen under one lock, so concurrent callers never get
+ * the same block.
+ *
+ * @return The block, or 0 if the disk is full.
+ */
+uint32_t fat_alloc_block();
+
+/**
+ * @brief Allocate a whole chain of blocks at once.
+ *
+ * Either every block is allocated or none is.
+ *
+ * @param count Length of the chain.
+ * @return First block of the chain, or 0 if fewer than count are free.
+ */
+uint32_t fat_alloc_chain(uint32_t count);
+
+/**
+ * @brief Allocate a chain of consecutive blocks, the lowest run that fits.
+ *
+ * @param count Length of the chain.
+ * @return First block of the chain, or 0 if no run of count blocks is free.
+ */
+uint32_t fat_alloc_run(uint32_t count);
 
 /**
  * @brief Format and initialize a new PennFAT filesystem.
  *
  * This function creates a new filesystem with the specified name,
  * FAT block count, and block size configuration. It writes an empty
- * FAT table and initializes the root directory.
+ * FAT table and initializes the root directory as an empty directory tree
+ * (see fat_dir.h).
+ *
+ * A FAT of up to FAT_MAX_BLOCKS blocks uses 16-bit entries; a larger one
+ * (up to FAT32_MAX_BLOCKS) uses 32-bit entries, which is flagged in fat[0]
+ * and allows images of many gigabytes.
  *
  * @param fs_name Name of the new filesystem (file to create).
  * @param blocks_in_fat Number of blocks reserved for FAT.
@@ -145,8 +400,9 @@ int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config);
  * @brief Mount a PennFAT filesystem.
  *
  * Opens the filesystem file, maps the FAT table into memory,
- * loads the root directory, and initializes file descriptors
- * for standard input, output, and error.
+ * converts a flat root directory left by older versions to a directory
+ * tree, and initializes file descriptors for standard input, output,
+ * and error.
  *
  * @param fs_name Name of the filesystem file to mount.
  * @return 0 on success, negative error code on failure.
@@ -156,8 +412,9 @@ int mount(const char* fs_name);
 /**
  * @brief Unmount the currently mounted PennFAT filesystem.
  *
- * This function flushes and unmaps the FAT, writes the root directory
- * back to disk, and releases resources associated with the filesystem.
+ * This function flushes and unmaps the FAT and releases resources
+ * associated with the filesystem. Directories are written as they change,
+ * so there is nothing else to write back.
  *
  * @return 0 on success, negative error code on failure.
  */
@@ -172,11 +429,53 @@ int unmount();
  */
 int ptouch(int argc, char* argv[]);
 
+/**
+ * @brief Create new empty directories.
+ *
+ * @param argc Number of arguments.
+ * @param argv Array of arguments (paths of the directories to create).
+ * @return 0 on success, negative error code on failure.
+ */
+int pmkdir(int argc, char* argv[]);
+
+/**
+ * @brief Remove empty directories.
+ *
+ * @param argc Number of arguments.
+ * @param argv Array of arguments (paths of the directories to remove).
+ * @return 0 on success, negative error code on failure.
+ */
+int prmdir(int argc, char* argv[]);
+
+/**
+ * @brief List, take or delete snapshots.
+ *
+ * "snapshot" lists them, "snapshot <name>" takes one and
+ * "snapshot -d <name>" deletes one.
+ *
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @return 0 on success, negative error code on failure.
+ */
+int psnapshot(int argc, char* argv[]);
+
+/**
+ * @brief Roll the filesystem back to a snapshot.
+ *
+ * @param argc Number of arguments.
+ * @param argv Array of arguments ("rollback <name>").
+ * @return 0 on success, negative error code on failure.
+ */
+int prollback(int argc, char* argv[]);
+
 /**
  * @brief Rename or move a file from source to destination.
+ *
+ * If dest is an existing directory the file is moved into it under its
+ * current name.
  * 
- * @param source Original file name.
- * @param dest New file name.
+ * @param source Original path.
+ * @param dest New path.
  * @return 0 on success, negative error code on failure.
  */
 int mv(const char* source, const char* dest);
@@ -247,9 +546,104 @@ int chmod(const char* filename, int perm);
 /**
  * @brief List information about a file or all files in the directory.
  * 
- * @param filename Name of the file (if NULL, list all).
+ * @param filename Path of a file or directory (if NULL, the root).
  * @return 0 on success, negative error code on failure.
  */
 int ls(const char* filename);
 
+/**
+ * @brief Stress the filesystem from several host threads at once.
+ *
+ * Runs rounds with 1, 2, 4 ... max_threads threads. In each round every
+ * thread writes kb kilobytes to a file of its own, reads them back and
+ * checks them, then deletes the file. Prints the combined throughput of
+ * each round.
+ *
+ * @param kb Kilobytes per thread.
+ * @param max_threads Largest number of threads.
+ * @return 0 on success, negative error code if a thread saw an error.
+ */
+int pstress(int kb, int max_threads);
+
+/**
+ * @brief Fsck command: "fsck [-r] [threads]" checks the image, and repairs
+ * it with -r. See fat_fsck.
+ *
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @return 0 if the image is clean, negative error code otherwise.
+ */
+int pfsck(int argc, char* argv[]);
+
+/**
+ * @brief Defrag command: "defrag [pause_us]" defragments the mounted image.
+ * See fat_defrag.
+ *
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @return 0 on success, negative error code on failure.
+ */
+int pdefrag(int argc, char* argv[]);
+
+/**
+ * @brief Scrub command: "scrub [kb_per_sec]" checks every block in use
+ * against its checksum, at most kb_per_sec KB per second (0 for no limit).
+ * See fat_scrub.
+ *
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @return 0 if every block matches, negative error code otherwise.
+ */
+int pscrub(int argc, char* argv[]);
+
+/**
+ * @brief Compress command: "compress [-d] <file>..." stores files
+ * compressed, or plainly again with -d, and prints the blocks each took
+ * before and after. See k_compress.
+ *
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @return 0 on success, negative error code on failure.
+ */
+int pcompress(int argc, char* argv[]);
+
+/**
+ * @brief Compare plain and compressed storage of the same log-like text.
+ *
+ * Writes kb kilobytes to a plain file and to a compressed one, 4 KB per
+ * write, reads each back with the image out of the page cache and checks
+ * it, then prints the blocks each took and both throughputs. The files are
+ * deleted afterwards.
+ *
+ * @param kb Kilobytes of text.
+ * @return 0 on success, negative error code on failure.
+ */
+int pzbench(int kb);
+
+/**
+ * @brief Dedup command: "dedup [-u] <file>..." stores files as maps of
+ * blocks shared by contents, or plainly again with -u, and prints the
+ * blocks each change freed or took. See k_dedup.
+ *
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @return 0 on success, negative error code on failure.
+ */
+int pdedup(int argc, char* argv[]);
+
+/**
+ * @brief Compare plain and deduplicated storage of near-identical files.
+ *
+ * Writes `copies` files of kb kilobytes of the same log-like text, each
+ * with a few bytes changed in place, 4 KB per write and read back to
+ * check; first as plain files, then deduplicated. Prints the blocks each
+ * set took and its write throughput, the share of blocks dedup saved and
+ * how much longer the run took. The files are deleted afterwards.
+ *
+ * @param kb Kilobytes per file.
+ * @param copies Number of files.
+ * @return 0 on success, negative error code on failure.
+ */
+int pddbench(int kb, int copies);
+
 #endif  // PENNFAT_H
\ No newline at end of file
@@ -1,24 +1,32 @@
 
 #include "./kernel/kernel.h"
 #include "./kernel/kernel_helper.h"
+#include "./scheduler/sched_policy.h"
 #include "./util/p_errno.h"
 
 int main(int argc, char* argv[]) {
-  // Check for correct number of arguments and set aio_enabled to true if async
-  if (argc > 2 && strcmp(argv[2], "--aio") == 0) {
-    aio_enabled = true;
-    int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+  char* log_fname = "log";  // default log file
+
+  // Optional arguments after the filesystem: [log_fname] [--aio] [--sched=X]
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--aio") == 0) {
+      // Set aio_enabled to true if async
+      aio_enabled = true;
+      int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+      fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+    } else if (strncmp(argv[i], "--sched=", 8) == 0) {
+      if (sched_select_policy(argv[i] + 8) == -1) {
+        k_print("Unknown scheduler '%s', using %s\n", argv[i] + 8,
+                sched_policy->name);
+      }
+    } else {
+      log_fname = argv[i];  // use the provided log file name
+    }
   }
   // Mount PennFAT FS
-  if (pmount(argv[1]) == -1) {
+  if (pmount(argv[1]) != 0) {
     k_print("Failed to mount PennFAT");
   }
-  char* log_fname = "log";  // default log file
-
-  if (argc > 2 && strcmp(argv[2], "--aio") != 0) {
-    log_fname = argv[2];  // use the provided log file name
-  }
   log_init(log_fname);  // Initialize logging
   scheduler_init();     // Initialize the scheduler
   init_kernel();        // Initialize the kernel
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include "sched_policy.h"
+#include "scheduler_helper.h"
+
+#define MLFQ_LEVELS 4
+#define MLFQ_BOOST_TICKS 50  // every 5 seconds everyone returns to the top
+
+// Ticks a process may use at each level before it is demoted
+static const int level_allotment[MLFQ_LEVELS] = {1, 2, 4, 8};
+
+// FIFO run queue per level
+static ThreadNode* heads[MLFQ_LEVELS];
+static ThreadNode* tails[MLFQ_LEVELS];
+static int ticks_since_boost = 0;
+
+// A process is never placed above the level given by its nice priority
+static int top_level_of(pcb_t* pcb) {
+  return pcb->priority;
+}
+
+static void mlfq_push(pcb_t* pcb) {
+  ThreadNode* node = malloc(sizeof(ThreadNode));
+  if (!node) {
+    perror("Failed to allocate memory for thread node");
+    exit(EXIT_FAILURE);
+  }
+  node->pcb = pcb;
+  node->next = NULL;
+  int level = pcb->sched_level;
+  if (tails[level]) {
+    tails[level]->next = node;
+  } else {
+    heads[level] = node;
+  }
+  tails[level] = node;
+  pcb->sched_slot = level;
+}
+
+static void mlfq_enqueue(pcb_t* pcb) {
+  if (pcb->sched_slot >= 0) {
+    return;  // already runnable
+  }
+  if (pcb->sched_level < top_level_of(pcb)) {
+    pcb->sched_level = top_level_of(pcb);
+  }
+  mlfq_push(pcb);
+}
+
+static bool mlfq_remove(pcb_t* pcb) {
+  int level = pcb->sched_slot;
+  if (level < 0 || level >= MLFQ_LEVELS) {
+    return false;
+  }
+  ThreadNode* prev = NULL;
+  for (ThreadNode* cur = heads[level]; cur; prev = cur, cur = cur->next) {
+    if (cur->pcb == pcb) {
+      if (prev) {
+        prev->next = cur->next;
+      } else {
+        heads[level] = cur->next;
+      }
+      if (tails[level] == cur) {
+        tails[level] = prev;
+      }
+      free(cur);
+      pcb->sched_slot = -1;
+      return true;
+    }
+  }
+  return false;
+}
+
+static pcb_t* mlfq_pick_next(void) {
+  for (int level = 0; level < MLFQ_LEVELS; level++) {
+    ThreadNode* node = heads[level];
+    if (node) {
+      pcb_t* pcb = node->pcb;
+      heads[level] = node->next;
+      if (!heads[level]) {
+        tails[level] = NULL;
+      }
+      free(node);
+      pcb->sched_slot = -1;
+      return pcb;
+    }
+  }
+  return NULL;
+}
+
+static bool mlfq_is_empty(void) {
+  for (int level = 0; level < MLFQ_LEVELS; level++) {
+    if (heads[level]) return false;
+  }
+  return true;
+}
+
+// Ran until preempted: charge the tick and demote once the allotment is used
+static void mlfq_quantum_expired(pcb_t* pcb) {
+  pcb->sched_ticks++;
+  if (pcb->sched_level < MLFQ_LEVELS - 1 &&
+      pcb->sched_ticks >= level_allotment[pcb->sched_level]) {
+    pcb->sched_level++;
+    pcb->sched_ticks = 0;
+  }
+}
+
+// Gave up the CPU to wait (sleep, waitpid, stdin): move up one level
+static void mlfq_blocked(pcb_t* pcb) {
+  if (pcb->sched_level > top_level_of(pcb)) {
+    pcb->sched_level--;
+  }
+  pcb->sched_ticks = 0;
+}
+
+// Periodic priority boost so CPU-bound processes cannot starve forever
+static void mlfq_tick(void) {
+  if (++ticks_since_boost < MLFQ_BOOST_TICKS) {
+    return;
+  }
+  ticks_since_boost = 0;
+
+  // Reset every process, then rebuild the queues in their current order
+  for (size_t i = 0; i < vec_len(&pcb_list); i++) {
+    pcb_t* pcb = vec_get(&pcb_list, i);
+    if (pcb && pcb->sched_slot < 0) {
+      pcb->sched_level = top_level_of(pcb);
+      pcb->sched_ticks = 0;
+    }
+  }
+  for (int level = 0; level < MLFQ_LEVELS; level++) {
+    ThreadNode* node = heads[level];
+    heads[level] = tails[level] = NULL;
+    while (node) {
+      ThreadNode* next = node->next;
+      pcb_t* pcb = node->pcb;
+      free(node);
+      pcb->sched_level = top_level_of(pcb);
+      pcb->sched_ticks = 0;
+      mlfq_push(pcb);
+      node = next;
+    }
+  }
+}
+
+const sched_policy_t mlfq_policy = {
+    .name = "mlfq",
+    .min_priority = 0,
+    .max_priority = 2,
+    .enqueue = mlfq_enqueue,
+    .remove = mlfq_remove,
+    .pick_next = mlfq_pick_next,
+    .is_empty = mlfq_is_empty,
+    .quantum_expired = mlfq_quantum_expired,
+    .blocked = mlfq_blocked,
+    .tick = mlfq_tick,
+};
@@ -0,0 +1,41 @@
+#include "sched_policy.h"
+#include <string.h>
+
+// All policies that can be selected at boot
+static const sched_policy_t* policies[] = {&priority_policy, &stride_policy,
+                                           &mlfq_policy};
+
+const sched_policy_t* sched_policy = &priority_policy;
+
+int sched_select_policy(const char* name) {
+  for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+    if (strcmp(policies[i]->name, name) == 0) {
+      sched_policy = policies[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+bool sched_priority_valid(int priority) {
+  return priority >= sched_policy->min_priority &&
+         priority <= sched_policy->max_priority;
+}
+
+void sched_note_quantum_expired(pcb_t* pcb) {
+  if (sched_policy->quantum_expired) {
+    sched_policy->quantum_expired(pcb);
+  }
+}
+
+void sched_note_blocked(pcb_t* pcb) {
+  if (sched_policy->blocked) {
+    sched_policy->blocked(pcb);
+  }
+}
+
+void sched_note_tick(void) {
+  if (sched_policy->tick) {
+    sched_policy->tick();
+  }
+}
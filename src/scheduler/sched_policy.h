@@ -0,0 +1,81 @@
+#ifndef SCHED_POLICY_H
+#define SCHED_POLICY_H
+
+#include <stdbool.h>
+#include "pcb.h"
+
+/**
+ * @brief A pluggable scheduling policy.
+ *
+ * The scheduler core (run_scheduler) only ever talks to the active policy
+ * through this table: runnable processes are handed to `enqueue`, taken back
+ * with `remove`, and `pick_next` chooses who runs for the next quantum. Each
+ * policy also defines the range of values `nice` accepts for it. The
+ * feedback hooks at the end are optional and may be NULL.
+ */
+typedef struct sched_policy_st {
+  const char* name;      // name used to select the policy at boot
+  int min_priority;      // lowest value accepted by nice
+  int max_priority;      // highest value accepted by nice
+  void (*enqueue)(pcb_t* pcb);    // make a process runnable
+  bool (*remove)(pcb_t* pcb);     // drop a process, true if it was queued
+  pcb_t* (*pick_next)(void);      // dequeue the next process to run
+  bool (*is_empty)(void);         // no runnable processes
+  void (*quantum_expired)(pcb_t* pcb);  // preempted after a full quantum
+  void (*blocked)(pcb_t* pcb);          // gave up the CPU to wait
+  void (*tick)(void);                   // called once per clock tick
+} sched_policy_t;
+
+// Fixed-ratio 9:6:4 round robin across priorities 0, 1 and 2 (default).
+extern const sched_policy_t priority_policy;
+
+// Stride scheduling with per-process weights derived from nice -20..19.
+extern const sched_policy_t stride_policy;
+
+// Multi-level feedback queue: demotes CPU hogs, promotes processes that block.
+extern const sched_policy_t mlfq_policy;
+
+// The policy currently in use by the scheduler.
+extern const sched_policy_t* sched_policy;
+
+/**
+ * @brief Selects the scheduling policy by name.
+ *
+ * Must be called before any process is created (i.e. before init_kernel).
+ *
+ * @param name Name of the policy ("priority", "stride" or "mlfq").
+ * @return 0 on success, -1 if no policy has that name.
+ */
+int sched_select_policy(const char* name);
+
+/**
+ * @brief Checks whether a priority is valid for the active policy.
+ *
+ * @param priority Priority (nice value) to check.
+ * @return true if the active policy accepts the priority.
+ */
+bool sched_priority_valid(int priority);
+
+/**
+ * @brief Tells the active policy that a process used its whole quantum.
+ *
+ * @param pcb The process that was preempted by the clock.
+ */
+void sched_note_quantum_expired(pcb_t* pcb);
+
+/**
+ * @brief Tells the active policy that a process is about to block.
+ *
+ * Called from k_sleep and from k_wait_on (waitpid, pipes and terminal input)
+ * before the process suspends.
+ *
+ * @param pcb The process that is giving up the CPU.
+ */
+void sched_note_blocked(pcb_t* pcb);
+
+/**
+ * @brief Gives the active policy its per-tick callback.
+ */
+void sched_note_tick(void);
+
+#endif  // SCHED_POLICY_H
@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "./vec/Vec.h"
+#include "sched_policy.h"
+
+#define STRIDE_NICE_MIN -20
+#define STRIDE_NICE_MAX 19
+#define STRIDE1 (1 << 20)  // stride of a process with weight 1
+
+// Weight per nice value (-20..19); each step is ~1.25x the CPU share of the
+// next one, with nice 0 at 1024
+static const int nice_to_weight[] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,   335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+static Vec heap;               // min-heap of runnable PCBs ordered by pass
+static bool heap_ready = false;
+static uint64_t global_pass = 0;  // pass of the most recently selected PCB
+
+static uint64_t stride_of(pcb_t* pcb) {
+  int nice = pcb->priority;
+  if (nice < STRIDE_NICE_MIN) nice = STRIDE_NICE_MIN;
+  if (nice > STRIDE_NICE_MAX) nice = STRIDE_NICE_MAX;
+  return (uint64_t)STRIDE1 * 1024 / nice_to_weight[nice - STRIDE_NICE_MIN];
+}
+
+static pcb_t* heap_at(size_t i) {
+  return vec_get(&heap, i);
+}
+
+static void heap_place(size_t i, pcb_t* pcb) {
+  vec_set(&heap, i, pcb);
+  pcb->sched_slot = (int)i;
+}
+
+static void sift_up(size_t i) {
+  pcb_t* pcb = heap_at(i);
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    pcb_t* p = heap_at(parent);
+    if (p->pass <= pcb->pass) break;
+    heap_place(i, p);
+    i = parent;
+  }
+  heap_place(i, pcb);
+}
+
+static void sift_down(size_t i) {
+  size_t n = vec_len(&heap);
+  pcb_t* pcb = heap_at(i);
+  while (true) {
+    size_t child = 2 * i + 1;
+    if (child >= n) break;
+    if (child + 1 < n && heap_at(child + 1)->pass < heap_at(child)->pass) {
+      child++;
+    }
+    if (pcb->pass <= heap_at(child)->pass) break;
+    heap_place(i, heap_at(child));
+    i = child;
+  }
+  heap_place(i, pcb);
+}
+
+// Detach the element at position i, keeping the heap property
+static void heap_remove_at(size_t i) {
+  size_t last = vec_len(&heap) - 1;
+  pcb_t* removed = heap_at(i);
+  if (i != last) {
+    pcb_t* moved = heap_at(last);
+    heap_place(i, moved);
+    vec_pop_back(&heap);
+    sift_down(i);
+    sift_up(moved->sched_slot);
+  } else {
+    vec_pop_back(&heap);
+  }
+  removed->sched_slot = -1;
+}
+
+static void stride_enqueue(pcb_t* pcb) {
+  if (!heap_ready) {
+    heap = vec_new(INITIAL_NUM_PCB, NULL);
+    heap_ready = true;
+  }
+  if (pcb->sched_slot >= 0) {
+    return;  // already runnable
+  }
+  // Processes that slept (or are new) restart at the current virtual time so
+  // they cannot monopolise the CPU to "catch up"
+  if (pcb->pass < global_pass) {
+    pcb->pass = global_pass;
+  }
+  vec_push_back(&heap, pcb);
+  sift_up(vec_len(&heap) - 1);
+}
+
+static bool stride_remove(pcb_t* pcb) {
+  if (!heap_ready || pcb->sched_slot < 0 ||
+      (size_t)pcb->sched_slot >= vec_len(&heap) ||
+      heap_at(pcb->sched_slot) != pcb) {
+    return false;
+  }
+  heap_remove_at(pcb->sched_slot);
+  return true;
+}
+
+static pcb_t* stride_pick_next(void) {
+  if (!heap_ready || vec_is_empty(&heap)) {
+    return NULL;
+  }
+  pcb_t* next = heap_at(0);
+  heap_remove_at(0);
+  global_pass = next->pass;
+  next->pass += stride_of(next);  // charge the quantum it is about to use
+  return next;
+}
+
+static bool stride_is_empty(void) {
+  return !heap_ready || vec_is_empty(&heap);
+}
+
+const sched_policy_t stride_policy = {
+    .name = "stride",
+    .min_priority = STRIDE_NICE_MIN,
+    .max_priority = STRIDE_NICE_MAX,
+    .enqueue = stride_enqueue,
+    .remove = stride_remove,
+    .pick_next = stride_pick_next,
+    .is_empty = stride_is_empty,
+};
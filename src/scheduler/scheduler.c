@@ -1,24 +1,33 @@
 #include "scheduler.h"
+#include <sched.h>
+#include <stdatomic.h>
+#include "./kernel/kaio.h"
+#include "./kernel/kstdin.h"
 #include "scheduler_helper.h"
+#include "sched_policy.h"
 
-int schedule_index = 0;  // Global scheduling index
-int running_pid = 0;     // Currently running process PID
+int running_pid = 0;  // Currently running process PID
 
-// Scheduling ratio: 2.25x:1.5x:x => 9:6:4 (Priority 0:1:2)
-static int priority_schedule[] = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0,  // Priority 0 (9x)
-    1, 1, 1, 1, 1, 1,           // Priority 1 (6x)
-    2, 2, 2, 2                  // Priority 2 (4x)
-};
+// Held while a clock tick or a yield is switching processes, so the two never
+// touch the run queues at the same time
+static atomic_flag scheduler_busy = ATOMIC_FLAG_INIT;
 
-void run_scheduler() {
-  // Check if all queues are empty
-  if (are_all_queues_empty()) {
-    idle_scheduler();
-    return;
+// Set by scheduler_kick until a tick, kicked or clock, gets to switch
+// processes for it; kicked_pid is the process it was for, 0 for none
+static atomic_bool kick_pending;
+static atomic_int kicked_pid;
+
+// Release the scheduler, raising again a kick whose tick found it held
+static void scheduler_release(void) {
+  atomic_flag_clear(&scheduler_busy);
+  if (atomic_load(&kick_pending)) {
+    kill(getpid(), SIGKICK);
   }
+}
 
-  // Suspend current running thread and requeue if needed
+// Suspend the running process and requeue it, telling the policy it used
+// its quantum if it was preempted by the clock
+static void suspend_running(bool expired) {
   if (running_pid != 0) {
     pcb_t* current_pcb = NULL;
 
@@ -33,54 +42,98 @@ void run_scheduler() {
     if (current_pcb) {
       spthread_suspend(current_pcb->thread);
       if (current_pcb->status == P_RUNNING) {
+        if (expired) {
+          sched_note_quantum_expired(current_pcb);
+        }
         add_to_queue(current_pcb);
       }
     }
   }
+}
+
+// Switch to a process taken off the run queue
+static void run_pcb(pcb_t* next_pcb) {
+  running_pid = next_pcb->pid;
+  next_pcb->status = P_RUNNING;
+  log_event("SCHEDULE", "\t%d\t%d\t%s", running_pid, next_pcb->priority,
+            next_pcb->cmd);
+  spthread_continue(next_pcb->thread);
+}
 
-  // Pick next PCB according to priority scheduling
-  pcb_t* next_pcb = NULL;
-  int attempts = 0;
-  int selected_priority;
+// Hand the CPU to the process a kick woke, if it is ready and not already
+// running; the process it preempts is requeued without losing its standing
+static bool run_kicked(int pid) {
+  pcb_t* pcb = pid ? k_get_pcb_with_given_pid(pid) : NULL;
+  if (!pcb || pcb->pid == running_pid || pcb->status != P_RUNNING ||
+      !sched_policy->remove(pcb)) {
+    return false;
+  }
+  suspend_running(false);
+  run_pcb(pcb);
+  return true;
+}
 
-  while (!next_pcb && attempts < 19) {  // max 19 entries in priority_schedule
-    selected_priority = priority_schedule[schedule_index];
-    next_pcb = remove_from_queue(selected_priority);
-    schedule_index = (schedule_index + 1) % 19;
-    attempts++;
+// Switch to the process the policy picks next; `expired` is whether the one
+// it replaces used up its quantum
+static void schedule(bool expired) {
+  // Check if all queues are empty
+  if (are_all_queues_empty()) {
+    idle_scheduler();
+    return;
   }
 
+  // Suspend current running thread and requeue if needed
+  suspend_running(expired);
+
+  // Pick next PCB according to the active scheduling policy
+  pcb_t* next_pcb = pick_next_from_queue();
+
   if (next_pcb) {
-    running_pid = next_pcb->pid;
-    next_pcb->status = P_RUNNING;
-    log_event("SCHEDULE", "\t%d\t%d\t%s", running_pid, selected_priority,
-              next_pcb->cmd);
-    spthread_continue(next_pcb->thread);
+    run_pcb(next_pcb);
   } else {
     running_pid = 0;
   }
 }
 
+void run_scheduler() {
+  schedule(true);
+}
+
 void scheduler_tick(int signum) {
-  current_tick++;
-  log_tick();
+  // Kicks run the scheduler early but are not clock ticks
+  bool clock = signum == SIGALRM;
+  if (clock) {
+    current_tick++;
+    log_tick();
+  }
+  if (atomic_flag_test_and_set(&scheduler_busy)) {
+    return;  // a process is yielding; sleepers are woken on the next tick
+  }
+  bool kick = atomic_exchange(&kick_pending, false);
+  if (!clock && !kick) {
+    atomic_flag_clear(&scheduler_busy);
+    return;  // a clock tick already ran for this kick
+  }
+  int kick_pid = atomic_exchange(&kicked_pid, 0);
+  if (clock) {
+    sched_note_tick();
+  }
   for (int i = 0; i < vec_len(&sleeping_processes); i++) {
     pcb_t* pcb = vec_get(&sleeping_processes, i);
     if (pcb->status == P_BLOCKED && pcb->wake_tick <= current_tick) {
       if (pcb->is_background || is_in_background_jobs(pcb)) {
-        if (i == vec_len(&sleeping_processes) - 1) {
-          k_print("[%d] + Done ", pcb->job_id);
-        } else {
-          k_print("[%d] Done ", pcb->job_id);
+        // Build the whole notice first so it goes out in a single write
+        char line[PRINT_BUFFER_SIZE];
+        bool last = i == vec_len(&sleeping_processes) - 1;
+        int len = snprintf(line, sizeof(line), "[%d] %sDone ", pcb->job_id,
+                           last ? "+ " : "");
+        for (int j = 0; pcb->argv[j] != NULL && len < sizeof(line); j++) {
+          len += snprintf(line + len, sizeof(line) - len, "%s ", pcb->argv[j]);
         }
-        for (int j = 0; pcb->argv[j] != NULL; j++) {
-          k_print("%s ", pcb->argv[j]);
+        if (len < sizeof(line)) {
+          snprintf(line + len, sizeof(line) - len, "\n%s", PROMPT);
         }
-        // Print newline
-        k_print("\n");
-
-        // Print shell prompt
-        k_print("%s", PROMPT);
+        k_print("%s", line);
       }
 
       pcb->status = P_RUNNING;
@@ -88,16 +141,76 @@ void scheduler_tick(int signum) {
       vec_shallow_erase(&sleeping_processes, i--);
     }
   }
+  k_stdin_poll();  // wake readers of the terminal if input has arrived
+  k_aio_poll();    // and processes whose I/O the worker has finished
+
+  // Idle outside the critical section so the next tick can run normally
+  bool idle = are_all_queues_empty();
+  // A kicked tick leaves alone the process it was for if that is running
+  if (!idle && !run_kicked(kick_pid) && (clock || kick_pid != running_pid)) {
+    schedule(clock);
+  }
+  atomic_flag_clear(&scheduler_busy);
+  if (idle) {
+    idle_scheduler();
+  }
+}
+
+// Signal mask of the thread holding the lock, restored when it is released
+static _Thread_local sigset_t lock_saved_mask;
+
+void scheduler_lock(void) {
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &lock_saved_mask);
+  while (atomic_flag_test_and_set(&scheduler_busy)) {
+    // A tick is switching processes and may be suspending this very thread,
+    // so wait with signals unblocked or it would never see the suspend
+    pthread_sigmask(SIG_SETMASK, &lock_saved_mask, NULL);
+    sched_yield();
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+  }
+}
+
+void scheduler_unlock(void) {
+  scheduler_release();
+  pthread_sigmask(SIG_SETMASK, &lock_saved_mask, NULL);
+}
+
+void scheduler_yield(pcb_t* self) {
+  if (!are_all_queues_empty()) {
+    run_scheduler();
+  }
+  scheduler_release();
+  // Signals stay blocked until sigsuspend, so a continue from a waker that
+  // runs before we are asleep stays pending instead of being lost
+  spthread_suspend_self();
+  pthread_sigmask(SIG_SETMASK, &lock_saved_mask, NULL);
+}
 
-  run_scheduler();
+void scheduler_kick(int pid) {
+  atomic_store(&kicked_pid, pid);
+  atomic_store(&kick_pending, true);
+  // If a process is switching, the kicked tick returns early and the kick is
+  // raised again when the scheduler is released
+  kill(getpid(), SIGKICK);
 }
 
 void scheduler_init() {
   struct sigaction sa;
   sa.sa_handler = scheduler_tick;
   sigemptyset(&sa.sa_mask);
+  // The job control handlers signal processes, which needs the scheduler
+  // lock, so they must not run on top of a tick that is holding it
+  sigaddset(&sa.sa_mask, SIGINT);
+  sigaddset(&sa.sa_mask, SIGTSTP);
+  sigaddset(&sa.sa_mask, SIGQUIT);
+  // Clock and kicked ticks both switch processes, so one waits for the other
+  sigaddset(&sa.sa_mask, SIGALRM);
+  sigaddset(&sa.sa_mask, SIGKICK);
   sa.sa_flags = SA_RESTART;
   sigaction(SIGALRM, &sa, NULL);
+  sigaction(SIGKICK, &sa, NULL);
 
   struct itimerval timer;
   timer.it_value.tv_sec = 0;
@@ -13,6 +13,9 @@
 
 #define QUANTUM 100000  // 100ms in microseconds
 
+// Raised by scheduler_kick; SIGUSR1 is taken by spthread (SIGPTHD)
+#define SIGKICK SIGUSR2
+
 extern int current_tick;
 
 /**
@@ -31,13 +34,57 @@ void scheduler_init(void);
  */
 void run_scheduler(void);
 
+/**
+ * @brief Enters the scheduler's critical section from a process.
+ *
+ * While it is held, clock ticks neither switch processes nor touch the run
+ * queues, so the caller can inspect and change scheduling state (and cannot be
+ * suspended half way through). All signals are blocked until the matching
+ * scheduler_unlock or scheduler_yield.
+ */
+void scheduler_lock(void);
+
+/**
+ * @brief Leaves the critical section entered with scheduler_lock.
+ */
+void scheduler_unlock(void);
+
+/**
+ * @brief Suspends a blocked process and hands the CPU to the next runnable
+ * process right away.
+ *
+ * Must be called with scheduler_lock held, after the caller has marked itself
+ * P_BLOCKED and registered wherever it will be woken from; the lock is
+ * released on the way out. Instead of idling until the next clock tick, the
+ * scheduler is run immediately. Returns once the process is running again.
+ *
+ * @param self PCB of the calling process.
+ */
+void scheduler_yield(pcb_t* self);
+
+/**
+ * @brief Runs the scheduler now instead of at the next clock tick, from a
+ * host thread that is not a PennOS process (the I/O worker).
+ *
+ * Raises SIGKICK once; its tick wakes whoever the caller made ready and
+ * switches processes, but does not advance the clock, so sleeps keep their
+ * length, and does not charge the preempted process a quantum. If `pid` is
+ * ready by then it runs right away, ahead of the policy's order, instead of
+ * waiting up to a quantum for its turn. A kick that lands while a process is
+ * switching is raised again when that process releases the scheduler.
+ *
+ * @param pid Process the kick is for, or 0 to let the policy pick.
+ */
+void scheduler_kick(int pid);
+
 /**
  * @brief Handles timer ticks for the scheduler.
  *
  * Called on each SIGALRM signal to update sleeping processes, wake them if
  * needed, and invoke the scheduler to select the next runnable process.
+ * Also called on SIGKICK, which does the same without advancing the clock.
  *
- * @param signum The signal number (expected to be SIGALRM).
+ * @param signum The signal number, SIGALRM or SIGKICK.
  */
 void scheduler_tick(int signum);
 
@@ -1,27 +1,34 @@
 #include "scheduler_helper.h"
+#include "sched_policy.h"
 
 extern Vec background_jobs;
 
 // Priority queues for the 3 levels
 ThreadNode* priority_queues[3] = {NULL, NULL, NULL};
 
-bool are_all_queues_empty(void) {
+int schedule_index = 0;  // Position in priority_schedule
+
+// Scheduling ratio: 2.25x:1.5x:x => 9:6:4 (Priority 0:1:2)
+static int priority_schedule[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0,  // Priority 0 (9x)
+    1, 1, 1, 1, 1, 1,           // Priority 1 (6x)
+    2, 2, 2, 2                  // Priority 2 (4x)
+};
+
+#define PRIORITY_SCHEDULE_LEN \
+  (int)(sizeof(priority_schedule) / sizeof(priority_schedule[0]))
+
+static bool priority_is_empty(void) {
   return (!priority_queues[0] && !priority_queues[1] && !priority_queues[2]);
 }
 
-void remove_pcb_from_queue(pcb_t* pcb, int priority) {
-  if (pcb == NULL) {
-    panic("remove_pcb_from_queue: pcb is NULL");
-    return;
-  }
+static bool priority_remove(pcb_t* pcb) {
+  int priority = pcb->priority;
   if (priority < 0 || priority > 2) {
     panic("remove_pcb_from_queue: priority out of bounds");
-    return;
+    return false;
   }
 
-  if (!priority_queues[priority])
-    return;  // Empty queue
-
   ThreadNode* prev = NULL;
   ThreadNode* current = priority_queues[priority];
 
@@ -33,14 +40,15 @@ void remove_pcb_from_queue(pcb_t* pcb, int priority) {
         priority_queues[priority] = current->next;
       }
       free(current);
-      return;
+      return true;
     }
     prev = current;
     current = current->next;
   }
+  return false;
 }
 
-void add_to_queue(pcb_t* pcb) {
+static void priority_enqueue(pcb_t* pcb) {
   int priority = pcb->priority;
   ThreadNode* new_node = malloc(sizeof(ThreadNode));
   if (!new_node) {
@@ -61,7 +69,7 @@ void add_to_queue(pcb_t* pcb) {
   }
 }
 
-pcb_t* remove_from_queue(int priority) {
+static pcb_t* priority_dequeue(int priority) {
   if (!priority_queues[priority])
     return NULL;
 
@@ -72,6 +80,49 @@ pcb_t* remove_from_queue(int priority) {
   return pcb;
 }
 
+// Walk the 9:6:4 table until a non-empty level is found
+static pcb_t* priority_pick_next(void) {
+  pcb_t* next_pcb = NULL;
+  int attempts = 0;
+
+  while (!next_pcb && attempts < PRIORITY_SCHEDULE_LEN) {
+    next_pcb = priority_dequeue(priority_schedule[schedule_index]);
+    schedule_index = (schedule_index + 1) % PRIORITY_SCHEDULE_LEN;
+    attempts++;
+  }
+  return next_pcb;
+}
+
+const sched_policy_t priority_policy = {
+    .name = "priority",
+    .min_priority = 0,
+    .max_priority = 2,
+    .enqueue = priority_enqueue,
+    .remove = priority_remove,
+    .pick_next = priority_pick_next,
+    .is_empty = priority_is_empty,
+};
+
+bool are_all_queues_empty(void) {
+  return sched_policy->is_empty();
+}
+
+bool remove_pcb_from_queue(pcb_t* pcb) {
+  if (pcb == NULL) {
+    panic("remove_pcb_from_queue: pcb is NULL");
+    return false;
+  }
+  return sched_policy->remove(pcb);
+}
+
+void add_to_queue(pcb_t* pcb) {
+  sched_policy->enqueue(pcb);
+}
+
+pcb_t* pick_next_from_queue(void) {
+  return sched_policy->pick_next();
+}
+
 bool is_in_background_jobs(pcb_t* check_pcb) {
   for (int i = 0; i < vec_len(&background_jobs); i++) {
     if (((pcb_t*)vec_get(&background_jobs, i))->pid == check_pcb->pid) {
@@ -85,6 +136,7 @@ void idle_scheduler() {
   sigset_t suspend_set;
   sigfillset(&suspend_set);
   sigdelset(&suspend_set, SIGALRM);
+  sigdelset(&suspend_set, SIGKICK);
   sigdelset(&suspend_set, SIGTSTP);
   sigsuspend(&suspend_set);
 }
@@ -22,11 +22,10 @@ typedef struct ThreadNode {
 } ThreadNode;
 
 /**
- * @brief Adds a process (represented by its PCB) to the corresponding priority
- * queue.
+ * @brief Makes a process runnable under the active scheduling policy.
  *
- * This function inserts the process into the priority queue based on its
- * priority level.
+ * For the default priority policy this appends the process to the queue of
+ * its priority level.
  *
  * @param pcb A pointer to the process control block (PCB) of the process to be
  * added.
@@ -34,27 +33,24 @@ typedef struct ThreadNode {
 void add_to_queue(pcb_t* pcb);
 
 /**
- * @brief Removes and returns the next process from a given priority queue.
+ * @brief Removes and returns the process that should run next.
  *
- * @param priority The priority level (0=highest, 2=lowest) to remove from.
- * @return pcb_t* Pointer to the removed PCB, or NULL if the queue is empty.
+ * @return pcb_t* Pointer to the removed PCB, or NULL if nothing is runnable.
  */
-pcb_t* remove_from_queue(int priority);
+pcb_t* pick_next_from_queue(void);
 
 /**
- * @brief Removes a specific process from its priority queue.
- *
- * Searches for the PCB in the priority queue and removes it if found.
+ * @brief Removes a specific process from the run queue.
  *
  * @param pcb A pointer to the PCB to be removed.
- * @param priority The priority level from which to remove the PCB.
+ * @return true if the process was queued, false otherwise.
  */
-void remove_pcb_from_queue(pcb_t* pcb, int priority);
+bool remove_pcb_from_queue(pcb_t* pcb);
 
 /**
- * @brief Checks if all priority queues are empty.
+ * @brief Checks if the run queue is empty.
  *
- * @return true if all queues are empty, false otherwise.
+ * @return true if no process is runnable, false otherwise.
  */
 bool are_all_queues_empty(void);
 
@@ -1,6 +1,8 @@
 #include "./pennshell.h"
 #include <termios.h>
 #include "./pennshell_helper.h"
+#include "./script.h"
+#include "./scheduler/sched_policy.h"
 #include "./util/p_errno.h"
 #include "./syscall/sys_call.h"
 
@@ -12,23 +14,37 @@ static void* (*thread_func_to_run)(void*) =
     NULL;                  // Function to run in the thread
 bool aio_enabled = false;  // Asynchronous I/O enabled
 
-/// Function to handle the shell prompt
+
+proc_fd_ent stdin_proc_fd =
+    (proc_fd_ent){.proc_fd = 0, .mode = F_READ, .global_fd = 0};
+
+proc_fd_ent stdout_proc_fd =
+    (proc_fd_ent){.proc_fd = 1, .mode = F_WRITE, .global_fd = 1};
+
+// Look up a command by name, NULL if it is not in the command table
+static command_t* find_command(const char* name) {
+  for (int i = 0; i < number_commands; ++i) {
+    if (strcmp(name, command_table[i].name) == 0) {
+      return &command_table[i];
+    }
+  }
+  return NULL;
+}
+
+/// Entry point for every spawned command. The child may first run long after
+/// the shell has moved on to the next command line, so the function is looked
+/// up from its own argv[0] rather than from shell state.
 void* wrapper(void* arg) {
-  thread_args_t* targs = (thread_args_t*)arg;
+  char** argv = (char**)arg;
   void* ret = NULL;
-  if (thread_func_to_run) {
-    ret = thread_func_to_run(targs);
+  command_t* command = find_command(argv[0]);
+  if (command) {
+    ret = command->function(argv);
   }
   s_exit();  // Exit the thread always after running the function
   return ret;
 }
 
-proc_fd_ent stdin_proc_fd =
-    (proc_fd_ent){.proc_fd = 0, .mode = F_READ, .offset = 0, .global_fd = 0};
-
-proc_fd_ent stdout_proc_fd =
-    (proc_fd_ent){.proc_fd = 1, .mode = F_WRITE, .offset = 0, .global_fd = 1};
-
 // Function to initialize the shell
 void init_shell() {
   if (!aio_enabled) {
@@ -43,20 +59,20 @@ void init_shell() {
 int redirect_stdout(struct parsed_command* command,
                     proc_fd_ent* file_descriptors) {
   int stdout_file_fd = -1;
-  if (cmd->is_file_append) {
-    stdout_file_fd = s_open(cmd->stdout_file, F_APPEND);
+  if (command->is_file_append) {
+    stdout_file_fd = s_open(command->stdout_file, F_APPEND);
     if (stdout_file_fd == -1) {
       u_perror("s_open: Failed");
     }
   } else {
-    stdout_file_fd = s_open(cmd->stdout_file, F_WRITE);
+    stdout_file_fd = s_open(command->stdout_file, F_WRITE);
     if (stdout_file_fd == -1) {
       u_perror("s_open: Failed");
     }
   }
   if (stdout_file_fd < 0) {
     k_print("[s-open] %s failed %s\n",
-                       cmd->stdout_file, cmd->commands[0][0]);
+                       command->stdout_file, command->commands[0][0]);
 
     return stdout_file_fd;
   } else {
@@ -70,7 +86,7 @@ int redirect_stdout(struct parsed_command* command,
 // Function to redirect stdin
 int redirect_stdin(struct parsed_command* command,
                    proc_fd_ent* file_descriptors) {
-  int stdin_file_fd = s_open(cmd->stdin_file, F_READ);
+  int stdin_file_fd = s_open(command->stdin_file, F_READ);
   if (stdin_file_fd == -1) {
     u_perror("s_open: Failed");
   }
@@ -90,106 +106,220 @@ int redirect_stdin(struct parsed_command* command,
   return stdin_file_fd;
 }
 
-void process_script_lines(int script_fd) {
-  char script_line[4096];
-  int line_len = 0;
-  while (s_read(script_fd, 1, script_line + line_len) > 0) {
-    if (script_line[line_len] == '\n' || script_line[line_len] == ';') {
-      script_line[strcspn(script_line, "\n")] = 0;
-      struct parsed_command* script_cmd;
-      int example = parse_command(script_line, &script_cmd);
-      print_parsed_command(script_cmd);
-      if (example == -1 || script_cmd == NULL) {
-        s_print("invalid command : Encountered a system call error\n");
-        free(script_cmd);
-        script_cmd = NULL;
-        continue;
+// Copy of argv for a child, which keeps it after the parsed command is gone
+// and frees it when it is cleaned up
+static char** copy_argv(char** argv) {
+  int argc = 0;
+  while (argv[argc]) {
+    argc++;
+  }
+  char** copy = malloc((argc + 1) * sizeof(char*));
+  for (int i = 0; copy && i <= argc; i++) {
+    copy[i] = argv[i] ? strdup(argv[i]) : NULL;
+  }
+  return copy;
+}
+
+// Free a copy from copy_argv that no child took over
+static void free_argv(char** argv) {
+  for (int i = 0; argv && argv[i]; i++) {
+    free(argv[i]);
+  }
+  free(argv);
+}
+
+// Function to run a job with several stages, stage i's stdout feeding stage
+// i+1's stdin through a pipe
+void run_pipeline(struct parsed_command* command) {
+  int num_stages = command->num_commands;
+  for (int i = 0; i < num_stages; i++) {
+    command_t* entry = find_command(command->commands[i][0]);
+    if (!entry || entry->is_builtin) {
+      k_print("%s: cannot be used in a pipeline\n", command->commands[i][0]);
+      return;
+    }
+  }
+
+  proc_fd_ent* file_descriptors = get_file_descriptors();
+  int in_fd = STDIN_FILENO;
+  int out_fd = STDOUT_FILENO;
+  if (command->stdin_file) {
+    in_fd = s_open(command->stdin_file, F_READ);
+    if (in_fd < 0) {
+      u_perror("s_open: Failed");
+      return;
+    }
+  }
+  if (command->stdout_file) {
+    out_fd = s_open(command->stdout_file,
+                    command->is_file_append ? F_APPEND : F_WRITE);
+    if (out_fd < 0) {
+      u_perror("s_open: Failed");
+      if (in_fd != STDIN_FILENO) {
+        s_close(in_fd);
       }
-      if (example > 0) {
-        k_print("invalid: Parser error: %d\n", example);
-        free(script_cmd);
-        script_cmd = NULL;
-        continue;
+      return;
+    }
+  }
+  int first_in_fd = in_fd;
+
+  pid_t pids[num_stages];
+  int spawned = 0;
+  for (int i = 0; i < num_stages; i++) {
+    int pipefd[2] = {-1, -1};
+    int stage_out = out_fd;
+    if (i < num_stages - 1) {
+      if (s_pipe(pipefd) == -1) {
+        u_perror("s_pipe: Failed");
+        break;
       }
-      execute_script_command(script_cmd);
-      free(script_cmd);
-      line_len = 0;
+      stage_out = pipefd[1];
+    }
+
+    file_descriptors[0] = file_descriptors[in_fd];
+    file_descriptors[0].proc_fd = 0;
+    file_descriptors[1] = file_descriptors[stage_out];
+    file_descriptors[1].proc_fd = 1;
+    thread_args_t targs = {.argv = copy_argv(command->commands[i]),
+                           .is_background = command->is_background,
+                           .owns_argv = true};
+    pids[spawned] = -1;
+    if (!targs.argv) {
+      P_ERRNO = P_ENOMEM;
+    } else {
+      pids[spawned] = s_spawn(wrapper, &targs, 0, 1, 2, 1, P_BLOCKED, false,
+                              command->is_background);
+    }
+    file_descriptors[0] = stdin_proc_fd;
+    file_descriptors[1] = stdout_proc_fd;
+    if (pids[spawned] == -1) {
+      u_perror("s_spawn: failed to fork pipeline stage");
+      free_argv(targs.argv);
     } else {
-      line_len++;
+      spawned++;
+    }
+
+    // The stages hold their own references to the pipe ends now
+    if (in_fd != first_in_fd) {
+      s_close(in_fd);
+    }
+    if (pipefd[1] >= 0) {
+      s_close(pipefd[1]);
+    }
+    in_fd = pipefd[0];
+  }
+  if (in_fd >= 0 && in_fd != first_in_fd) {
+    s_close(in_fd);  // a pipe was created for a stage that never ran
+  }
+  // The stages hold their own references to the redirected files too
+  if (first_in_fd != STDIN_FILENO) {
+    s_close(first_in_fd);
+  }
+  if (out_fd != STDOUT_FILENO) {
+    s_close(out_fd);
+  }
+
+  if (!command->is_background) {
+    for (int i = 0; i < spawned; i++) {
+      int wstatus;
+      current_foreground_pid = pids[i];
+      if (s_waitpid(pids[i], &wstatus, false, false, -1) == -1) {
+        u_perror("Failed to waitpid for pipeline stage");
+      }
     }
   }
 }
 
-void execute_script_command(struct parsed_command* script_cmd) {
-  char** cleaned_argv = malloc(sizeof(char*) * 100);  // adjust size if needed
-  int cleaned_argc = 0;
-  char** original_args = script_cmd->commands[0];
-
-  for (int i = 0; original_args[i]; i++) {
-    if ((strcmp(original_args[i], ">") == 0 ||
-         strcmp(original_args[i], ">>") == 0) &&
-        original_args[i + 1]) {
-      s_open(original_args[i + 1],
-             strcmp(original_args[i], ">>") == 0 ? F_APPEND : F_WRITE);
-      i++;  // skip next token
-    } else if (strcmp(original_args[i], "<") == 0 && original_args[i + 1]) {
-      s_open(original_args[i + 1], F_READ);
-      i++;
+void process_script_lines(int script_fd) {
+  script_t* script = script_load(script_fd);
+  if (!script) {
+    u_perror("script");
+    return;
+  }
+  for (size_t i = 0; i < vec_len(&script->lines); i++) {
+    script_line_t* line = vec_get(&script->lines, i);
+    if (line->err == -1) {
+      s_print("invalid command : Encountered a system call error\n");
+    } else if (line->err > 0) {
+      k_print("invalid: Parser error: %d\n", line->err);
     } else {
-      cleaned_argv[cleaned_argc++] = strdup(original_args[i]);
+      print_parsed_command(line->cmd);
+      execute_script_command(line->cmd);
     }
   }
-  cleaned_argv[cleaned_argc] = NULL;
-
-  const char* input_cmd = cleaned_argv[0];
-
-  for (int i = 0; i < number_commands; ++i) {
-    if (strcmp(input_cmd, command_table[i].name) == 0) {
-      thread_func_to_run = command_table[i].function;
-
-      thread_args_t* targs = malloc(sizeof(thread_args_t));
-      targs->argv = cleaned_argv;
-      targs->is_background = script_cmd->is_background;
-
-      if (command_table[i].is_builtin) {
-        command_table[i].function(targs);
-      } else {
-        proc_fd_ent* file_descriptors = get_file_descriptors();
-        int stdout_fd = -1, stdin_fd = -1;
-        if (script_cmd->stdout_file) {
-          stdout_fd = redirect_stdout(script_cmd, file_descriptors);
-          if (stdout_fd < 0)
-            return;
-        }
-        if (script_cmd->stdin_file) {
-          stdin_fd = redirect_stdin(script_cmd, file_descriptors);
-          if (stdin_fd < 0)
-            return;
-        }
+  script_done(script);
+}
 
-        current_foreground_pid = s_spawn(wrapper, targs, 0, 1, 2, 1, P_BLOCKED,
-                                         false, script_cmd->is_background);
+// Spawn a script's command, waiting for it unless it is in the background
+static void spawn_script_command(struct parsed_command* script_cmd,
+                                 thread_args_t* targs) {
+  char** argv = targs->argv;
+
+  current_foreground_pid = s_spawn(wrapper, targs, 0, 1, 2, 1, P_BLOCKED,
+                                   false, script_cmd->is_background);
+  if (current_foreground_pid == -1) {
+    char buf[PRINT_BUFFER_SIZE];
+    snprintf(buf, sizeof(buf), "s_spawn: failed to fork %s", argv[0]);
+    u_perror(buf);
+    free_argv(argv);
+  } else if (!script_cmd->is_background) {
+    int wstatus;
+    if (s_waitpid(current_foreground_pid, &wstatus, false, false, -1) == -1) {
+      char buf[PRINT_BUFFER_SIZE];
+      snprintf(buf, sizeof(buf), "Failed to waitpid for %s", argv[0]);
+      u_perror(buf);
+    }
+  }
+}
 
-        if (current_foreground_pid == -1) {
-          char buf[PRINT_BUFFER_SIZE];
-          k_print("s_spawn: failed to fork %s ", input_cmd);
-          u_perror(buf);
-        }
+void execute_script_command(struct parsed_command* script_cmd) {
+  if (script_cmd->num_commands > 1) {
+    run_pipeline(script_cmd);
+    return;
+  }
 
-        if (!script_cmd->is_background) {
-          int wstatus;
-          if (s_waitpid(current_foreground_pid, &wstatus, false, false, -1) ==
-              -1) {
-            char buf[PRINT_BUFFER_SIZE];
-            k_print("Failed to waitpid for %s ", input_cmd);
-            u_perror(buf);
-          }
-        }
+  // The parser has taken the redirections out of the arguments already
+  char** argv = script_cmd->commands[0];
+  command_t* command = find_command(argv[0]);
+  if (!command) {
+    k_print("command not found: %s\n", argv[0]);
+    return;
+  }
+  thread_func_to_run = command->function;
+  thread_args_t targs = {.argv = argv,
+                         .is_background = script_cmd->is_background};
+  if (command->is_builtin) {
+    command->function(&targs);
+    return;
+  }
 
-        reset_redirections();  // Reset file descriptors
-      }
-      break;
-    }
+  // The child holds its own references to the redirected files, so the
+  // shell closes its descriptors for them once the command has started
+  proc_fd_ent* file_descriptors = get_file_descriptors();
+  int in_fd = -1;
+  int out_fd = -1;
+  if (script_cmd->stdin_file &&
+      (in_fd = redirect_stdin(script_cmd, file_descriptors)) < 0) {
+    return;
+  }
+  if (script_cmd->stdout_file &&
+      (out_fd = redirect_stdout(script_cmd, file_descriptors)) < 0) {
+    out_fd = -1;
+  } else if (!(targs.argv = copy_argv(argv))) {
+    // The child can outlive this script line (stopped, or in the
+    // background) and the cache may free the line, so it gets its own argv
+    P_ERRNO = P_ENOMEM;
+    u_perror("script");
+  } else {
+    targs.owns_argv = true;
+    spawn_script_command(script_cmd, &targs);
+  }
+  reset_redirections();
+  if (in_fd >= 0) {
+    s_close(in_fd);
+  }
+  if (out_fd >= 0) {
+    s_close(out_fd);
   }
 }
 
@@ -210,7 +340,7 @@ void* penn_shell(void* arg) {
     if (read_len == -1) {
       punmount();  // Unmount the filesystem
       k_print("\nExiting penn-os...\n");
-
+      s_flush();
       exit(0);  // Exit the shell
     }
     if (read_len > 0)
@@ -256,6 +386,15 @@ void* penn_shell(void* arg) {
         }
       }
 
+      // PIPELINES
+      if (cmd->num_commands > 1) {
+        run_pipeline(cmd);
+        free(cmd);  // the stages have their own copies of argv
+        cmd = NULL;
+        s_reap_zombies();
+        continue;
+      }
+
       // REDIRECTION HANDLING
       int stdin_fd = 0;
       int stdout_fd = 1;
@@ -288,7 +427,7 @@ void* penn_shell(void* arg) {
 
       // Check if the command is "fg"
       if (strcmp(input_cmd, "fg") == 0) {
-        thread_args_t* targs = malloc(sizeof(thread_args_t));
+        thread_args_t* targs = calloc(1, sizeof(thread_args_t));
         targs->argv = cleaned_argv;
         targs->is_background = cmd->is_background;
 
@@ -310,8 +449,9 @@ void* penn_shell(void* arg) {
         }
 
         int priority = atoi(cmd->commands[0][1]);
-          if (priority > 2  || priority < 0){
-            k_print("Error! : Priority must be 0,1,2\n");
+          if (!sched_priority_valid(priority)) {
+            k_print("Error! : Priority must be between %d and %d\n",
+                    sched_policy->min_priority, sched_policy->max_priority);
             continue;
           }
         const char* command = cmd->commands[0][2];
@@ -335,7 +475,7 @@ void* penn_shell(void* arg) {
         while (cmd->commands[0][2 + argc] != NULL)
           argc++;
 
-        thread_args_t* targs = malloc(sizeof(thread_args_t));
+        thread_args_t* targs = calloc(1, sizeof(thread_args_t));
         targs->argv = malloc(sizeof(char*) * (argc + 2));
         targs->argv[0] = strdup(command);
         for (int i = 0; i < argc; i++) {
@@ -358,7 +498,7 @@ void* penn_shell(void* arg) {
         if (strcmp(input_cmd, command_table[i].name) == 0) {
           thread_func_to_run = command_table[i].function;
 
-          thread_args_t* targs = malloc(sizeof(thread_args_t));
+          thread_args_t* targs = calloc(1, sizeof(thread_args_t));
           targs->argv = cleaned_argv;
           targs->is_background = cmd->is_background;
 
@@ -470,6 +610,7 @@ void* penn_shell(void* arg) {
           continue;
         }
         process_script_lines(script_fd);
+        s_close(script_fd);
       }
     }
     s_reap_zombies();  // for reaping background
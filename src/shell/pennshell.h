@@ -25,6 +25,14 @@ char* preprocess_redirection(const char* input);
 
 void execute_script_command(struct parsed_command *script_cmd);
 
+/**
+ * @brief Run a job with more than one stage.
+ * Every stage runs in its own process; the stdout of each stage is connected
+ * to the stdin of the next with a pipe. Redirections apply to the first
+ * stage's stdin and the last stage's stdout.
+ */
+void run_pipeline(struct parsed_command* command);
+
 void process_script_lines(int script_fd);
 
 void reset_redirections();
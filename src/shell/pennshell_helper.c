@@ -2,9 +2,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/uio.h>
 #include "./util/p_errno.h"
 
 #define HISTORY_FILE ".pennsh_history"
+#define CLEAR_LINE "\r\x1b[2K"
+#define CURSOR_LEFT "\x1b[D"
+#define CURSOR_RIGHT "\x1b[C"
+#define LINE_IOV_MAX 260  // a redrawn line and a cursor move per character
 
 char history[HISTORY_LIMIT][128];   // In-memory history buffer
 int history_size = 0;               // Number of lines in history
@@ -70,10 +75,27 @@ void setup_signals() {
   }
 }
 
+// Appends count copies of a control sequence to iov; returns the new length
+static int add_moves(struct iovec* iov, int iovcnt, const char* seq,
+                     int count) {
+  for (int i = 0; i < count; i++) {
+    iov[iovcnt++] = (struct iovec){(char*)seq, strlen(seq)};
+  }
+  return iovcnt;
+}
+
+// Clears the current line and reprints the shell prompt followed by the
+// len bytes of line, in one write
+static void redraw_line(const char* line, int len) {
+  struct iovec iov[] = {{CLEAR_LINE, strlen(CLEAR_LINE)},
+                        {PROMPT, strlen(PROMPT)},
+                        {(char*)line, len}};
+  s_writev(STDOUT_FILENO, iov, len > 0 ? 3 : 2);
+}
+
 // Clears the current line and reprints the shell prompt
 void clear_line_and_prompt() {
-  s_write(1, 5, "\r\x1b[2K");          // Clear line
-  s_write(1, strlen(PROMPT), PROMPT);  // Write prompt
+  redraw_line(NULL, 0);
 }
 
 // Adds a new line to the in-memory history buffer
@@ -92,8 +114,9 @@ void add_to_history(const char* line) {
 void save_history_line(const char* line) {
   int fd = open(HISTORY_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
   if (fd >= 0) {
-    s_write(fd, strlen(line), line);
-    s_write(fd, 1, "\n");
+    // A host file, so the host's writev: one append for line and newline
+    struct iovec iov[] = {{(char*)line, strlen(line)}, {"\n", 1}};
+    writev(fd, iov, 2);
     close(fd);
   }
 }
@@ -151,14 +174,14 @@ int read_input_line(char* buf) {
     prompt_displayed = 1;
   }
 
+  struct iovec iov[LINE_IOV_MAX];
   while (1) {
     char c;
-    ssize_t r = read(STDIN_FILENO, &c, 1);
+    // The shell is parked until a key arrives, so other jobs keep running
+    int r = s_read(STDIN_FILENO, 1, &c);
 
     if (r < 0) {
-      if (aio_enabled && errno == EAGAIN)
-        return 0;  // no input
-      continue;    // real error, retry
+      continue;  // real error, retry
     }
     if (r == 0)
       return -1;  // EOF
@@ -171,32 +194,33 @@ int read_input_line(char* buf) {
     }  // Ctrl+L
 
     if (c == 1) {  // Ctrl+A
-      while (cursor_pos > 0) {
-        s_write(1, 3, "\x1b[D");
-        cursor_pos--;
+      if (cursor_pos > 0) {
+        s_writev(STDOUT_FILENO, iov, add_moves(iov, 0, CURSOR_LEFT, cursor_pos));
       }
+      cursor_pos = 0;
       continue;
     }
     if (c == 5) {  // Ctrl+E
-      while (cursor_pos < buf_len) {
-        s_write(1, 3, "\x1b[C");
-        cursor_pos++;
+      if (cursor_pos < buf_len) {
+        s_writev(STDOUT_FILENO, iov,
+                 add_moves(iov, 0, CURSOR_RIGHT, buf_len - cursor_pos));
       }
+      cursor_pos = buf_len;
       continue;
     }
     if (c == 11) {  // Ctrl+K
-      for (int i = cursor_pos; i < buf_len; i++)
-        s_write(1, 1, " ");
-      for (int i = cursor_pos; i < buf_len; i++)
-        s_write(1, 3, "\x1b[D");
+      if (cursor_pos < buf_len) {
+        int n = add_moves(iov, 0, " ", buf_len - cursor_pos);
+        n = add_moves(iov, n, CURSOR_LEFT, buf_len - cursor_pos);
+        s_writev(STDOUT_FILENO, iov, n);
+      }
       buf[cursor_pos] = '\0';
       buf_len = cursor_pos;
       continue;
     }
     if (c == 21) {  // Ctrl+U
-      while (cursor_pos > 0) {
-        s_write(1, 3, "\b \b");
-        cursor_pos--;
+      if (cursor_pos > 0) {
+        s_writev(STDOUT_FILENO, iov, add_moves(iov, 0, "\b \b", cursor_pos));
       }
       memmove(buf, buf + cursor_pos, buf_len - cursor_pos);
       buf_len -= cursor_pos;
@@ -222,34 +246,34 @@ int read_input_line(char* buf) {
         memmove(buf + cursor_pos - 1, buf + cursor_pos, buf_len - cursor_pos);
         buf_len--;
         cursor_pos--;
-        s_write(1, 1, "\b");
-        s_write(1, buf_len - cursor_pos, &buf[cursor_pos]);
-        s_write(1, 1, " ");
-        for (int i = 0; i <= buf_len - cursor_pos; i++)
-          s_write(1, 3, "\x1b[D");
+        // Step back, redraw the rest of the line over it and return
+        int n = add_moves(iov, 0, "\b", 1);
+        iov[n++] = (struct iovec){&buf[cursor_pos], buf_len - cursor_pos};
+        n = add_moves(iov, n, " ", 1);
+        n = add_moves(iov, n, CURSOR_LEFT, buf_len - cursor_pos + 1);
+        s_writev(STDOUT_FILENO, iov, n);
       }
       continue;
     }
     if (c == '\x1b') {  // Arrow keys
       char seq[2];
-      if (read(STDIN_FILENO, seq, 2) == 2 && seq[0] == '[') {
+      if (s_read(STDIN_FILENO, 1, &seq[0]) == 1 &&
+          s_read(STDIN_FILENO, 1, &seq[1]) == 1 && seq[0] == '[') {
         if (seq[1] == 'A') {  // Up
           if (history_pos > 0) {
             history_pos--;
-            clear_line_and_prompt();
             strcpy(buf, history[history_pos]);
             buf_len = strlen(buf);
             cursor_pos = buf_len;
-            s_write(1, buf_len, buf);
+            redraw_line(buf, buf_len);
           }
         } else if (seq[1] == 'B') {  // Down
           if (history_pos < history_size - 1) {
             history_pos++;
-            clear_line_and_prompt();
             strcpy(buf, history[history_pos]);
             buf_len = strlen(buf);
             cursor_pos = buf_len;
-            s_write(1, buf_len, buf);
+            redraw_line(buf, buf_len);
           } else {
             history_pos = history_size;
             clear_line_and_prompt();
@@ -271,10 +295,11 @@ int read_input_line(char* buf) {
       memmove(buf + cursor_pos + 1, buf + cursor_pos, buf_len - cursor_pos);
       buf[cursor_pos] = c;
       buf_len++;
-      s_write(1, buf_len - cursor_pos, &buf[cursor_pos]);
+      // Redraw from the new character on, then put the cursor after it
+      iov[0] = (struct iovec){&buf[cursor_pos], buf_len - cursor_pos};
       cursor_pos++;
-      for (int i = cursor_pos; i < buf_len; i++)
-        s_write(1, 3, "\x1b[D");
+      s_writev(STDOUT_FILENO, iov,
+               add_moves(iov, 1, CURSOR_LEFT, buf_len - cursor_pos));
     }
   }
 }
@@ -0,0 +1,151 @@
+#include "./script.h"
+#include "./pennfat/pennfat_help.h"
+#include "./syscall/sys_call.h"
+#include "./util/p_errno.h"
+
+static script_t* cache[SCRIPT_CACHE_MAX];
+static unsigned uses;  // scripts loaded so far
+
+// Read fd to EOF a block at a time into one NUL-terminated buffer
+static char* read_all(int fd, int* len) {
+  int cap = SCRIPT_BLOCK;
+  char* text = malloc(cap + 1);
+  *len = 0;
+  while (text) {
+    int n = s_read(fd, SCRIPT_BLOCK, text + *len);
+    if (n < 0) {
+      free(text);
+      return NULL;
+    }
+    if (n == 0) {
+      text[*len] = '\0';
+      return text;
+    }
+    *len += n;
+    if (cap - *len < SCRIPT_BLOCK) {
+      cap *= 2;
+      char* grown = realloc(text, cap + 1);
+      if (!grown) {
+        free(text);
+      }
+      text = grown;
+    }
+  }
+  P_ERRNO = P_ENOMEM;
+  return NULL;
+}
+
+static void script_free(script_t* script) {
+  if (!script) {
+    return;
+  }
+  for (size_t i = 0; i < vec_len(&script->lines); i++) {
+    script_line_t* line = vec_get(&script->lines, i);
+    free(line->cmd);
+    free(line);
+  }
+  vec_destroy(&script->lines);
+  free(script->text);
+  free(script);
+}
+
+// Split text at newlines and semicolons and parse each piece
+static script_t* script_parse(char* text, int len) {
+  script_t* script = calloc(1, sizeof(script_t));
+  char* copy = malloc(len + 1);
+  if (!script || !copy) {
+    free(script);
+    free(copy);
+    return NULL;
+  }
+  memcpy(copy, text, len + 1);
+  script->lines = vec_new(16, NULL);
+
+  for (char* piece = copy; piece;) {
+    char* end = piece + strcspn(piece, "\n;");
+    char* next = *end ? end + 1 : NULL;
+    *end = '\0';
+    if (piece[strspn(piece, " \t\r")]) {
+      script_line_t* line = calloc(1, sizeof(script_line_t));
+      if (!line) {
+        free(copy);
+        script_free(script);
+        return NULL;
+      }
+      line->err = parse_command(piece, &line->cmd);
+      if (line->err || (line->cmd && line->cmd->num_commands == 0)) {
+        free(line->cmd);
+        line->cmd = NULL;
+      }
+      if (line->err || line->cmd) {
+        vec_push_back(&script->lines, line);
+      } else {
+        free(line);
+      }
+    }
+    piece = next;
+  }
+  free(copy);
+  script->text = text;
+  script->len = len;
+  return script;
+}
+
+script_t* script_load(int fd) {
+  int len;
+  char* text = read_all(fd, &len);
+  if (!text) {
+    return NULL;
+  }
+  uses++;
+
+  // The same contents parse the same way, so a rerun needs no parsing. A
+  // script still running (one that ran scriptbench) is never replaced.
+  int victim = -1;
+  for (int i = 0; i < SCRIPT_CACHE_MAX; i++) {
+    script_t* script = cache[i];
+    if (script && script->len == len && memcmp(script->text, text, len) == 0) {
+      free(text);
+      script->uses = uses;
+      script->running++;
+      return script;
+    }
+    if (!script || (!script->running &&
+                    (victim < 0 || (cache[victim] &&
+                                    script->uses < cache[victim]->uses)))) {
+      victim = i;
+    }
+  }
+
+  script_t* script = script_parse(text, len);
+  if (!script) {
+    free(text);
+    P_ERRNO = P_ENOMEM;
+    return NULL;
+  }
+  script->uses = uses;
+  script->running = 1;
+  if (victim >= 0) {
+    script_free(cache[victim]);
+    cache[victim] = script;
+    script->cached = true;
+  }
+  return script;
+}
+
+void script_done(script_t* script) {
+  if (--script->running == 0 && !script->cached) {
+    script_free(script);
+  }
+}
+
+void script_cache_clear() {
+  for (int i = 0; i < SCRIPT_CACHE_MAX; i++) {
+    if (cache[i] && cache[i]->running) {
+      cache[i]->cached = false;  // freed by its last script_done
+    } else {
+      script_free(cache[i]);
+    }
+    cache[i] = NULL;
+  }
+}
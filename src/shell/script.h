@@ -0,0 +1,57 @@
+#ifndef SCRIPT_H_
+#define SCRIPT_H_
+
+#include "./util/parser.h"
+#include "./vec/Vec.h"
+
+#define SCRIPT_BLOCK 4096    // bytes per s_read of a script
+#define SCRIPT_CACHE_MAX 8   // parsed scripts kept for the next run
+
+/**
+ * @brief One command of a script, as parse_command left it.
+ */
+typedef struct script_line_st {
+  int err;                      // parse_command's result, 0 if it parsed
+  struct parsed_command* cmd;   // NULL unless err is 0
+} script_line_t;
+
+/**
+ * @brief A script file split at newlines and semicolons and parsed.
+ *
+ * Scripts are kept in a small cache keyed by their contents, so running the
+ * same script again reads it but skips parsing.
+ */
+typedef struct script_st {
+  char* text;     // the file's contents when it was parsed
+  int len;        // their length
+  Vec lines;      // script_line_t*, in order, without empty ones
+  unsigned uses;  // last run, for replacing the least recently used
+  int running;    // script_load calls not yet matched by script_done
+  bool cached;    // in the cache, which frees it
+} script_t;
+
+/**
+ * @brief Reads a script a block at a time and returns it parsed, from the
+ * cache if a script with the same contents was run before.
+ *
+ * @param fd Process descriptor of the script, read from its offset to EOF.
+ * @return The script, to be handed to script_done once it has run, or NULL
+ * with P_ERRNO set.
+ */
+script_t* script_load(int fd);
+
+/**
+ * @brief Marks a script from script_load as done running, freeing it if it
+ * did not fit in the cache.
+ *
+ * @param script The script.
+ */
+void script_done(script_t* script);
+
+/**
+ * @brief Drops every cached script; one still running is freed by its
+ * script_done.
+ */
+void script_cache_clear();
+
+#endif  // SCRIPT_H_
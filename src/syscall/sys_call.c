@@ -2,6 +2,11 @@
 #include <stdarg.h>
 #include <termios.h>  //For extra credit
 #include <unistd.h>   // For extra credit
+#include "./kernel/kaio.h"
+#include "./kernel/kmmap.h"
+#include "./kernel/kpipe.h"
+#include "./kernel/kstdout.h"
+#include "./scheduler/sched_policy.h"
 #include "./shell/pennshell_helper.h"
 #include "./util/p_errno.h"
 
@@ -21,6 +26,9 @@ pid_t s_spawn(void* (*func)(void*),
              is_background);  // create a new process Child
   if (child_pid == -1) {
     P_ERRNO = P_EFORK;
+  } else {
+    // The child is ours to reap, so its PCB is still there
+    k_get_pcb_with_given_pid(child_pid)->owns_argv = t_args->owns_argv;
   }
   return child_pid;
 }
@@ -42,8 +50,9 @@ void s_exit() {
 
 // Change the priority of a process
 int s_nice(pid_t pid, int priority) {
-  if (priority < 0 || priority > 2) {  // Prioirty is 0,1,2
-    k_print("Priority must be 0 , 1 or 2.\n");
+  if (!sched_priority_valid(priority)) {  // Range depends on the policy
+    k_print("Priority must be between %d and %d.\n",
+            sched_policy->min_priority, sched_policy->max_priority);
     P_ERRNO = P_EINVAL_NICE;
     return -1;
   }
@@ -77,7 +86,7 @@ void s_jobs() {
 
 int is_posix(const char* fname) {
   for (int i = 0; i < strlen(fname); i++) {
-    if (fname[i] == 45 || fname[i] == 46 ||
+    if (fname[i] == 45 || fname[i] == 46 || fname[i] == 47 ||
         (fname[i] >= 48 && fname[i] <= 57) ||
         (fname[i] >= 65 && fname[i] <= 90) || fname[i] == 95 ||
         (fname[i] >= 97 && fname[i] <= 122)) {
@@ -110,7 +119,7 @@ int is_valid_fd(int fd) {
   return fd >= 0 && fd < MAX_OPEN_FILES;
 }
 
-int s_open(const char* fname, int mode) {
+static int fd_open(proc_fd_ent* fd_table, const char* fname, int mode) {
   // Validate fname and mode
   if (mode < 0 || mode > 2) {
     P_ERRNO = INVALID_MODE;
@@ -120,7 +129,6 @@ int s_open(const char* fname, int mode) {
     P_ERRNO = FILENAME_INVALID;
     return -1;
   }
-  proc_fd_ent* fd_table = get_file_descriptors();
   int global_fd = k_open(fname, mode);
   if (global_fd < 0) {
     P_ERRNO = FD_INVALID;
@@ -139,21 +147,20 @@ int s_open(const char* fname, int mode) {
     P_ERRNO = TOO_MANY_OPEN_FILES;
     return -1;
   }
-  proc_fd_ent fd_ent;
-  fd_ent = (proc_fd_ent){.proc_fd = fd,
-                         .mode = mode,
-                         .offset = (mode == F_APPEND) ? k_file_size(fname) : 0,
-                         .global_fd = global_fd};
-  fd_table[fd] = fd_ent;
+  fd_table[fd] =
+      (proc_fd_ent){.proc_fd = fd, .mode = mode, .global_fd = global_fd};
   return fd;
 }
 
-int s_close(int fd) {
+int s_open(const char* fname, int mode) {
+  return fd_open(get_file_descriptors(), fname, mode);
+}
+
+static int fd_close(proc_fd_ent* fd_table, int fd) {
   if (!(is_valid_fd(fd))) {
     P_ERRNO = FD_INVALID;
     return -1;
   }
-  proc_fd_ent* fd_table = get_file_descriptors();
   if (fd_table[fd].proc_fd == -1) {
     P_ERRNO = FD_INVALID;
     return -1;
@@ -163,8 +170,85 @@ int s_close(int fd) {
   return 0;
 }
 
-int s_write(int fd, int n, const char* str) {
+int s_close(int fd) {
+  return fd_close(get_file_descriptors(), fd);
+}
+
+int s_pipe(int pipefd[2]) {
+  proc_fd_ent* fd_table = get_file_descriptors();
+  if (!fd_table || !pipefd) {
+    P_ERRNO = fd_table ? P_EINVAL : FD_TABLE_NULL;
+    return -1;
+  }
+
+  // Find two free slots in the process table before touching the kernel
+  int slots[2] = {-1, -1};
+  for (int i = 0, found = 0; i < MAX_OPEN_FILES && found < 2; i++) {
+    if (fd_table[i].proc_fd < 0) {
+      slots[found++] = i;
+    }
+  }
+  if (slots[1] < 0) {
+    P_ERRNO = TOO_MANY_OPEN_FILES;
+    return -1;
+  }
+
+  int global_fds[2];
+  if (k_pipe(global_fds) < 0) {
+    return -1;
+  }
+  fd_table[slots[0]] = (proc_fd_ent){
+      .proc_fd = slots[0], .mode = F_READ, .global_fd = global_fds[0]};
+  fd_table[slots[1]] = (proc_fd_ent){
+      .proc_fd = slots[1], .mode = F_WRITE, .global_fd = global_fds[1]};
+  pipefd[0] = slots[0];
+  pipefd[1] = slots[1];
+  return 0;
+}
+
+// Flush the calling process's terminal output
+void s_flush(void) {
+  k_flush();
+}
+
+void* s_mmap(int fd, int offset, int length, int prot) {
   proc_fd_ent* fd_table = get_file_descriptors();
+  if (!is_valid_fd(fd) || fd_table[fd].proc_fd == -1) {
+    P_ERRNO = FD_INVALID;
+    return NULL;
+  }
+  if (offset < 0 || length <= 0) {
+    P_ERRNO = P_EINVAL;
+    return NULL;
+  }
+  if ((prot & PROT_WRITE) && fd_table[fd].mode == F_READ) {
+    P_ERRNO = INVALID_MODE;
+    return NULL;
+  }
+  return k_mmap(fd_table[fd].global_fd, offset, length, prot,
+                find_parent_with_current_thread()->pid);
+}
+
+int s_msync(void* addr) {
+  return k_msync(addr, find_parent_with_current_thread()->pid);
+}
+
+int s_munmap(void* addr) {
+  return k_munmap(addr, find_parent_with_current_thread()->pid);
+}
+
+// Report a failed k_read/k_write with the error it gave, either returned
+// or left in P_ERRNO
+static int io_error(int result) {
+  if (result < -1) {
+    P_ERRNO = result;
+  } else if (P_ERRNO == 0) {
+    P_ERRNO = FD_INVALID;
+  }
+  return -1;
+}
+
+static int fd_write(proc_fd_ent* fd_table, int fd, int n, const char* str) {
   if (!fd_table) {
     P_ERRNO = FD_TABLE_NULL;
     return -1;
@@ -189,20 +273,20 @@ int s_write(int fd, int n, const char* str) {
     P_ERRNO = INVALID_MODE;
     return -1;
   }
-  int global_fd = fd_table[fd].global_fd;
-  k_lseek(global_fd, fd_table[fd].offset, F_SEEK_SET);
-  int bytes_written = k_write(global_fd, str, n);
+  // The description keeps the offset, so there is nothing to seek
+  P_ERRNO = 0;
+  int bytes_written = k_write(fd_table[fd].global_fd, str, n);
   if (bytes_written < 0) {
-    P_ERRNO = FD_INVALID;
-    return -1;
+    return io_error(bytes_written);
   }
-
-  fd_table[fd].offset += bytes_written;
   return bytes_written;
 }
 
-int s_read(int fd, int n, char* buf) {
-  proc_fd_ent* fd_table = get_file_descriptors();
+int s_write(int fd, int n, const char* str) {
+  return fd_write(get_file_descriptors(), fd, n, str);
+}
+
+static int fd_read(proc_fd_ent* fd_table, int fd, int n, char* buf) {
   if (!(is_valid_fd(fd)) || fd_table[fd].proc_fd == -1) {
     P_ERRNO = FD_INVALID;
     return -1;
@@ -211,15 +295,38 @@ int s_read(int fd, int n, char* buf) {
     P_ERRNO = P_EINVAL;
     return -1;
   }
-  int global_fd = fd_table[fd].global_fd;
-  k_lseek(global_fd, fd_table[fd].offset, F_SEEK_SET);
-  int bytes_read = k_read(global_fd, n, buf);
+  P_ERRNO = 0;
+  int bytes_read = k_read(fd_table[fd].global_fd, n, buf);
   if (bytes_read < 0) {
+    return io_error(bytes_read);
+  }
+  return bytes_read;
+}
+
+int s_read(int fd, int n, char* buf) {
+  return fd_read(get_file_descriptors(), fd, n, buf);
+}
+
+int s_writev(int fd, const struct iovec* iov, int iovcnt) {
+  proc_fd_ent* fd_table = get_file_descriptors();
+  if (!(is_valid_fd(fd)) || fd_table[fd].proc_fd == -1) {
     P_ERRNO = FD_INVALID;
     return -1;
   }
-  fd_table[fd].offset += bytes_read;
-  return bytes_read;
+  if (fd_table[fd].mode != F_WRITE && fd_table[fd].mode != F_APPEND) {
+    P_ERRNO = INVALID_MODE;
+    return -1;
+  }
+  return k_writev(fd_table[fd].global_fd, iov, iovcnt);
+}
+
+int s_readv(int fd, const struct iovec* iov, int iovcnt) {
+  proc_fd_ent* fd_table = get_file_descriptors();
+  if (!(is_valid_fd(fd)) || fd_table[fd].proc_fd == -1) {
+    P_ERRNO = FD_INVALID;
+    return -1;
+  }
+  return k_readv(fd_table[fd].global_fd, iov, iovcnt);
 }
 
 int s_unlink(const char* fname) {
@@ -239,9 +346,7 @@ int s_unlink(const char* fname) {
   return unlink_val;
 }
 
-int s_lseek(int fd, int offset, int whence) {
-  proc_fd_ent* fd_table = get_file_descriptors();
-
+static int fd_lseek(proc_fd_ent* fd_table, int fd, int offset, int whence) {
   // Validate file descriptor
   if (!is_valid_fd(fd) || fd_table[fd].proc_fd == -1) {
     k_print("DEBUG[s_lseek]: invalid fd %d\n", fd);
@@ -256,15 +361,141 @@ int s_lseek(int fd, int offset, int whence) {
 
   int global_fd = fd_table[fd].global_fd;
 
-  // Call kernel-level seek
+  // Call kernel-level seek; the offset lives in the description
   int result = k_lseek(global_fd, offset, whence);
   if (result < 0) {
     k_print("DEBUG[s_lseek]: kernel lseek failed\n");
     return result;
   }
+  return result;
+}
+
+int s_lseek(int fd, int offset, int whence) {
+  return fd_lseek(get_file_descriptors(), fd, offset, whence);
+}
 
-  // Update local offset
-  fd_table[fd].offset = result;
+int s_ring_init(io_ring_t* ring, unsigned entries) {
+  if (!ring || entries == 0 || entries > RING_MAX_ENTRIES) {
+    P_ERRNO = P_EINVAL;
+    return -1;
+  }
+  unsigned size = 1;
+  while (size < entries) {
+    size <<= 1;
+  }
+  *ring = (io_ring_t){.sq = calloc(size, sizeof(ring_sqe_t)),
+                      .cq = calloc(size, sizeof(ring_cqe_t)),
+                      .entries = size};
+  if (!ring->sq || !ring->cq) {
+    s_ring_free(ring);
+    P_ERRNO = P_ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+void s_ring_free(io_ring_t* ring) {
+  free(ring->sq);
+  free(ring->cq);
+  *ring = (io_ring_t){0};
+}
+
+ring_sqe_t* s_ring_sqe(io_ring_t* ring) {
+  // Room for the request's completion too, so posting never overflows
+  if (ring->sq_tail - ring->sq_head + ring->cq_tail - ring->cq_head >=
+      ring->entries) {
+    return NULL;
+  }
+  ring_sqe_t* sqe = &ring->sq[ring->sq_tail++ & (ring->entries - 1)];
+  *sqe = (ring_sqe_t){0};
+  return sqe;
+}
+
+// Run one request on the caller's table; opened is the fd of the batch's
+// last open
+static int ring_run(proc_fd_ent* fd_table, ring_sqe_t* sqe, int* opened) {
+  int fd = sqe->fd == RING_FD_OPENED ? *opened : sqe->fd;
+  switch (sqe->op) {
+    case RING_OP_OPEN:
+      *opened = fd_open(fd_table, sqe->fname, sqe->mode);
+      return *opened;
+    case RING_OP_READ:
+      return fd_read(fd_table, fd, sqe->n, sqe->buf);
+    case RING_OP_WRITE:
+      return fd_write(fd_table, fd, sqe->n, sqe->buf);
+    case RING_OP_LSEEK:
+      return fd_lseek(fd_table, fd, sqe->n, sqe->mode);
+    case RING_OP_CLOSE:
+      return fd_close(fd_table, fd);
+  }
+  P_ERRNO = P_EINVAL;
+  return -1;
+}
+
+int s_ring_submit(io_ring_t* ring) {
+  proc_fd_ent* fd_table = get_file_descriptors();
+  int opened = -1;
+  int count = 0;
+  k_batch_begin();
+  for (; ring->sq_head != ring->sq_tail; ring->sq_head++, count++) {
+    ring_sqe_t* sqe = &ring->sq[ring->sq_head & (ring->entries - 1)];
+    P_ERRNO = 0;
+    int res = ring_run(fd_table, sqe, &opened);
+    ring->cq[ring->cq_tail++ & (ring->entries - 1)] = (ring_cqe_t){
+        .res = res, .err = res < 0 ? P_ERRNO : 0, .user_data = sqe->user_data};
+  }
+  k_batch_end();
+  return count;
+}
+
+ring_cqe_t* s_ring_cqe(io_ring_t* ring) {
+  if (ring->cq_head == ring->cq_tail) {
+    return NULL;
+  }
+  return &ring->cq[ring->cq_head & (ring->entries - 1)];
+}
+
+void s_ring_cqe_seen(io_ring_t* ring) {
+  if (ring->cq_head != ring->cq_tail) {
+    ring->cq_head++;
+  }
+}
+
+// Hand cb to the I/O worker
+static int aio_start(aio_t* cb, int op) {
+  proc_fd_ent* fd_table = get_file_descriptors();
+  if (!cb || !is_valid_fd(cb->fd) || fd_table[cb->fd].proc_fd == -1) {
+    P_ERRNO = FD_INVALID;
+    return -1;
+  }
+  if (cb->n < 0 || cb->offset < 0 || (cb->n > 0 && !cb->buf)) {
+    P_ERRNO = P_EINVAL;
+    return -1;
+  }
+  if (op == AIO_WRITE && fd_table[cb->fd].mode == F_READ) {
+    P_ERRNO = INVALID_MODE;
+    return -1;
+  }
+  cb->req = k_aio_submit(op, fd_table[cb->fd].global_fd, cb->offset, cb->buf,
+                         cb->n, find_parent_with_current_thread()->pid);
+  return cb->req ? 0 : -1;
+}
+
+int s_aio_read(aio_t* cb) {
+  return aio_start(cb, AIO_READ);
+}
+
+int s_aio_write(aio_t* cb) {
+  return aio_start(cb, AIO_WRITE);
+}
+
+int s_aio_wait(aio_t* cb) {
+  if (!cb || !cb->req) {
+    P_ERRNO = P_EINVAL;
+    return -1;
+  }
+  int result = k_aio_wait(cb->req, cb->buf);
+  cb->req = NULL;
   return result;
 }
 
@@ -277,11 +508,11 @@ int s_perm(const char* fname) {
 }
 
 void* s_ls(void* arg) {
-  thread_args_t* targs = (thread_args_t*)arg;
+  char** argv = (char**)arg;
 
   const char* filename = NULL;
-  if (targs && targs->argv && targs->argv[1]) {
-    filename = targs->argv[1];
+  if (argv && argv[1]) {
+    filename = argv[1];
   }
 
   ls(filename);
@@ -303,6 +534,94 @@ void* s_touch(void* arg) {
   return (void*)(long)ptouch(argc, argv);
 }
 
+// Helper function to create directories
+void* s_mkdir(void* arg) {
+  char** argv = (char**)arg;
+  if (!argv || !argv[1]) {
+    k_print("Usage: mkdir <dir> [dir ...]\n");
+    return NULL;
+  }
+  int argc = 0;
+  while (argv[argc] != NULL) {
+    argc++;
+  }
+  return (void*)(long)pmkdir(argc, argv);
+}
+
+// Helper function to remove empty directories
+void* s_rmdir(void* arg) {
+  char** argv = (char**)arg;
+  if (!argv || !argv[1]) {
+    k_print("Usage: rmdir <dir> [dir ...]\n");
+    return NULL;
+  }
+  int argc = 0;
+  while (argv[argc] != NULL) {
+    argc++;
+  }
+  return (void*)(long)prmdir(argc, argv);
+}
+
+// Helper function to list, take or delete snapshots
+void* s_snapshot(void* arg) {
+  char** argv = (char**)arg;
+  int argc = 0;
+  while (argv && argv[argc] != NULL) {
+    argc++;
+  }
+  int ret = psnapshot(argc, argv);
+  if (ret < 0 && ret != INVALID_MODE) {
+    P_ERRNO = ret;
+    u_perror("snapshot");
+  }
+  return (void*)(long)ret;
+}
+
+// Helper function to roll back to a snapshot
+void* s_rollback(void* arg) {
+  char** argv = (char**)arg;
+  int argc = 0;
+  while (argv && argv[argc] != NULL) {
+    argc++;
+  }
+  int ret = prollback(argc, argv);
+  if (ret < 0 && ret != INVALID_MODE) {
+    P_ERRNO = ret;
+    u_perror("rollback");
+  }
+  return (void*)(long)ret;
+}
+
+// Helper function to defragment the filesystem
+void* s_defrag(void* arg) {
+  char** argv = (char**)arg;
+  int argc = 0;
+  while (argv && argv[argc] != NULL) {
+    argc++;
+  }
+  int ret = pdefrag(argc, argv);
+  if (ret < 0 && ret != INVALID_MODE) {
+    P_ERRNO = ret;
+    u_perror("defrag");
+  }
+  return (void*)(long)ret;
+}
+
+// Helper function to check the filesystem's blocks against their checksums
+void* s_scrub(void* arg) {
+  char** argv = (char**)arg;
+  int argc = 0;
+  while (argv && argv[argc] != NULL) {
+    argc++;
+  }
+  int ret = pscrub(argc, argv);
+  if (ret < 0 && ret != INVALID_MODE) {
+    P_ERRNO = ret;
+    u_perror("scrub");
+  }
+  return (void*)(long)ret;
+}
+
 // Helper function to remove a file
 void* s_rm(void* arg) {
   char** argv = (char**)arg;
@@ -380,6 +699,10 @@ void* s_chmod(void* arg) {
         result = chmod(filename, -PERM_WRITE);
       } else if (argv[1][i] == 'x') {
         result = chmod(filename, -PERM_EXEC);
+      } else if (argv[1][i] == 'c') {
+        result = k_compress(filename, false);
+      } else if (argv[1][i] == 'd') {
+        result = k_dedup(filename, false);
       }
     }
   } else if (argv[1][0] == '+') {
@@ -390,6 +713,10 @@ void* s_chmod(void* arg) {
         result = chmod(filename, PERM_WRITE);
       } else if (argv[1][i] == 'x') {
         result = chmod(filename, PERM_EXEC);
+      } else if (argv[1][i] == 'c') {
+        result = k_compress(filename, true);
+      } else if (argv[1][i] == 'd') {
+        result = k_dedup(filename, true);
       }
     }
   }
@@ -404,40 +731,40 @@ void* s_echo(void* arg) {
   char** t_args = (char**)arg;
   char** argv = t_args;
 
-  char buffer[MAX_BUFFER_SIZE];  // max size of echo output
-  int len = 0;
-  // Build output string
-  for (int i = 1; argv[i]; ++i) {
-    int word_len = strlen(argv[i]);
-    if (len + word_len + 2 >= sizeof(buffer)) {
-      panic("echo: output too long");
-      return NULL;
-    }
-
-    memcpy(buffer + len, argv[i], word_len);
-    len += word_len;
-
-    if (argv[i + 1]) {
-      buffer[len++] = ' ';
-    }
+  int argc = 0;
+  while (argv[argc]) {
+    argc++;
+  }
+  // Each word and the space or newline after it, written in one call
+  struct iovec* iov = malloc(sizeof(struct iovec) * 2 * MAX(argc - 1, 1));
+  if (!iov) {
+    u_perror("echo");
+    return NULL;
+  }
+  int iovcnt = 0;
+  for (int i = 1; i < argc; ++i) {
+    iov[iovcnt++] = (struct iovec){argv[i], strlen(argv[i])};
+    iov[iovcnt++] = (struct iovec){i + 1 < argc ? " " : "\n", 1};
+  }
+  if (iovcnt == 0) {
+    iov[iovcnt++] = (struct iovec){"\n", 1};
   }
 
-  buffer[len++] = '\n';
-
-  // Write once
-  if (s_write(1, len, buffer) == -1) {
+  int written = s_writev(STDOUT_FILENO, iov, iovcnt);
+  free(iov);
+  if (written == -1) {
     u_perror("s_write: Failed");
   }
   proc_fd_ent* file_table = get_file_descriptors();
   if (file_table[STDIN_FILENO].global_fd != 0) {
     s_close(STDIN_FILENO);
     file_table[STDIN_FILENO] = (proc_fd_ent){
-        .proc_fd = 0, .mode = F_READ, .offset = 0, .global_fd = 0};
+        .proc_fd = 0, .mode = F_READ, .global_fd = 0};
   }
   if (file_table[STDOUT_FILENO].global_fd != 1) {
     s_close(STDOUT_FILENO);
     file_table[STDOUT_FILENO] = (proc_fd_ent){
-        .proc_fd = 1, .mode = F_WRITE, .offset = 0, .global_fd = 1};
+        .proc_fd = 1, .mode = F_WRITE, .global_fd = 1};
   }
   return NULL;
 }
@@ -571,7 +898,7 @@ void* s_edit(void* arg) {
     int cursor_pos = strlen(buffer[current_line]);
     char ch;
 
-    while (read(STDIN_FILENO, &ch, 1) == 1) {
+    while (s_read(STDIN_FILENO, 1, &ch) == 1) {
       if (ch == '\n') {
         s_write(1, 1, "\n");
         break;
@@ -586,8 +913,8 @@ void* s_edit(void* arg) {
         }
       } else if (ch == '\x1b') {  // Escape sequence (arrow keys)
         char seq[2];
-        if (read(STDIN_FILENO, &seq[0], 1) == 1 &&
-            read(STDIN_FILENO, &seq[1], 1) == 1) {
+        if (s_read(STDIN_FILENO, 1, &seq[0]) == 1 &&
+            s_read(STDIN_FILENO, 1, &seq[1]) == 1) {
           if (seq[0] == '[') {
             switch (seq[1]) {
               case 'A':  // Up
@@ -625,8 +952,8 @@ void* s_edit(void* arg) {
         int i = 0;
         command[i++] = ch;
         s_write(1, 1, &ch);
-        while (i < sizeof(command) - 1 && read(STDIN_FILENO, &ch, 1) == 1 &&
-               ch != '\n') {
+        while (i < sizeof(command) - 1 &&
+               s_read(STDIN_FILENO, 1, &ch) == 1 && ch != '\n') {
           command[i++] = ch;
           s_write(1, 1, &ch);
         }
@@ -717,7 +1044,16 @@ void* s_wc(void* arg) {
   char** argv = (char**)arg;
   char msg[PRINT_BUFFER_SIZE];
   if (!argv || !argv[1]) {
-    int len = snprintf(msg, sizeof(msg), "Usage: wc <filename>\n");
+    // No file: count whatever arrives on stdin (e.g. from a pipe)
+    int lines = 0, words = 0, chars = 0;
+    proc_fd_ent* fd_table = get_file_descriptors();
+    if (k_wc_fd(fd_table[STDIN_FILENO].global_fd, &lines, &words, &chars) <
+        0) {
+      int len = snprintf(msg, sizeof(msg), "wc: failed to read stdin\n");
+      s_write(STDOUT_FILENO, len, msg);
+      return NULL;
+    }
+    int len = snprintf(msg, sizeof(msg), "%d %d %d\n", lines, words, chars);
     s_write(STDOUT_FILENO, len, msg);
     return NULL;
   }
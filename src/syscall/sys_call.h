@@ -156,6 +156,29 @@ int s_read(int fd, int n, char* buf);
  */
 int s_write(int fd, int n, const char* str);
 
+/**
+ * @brief write the pieces of iov to the file referenced by fd, in order, as
+ * one write: the fd is checked and the file is written and synced once.
+ * Advances the file pointer by the number of bytes written.
+ *
+ * @param fd file descriptor referencing the file
+ * @param iov pieces to write
+ * @param iovcnt number of pieces, 1 to IOV_MAX
+ * @return number of bytes written, or -1 on error with P_ERRNO set
+ */
+int s_writev(int fd, const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief read from the file referenced by fd into the buffers of iov, filling
+ * each before the next, as one read.
+ *
+ * @param fd file descriptor referencing the file
+ * @param iov buffers to fill
+ * @param iovcnt number of buffers, 1 to IOV_MAX
+ * @return number of bytes read, 0 at EOF, or -1 on error with P_ERRNO set
+ */
+int s_readv(int fd, const struct iovec* iov, int iovcnt);
+
 /**
  * @brief close the file fd and return 0 on success, or a negative value on
  * failure. On success the local process’ file descriptor table should be
@@ -165,6 +188,58 @@ int s_write(int fd, int n, const char* str);
  */
 int s_close(int fd);
 
+/**
+ * @brief create a pipe. pipefd[0] becomes the read end and pipefd[1] the
+ * write end in the calling process' file descriptor table. Reads block until
+ * data arrives or every write end is closed (then 0 is returned); writes
+ * block while the pipe is full.
+ *
+ * @param pipefd array receiving the two new file descriptors
+ * @return 0 on success, -1 on failure with P_ERRNO set
+ */
+int s_pipe(int pipefd[2]);
+
+/**
+ * @brief write out everything the calling process has buffered for the
+ * terminal. Terminal output is buffered per process and is otherwise only
+ * flushed when the buffer fills, at a newline if stdout is a terminal, before
+ * reading stdin, and when the process exits.
+ */
+void s_flush(void);
+
+/**
+ * @brief map length bytes of an open file, from offset, into memory, so
+ * they can be read and written without copying them through s_read and
+ * s_write. A plain file is mapped straight from the image where its blocks
+ * allow; otherwise the process gets a copy that is written back by s_msync
+ * and s_munmap. The file stays open until the mapping is removed, and the
+ * mapping is removed when the process exits. See k_mmap.
+ *
+ * @param fd file descriptor of a regular file; opened for writing if prot
+ * has PROT_WRITE
+ * @param offset where the range starts
+ * @param length bytes to map; the range must lie within the file
+ * @param prot PROT_READ, PROT_WRITE or both
+ * @return address of the range, or NULL on failure with P_ERRNO set
+ */
+void* s_mmap(int fd, int offset, int length, int prot);
+
+/**
+ * @brief write the changes made through a mapping back to its file.
+ *
+ * @param addr address returned by s_mmap
+ * @return 0 on success, -1 on failure with P_ERRNO set
+ */
+int s_msync(void* addr);
+
+/**
+ * @brief write a mapping back like s_msync and remove it.
+ *
+ * @param addr address returned by s_mmap
+ * @return 0 on success, -1 on failure with P_ERRNO set
+ */
+int s_munmap(void* addr);
+
 /**
  * @brief remove the file. Be careful how you implement this, like Linux,
  * you should not be able to delete a file that is in use by another process.
@@ -182,6 +257,156 @@ int s_unlink(const char* fname);
  */
 int s_lseek(int fd, int offset, int whence);
 
+// Operations a submission ring can queue
+#define RING_OP_OPEN 0
+#define RING_OP_READ 1
+#define RING_OP_WRITE 2
+#define RING_OP_LSEEK 3
+#define RING_OP_CLOSE 4
+
+// An fd that stands for the one the last open of the same submission
+// returned, so a file can be opened, used and closed in one batch
+#define RING_FD_OPENED -2
+
+#define RING_MAX_ENTRIES 4096
+
+/**
+ * @brief A queued request: the arguments of the s_open, s_read, s_write,
+ * s_lseek or s_close call it stands for.
+ */
+typedef struct ring_sqe_st {
+  int op;              // RING_OP_*
+  int fd;              // or RING_FD_OPENED
+  const char* fname;   // RING_OP_OPEN
+  int mode;            // open mode, or whence for RING_OP_LSEEK
+  char* buf;           // RING_OP_READ and RING_OP_WRITE
+  int n;               // bytes to read or write, or the lseek offset
+  uint64_t user_data;  // copied to the request's completion
+} ring_sqe_t;
+
+/**
+ * @brief The result of a request, in the order the requests were queued.
+ */
+typedef struct ring_cqe_st {
+  int res;             // what the call would have returned
+  int err;             // P_ERRNO after the call, when res is negative
+  uint64_t user_data;  // from the request
+} ring_cqe_t;
+
+/**
+ * @brief A process's submission and completion queues.
+ *
+ * Requests are taken with s_ring_sqe and filled in, then s_ring_submit
+ * runs every queued request in order and posts a completion for each. A
+ * request is only handed out while there is room for its completion, so
+ * completions must be consumed (s_ring_cqe and s_ring_cqe_seen) before more
+ * requests can be queued than the ring holds.
+ */
+typedef struct io_ring_st {
+  ring_sqe_t* sq;
+  ring_cqe_t* cq;
+  unsigned entries;  // a power of two
+  unsigned sq_head;  // next request to run
+  unsigned sq_tail;  // next request to hand out
+  unsigned cq_head;  // next completion to consume
+  unsigned cq_tail;  // next completion to post
+} io_ring_t;
+
+/**
+ * @brief set up an empty ring.
+ *
+ * @param ring the ring
+ * @param entries requests it holds at a time, rounded up to a power of two
+ * @return 0 on success, -1 on failure with P_ERRNO set
+ */
+int s_ring_init(io_ring_t* ring, unsigned entries);
+
+/**
+ * @brief free a ring's queues; requests not yet submitted are dropped.
+ *
+ * @param ring the ring
+ */
+void s_ring_free(io_ring_t* ring);
+
+/**
+ * @brief hand out the next request to fill in, cleared.
+ *
+ * @param ring the ring
+ * @return the request, or NULL if the ring is full
+ */
+ring_sqe_t* s_ring_sqe(io_ring_t* ring);
+
+/**
+ * @brief run every queued request in order.
+ *
+ * The calling process's fd table is looked up once for the batch, and the
+ * FAT and the image are flushed once at the end rather than after each
+ * write. A request that fails does not stop the ones after it.
+ *
+ * @param ring the ring
+ * @return number of requests run
+ */
+int s_ring_submit(io_ring_t* ring);
+
+/**
+ * @brief the oldest completion not yet consumed.
+ *
+ * @param ring the ring
+ * @return the completion, or NULL if there is none
+ */
+ring_cqe_t* s_ring_cqe(io_ring_t* ring);
+
+/**
+ * @brief consume the completion s_ring_cqe returned.
+ *
+ * @param ring the ring
+ */
+void s_ring_cqe_seen(io_ring_t* ring);
+
+/**
+ * @brief An asynchronous read or write, filled in by the caller: the file,
+ * the buffer, how many bytes and where in the file. req belongs to the
+ * kernel while the request is in flight.
+ */
+typedef struct aio_st {
+  int fd;
+  char* buf;
+  int n;
+  int offset;
+  struct aio_req_st* req;
+} aio_t;
+
+/**
+ * @brief start reading cb->n bytes at cb->offset of the regular file cb->fd
+ * into cb->buf. The kernel's I/O worker does the read while the process
+ * keeps running; the bytes are in cb->buf once s_aio_wait returns. The
+ * file pointer is neither used nor moved.
+ *
+ * @param cb the request
+ * @return 0 on success, -1 on failure with P_ERRNO set
+ */
+int s_aio_read(aio_t* cb);
+
+/**
+ * @brief start writing cb->n bytes of cb->buf at cb->offset of the regular
+ * file cb->fd. The bytes are copied before this returns, so cb->buf can be
+ * reused; the write, and the fsync after it, happen on the I/O worker. As
+ * with s_write the file ends after the last byte written.
+ *
+ * @param cb the request
+ * @return 0 on success, -1 on failure with P_ERRNO set
+ */
+int s_aio_write(aio_t* cb);
+
+/**
+ * @brief wait for a request started with s_aio_read or s_aio_write. The
+ * process is blocked, so others run, until the worker is done.
+ *
+ * @param cb the request
+ * @return bytes read or written, or -1 on failure with P_ERRNO set
+ */
+int s_aio_wait(aio_t* cb);
+
 int s_perm(const char* fname);
 /**
  * @brief list file fname under the current directory.  If filename is NULL,
@@ -201,6 +426,51 @@ void* s_ls(void* arg);
  */
 void* s_touch(void* arg);
 
+/**
+ * @brief Create directories; each argument is a path from the root.
+ *
+ * @param arg argv of the command
+ */
+void* s_mkdir(void* arg);
+
+/**
+ * @brief Remove empty directories; each argument is a path from the root.
+ *
+ * @param arg argv of the command
+ */
+void* s_rmdir(void* arg);
+
+/**
+ * @brief List, take (snapshot <name>) or delete (snapshot -d <name>)
+ * snapshots of the filesystem.
+ *
+ * @param arg argv of the command
+ */
+void* s_snapshot(void* arg);
+
+/**
+ * @brief Roll the filesystem back to a snapshot; no file may be open.
+ *
+ * @param arg argv of the command
+ */
+void* s_rollback(void* arg);
+
+/**
+ * @brief Defragment the filesystem while other processes keep using it
+ * (defrag [pause_us]).
+ *
+ * @param arg argv of the command
+ */
+void* s_defrag(void* arg);
+
+/**
+ * @brief Check every block in use against its checksum, rate limited so it
+ * can run in the background (scrub [kb_per_sec]).
+ *
+ * @param arg argv of the command
+ */
+void* s_scrub(void* arg);
+
 /**
  * @brief change the permission of the file fname to perm.
  * The permission is a number between 0 and 7, where 0 is no permission and 7 is
@@ -244,7 +514,9 @@ void* s_cat(void* arg);
 /**
  * @brief change the permission of the file fname to perm.
  * The permission is a number between 0 and 7, where 0 is no permission and 7 is
- * read, write, and execute.
+ * read, write, and execute. The flag c (chmod +c / -c) stores the file
+ * compressed or plainly instead, see k_compress, and d deduplicated, see
+ * k_dedup.
  *
  * @param fname name of the file
  * @param perm permission to set
@@ -298,7 +570,8 @@ void* s_clear();
 void* s_edit(void* arg);
 
 /**
- * @brief Count the number of lines, words, and characters in a file.
+ * @brief Count the number of lines, words, and characters in a file, or in
+ * standard input when no file is given.
  * @param arg Arguments for the function.
  *
  */
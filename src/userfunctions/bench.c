@@ -0,0 +1,806 @@
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../scheduler/sched_policy.h"
+#include "../shell/pennshell.h"
+#include "../shell/script.h"
+#include "../syscall/sys_call.h"
+#include "../util/p_errno.h"
+
+#define BENCH_MAX_BUSY 16
+#define BENCH_MAX_ROUNDS 256
+#define BENCH_CHUNK 4096
+#define BENCH_TMP_FILE "pipebench.tmp"
+#define BENCH_MAX_PROCS 10000
+#define BENCH_DIR "dirbench.d"
+#define BENCH_MAX_ENTRIES 1000000
+#define BENCH_MMAP_FILE "mmapbench.tmp"
+#define BENCH_MMAP_STRIDE 4096  // bytes between the bytes mmapbench changes
+#define BENCH_RING_ENTRIES 64
+#define BENCH_RING_BATCH (BENCH_RING_ENTRIES / 3)  // open, use, close
+#define BENCH_RING_FILE_SIZE 512
+#define BENCH_MAX_FILES 100000
+#define BENCH_AIO_FILE "aiobench.tmp"
+#define BENCH_AIO_DEPTH 8  // aiobench writes in flight at once
+#define BENCH_FD_FILE "fdbench.tmp"
+#define BENCH_SCRIPT_FILE "scriptbench.tmp"
+#define BENCH_SCRIPT_OUT "scriptbench.out"
+#define BENCH_SCRIPT_LINE "echo x > " BENCH_SCRIPT_OUT "\n"  // spawned and redirected
+#define BENCH_MAX_LINES 1000000
+
+static void* bench_busy(void* arg) {
+  while (1)
+    ;
+  return NULL;
+}
+
+// Stands in for a short interactive command such as `echo`
+static void* bench_probe(void* arg) {
+  s_exit();
+  return NULL;
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Parses argv[i] as a positive count, falling back to def
+static int count_arg(char** argv, int i, int def, int max) {
+  for (int j = 1; j <= i; j++) {
+    if (!argv[j]) {
+      return def;
+    }
+  }
+  int value = atoi(argv[i]);
+  if (value <= 0) {
+    return def;
+  }
+  return value > max ? max : value;
+}
+
+void* schedbench(void* arg) {
+  thread_args_t* t_args = (thread_args_t*)arg;
+  char** argv = t_args->argv;
+  int nbusy = count_arg(argv, 1, 4, BENCH_MAX_BUSY);
+  int rounds = count_arg(argv, 2, 20, BENCH_MAX_ROUNDS);
+
+  char* busy_argv[] = {"benchbusy", NULL};
+  char* probe_argv[] = {"benchprobe", NULL};
+  thread_args_t busy_args = {.argv = busy_argv, .is_background = true};
+  thread_args_t probe_args = {.argv = probe_argv, .is_background = false};
+
+  pid_t busy[BENCH_MAX_BUSY];
+  for (int i = 0; i < nbusy; i++) {
+    busy[i] = s_spawn(bench_busy, &busy_args, 0, 1, 2, 1, P_BLOCKED, false,
+                      true);
+  }
+  s_sleep(10);  // let the busy loops use up their time at the top
+
+  uint64_t samples[BENCH_MAX_ROUNDS];
+  uint64_t total = 0;
+  for (int i = 0; i < rounds; i++) {
+    uint64_t start = now_us();
+    pid_t pid = s_spawn(bench_probe, &probe_args, 0, 1, 2, 1, P_BLOCKED,
+                        false, false);
+    s_waitpid(pid, NULL, false, false, -1);
+    samples[i] = now_us() - start;
+    total += samples[i];
+  }
+
+  for (int i = 0; i < nbusy; i++) {
+    if (busy[i] > 0) {
+      s_kill(busy[i], P_SIGTERM);
+      s_waitpid(busy[i], NULL, false, false, -1);
+    }
+  }
+
+  qsort(samples, rounds, sizeof(uint64_t), cmp_u64);
+  s_print("schedbench: policy=%s busy=%d rounds=%d\n", sched_policy->name,
+          nbusy, rounds);
+  s_print("  mean %.1f ms  p50 %.1f ms  max %.1f ms\n",
+          total / 1000.0 / rounds, samples[rounds / 2] / 1000.0,
+          samples[rounds - 1] / 1000.0);
+  return NULL;
+}
+
+// Writes argv[1] bytes to stdout in BENCH_CHUNK pieces
+static void* bench_writer(void* arg) {
+  char** argv = (char**)arg;
+  static char chunk[BENCH_CHUNK];
+  memset(chunk, 'x', sizeof(chunk));
+  int remaining = atoi(argv[1]);
+  while (remaining > 0) {
+    int n = s_write(STDOUT_FILENO, MIN(remaining, BENCH_CHUNK), chunk);
+    if (n <= 0) {
+      break;
+    }
+    remaining -= n;
+  }
+  s_exit();
+  return NULL;
+}
+
+// Drains stdin until end of file
+static void* bench_reader(void* arg) {
+  char buf[BENCH_CHUNK];
+  while (s_read(STDIN_FILENO, sizeof(buf), buf) > 0)
+    ;
+  s_exit();
+  return NULL;
+}
+
+// Spawns func with the given global-table entries as its stdin and stdout
+static pid_t bench_spawn(void* (*func)(void*),
+                         char** argv,
+                         int in_fd,
+                         int out_fd) {
+  proc_fd_ent* fds = get_file_descriptors();
+  proc_fd_ent saved_in = fds[0];
+  proc_fd_ent saved_out = fds[1];
+  fds[0] = fds[in_fd];
+  fds[0].proc_fd = 0;
+  fds[1] = fds[out_fd];
+  fds[1].proc_fd = 1;
+  thread_args_t args = {.argv = argv, .is_background = false};
+  pid_t pid = s_spawn(func, &args, 0, 1, 2, 1, P_BLOCKED, false, false);
+  fds[0] = saved_in;
+  fds[1] = saved_out;
+  return pid;
+}
+
+static double mb_per_sec(int bytes, uint64_t us) {
+  return us ? (bytes / (1024.0 * 1024.0)) / (us / 1e6) : 0;
+}
+
+void* pipebench(void* arg) {
+  thread_args_t* t_args = (thread_args_t*)arg;
+  int kb = count_arg(t_args->argv, 1, 256, 1 << 20);
+  int bytes = kb * 1024;
+  char size[16];
+  snprintf(size, sizeof(size), "%d", bytes);
+  char* writer_argv[] = {"benchwriter", size, NULL};
+  char* reader_argv[] = {"benchreader", NULL};
+
+  // Writer and reader connected by a pipe, running concurrently
+  int pipefd[2];
+  if (s_pipe(pipefd) == -1) {
+    u_perror("pipebench: s_pipe");
+    return NULL;
+  }
+  uint64_t start = now_us();
+  pid_t writer = bench_spawn(bench_writer, writer_argv, 0, pipefd[1]);
+  pid_t reader = bench_spawn(bench_reader, reader_argv, pipefd[0], 1);
+  s_close(pipefd[0]);
+  s_close(pipefd[1]);
+  s_waitpid(writer, NULL, false, false, -1);
+  s_waitpid(reader, NULL, false, false, -1);
+  uint64_t pipe_us = now_us() - start;
+
+  // Writer fills a temporary file, then the reader reads it back
+  start = now_us();
+  int tmp_fd = s_open(BENCH_TMP_FILE, F_WRITE);
+  if (tmp_fd == -1) {
+    u_perror("pipebench: s_open");
+    return NULL;
+  }
+  writer = bench_spawn(bench_writer, writer_argv, 0, tmp_fd);
+  s_waitpid(writer, NULL, false, false, -1);
+  s_close(tmp_fd);
+  tmp_fd = s_open(BENCH_TMP_FILE, F_READ);
+  reader = bench_spawn(bench_reader, reader_argv, tmp_fd, 1);
+  s_waitpid(reader, NULL, false, false, -1);
+  s_close(tmp_fd);
+  uint64_t file_us = now_us() - start;
+  s_unlink(BENCH_TMP_FILE);
+
+  s_print("pipebench: %d KB\n", kb);
+  s_print("  pipe      %8.1f ms  %7.2f MB/s\n", pipe_us / 1000.0,
+          mb_per_sec(bytes, pipe_us));
+  s_print("  temp file %8.1f ms  %7.2f MB/s\n", file_us / 1000.0,
+          mb_per_sec(bytes, file_us));
+  return NULL;
+}
+
+// Sleeps until psbench kills it
+static void* bench_sleeper(void* arg) {
+  s_sleep(1 << 30);
+  s_exit();
+  return NULL;
+}
+
+void* psbench(void* arg) {
+  thread_args_t* t_args = (thread_args_t*)arg;
+  int nprocs = count_arg(t_args->argv, 1, 1000, BENCH_MAX_PROCS);
+  pid_t* pids = malloc(nprocs * sizeof(pid_t));
+  if (!pids) {
+    P_ERRNO = P_ENOMEM;
+    u_perror("psbench");
+    return NULL;
+  }
+
+  char* sleeper_argv[] = {"benchsleeper", NULL};
+  thread_args_t sleeper_args = {.argv = sleeper_argv, .is_background = true};
+  int spawned = 0;
+  for (; spawned < nprocs; spawned++) {
+    pids[spawned] = s_spawn(bench_sleeper, &sleeper_args, 0, 1, 2, 1,
+                            P_BLOCKED, false, true);
+    if (pids[spawned] <= 0) {
+      break;
+    }
+  }
+  s_sleep(1);  // let every sleeper reach s_sleep
+
+  uint64_t start = now_us();
+  s_ps();
+  s_flush();
+  uint64_t ps_us = now_us() - start;
+
+  for (int i = 0; i < spawned; i++) {
+    s_kill(pids[i], P_SIGTERM);
+    s_waitpid(pids[i], NULL, false, false, -1);
+  }
+  free(pids);
+
+  s_print("psbench: %d processes\n", spawned);
+  s_print("  ps %8.1f ms\n", ps_us / 1000.0);
+  return NULL;
+}
+
+// Path of the i-th dirbench file
+static void bench_entry_path(char* path, size_t len, int i) {
+  snprintf(path, len, "%s/f%07d", BENCH_DIR, i);
+}
+
+void* dirbench(void* arg) {
+  thread_args_t* t_args = (thread_args_t*)arg;
+  int n = count_arg(t_args->argv, 1, 10000, BENCH_MAX_ENTRIES);
+  char* mkdir_argv[] = {"mkdir", BENCH_DIR, NULL};
+  char path[64];
+
+  if (s_perm(BENCH_DIR) >= 0) {
+    s_print("dirbench: %s already exists\n", BENCH_DIR);
+    return NULL;
+  }
+  s_mkdir(mkdir_argv);
+
+  uint64_t start = now_us();
+  int created = 0;
+  for (; created < n; created++) {
+    bench_entry_path(path, sizeof(path), created);
+    int fd = s_open(path, F_WRITE);
+    if (fd == -1) {
+      u_perror("dirbench: s_open");
+      break;
+    }
+    s_close(fd);
+  }
+  uint64_t create_us = now_us() - start;
+
+  start = now_us();
+  for (int i = 0; i < created; i++) {
+    bench_entry_path(path, sizeof(path), i);
+    int fd = s_open(path, F_READ);
+    if (fd != -1) {
+      s_close(fd);
+    }
+  }
+  uint64_t open_us = now_us() - start;
+
+  start = now_us();
+  for (int i = 0; i < created; i++) {
+    bench_entry_path(path, sizeof(path), i);
+    s_unlink(path);
+  }
+  uint64_t unlink_us = now_us() - start;
+  char* rmdir_argv[] = {"rmdir", BENCH_DIR, NULL};
+  s_rmdir(rmdir_argv);
+
+  double per_op = created ? 1.0 / created : 0;
+  s_print("dirbench: %d entries\n", created);
+  s_print("  create %8.1f ms  %6.1f us/op\n", create_us / 1000.0,
+          create_us * per_op);
+  s_print("  open   %8.1f ms  %6.1f us/op\n", open_us / 1000.0,
+          open_us * per_op);
+  s_print("  unlink %8.1f ms  %6.1f us/op\n", unlink_us / 1000.0,
+          unlink_us * per_op);
+  return NULL;
+}
+
+// Sum of every byte of the file read through s_read, BENCH_CHUNK at a time
+static uint64_t bench_read_sum(int fd) {
+  char buf[BENCH_CHUNK];
+  uint64_t sum = 0;
+  int n;
+  while ((n = s_read(fd, BENCH_CHUNK, buf)) > 0) {
+    for (int i = 0; i < n; i++) {
+      sum += (unsigned char)buf[i];
+    }
+  }
+  return sum;
+}
+
+void* mmapbench(void* arg) {
+  thread_args_t* t_args = (thread_args_t*)arg;
+  int kb = count_arg(t_args->argv, 1, 4096, 1 << 20);
+  int bytes = kb * 1024;
+  char buf[BENCH_CHUNK];
+
+  int fd = s_open(BENCH_MMAP_FILE, F_WRITE);
+  if (fd == -1) {
+    u_perror("mmapbench: s_open");
+    return NULL;
+  }
+  for (int done = 0; done < bytes; done += BENCH_CHUNK) {
+    for (int i = 0; i < BENCH_CHUNK; i++) {
+      buf[i] = (char)(done / BENCH_CHUNK + i * 7);
+    }
+    if (s_write(fd, MIN(bytes - done, BENCH_CHUNK), buf) <
+        MIN(bytes - done, BENCH_CHUNK)) {
+      break;  // the disk is full: use what fit
+    }
+  }
+  bytes = MIN(bytes, MAX(s_lseek(fd, 0, F_SEEK_END), 0));
+  s_close(fd);
+  if (bytes == 0) {
+    s_print("mmapbench: no room for the file\n");
+    s_unlink(BENCH_MMAP_FILE);
+    return NULL;
+  }
+
+  // Read every byte through s_read, then through a read-only mapping
+  fd = s_open(BENCH_MMAP_FILE, F_READ);
+  uint64_t start = now_us();
+  uint64_t read_sum = bench_read_sum(fd);
+  uint64_t read_us = now_us() - start;
+  start = now_us();
+  unsigned char* map = s_mmap(fd, 0, bytes, PROT_READ);
+  uint64_t map_sum = 0;
+  for (int i = 0; map && i < bytes; i++) {
+    map_sum += map[i];
+  }
+  if (map) {
+    s_munmap(map);
+  }
+  uint64_t map_us = now_us() - start;
+  s_close(fd);
+  if (!map) {
+    u_perror("mmapbench: s_mmap");
+    s_unlink(BENCH_MMAP_FILE);
+    return NULL;
+  }
+
+  // Change a byte per stride through a writable mapping and read it back
+  fd = s_open(BENCH_MMAP_FILE, F_APPEND);
+  start = now_us();
+  map = s_mmap(fd, 0, bytes, PROT_READ | PROT_WRITE);
+  int changed = 0;
+  int64_t delta = 0;  // what the changes add to the sum
+  for (int i = 0; map && i < bytes; i += BENCH_MMAP_STRIDE, changed++) {
+    delta += (unsigned char)(map[i] + 1) - map[i];
+    map[i]++;
+  }
+  int unmapped = map ? s_munmap(map) : -1;
+  uint64_t write_us = now_us() - start;
+  s_close(fd);
+  fd = s_open(BENCH_MMAP_FILE, F_READ);
+  uint64_t after_sum = bench_read_sum(fd);
+  s_close(fd);
+  s_unlink(BENCH_MMAP_FILE);
+  if (unmapped == -1) {
+    u_perror("mmapbench: writable s_mmap");
+    return NULL;
+  }
+
+  s_print("mmapbench: %d KB\n", bytes / 1024);
+  s_print("  s_read      %8.1f ms  %7.2f MB/s\n", read_us / 1000.0,
+          mb_per_sec(bytes, read_us));
+  s_print("  s_mmap      %8.1f ms  %7.2f MB/s  (%s)\n", map_us / 1000.0,
+          mb_per_sec(bytes, map_us),
+          map_sum == read_sum ? "same bytes" : "DIFFERENT BYTES");
+  s_print("  write back  %8.1f ms  %d bytes changed (%s)\n",
+          write_us / 1000.0, changed,
+          (int64_t)(after_sum - read_sum) == delta ? "read back" : "LOST");
+  return NULL;
+}
+
+
+typedef char ring_path_t[24];
+
+// Contents of the i-th ringbench file
+static void ring_fill(char* buf, int i) {
+  memset(buf, 'a' + i % 26, BENCH_RING_FILE_SIZE);
+}
+
+// Writes then reads back the files with one call per operation; returns the
+// files read back intact
+static int ring_plain(ring_path_t* paths, int n, uint64_t us[2]) {
+  char buf[BENCH_RING_FILE_SIZE];
+  char expect[BENCH_RING_FILE_SIZE];
+  uint64_t start = now_us();
+  for (int i = 0; i < n; i++) {
+    ring_fill(buf, i);
+    int fd = s_open(paths[i], F_WRITE);
+    s_write(fd, BENCH_RING_FILE_SIZE, buf);
+    s_close(fd);
+  }
+  us[0] = now_us() - start;
+
+  int good = 0;
+  start = now_us();
+  for (int i = 0; i < n; i++) {
+    int fd = s_open(paths[i], F_READ);
+    int got = s_read(fd, BENCH_RING_FILE_SIZE, buf);
+    s_close(fd);
+    ring_fill(expect, i);
+    good += got == BENCH_RING_FILE_SIZE && !memcmp(buf, expect, got);
+  }
+  us[1] = now_us() - start;
+  return good;
+}
+
+// Queues open, op and close of file i; the op's completion carries i
+static void ring_queue(io_ring_t* ring, ring_path_t* paths, int i, int op,
+                       char* buf) {
+  ring_sqe_t* sqe = s_ring_sqe(ring);
+  *sqe = (ring_sqe_t){.op = RING_OP_OPEN,
+                      .fname = paths[i],
+                      .mode = op == RING_OP_WRITE ? F_WRITE : F_READ,
+                      .user_data = UINT64_MAX};
+  sqe = s_ring_sqe(ring);
+  *sqe = (ring_sqe_t){.op = op,
+                      .fd = RING_FD_OPENED,
+                      .buf = buf,
+                      .n = BENCH_RING_FILE_SIZE,
+                      .user_data = i};
+  sqe = s_ring_sqe(ring);
+  *sqe = (ring_sqe_t){
+      .op = RING_OP_CLOSE, .fd = RING_FD_OPENED, .user_data = UINT64_MAX};
+}
+
+// The same work as ring_plain, BENCH_RING_BATCH files per submission
+static int ring_batched(io_ring_t* ring, ring_path_t* paths, int n,
+                        uint64_t us[2]) {
+  static char bufs[BENCH_RING_BATCH][BENCH_RING_FILE_SIZE];
+  char expect[BENCH_RING_FILE_SIZE];
+  ring_cqe_t* cqe;
+  uint64_t start = now_us();
+  for (int first = 0; first < n; first += BENCH_RING_BATCH) {
+    for (int i = first; i < MIN(n, first + BENCH_RING_BATCH); i++) {
+      ring_fill(bufs[i - first], i);
+      ring_queue(ring, paths, i, RING_OP_WRITE, bufs[i - first]);
+    }
+    s_ring_submit(ring);
+    while ((cqe = s_ring_cqe(ring))) {
+      s_ring_cqe_seen(ring);
+    }
+  }
+  us[0] = now_us() - start;
+
+  int good = 0;
+  start = now_us();
+  for (int first = 0; first < n; first += BENCH_RING_BATCH) {
+    for (int i = first; i < MIN(n, first + BENCH_RING_BATCH); i++) {
+      ring_queue(ring, paths, i, RING_OP_READ, bufs[i - first]);
+    }
+    s_ring_submit(ring);
+    while ((cqe = s_ring_cqe(ring))) {
+      int i = cqe->user_data;
+      if (cqe->user_data != UINT64_MAX && cqe->res == BENCH_RING_FILE_SIZE) {
+        ring_fill(expect, i);
+        good += !memcmp(bufs[i - first], expect, BENCH_RING_FILE_SIZE);
+      }
+      s_ring_cqe_seen(ring);
+    }
+  }
+  us[1] = now_us() - start;
+  return good;
+}
+
+void* ringbench(void* arg) {
+  thread_args_t* t_args = (thread_args_t*)arg;
+  int n = count_arg(t_args->argv, 1, 200, BENCH_MAX_FILES);
+  ring_path_t* paths = malloc(n * sizeof(ring_path_t));
+  io_ring_t ring;
+  if (!paths || s_ring_init(&ring, BENCH_RING_ENTRIES) == -1) {
+    u_perror("ringbench");
+    free(paths);
+    return NULL;
+  }
+  for (int i = 0; i < n; i++) {
+    snprintf(paths[i], sizeof(ring_path_t), "ringbench.%05d", i);
+  }
+
+  uint64_t plain_us[2];
+  uint64_t ring_us[2];
+  int plain_good = ring_plain(paths, n, plain_us);
+  int ring_good = ring_batched(&ring, paths, n, ring_us);
+  for (int i = 0; i < n; i++) {
+    s_unlink(paths[i]);
+  }
+  s_ring_free(&ring);
+  free(paths);
+
+  s_print("ringbench: %d files of %d bytes, %d per submission\n", n,
+          BENCH_RING_FILE_SIZE, BENCH_RING_BATCH);
+  s_print("  s_*   write %8.1f ms  read %8.1f ms  (%d intact)\n",
+          plain_us[0] / 1000.0, plain_us[1] / 1000.0, plain_good);
+  s_print("  ring  write %8.1f ms  read %8.1f ms  (%d intact)\n",
+          ring_us[0] / 1000.0, ring_us[1] / 1000.0, ring_good);
+  return NULL;
+}
+
+static volatile uint64_t aio_spins;  // progress of aiobench's busy process
+
+static void* bench_spin(void* arg) {
+  while (1) {
+    aio_spins++;
+  }
+  return NULL;
+}
+
+// Writes the file a chunk at a time, through s_write or through the I/O
+// worker with BENCH_AIO_DEPTH writes in flight; returns the microseconds it
+// took and the busy process's progress meanwhile
+static uint64_t aio_phase(int bytes, bool async, uint64_t* spins) {
+  char buf[BENCH_CHUNK];
+  memset(buf, async ? 'a' : 's', sizeof(buf));
+  aio_t cbs[BENCH_AIO_DEPTH] = {0};
+  int fd = s_open(BENCH_AIO_FILE, F_WRITE);
+  uint64_t before = aio_spins;
+  uint64_t start = now_us();
+  int i = 0;
+  for (int done = 0; done < bytes; done += BENCH_CHUNK, i++) {
+    int n = MIN(bytes - done, BENCH_CHUNK);
+    if (!async) {
+      if (s_write(fd, n, buf) != n) {
+        u_perror("aiobench: s_write");
+        break;
+      }
+      continue;
+    }
+    // Reuse the oldest slot once its write is done
+    aio_t* cb = &cbs[i % BENCH_AIO_DEPTH];
+    if (cb->req && s_aio_wait(cb) == -1) {
+      u_perror("aiobench: s_aio_wait");
+      break;
+    }
+    *cb = (aio_t){.fd = fd, .buf = buf, .n = n, .offset = done};
+    if (s_aio_write(cb) == -1) {
+      u_perror("aiobench: s_aio_write");
+      break;
+    }
+  }
+  for (int j = 0; j < BENCH_AIO_DEPTH; j++) {
+    if (cbs[j].req) {
+      s_aio_wait(&cbs[j]);
+    }
+  }
+  uint64_t us = now_us() - start;
+  *spins = aio_spins - before;
+  s_close(fd);
+  return us;
+}
+
+void* aiobench(void* arg) {
+  thread_args_t* t_args = (thread_args_t*)arg;
+  int kb = count_arg(t_args->argv, 1, 4096, 1 << 20);
+  int bytes = kb * 1024;
+  char* spin_argv[] = {"benchspin", NULL};
+  thread_args_t spin_args = {.argv = spin_argv, .is_background = true};
+  // Same priority as a foreground command, so the two take turns
+  pid_t spin = s_spawn(bench_spin, &spin_args, 0, 1, 2, 0, P_BLOCKED, false,
+                       true);
+
+  uint64_t sync_spins, async_spins;
+  uint64_t sync_us = aio_phase(bytes, false, &sync_spins);
+  uint64_t async_us = aio_phase(bytes, true, &async_spins);
+  if (spin > 0) {
+    s_kill(spin, P_SIGTERM);
+    s_waitpid(spin, NULL, false, false, -1);
+  }
+  s_unlink(BENCH_AIO_FILE);
+
+  s_print("aiobench: %d KB in %d KB writes beside a busy process\n", kb,
+          BENCH_CHUNK / 1024);
+  s_print("  s_write      %8.1f ms  busy process %6.1f M spins/s\n",
+          sync_us / 1000.0, sync_us ? sync_spins / (double)sync_us : 0);
+  s_print("  s_aio_write  %8.1f ms  busy process %6.1f M spins/s\n",
+          async_us / 1000.0, async_us ? async_spins / (double)async_us : 0);
+  return NULL;
+}
+
+// Byte i of the fdbench file
+static char fd_byte(int i) {
+  return 'a' + i % 26;
+}
+
+void* fdbench(void* arg) {
+  thread_args_t* t_args = (thread_args_t*)arg;
+  int n = count_arg(t_args->argv, 1, 1000, MAX_OPEN_FILES - 3);
+  int* fds = malloc(n * sizeof(int));
+  char* data = malloc(n);
+  if (!fds || !data) {
+    free(fds);
+    free(data);
+    P_ERRNO = P_ENOMEM;
+    u_perror("fdbench");
+    return NULL;
+  }
+  for (int i = 0; i < n; i++) {
+    data[i] = fd_byte(i);
+  }
+  int fd = s_open(BENCH_FD_FILE, F_WRITE);
+  if (fd == -1 || s_write(fd, n, data) != n) {
+    u_perror("fdbench: s_write");
+    s_close(fd);
+    s_unlink(BENCH_FD_FILE);
+    free(fds);
+    free(data);
+    return NULL;
+  }
+  s_close(fd);
+
+  // Every open has its own offset: put open i at byte i
+  uint64_t start = now_us();
+  int opened = 0;
+  for (; opened < n; opened++) {
+    fds[opened] = s_open(BENCH_FD_FILE, F_READ);
+    if (fds[opened] == -1) {
+      u_perror("fdbench: s_open");
+      break;
+    }
+    s_lseek(fds[opened], opened, F_SEEK_SET);
+  }
+  uint64_t open_us = now_us() - start;
+
+  // Read two bytes through each, last opened first
+  start = now_us();
+  int intact = 0;
+  for (int i = opened - 1; i >= 0; i--) {
+    char got[2];
+    int want = MIN(2, n - i);
+    intact += s_read(fds[i], 2, got) == want && got[0] == fd_byte(i) &&
+              (want == 1 || got[1] == fd_byte(i + 1));
+  }
+  uint64_t read_us = now_us() - start;
+
+  start = now_us();
+  for (int i = 0; i < opened; i++) {
+    s_close(fds[i]);
+  }
+  uint64_t close_us = now_us() - start;
+  s_unlink(BENCH_FD_FILE);
+  free(fds);
+  free(data);
+
+  double per_op = opened ? 1.0 / opened : 0;
+  s_print("fdbench: %d opens of one file, %d read their own bytes\n", opened,
+          intact);
+  s_print("  open   %8.1f ms  %6.1f us/op\n", open_us / 1000.0,
+          open_us * per_op);
+  s_print("  read   %8.1f ms  %6.1f us/op\n", read_us / 1000.0,
+          read_us * per_op);
+  s_print("  close  %8.1f ms  %6.1f us/op\n", close_us / 1000.0,
+          close_us * per_op);
+  return NULL;
+}
+
+// Parse a script the way the shell used to: one s_read per byte, one
+// parse_command per line. Returns the commands parsed.
+static int script_bytewise(int fd) {
+  char line[SCRIPT_BLOCK];
+  int len = 0;
+  int parsed = 0;
+  while (len < SCRIPT_BLOCK - 1 && s_read(fd, 1, line + len) > 0) {
+    if (line[len] != '\n' && line[len] != ';') {
+      len++;
+      continue;
+    }
+    line[len] = '\0';
+    struct parsed_command* cmd = NULL;
+    if (parse_command(line, &cmd) == 0) {
+      parsed++;
+    }
+    free(cmd);
+    len = 0;
+  }
+  return parsed;
+}
+
+// Load the script through script_load, running its commands if asked, and
+// return how many there are
+static int script_timed_load(bool cold, bool run, uint64_t* us) {
+  if (cold) {
+    script_cache_clear();
+  }
+  int fd = s_open(BENCH_SCRIPT_FILE, F_READ);
+  if (fd == -1) {
+    return -1;
+  }
+  uint64_t start = now_us();
+  script_t* script = script_load(fd);
+  for (size_t i = 0; run && script && i < vec_len(&script->lines); i++) {
+    script_line_t* line = vec_get(&script->lines, i);
+    execute_script_command(line->cmd);
+  }
+  *us = now_us() - start;
+  s_close(fd);
+  if (!script) {
+    return -1;
+  }
+  int n = vec_len(&script->lines);
+  script_done(script);
+  return n;
+}
+
+static double per_sec(int n, uint64_t us) {
+  return us ? n * 1e6 / us : 0;
+}
+
+void* scriptbench(void* arg) {
+  thread_args_t* t_args = (thread_args_t*)arg;
+  int n = count_arg(t_args->argv, 1, 10000, BENCH_MAX_LINES);
+  int line_len = strlen(BENCH_SCRIPT_LINE);
+  char* text = malloc((size_t)n * line_len);
+  if (!text) {
+    P_ERRNO = P_ENOMEM;
+    u_perror("scriptbench");
+    return NULL;
+  }
+  for (int i = 0; i < n; i++) {
+    memcpy(text + (size_t)i * line_len, BENCH_SCRIPT_LINE, line_len);
+  }
+  int fd = s_open(BENCH_SCRIPT_FILE, F_WRITE);
+  int wrote = fd == -1 ? -1 : s_write(fd, n * line_len, text);
+  s_close(fd);
+  free(text);
+  if (wrote != n * line_len) {
+    u_perror("scriptbench: s_write");
+    s_unlink(BENCH_SCRIPT_FILE);
+    return NULL;
+  }
+
+  fd = s_open(BENCH_SCRIPT_FILE, F_READ);
+  uint64_t start = now_us();
+  int counts[4];
+  uint64_t us[4] = {0};
+  counts[0] = fd == -1 ? -1 : script_bytewise(fd);
+  us[0] = now_us() - start;
+  s_close(fd);
+
+  // Parsing alone, then a whole run of the cached script, which spawns
+  // every command; a cold run only adds the parse timed above
+  counts[1] = script_timed_load(true, false, &us[1]);
+  counts[2] = script_timed_load(false, false, &us[2]);
+  counts[3] = script_timed_load(false, true, &us[3]);
+  s_unlink(BENCH_SCRIPT_FILE);
+  s_unlink(BENCH_SCRIPT_OUT);
+  for (int i = 0; i < 4; i++) {
+    if (counts[i] < 0) {
+      u_perror("scriptbench");
+      return NULL;
+    }
+  }
+
+  const char* phases[] = {"parse, byte reads", "parse, block reads",
+                          "parse, cached", "run, cached"};
+  s_print("scriptbench: %d lines of %.*s", n, line_len, BENCH_SCRIPT_LINE);
+  for (int i = 0; i < 4; i++) {
+    s_print("  %-18s %8.1f ms  %10.0f commands/s\n", phases[i],
+            us[i] / 1000.0, per_sec(counts[i], us[i]));
+  }
+  return NULL;
+}
@@ -0,0 +1,100 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+/**
+ * @brief Measures shell command response time under CPU load.
+ *
+ * Usage: schedbench [nbusy] [rounds]. Spawns `nbusy` busy loops, then times
+ * `rounds` spawn + waitpid round trips of a trivial command and prints the
+ * mean, median and worst latency together with the active scheduler. Boot
+ * PennOS with different --sched= policies to compare them.
+ */
+void* schedbench(void* arg);
+
+/**
+ * @brief Compares pipe throughput with passing data through a file.
+ *
+ * Usage: pipebench [kb]. Moves `kb` kilobytes (default 256) from a writer
+ * process to a reader process, first over a pipe and then through a
+ * temporary file on the FAT image, and prints the time and MB/s of each.
+ */
+void* pipebench(void* arg);
+
+/**
+ * @brief Times `ps` over a large process table.
+ *
+ * Usage: psbench [nprocs]. Spawns `nprocs` sleeping processes (default
+ * 1000), times one `ps` listing including the final flush to the host
+ * stdout, then kills and reaps the sleepers and prints the elapsed time.
+ */
+void* psbench(void* arg);
+
+/**
+ * @brief Times lookups, inserts and deletes in one large directory.
+ *
+ * Usage: dirbench [n]. Creates `n` empty files (default 10000) in a new
+ * directory, opens each of them once, then unlinks them all and removes the
+ * directory, printing the time per operation of each phase. Every file takes
+ * a data block, so large runs need a large image.
+ */
+void* dirbench(void* arg);
+
+/**
+ * @brief Compares reading a file through s_read and through s_mmap.
+ *
+ * Usage: mmapbench [kb]. Writes a file of `kb` kilobytes (default 4096),
+ * sums its bytes read 4 KB at a time and then through a read-only mapping,
+ * and prints the time and MB/s of each. It then changes one byte per 4 KB
+ * through a writable mapping, times s_munmap writing them back and checks
+ * the file with s_read. The file is deleted afterwards.
+ */
+void* mmapbench(void* arg);
+
+/**
+ * @brief Compares small-file I/O through single calls and through a
+ * submission ring.
+ *
+ * Usage: ringbench [nfiles]. Writes `nfiles` files of 512 bytes (default
+ * 200) with an s_open, s_write and s_close each, and reads them back the
+ * same way; then does both again by queueing each file's three requests on
+ * a ring and submitting 21 files at a time. Prints the time of each phase
+ * and how many files read back intact. The files are deleted afterwards.
+ */
+void* ringbench(void* arg);
+
+/**
+ * @brief Shows how much CPU a busy process gets while another writes a
+ * file, with blocking writes and with writes done by the I/O worker.
+ *
+ * Usage: aiobench [kb]. Starts a busy loop, then writes `kb` kilobytes
+ * (default 4096) 4 KB at a time with s_write, and again with s_aio_write,
+ * keeping 8 writes in flight. Prints the time each took and how fast the
+ * busy loop ran meanwhile. The file is deleted afterwards.
+ */
+void* aiobench(void* arg);
+
+/**
+ * @brief Opens one file many times at once and checks every open keeps its
+ * own offset.
+ *
+ * Usage: fdbench [n]. Writes an `n`-byte file, opens it `n` times (default
+ * 1000), seeks open i to byte i, then reads two bytes through each in
+ * reverse order and closes them all. Prints the time per operation of each
+ * phase and how many opens read the bytes they were at. The file is deleted
+ * afterwards.
+ */
+void* fdbench(void* arg);
+
+/**
+ * @brief Compares reading a script a byte at a time with the shell's block
+ * reader and its cache of parsed scripts.
+ *
+ * Usage: scriptbench [n]. Writes a script of `n` lines (default 10000) of
+ * `echo x > scriptbench.out`, parses it with one s_read per byte, then
+ * loads it with script_load twice (parsed, then from the cache), and
+ * finally runs it from the cache, spawning every command. Prints the time
+ * and commands per second of each. The files are deleted afterwards.
+ */
+void* scriptbench(void* arg);
+
+#endif
@@ -1,4 +1,5 @@
 #include "./user_functions.h"
+#include "./scheduler/sched_policy.h"
 #include "./util/p_errno.h"
 
 void* u_cat(void* arg) {
@@ -180,8 +181,9 @@ void* u_nice(void* arg) {
   char* command = argv[1];
   int priority = atoi(argv[2]);
 
-  if (priority > 2  || priority < 0){
-    k_print("Priority must be 0,1,2\n");
+  if (!sched_priority_valid(priority)) {
+    k_print("Priority must be between %d and %d\n",
+            sched_policy->min_priority, sched_policy->max_priority);
     return NULL;
   }
 
@@ -213,7 +215,7 @@ void* u_nice(void* arg) {
   }
   new_argv[count + 1] = NULL;
 
-  thread_args_t* child_args = malloc(sizeof(thread_args_t));
+  thread_args_t* child_args = calloc(1, sizeof(thread_args_t));
   child_args->argv = new_argv;
   child_args->is_background = is_background;
 
@@ -233,8 +235,8 @@ void* u_nice_pid(void* arg) {
   int priority = atoi(argv[1]);
   int pid = atoi(argv[2]);
 
-  if (pid <= 0 || priority < 0 || priority > 2) {
-    panic("Invalid PID or priority. Priority must be 0, 1, or 2.\n");
+  if (pid <= 0 || !sched_priority_valid(priority)) {
+    panic("Invalid PID or priority for the active scheduler.\n");
     return NULL;
   }
   // Change the priority of the process
@@ -305,6 +307,7 @@ void* u_jobs(void* arg) {
 }
 
 void* u_logout(void* arg) {
+  s_flush();
   exit(0);
   return NULL;
 }
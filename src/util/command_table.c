@@ -1,6 +1,7 @@
 
 #include "./command_table.h"
 #include "./syscall/sys_call.h"
+#include "./userfunctions/bench.h"
 #include "./userfunctions/stress.h"
 #include "./userfunctions/user_functions.h"
 
@@ -25,6 +26,12 @@ command_t command_table[] = {
     {"echo", "Echo back input string.", u_echo, false},
     {"ls", "List files.", s_ls, false},
     {"touch", "Create or update files.", s_touch, false},
+    {"mkdir", "Create directories.", s_mkdir, false},
+    {"rmdir", "Remove empty directories.", s_rmdir, false},
+    {"snapshot", "List, take or delete snapshots.", s_snapshot, false},
+    {"rollback", "Roll the filesystem back to a snapshot.", s_rollback, false},
+    {"defrag", "Defragment files and compact directories.", s_defrag, false},
+    {"scrub", "Check blocks against their checksums.", s_scrub, false},
     {"mv", "Rename a file.", s_mv, false},
     {"cp", "Copy a file.", s_cp, false},
     {"rm", "Remove files.", s_rm, false},
@@ -44,7 +51,16 @@ command_t command_table[] = {
     {"recur", "Recursively spawn processes.", recur, true},
     {"crash", "Crash the system.", crash, true},
     {"clear", "Clear Screen.", u_clear, true},
+    {"schedbench", "Time command latency under CPU load.", schedbench, true},
+    {"pipebench", "Compare pipe and temp file throughput.", pipebench, true},
+    {"psbench", "Time ps over many processes.", psbench, true},
+    {"dirbench", "Time operations on a large directory.", dirbench, true},
+    {"mmapbench", "Compare s_read and s_mmap on a file.", mmapbench, true},
+    {"ringbench", "Compare small-file I/O with and without a ring.", ringbench, true},
+    {"aiobench", "Compare s_write and s_aio_write beside a busy process.", aiobench, true},
+    {"fdbench", "Open one file many times, each at its own offset.", fdbench, true},
+    {"scriptbench", "Time reading, parsing and running a long script.", scriptbench, true},
     {"wc", "Count the number of lines, words and characters in a file.", u_wc,
-     true}};
+     false}};
 
 int number_commands = sizeof(command_table) / sizeof(command_t);
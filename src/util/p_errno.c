@@ -2,7 +2,7 @@
 #include "./syscall/sys_call.h"
 #include <stdio.h>
 
-int P_ERRNO = 0;  // Start with no error
+_Thread_local int P_ERRNO = 0;  // Start with no error
 
 void u_perror(const char *user_message) {
     const char *error_message;
@@ -43,7 +43,7 @@ void u_perror(const char *user_message) {
             error_message = "Failed to waitpid";
             break;
         case P_EINVAL_NICE:
-            error_message = "Priority must be between 0 and 2";
+            error_message = "Priority out of range for the active scheduler";
             break;
         case FD_INVALID:
             error_message = "Invalid file descriptor";
@@ -90,6 +90,33 @@ void u_perror(const char *user_message) {
         case FD_TABLE_NULL:
             error_message = "fd_table is NULL";
             break;
+        case ILLEGAL_SEEK:
+            error_message = "Illegal seek on a pipe";
+            break;
+        case BROKEN_PIPE:
+            error_message = "Broken pipe";
+            break;
+        case NOT_A_DIRECTORY:
+            error_message = "Not a directory";
+            break;
+        case IS_A_DIRECTORY:
+            error_message = "Is a directory";
+            break;
+        case DIR_NOT_EMPTY:
+            error_message = "Directory not empty";
+            break;
+        case READ_ONLY_FS:
+            error_message = "Read-only file system (snapshot)";
+            break;
+        case TOO_MANY_SNAPSHOTS:
+            error_message = "Too many snapshots";
+            break;
+        case FS_CORRUPTED:
+            error_message = "File system has errors";
+            break;
+        case BAD_CHECKSUM:
+            error_message = "Block fails its checksum";
+            break;
         default:
             error_message = "Unknown error";
     }
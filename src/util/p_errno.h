@@ -1,7 +1,10 @@
 #ifndef P_ERRNO_H
 #define P_ERRNO_H
 
-extern int P_ERRNO;  // Global error code variable
+// Error code of the last failed call, one per thread: each PennOS process
+// runs on its own thread, and host worker threads must not touch a
+// process's error
+extern _Thread_local int P_ERRNO;
 
 // Define PennOS error codes
 #define P_EPERM    1   // Operation not permitted
@@ -15,7 +18,7 @@ extern int P_ERRNO;  // Global error code variable
 #define P_EWAITPID_I 9   // Failed to waitpid
 #define P_EWAITPID_II 10   // Failed to waitpid
 #define P_EWAITPID_III 11 // Failed to waitpid
-#define P_EINVAL_NICE 12 // Invalid argument nice
+#define P_EINVAL_NICE 12 // Priority out of range for the scheduler policy
 
 #define FD_INVALID -1
 #define FS_NOT_MOUNTED -2
@@ -32,6 +35,15 @@ extern int P_ERRNO;  // Global error code variable
 #define FS_MEMORY_ERROR -13
 #define FILENAME_INVALID -14
 #define FD_TABLE_NULL -15
+#define ILLEGAL_SEEK -16
+#define BROKEN_PIPE -17
+#define NOT_A_DIRECTORY -18
+#define IS_A_DIRECTORY -19
+#define DIR_NOT_EMPTY -20
+#define READ_ONLY_FS -21
+#define TOO_MANY_SNAPSHOTS -22
+#define FS_CORRUPTED -23
+#define BAD_CHECKSUM -24
 // Add more error codes relevant to YOUR system calls
 
 // Function to print user error messages
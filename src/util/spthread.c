@@ -242,12 +242,20 @@ int spthread_suspend_self() {
     return ESRCH;
   }
 
+  // Keep SIGPTHD blocked until sigsuspend atomically unblocks it; otherwise a
+  // continue that lands before we reach sigsuspend is lost and we never wake
+  sigset_t block_set, old_set;
+  sigemptyset(&block_set);
+  sigaddset(&block_set, SIGPTHD);
+  pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+
   my_meta->state = SPTHREAD_SUSPENDED_STATE;
 
   do {
     sigsuspend(&my_meta->suspend_set);
   } while (my_meta->state == SPTHREAD_SUSPENDED_STATE);
 
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
   return 0;
 }
 
@@ -451,6 +459,13 @@ static void* spthread_start(void* arg) {
 
   pthread_cleanup_push(mark_self_terminated, NULL);
 
+  // block SIGPTHD until we are in sigsuspend so that an early
+  // continue from the scheduler stays pending instead of being lost
+  sigset_t block_set, old_set;
+  sigemptyset(&block_set);
+  sigaddset(&block_set, SIGPTHD);
+  pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+
   // let spthread_create caller know that
   // we finished setup
   pthread_mutex_lock(&(args->setup_mutex));
@@ -463,6 +478,7 @@ static void* spthread_start(void* arg) {
   do {
     sigsuspend(&my_meta->suspend_set);
   } while (my_meta->state == SPTHREAD_SUSPENDED_STATE);
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
 
   // run the desired function
   res = func.actual_routine(func.actual_arg);
@@ -6,6 +6,7 @@
 typedef struct {
     bool is_background; 
     char **argv;       
+    bool owns_argv;  // argv is a copy the process frees when it is cleaned up
 
 } thread_args_t;
 